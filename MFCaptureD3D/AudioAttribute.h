@@ -11,6 +11,8 @@ public:
     UINT   m_uChannel;
     UINT   m_uSampleRate;
     UINT   m_uSampleBit;
+    UINT   m_uBlockAlign = 0;           // Bytes in a frame of all channels.
+    UINT64 m_ullChannelLayout = 0;      // AV_CH_LAYOUT_*
 
 protected:
 
@@ -48,30 +48,49 @@ public:
     // The caller must provide the default stride as an input parameter, in case
     // the buffer does not expose IMF2DBuffer. You can calculate the default stride
     // from the media type.
+    //
+    // Optionally returns the lowest address of the locked image and the number
+    // of bytes from there. For a bottom-up image, that is the last scan line.
     //-------------------------------------------------------------------
 
     HRESULT LockBuffer(
         LONG  lDefaultStride,    // Minimum stride (with no padding).
         DWORD dwHeightInPixels,  // Height of the image, in pixels.
         BYTE  **ppbScanLine0,    // Receives a pointer to the start of scan line 0.
-        LONG  *plStride          // Receives the actual stride.
+        LONG  *plStride,         // Receives the actual stride.
+        BYTE  **ppbBufferStart = NULL,   // Receives the start of the locked memory.
+        DWORD *pcbBufferLength = NULL    // Receives its length, in bytes.
         )
     {
         HRESULT hr = S_OK;
+        BYTE *pbStart = NULL;
+        DWORD cbLength = 0;
 
         // Use the 2-D version if available.
         if (m_p2DBuffer)
         {
             hr = m_p2DBuffer->Lock2D(ppbScanLine0, plStride);
+            if (SUCCEEDED(hr))
+            {
+                // Lock2D does not report the length; the first plane is the
+                // least the buffer holds.
+                pbStart = *ppbScanLine0;
+                if (*plStride < 0)
+                {
+                    pbStart += (INT_PTR)*plStride * (INT_PTR)(dwHeightInPixels - 1);
+                }
+                cbLength = abs(*plStride) * dwHeightInPixels;
+            }
         }
         else
         {
             // Use non-2D version.
             BYTE *pData = NULL;
 
-            hr = m_pBuffer->Lock(&pData, NULL, NULL);
+            hr = m_pBuffer->Lock(&pData, NULL, &cbLength);
             if (SUCCEEDED(hr))
             {
+                pbStart = pData;
                 *plStride = lDefaultStride;
                 if (lDefaultStride < 0)
                 {
@@ -90,6 +109,15 @@ public:
 
         m_bLocked = (SUCCEEDED(hr));
 
+        if (m_bLocked && ppbBufferStart)
+        {
+            *ppbBufferStart = pbStart;
+        }
+        if (m_bLocked && pcbBufferLength)
+        {
+            *pcbBufferLength = cbLength;
+        }
+
         return hr;
     }
 
@@ -72,7 +72,8 @@ static void OnInitDialog(HWND hwnd)
     SetWindowTextA(hStatic1, str1);
 
     char str2[20];
-    snprintf(str2,20,"%dx%dp%d", attr->m_uWidth,attr->m_uHeight,attr->m_uFps);
+    snprintf(str2,20,"%dx%dp%.4g", attr->m_uWidth,attr->m_uHeight,
+        attr->m_frameRate.Denominator ? (double)attr->m_frameRate.Numerator / attr->m_frameRate.Denominator : 0.0);
     SetWindowTextA(hStatic2, str2);
 
     char * str3;
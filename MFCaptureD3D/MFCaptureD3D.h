@@ -31,10 +31,15 @@
 
 extern "C" {
 #include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
 #include <libswresample//swresample.h>
 #include <libswscale/swscale.h>
+#include <libavutil/audio_fifo.h>
+#include <libavutil/cpu.h>
 #include <libavutil/imgutils.h>
 #include <libavutil/opt.h>
+#include <libavutil/pixdesc.h>
+#include <libavutil/time.h>
 
 #include <pthread.h>
 }
@@ -42,6 +47,15 @@ extern "C" {
 #include "bufferpool.h"
 #include "bufferpipe.h"
 #include "memorypool.h"
+#include "workerpool.h"
+#include "mediaqueue.h"
+#include "pipeline.h"
+#include "packetdistributor.h"
+#include "slicescaler.h"
+#include "speedcontrol.h"
+#include "mp4writer.h"
+#include "filewriter.h"
+#include "archivewriter.h"
 
 template <class T> void SafeRelease(T **ppT)
 {
@@ -77,6 +91,13 @@ template <class T> void SafeRelease(T **ppT)
 #include "AudioAttribute.h"
 
 #include "device.h"
+#include "yuvconvert.h"
+#include "audioconvert.h"
+#include "sampleframe.h"
+#include "recordfile.h"
+#include "encodeprofile.h"
+#include "simulcast.h"
+#include "benchmark.h"
 #include "audio.h"
 #include "preview.h"
 
@@ -11,7 +11,8 @@ public:
 	UINT   m_uWidth;
 	UINT   m_uHeight;
 	LONG   m_uStride;
-	UINT   m_uFps;
+	UINT   m_uFps;			// Nearest whole rate, for GOP lengths and display.
+	MFRatio m_frameRate = { 0, 1 };	// Nominal rate; the sample times give the actual one.
 	BOOL   m_bInterlace;
 
 	void SetVideoSize(UINT width, UINT height) {
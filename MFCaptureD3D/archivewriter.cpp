@@ -0,0 +1,472 @@
+
+#include "MFCaptureD3D.h"
+
+#include <stdio.h>
+#include <string>
+
+
+// The file is written in runs of this size.
+const int ARCHIVE_IO_BUFFER_SIZE = 1 << 20;
+
+// Slice counts of FFV1 version 3, fewest first. Every thread gets at
+// least one slice.
+static const int g_FFV1Slices[] = { 4, 6, 9, 12, 16, 24 };
+
+
+class ArchiveWriterImpl : public ArchiveWriter
+{
+
+public:
+	ArchiveWriterImpl();
+	~ArchiveWriterImpl();
+
+	void Create();
+	void Destory();
+
+	int Open(const char * path, int width, int height, AVPixelFormat format,
+		AVRational frameRate, AVRational timeBase, int threads);
+	int Write(const AVFrame * frame);
+	int Close();
+	void GetStats(ArchiveStats * stats, bool reset);
+
+private:
+	void Init();
+	void Uninit();
+
+	int OpenEncoder(int width, int height, AVPixelFormat format,
+		AVRational frameRate, AVRational timeBase, int threads);
+	int OpenMuxer(const char * path, AVRational frameRate);
+	int Encode(const AVFrame * frame);
+
+	static int WriteIO(void * opaque, uint8_t * buf, int size);
+	static int64_t SeekIO(void * opaque, int64_t offset, int whence);
+
+private:
+	AVCodecContext * context = NULL;
+	AVFormatContext * format = NULL;
+	AVStream * stream = NULL;
+	FILE * file = NULL;
+	std::string path;
+
+	// To the encoder format, when the input is not in it.
+	SwsContext * sws = NULL;
+	AVFrame * converted = NULL;
+
+	// A reference to the input with the pts of the file; the frames
+	// are shared with the other stages.
+	AVFrame * input = NULL;
+
+	int64_t startPts = AV_NOPTS_VALUE;
+	int frameBytes = 0;
+	bool failed = false;
+
+	ArchiveStats stats;
+};
+
+
+ArchiveWriter * ArchiveWriter::Create() {
+
+	ArchiveWriterImpl * writer = new ArchiveWriterImpl();
+	if (writer)
+	{
+		writer->Create();
+	}
+
+	return writer;
+
+}
+
+
+ArchiveWriterImpl::ArchiveWriterImpl()
+{
+	Init();
+}
+
+
+ArchiveWriterImpl::~ArchiveWriterImpl()
+{
+	Uninit();
+}
+
+
+void ArchiveWriterImpl::Init()
+{
+	memset(&stats, 0, sizeof(stats));
+}
+
+
+void ArchiveWriterImpl::Uninit()
+{
+	Close();
+}
+
+
+void ArchiveWriterImpl::Create()
+{
+}
+
+
+void ArchiveWriterImpl::Destory()
+{
+	delete this;
+}
+
+
+int ArchiveWriterImpl::Open(const char * _path, int width, int height, AVPixelFormat fmt,
+	AVRational frameRate, AVRational timeBase, int threads)
+{
+	if (context != NULL || width <= 0 || height <= 0)
+	{
+		return -1;
+	}
+
+	path = _path;
+	startPts = AV_NOPTS_VALUE;
+	frameBytes = av_image_get_buffer_size(fmt, width, height, 1);
+	failed = false;
+	memset(&stats, 0, sizeof(stats));
+
+	if (OpenEncoder(width, height, fmt, frameRate, timeBase, threads) < 0 ||
+		OpenMuxer(_path, frameRate) < 0)
+	{
+		Close();
+		return -1;
+	}
+
+	stats.threads = context->thread_count;
+
+	return 0;
+}
+
+
+int ArchiveWriterImpl::OpenEncoder(int width, int height, AVPixelFormat fmt,
+	AVRational frameRate, AVRational timeBase, int threads)
+{
+	AVCodec * codec = avcodec_find_encoder(AV_CODEC_ID_FFV1);
+	if (codec == NULL)
+	{
+		LOG_ERR("%s: no FFV1 encoder\n", path.c_str());
+		return -1;
+	}
+
+	// Only a format that holds every sample of the input will do.
+	int loss = 0;
+	AVPixelFormat encFmt = avcodec_find_best_pix_fmt_of_list(codec->pix_fmts, fmt, 0, &loss);
+	if (encFmt == AV_PIX_FMT_NONE || loss != 0)
+	{
+		LOG_ERR("%s: FFV1 cannot store %s losslessly\n", path.c_str(), av_get_pix_fmt_name(fmt));
+		return -1;
+	}
+
+	context = avcodec_alloc_context3(codec);
+	if (context == NULL)
+	{
+		return -1;
+	}
+
+	int slices = g_FFV1Slices[0];
+	for (int i = 0; i < (int)ARRAYSIZE(g_FFV1Slices) && slices < threads; i++)
+	{
+		slices = g_FFV1Slices[i];
+	}
+
+	context->width = width;
+	context->height = height;
+	context->pix_fmt = encFmt;
+	context->time_base = timeBase;
+	context->framerate = frameRate;
+
+	// Version 3 for slices and CRCs. The range coder with its own state
+	// tables and the large context model compress best; the model is
+	// reset every second, so a damaged frame costs at most that.
+	context->level = 3;
+	context->gop_size = frameRate.num > 0 ? FFMAX(frameRate.num / FFMAX(frameRate.den, 1), 1) : 1;
+	context->thread_type = FF_THREAD_SLICE;
+	context->thread_count = threads;
+	context->slices = slices;
+
+	av_opt_set_int(context->priv_data, "slicecrc", 1, 0);
+	av_opt_set_int(context->priv_data, "coder", 1, 0);
+	av_opt_set_int(context->priv_data, "context", 1, 0);
+
+	input = av_frame_alloc();
+	if (input == NULL)
+	{
+		return -1;
+	}
+
+	int ret = avcodec_open2(context, codec, NULL);
+	if (ret < 0)
+	{
+		LOG_ERR("%s: cannot open the FFV1 encoder: %d\n", path.c_str(), ret);
+		return -1;
+	}
+
+	if (encFmt != fmt)
+	{
+		sws = sws_getContext(width, height, fmt, width, height, encFmt, SWS_POINT, NULL, NULL, NULL);
+		converted = av_frame_alloc();
+
+		if (converted)
+		{
+			converted->format = encFmt;
+			converted->width = width;
+			converted->height = height;
+		}
+
+		if (sws == NULL || converted == NULL || av_frame_get_buffer(converted, 32) < 0)
+		{
+			return -1;
+		}
+	}
+
+	LOG_INFO("%s: FFV1 %s, %d slices, %d threads\n", path.c_str(),
+		av_get_pix_fmt_name(encFmt), slices, context->thread_count);
+
+	return 0;
+}
+
+
+int ArchiveWriterImpl::OpenMuxer(const char * _path, AVRational frameRate)
+{
+	int ret = avformat_alloc_output_context2(&format, NULL, "matroska", NULL);
+	if (ret < 0)
+	{
+		LOG_ERR("%s: cannot create the matroska muxer: %d\n", _path, ret);
+		format = NULL;
+		return -1;
+	}
+
+	stream = avformat_new_stream(format, NULL);
+	if (stream == NULL || avcodec_parameters_from_context(stream->codecpar, context) < 0)
+	{
+		return -1;
+	}
+	stream->time_base = context->time_base;
+	stream->avg_frame_rate = frameRate;
+
+	file = fopen(_path, "wb");
+	if (file == NULL)
+	{
+		LOG_ERR("cannot create %s\n", _path);
+		return -1;
+	}
+
+	// avio buffers the writes already.
+	setvbuf(file, NULL, _IONBF, 0);
+
+	uint8_t * buffer = (uint8_t *)av_malloc(ARCHIVE_IO_BUFFER_SIZE);
+
+	format->pb = buffer ? avio_alloc_context(buffer, ARCHIVE_IO_BUFFER_SIZE, 1, this, NULL, WriteIO, SeekIO) : NULL;
+	if (format->pb == NULL)
+	{
+		av_free(buffer);
+		return -1;
+	}
+
+	ret = avformat_write_header(format, NULL);
+	if (ret < 0)
+	{
+		LOG_ERR("%s: avformat_write_header failed with %d\n", _path, ret);
+		return -1;
+	}
+
+	return 0;
+}
+
+
+int ArchiveWriterImpl::Write(const AVFrame * frame)
+{
+	if (context == NULL || failed || frame == NULL)
+	{
+		return -1;
+	}
+
+	int64_t start = av_gettime_relative();
+
+	if (sws)
+	{
+		if (av_frame_make_writable(converted) < 0 ||
+			sws_scale(sws, frame->data, frame->linesize, 0, frame->height,
+				converted->data, converted->linesize) <= 0)
+		{
+			return -1;
+		}
+
+		av_frame_copy_props(converted, frame);
+		frame = converted;
+	}
+
+	if (av_frame_ref(input, frame) < 0)
+	{
+		return -1;
+	}
+
+	if (startPts == AV_NOPTS_VALUE)
+	{
+		startPts = input->pts != AV_NOPTS_VALUE ? input->pts : 0;
+	}
+	input->pts = input->pts != AV_NOPTS_VALUE ? input->pts - startPts : stats.frames;
+
+	int ret = Encode(input);
+
+	av_frame_unref(input);
+
+	stats.frames++;
+	stats.rawBytes += frameBytes;
+	stats.encodeTime += av_gettime_relative() - start;
+
+	return ret;
+}
+
+
+// Encodes a frame, or drains the encoder when frame is NULL, and writes
+// the packets.
+int ArchiveWriterImpl::Encode(const AVFrame * frame)
+{
+	AVPacket * pkt = av_packet_alloc();
+	if (pkt == NULL)
+	{
+		return -1;
+	}
+
+	int ret = 0;
+
+	for (;;)
+	{
+		int got_packet = 0;
+
+		ret = avcodec_encode_video2(context, pkt, frame, &got_packet);
+		if (ret < 0)
+		{
+			LOG_ERR("%s: avcodec_encode_video2 error with %d\n", path.c_str(), ret);
+			failed = true;
+			break;
+		}
+
+		if (!got_packet)
+		{
+			break;
+		}
+
+		stats.codedBytes += pkt->size;
+
+		pkt->stream_index = stream->index;
+		av_packet_rescale_ts(pkt, context->time_base, stream->time_base);
+
+		ret = av_write_frame(format, pkt);
+		av_packet_unref(pkt);
+
+		if (ret < 0)
+		{
+			LOG_ERR("%s: av_write_frame failed with %d\n", path.c_str(), ret);
+			failed = true;
+			break;
+		}
+
+		// A frame gives at most one packet; a flush gives all of them.
+		if (frame)
+		{
+			break;
+		}
+	}
+
+	av_packet_free(&pkt);
+
+	return ret < 0 ? -1 : 0;
+}
+
+
+int ArchiveWriterImpl::Close()
+{
+	int ret = failed ? -1 : 0;
+
+	if (format && file && format->pb)
+	{
+		if (context && !failed)
+		{
+			Encode(NULL);
+		}
+
+		if (av_write_trailer(format) < 0 || failed)
+		{
+			ret = -1;
+		}
+
+		avio_flush(format->pb);
+	}
+
+	if (format && format->pb)
+	{
+		av_freep(&format->pb->buffer);
+		av_freep(&format->pb);
+	}
+
+	if (file)
+	{
+		if (fclose(file) != 0)
+		{
+			ret = -1;
+		}
+		file = NULL;
+	}
+
+	avformat_free_context(format);
+	format = NULL;
+	stream = NULL;
+
+	avcodec_free_context(&context);
+
+	sws_freeContext(sws);
+	sws = NULL;
+	av_frame_free(&converted);
+	av_frame_free(&input);
+
+	return ret;
+}
+
+
+void ArchiveWriterImpl::GetStats(ArchiveStats * _stats, bool reset)
+{
+	*_stats = stats;
+
+	if (reset)
+	{
+		int threads = stats.threads;
+		memset(&stats, 0, sizeof(stats));
+		stats.threads = threads;
+	}
+}
+
+
+int ArchiveWriterImpl::WriteIO(void * opaque, uint8_t * buf, int size)
+{
+	FILE * file = ((ArchiveWriterImpl *)opaque)->file;
+
+	if (fwrite(buf, 1, size, file) != (size_t)size)
+	{
+		return AVERROR(EIO);
+	}
+	return size;
+}
+
+
+int64_t ArchiveWriterImpl::SeekIO(void * opaque, int64_t offset, int whence)
+{
+	FILE * file = ((ArchiveWriterImpl *)opaque)->file;
+
+	if (whence == AVSEEK_SIZE)
+	{
+		int64_t pos = _ftelli64(file);
+		_fseeki64(file, 0, SEEK_END);
+		int64_t size = _ftelli64(file);
+		_fseeki64(file, pos, SEEK_SET);
+		return size;
+	}
+
+	if (_fseeki64(file, offset, whence & ~AVSEEK_FORCE) != 0)
+	{
+		return AVERROR(EIO);
+	}
+	return _ftelli64(file);
+}
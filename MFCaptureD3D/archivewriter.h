@@ -0,0 +1,43 @@
+
+#pragma once
+
+struct ArchiveStats
+{
+	uint32_t frames;
+	uint64_t rawBytes;		// Of the frames passed to Write().
+	uint64_t codedBytes;
+	int64_t encodeTime;		// us, wall time of Write().
+	int threads;
+};
+
+// Records frames losslessly: FFV1 version 3 in a Matroska file. Each
+// frame is cut into slices that libavcodec encodes on its own threads,
+// with a CRC per slice. A format FFV1 does not take, e.g. NV12, is
+// rearranged into one it does without changing a sample; a format that
+// cannot be is refused.
+//
+// The file is written through a buffer of its own, and the header, the
+// cues and the duration are written when it is closed.
+//
+// Write() and Close() are called from one thread at a time.
+class ArchiveWriter
+{
+
+public:
+
+	static ArchiveWriter * Create();
+	virtual void Destory() = 0;
+
+	// The pts of the frames are in timeBase; the file starts at the first.
+	virtual int Open(const char * path, int width, int height, AVPixelFormat format,
+		AVRational frameRate, AVRational timeBase, int threads) = 0;
+
+	// Encodes and writes a frame. Returns 0, or -1.
+	virtual int Write(const AVFrame * frame) = 0;
+
+	// Writes the rest and closes the file. Returns -1 if anything was lost.
+	virtual int Close() = 0;
+
+	virtual void GetStats(ArchiveStats * stats, bool reset) = 0;
+
+};
@@ -2,6 +2,47 @@
 #include "MFCaptureD3D.h"
 #include <shlwapi.h>
 
+// Captured samples the writer and the resampler may fall behind by
+// before the oldest are dropped.
+const UINT AUDIO_QUEUE_FRAMES = 50;
+
+// Queue sizes between the later stages, which block rather than drop.
+const UINT STAGE_QUEUE_FRAMES = 8;
+const UINT STAGE_QUEUE_PACKETS = 32;
+
+// Captured audio the read thread may fall behind by before the callback
+// drops samples.
+const UINT AUDIO_PIPE_MS = 1000;
+
+// Samples in a frame from the read thread, when the encoder does not
+// fix a frame size.
+const UINT AUDIO_READ_SAMPLES = 1024;
+
+// Longest wait of the read thread for a wake-up it may have missed.
+const DWORD AUDIO_READ_TIMEOUT_MS = 100;
+
+// Time the capture callback should stay under, and the number of
+// callbacks between reports of it.
+const INT64 AUDIO_HOLD_BUDGET = 100;    // us
+const UINT AUDIO_HOLD_STATS_CALLBACKS = 500;
+
+// Bit rate of the AAC recording, per encoded channel.
+const int64_t AAC_BIT_RATE_PER_CHANNEL = 32000;
+
+// Resampler statistics.
+const UINT AUDIO_RESAMPLE_STATS_SECONDS = 10;
+
+// Drift compensation. The first seconds are left out of the fit, while
+// the device fills its buffers. The correction is at most
+// AUDIO_DRIFT_MAX_PPM of the samples: a pitch change of under 2 cents.
+const DWORD AUDIO_DRIFT_SETTLE_MS = 2000;
+const DWORD AUDIO_DRIFT_WINDOW_MS = 10000;
+const double AUDIO_DRIFT_MAX_PPM = 1000;
+
+// Record files.
+const RecordFileConfig PCM_FILE_CONFIG = { 1 << 20, 2, FALSE, 16 << 20 };
+const RecordFileConfig AAC_FILE_CONFIG = { 256 << 10, 2, FALSE, 0 };
+
 
 CAudio::CAudio() :
 	m_nRefCount(1),
@@ -9,19 +50,62 @@ CAudio::CAudio() :
 	m_codec(NULL),
 	m_codecContext(NULL),
 	m_swrContext(NULL),
+    m_pfnConvert(NULL),
+    m_pConvertBuffer(NULL),
+    m_cbConvertBuffer(0),
+    m_pfnDownmix(NULL),
+    m_pDownmixBuffer(NULL),
+    m_cbDownmixBuffer(0),
+    m_iDownmixChannels(0),
+    m_bDither(FALSE),
+    m_resampleProfile(RESAMPLE_PROFILE_DEFAULT),
+    m_llResampleTime(0),
+    m_llResampleSamples(0),
+    m_bDriftCompensation(FALSE),
+    m_llReadFrames(0),
+    m_lDriftReport(0),
+    m_bDriftBase(FALSE),
+    m_lDriftBaseStarts(0),
+    m_dDriftBase(0),
+    m_llCompensated(0),
+    m_pipeline(NULL),
+    m_captureSource(-1),
+    m_fifo(NULL),
+    m_audioPipe(NULL),
+    m_hSamplesReady(NULL),
+    m_bReading(FALSE),
+    m_pCapturePipe(NULL),
+    m_lCapturing(0),
+    m_lCaptureStarts(0),
+    m_lCallbacks(0),
+    m_uReadBytes(0),
+    m_llWrittenFrames(0),
+    m_llAnchorFrame(0),
+    m_llAnchorTime(0),
+    m_lAnchorStarts(0),
+    m_bPtsBase(FALSE),
+    m_lHoldReport(0),
     m_srcFrame(NULL),
     m_dstFrame(NULL),
-	m_audioPipe(NULL),
     aacfile(NULL),
-    pcmfile(NULL)
+    pcmfile(NULL),
+    m_mp4Writer(NULL),
+    m_iMP4Stream(-1)
 {
     InitializeCriticalSection(&m_critsec);
+    InitializeCriticalSection(&m_filesec);
+
+    ZeroMemory(&m_hold, sizeof(m_hold));
+    ZeroMemory(&m_holdReport, sizeof(m_holdReport));
+    ZeroMemory(&m_drift, sizeof(m_drift));
+    ZeroMemory(&m_driftReport, sizeof(m_driftReport));
 }
 
 
 CAudio::~CAudio()
 {
 
+    DeleteCriticalSection(&m_filesec);
     DeleteCriticalSection(&m_critsec);
 }
 
@@ -115,7 +199,7 @@ HRESULT CAudio::OnReadSample(
     HRESULT hrStatus,
     DWORD /* dwStreamIndex */,
     DWORD /* dwStreamFlags */,
-    LONGLONG /* llTimestamp */,
+    LONGLONG llTimestamp,
     IMFSample *pSample      // Can be NULL
     )
 {
@@ -123,11 +207,16 @@ HRESULT CAudio::OnReadSample(
     IMFMediaBuffer *pMediaBuffer = NULL;
     BYTE * pBuffer = NULL;
 
-    static int count = 0;
+    INT64 llStart = av_gettime_relative();
 
-    int ret = 0;
+    // No lock: the UI thread holds m_critsec while it joins threads.
+    // The count keeps the pipe and the reader alive until the return.
+    InterlockedIncrement(&m_lCallbacks);
 
-    EnterCriticalSection(&m_critsec);
+    IMFSourceReader *pReader = (IMFSourceReader*)InterlockedCompareExchangePointer(
+        (PVOID volatile*)&m_pReader, NULL, NULL);
+    BufferPipe *pPipe = (BufferPipe*)InterlockedCompareExchangePointer(
+        (PVOID volatile*)&m_pCapturePipe, NULL, NULL);
 
     if (FAILED(hrStatus))
     {
@@ -148,39 +237,35 @@ HRESULT CAudio::OnReadSample(
                 DWORD bufSize;
                 pMediaBuffer->Lock(&pBuffer, NULL, &bufSize);
                 //LOG_DEBUG("read audio sample{count=%d, size=%d}\n", bufCount, bufSize);
-                if (m_bPCMRecordStatus)
+
+                // Copy the samples for the read thread, so that the
+                // buffer goes straight back to the source.
+                UINT cbFrame = m_audioAttribute.m_uBlockAlign;
+
+                if (pPipe && cbFrame > 0 && m_lCapturing)
                 {
-                    pcmfile->write((char *)pBuffer, bufSize);
-                }
+                    DWORD cbWrite = bufSize - bufSize % cbFrame;
+                    LONG lStarts = m_lCaptureStarts;
+
+                    // Published before the samples it stamps.
+                    if (cbWrite > 0 && m_lAnchorStarts != lStarts)
+                    {
+                        m_llAnchorFrame = m_llWrittenFrames;
+                        m_llAnchorTime = llTimestamp;
+                        InterlockedExchange(&m_lAnchorStarts, lStarts);
+                    }
+
+                    if (cbWrite > 0 && pPipe->Write(pBuffer, cbWrite) == 0)
+                    {
+                        m_hold.uOverruns += cbWrite / cbFrame;
+                    }
+                    else
+                    {
+                        m_llWrittenFrames += cbWrite / cbFrame;
+                    }
 
-				m_srcFrame->data[0] = pBuffer;
-				m_srcFrame->nb_samples = bufSize / (m_audioAttribute.m_uSampleBit / 8 * 2);
-				ret = swr_convert_frame(m_swrContext, m_dstFrame, m_srcFrame);
-				if (ret < 0)
-				{
-					char strerr[100];
-					av_strerror(ret, strerr, 100);
-					LOG_ERR("swr_config_frame failed with %s\n", strerr);
-				}
-
-				if (m_bAACRecordStatus == TRUE)
-				{
-					AVPacket pkt;
-					av_init_packet(&pkt);
-					pkt.data = NULL;    // packet data will be allocated by the encoder
-					pkt.size = 0;
-					int got_frame;
-					ret = avcodec_encode_audio2(m_codecContext, &pkt, m_dstFrame, &got_frame);
-					if (ret < 0) {
-						fprintf(stderr, "Error encoding audio frame\n");
-						exit(1);
-					}
-
-					if (got_frame) {
-						aacfile->write((char *)pkt.data, pkt.size);
-						av_packet_unref(&pkt);
-					}
-				}
+                    SetEvent(m_hSamplesReady);
+                }
 
                 pMediaBuffer->Unlock();
             }
@@ -188,10 +273,15 @@ HRESULT CAudio::OnReadSample(
 
     }
 
-    // Request the next frame.
-    if (SUCCEEDED(hr))
+    SafeRelease(&pMediaBuffer);
+
+    UpdateHoldTime(av_gettime_relative() - llStart);
+
+    // Request the next frame. Last: the next callback may start before
+    // this one returns, and only one may write to the pipe at a time.
+    if (SUCCEEDED(hr) && pReader)
     {
-        hr = m_pReader->ReadSample(
+        hr = pReader->ReadSample(
             (DWORD)MF_SOURCE_READER_FIRST_AUDIO_STREAM,
             0,
             NULL,   // actual
@@ -201,13 +291,246 @@ HRESULT CAudio::OnReadSample(
             );
     }
 
-    SafeRelease(&pMediaBuffer);
+    InterlockedDecrement(&m_lCallbacks);
 
-    LeaveCriticalSection(&m_critsec);
     return hr;
 }
 
 
+//-------------------------------------------------------------------
+// UpdateCapturing
+//
+// Tells the capture callback whether to copy the samples. Called with
+// m_filesec held, after a record flag changes.
+//-------------------------------------------------------------------
+
+void CAudio::UpdateCapturing()
+{
+    BOOL bCapturing = m_bPCMRecordStatus == TRUE || m_bAACRecordStatus == TRUE ||
+        m_bMP4RecordStatus == TRUE;
+
+    if (InterlockedExchange(&m_lCapturing, bCapturing ? 1 : 0) == 0 && bCapturing)
+    {
+        InterlockedIncrement(&m_lCaptureStarts);
+    }
+}
+
+
+//-------------------------------------------------------------------
+// WaitForCallbacks
+//
+// Waits for the capture callbacks that are running to return. Those
+// that start later see what has been taken away before the call.
+//-------------------------------------------------------------------
+
+void CAudio::WaitForCallbacks()
+{
+    while (InterlockedCompareExchange(&m_lCallbacks, 0, 0) != 0)
+    {
+        Sleep(1);
+    }
+}
+
+
+//-------------------------------------------------------------------
+// UpdateHoldTime
+//
+// Adds the time of a capture callback to m_hold, and hands the totals
+// to the read thread every AUDIO_HOLD_STATS_CALLBACKS callbacks. If the
+// last report has not been taken yet, the totals keep adding up.
+//-------------------------------------------------------------------
+
+void CAudio::UpdateHoldTime(INT64 llHold)
+{
+    m_hold.uCallbacks++;
+    m_hold.llSum += llHold;
+    m_hold.llMax = max(m_hold.llMax, llHold);
+
+    if (llHold > AUDIO_HOLD_BUDGET)
+    {
+        m_hold.uOverBudget++;
+    }
+
+    if (m_hold.uCallbacks >= AUDIO_HOLD_STATS_CALLBACKS && m_lHoldReport == 0)
+    {
+        m_holdReport = m_hold;
+        ZeroMemory(&m_hold, sizeof(m_hold));
+
+        InterlockedExchange(&m_lHoldReport, 1);
+    }
+}
+
+
+//-------------------------------------------------------------------
+// LogHoldTime
+//
+// Logs the report of UpdateHoldTime(). Runs on the read thread.
+//-------------------------------------------------------------------
+
+void CAudio::LogHoldTime()
+{
+    const HoldStats &stats = m_holdReport;
+
+    LOG_INFO("audio capture: %u callbacks, hold %.1f us avg, %lld us max, %u over %lld us, %u samples dropped\n",
+        stats.uCallbacks, (double)stats.llSum / max(stats.uCallbacks, 1), stats.llMax,
+        stats.uOverBudget, AUDIO_HOLD_BUDGET, stats.uOverruns);
+
+    if (stats.uOverBudget > 0)
+    {
+        LOG_ERR("audio capture callback over %lld us in %u of %u callbacks\n",
+            AUDIO_HOLD_BUDGET, stats.uOverBudget, stats.uCallbacks);
+    }
+}
+
+
+//-------------------------------------------------------------------
+// UpdateDrift
+//
+// Adds a point to the fit of the drift: the samples delivered so far,
+// those read and those still in m_audioPipe, against the system clock.
+// Called by the read thread as it wakes, just after a callback.
+//-------------------------------------------------------------------
+
+void CAudio::UpdateDrift()
+{
+    UINT cbFrame = m_audioAttribute.m_uBlockAlign;
+    INT64 llNow = av_gettime_relative();
+    INT64 llFrames = m_llReadFrames + m_audioPipe->GetLength() / cbFrame;
+
+    // Nothing is delivered while no recording is on: not a slow device.
+    LONG lStarts = m_lCaptureStarts;
+    BOOL bCapturing = m_lCapturing != 0;
+
+    if (!bCapturing || lStarts != m_drift.lStarts)
+    {
+        if (m_drift.llFirst != 0)
+        {
+            ZeroMemory(&m_drift, sizeof(m_drift));
+            InterlockedExchange(&m_lDriftReport, 0);
+        }
+        m_drift.lStarts = lStarts;
+
+        if (!bCapturing)
+        {
+            return;
+        }
+    }
+
+    if (m_drift.llFirst == 0)
+    {
+        m_drift.llFirst = llNow;
+    }
+
+    if (llNow - m_drift.llFirst < AUDIO_DRIFT_SETTLE_MS * 1000)
+    {
+        return;
+    }
+
+    if (m_drift.llStart == 0)
+    {
+        m_drift.llStart = llNow;
+        m_drift.llStartFrames = llFrames;
+        m_drift.llWindowStart = llNow;
+    }
+
+    double x = (llNow - m_drift.llStart) / 1000000.0;
+    double y = (double)(llFrames - m_drift.llStartFrames) - x * m_audioAttribute.m_uSampleRate;
+
+    m_drift.dSumX += x;
+    m_drift.dSumY += y;
+    m_drift.dSumXX += x * x;
+    m_drift.dSumXY += x * y;
+    m_drift.uPoints++;
+
+    if (llNow - m_drift.llWindowStart < AUDIO_DRIFT_WINDOW_MS * 1000)
+    {
+        return;
+    }
+
+    // Least squares: the callbacks come in bursts of several ms, which
+    // a single point per window would take for drift.
+    double n = m_drift.uPoints;
+    double d = n * m_drift.dSumXX - m_drift.dSumX * m_drift.dSumX;
+
+    if (d > 0)
+    {
+        double b = (n * m_drift.dSumXY - m_drift.dSumX * m_drift.dSumY) / d;
+        double a = (m_drift.dSumY - b * m_drift.dSumX) / n;
+
+        m_driftReport.dExcess = a + b * x;
+        m_driftReport.dRate = b;
+        m_driftReport.lStarts = m_drift.lStarts;
+        InterlockedExchange(&m_lDriftReport, 1);
+    }
+
+    m_drift.llWindowStart = llNow;
+    m_drift.dSumX = m_drift.dSumY = m_drift.dSumXX = m_drift.dSumXY = 0;
+    m_drift.uPoints = 0;
+}
+
+
+//-------------------------------------------------------------------
+// CompensateDrift
+//
+// Asks swresample to take out, over the next window, what the device
+// will have gained on the system clock by its end since the recording
+// started, less what it has been asked to take out already.
+//-------------------------------------------------------------------
+
+void CAudio::CompensateDrift()
+{
+    DriftStats drift = m_driftReport;
+
+    // A new recording, or a new fit after the capture stopped in between.
+    if (!m_bDriftBase || drift.lStarts != m_lDriftBaseStarts)
+    {
+        m_bDriftBase = TRUE;
+        m_lDriftBaseStarts = drift.lStarts;
+        m_dDriftBase = drift.dExcess;
+        m_llCompensated = 0;
+    }
+
+    double dScale = (double)m_dstFrame->sample_rate / m_srcFrame->sample_rate;
+    int iDistance = (int)((INT64)m_dstFrame->sample_rate * AUDIO_DRIFT_WINDOW_MS / 1000);
+    int iMax = (int)(iDistance * AUDIO_DRIFT_MAX_PPM / 1000000);
+
+    double dAhead = drift.dExcess - m_dDriftBase + drift.dRate * AUDIO_DRIFT_WINDOW_MS / 1000;
+    int iDelta = av_clip((int)lrint(-dAhead * dScale - m_llCompensated), -iMax, iMax);
+
+    int ret = swr_set_compensation(m_swrContext, iDelta, iDistance);
+    if (ret < 0)
+    {
+        LOG_ERR("swr_set_compensation failed with %d\n", ret);
+        return;
+    }
+
+    m_llCompensated += iDelta;
+
+    LOG_INFO("audio drift: device %+.1f ppm against the system clock, %+d samples over %u ms\n",
+        1000000.0 * drift.dRate / m_srcFrame->sample_rate, iDelta, AUDIO_DRIFT_WINDOW_MS);
+}
+
+
+//-------------------------------------------------------------------
+// LogResampleStats
+//
+// CPU time of swresample per second of audio, and the delay it adds:
+// the input it holds for its filter.
+//-------------------------------------------------------------------
+
+void CAudio::LogResampleStats()
+{
+    double dSeconds = (double)m_llResampleSamples / m_srcFrame->sample_rate;
+
+    LOG_INFO("audio resample %s: %.1f us per second of audio, %.2f ms delay\n",
+        g_ResampleProfiles[m_resampleProfile].name, m_llResampleTime / dSeconds,
+        swr_get_delay(m_swrContext, 1000000) / 1000.0);
+
+    m_llResampleTime = 0;
+    m_llResampleSamples = 0;
+}
+
+
 //-------------------------------------------------------------------
 //  CloseDevice
 //
@@ -218,9 +541,15 @@ HRESULT CAudio::CloseDevice()
 {
     EnterCriticalSection(&m_critsec);
 
+    // Drains and flushes every stage before the codec goes away.
+    StopPipeline();
     UninitCodec();
 
-    SafeRelease(&m_pReader);
+    // A callback running now still has the reader.
+    IMFSourceReader *pReader = (IMFSourceReader*)InterlockedExchangePointer(
+        (PVOID volatile*)&m_pReader, NULL);
+    WaitForCallbacks();
+    SafeRelease(&pReader);
 
 //     CoTaskMemFree(m_pwszSymbolicLink);
 //     m_pwszSymbolicLink = NULL;
@@ -231,6 +560,25 @@ HRESULT CAudio::CloseDevice()
 }
 
 
+//-------------------------------------------------------------------
+// ChannelLayoutFromMask
+//
+// The layout of a WAVEFORMATEXTENSIBLE speaker mask, whose bits are
+// those of AV_CH_*. Without a mask, or one that does not match the
+// channel count, the default layout for the count.
+//-------------------------------------------------------------------
+
+static UINT64 ChannelLayoutFromMask(UINT32 uMask, UINT32 nChannels)
+{
+    if (uMask != 0 && av_get_channel_layout_nb_channels(uMask) == (int)nChannels)
+    {
+        return uMask;
+    }
+
+    return av_get_default_channel_layout(nChannels);
+}
+
+
 //-------------------------------------------------------------------
 // SetDevice
 //
@@ -360,7 +708,8 @@ HRESULT CAudio::SetDevice(IMFActivate *pActivate)
 		GUID subType;
 		pType->GetGUID(MF_MT_SUBTYPE, &subType);
 
-        UINT32 nChannels, nSamplesPerSec, nAvgBytesPerSec, nBlockAlign, wBitsPerSample, wSamplesPerBlock, uBitSize;
+        UINT32 nChannels = 0, nSamplesPerSec = 0, nAvgBytesPerSec = 0, nBlockAlign = 0, wBitsPerSample = 0, wSamplesPerBlock = 0, uBitSize = 0;
+        UINT32 uChannelMask = 0;
         pType->GetUINT32(MF_MT_AUDIO_NUM_CHANNELS, &nChannels);
         pType->GetUINT32(MF_MT_AUDIO_AVG_BYTES_PER_SECOND, &nAvgBytesPerSec);
         pType->GetUINT32(MF_MT_AUDIO_BLOCK_ALIGNMENT, &nBlockAlign);
@@ -368,17 +717,42 @@ HRESULT CAudio::SetDevice(IMFActivate *pActivate)
         pType->GetUINT32(MF_MT_AUDIO_SAMPLES_PER_SECOND, &nSamplesPerSec);
         pType->GetUINT32(MF_MT_AUDIO_SAMPLES_PER_BLOCK, &wSamplesPerBlock);
         pType->GetUINT32(MF_MT_AUDIO_VALID_BITS_PER_SAMPLE, &uBitSize);
+        pType->GetUINT32(MF_MT_AUDIO_CHANNEL_MASK, &uChannelMask);
 
         m_audioAttribute.m_uChannel = nChannels;
         m_audioAttribute.m_uSampleBit = wBitsPerSample;
         m_audioAttribute.m_uSampleRate = nSamplesPerSec;
+        m_audioAttribute.m_uBlockAlign = nBlockAlign ? nBlockAlign : wBitsPerSample / 8 * nChannels;
+        m_audioAttribute.m_ullChannelLayout = ChannelLayoutFromMask(uChannelMask, nChannels);
 		if (subType.Data1 == MFAudioFormat_Float.Data1)
 		{
 			m_audioAttribute.m_iSampleFmt = AV_SAMPLE_FMT_FLT;
 		}
+		else if (subType.Data1 == MFAudioFormat_PCM.Data1)
+		{
+			m_audioAttribute.m_iSampleFmt = wBitsPerSample == 8 ? AV_SAMPLE_FMT_U8 :
+				wBitsPerSample == 16 ? AV_SAMPLE_FMT_S16 :
+				wBitsPerSample == 32 ? AV_SAMPLE_FMT_S32 : AV_SAMPLE_FMT_NONE;
+
+            // Packed 24-bit samples have no sample format in FFmpeg; read
+            // as 16 bits they would be encoded as noise.
+            if (m_audioAttribute.m_iSampleFmt == AV_SAMPLE_FMT_NONE)
+            {
+                LOG_ERR("audio: %u-bit PCM is not supported\n", wBitsPerSample);
+                hr = MF_E_INVALIDMEDIATYPE;
+            }
+		}
     }
 
-    InitCodec();
+    if (SUCCEEDED(hr))
+    {
+        InitCodec();
+    }
+
+    if (SUCCEEDED(hr) && FAILED(StartPipeline()))
+    {
+        LOG_ERR("cannot start the audio pipeline\n");
+    }
 
     if (SUCCEEDED(hr))
     {
@@ -413,115 +787,836 @@ HRESULT CAudio::SetDevice(IMFActivate *pActivate)
     return hr;
 }
 
-static int check_sample_fmt(AVCodec *codec, enum AVSampleFormat sample_fmt)
+//-------------------------------------------------------------------
+// StartPipeline
+//
+// Starts the capture graph and the read thread. Writing, resampling
+// and encoding run on their own threads, off the capture callback.
+//-------------------------------------------------------------------
+
+HRESULT CAudio::StartPipeline()
 {
-    const enum AVSampleFormat *p = codec->sample_fmts;
+    UINT cbFrame = m_audioAttribute.m_uBlockAlign;
+    UINT uReadSamples = AUDIO_READ_SAMPLES;
 
-    while (*p != AV_SAMPLE_FMT_NONE) {
-        if (*p == sample_fmt)
-            return 1;
-        p++;
+    if (m_codecContext && m_codecContext->frame_size > 0)
+    {
+        m_fifo = av_audio_fifo_alloc(m_codecContext->sample_fmt,
+            m_codecContext->channels, m_codecContext->frame_size * 2);
+
+        uReadSamples = m_codecContext->frame_size;
     }
-    return 0;
-}
 
-static int check_sample_rate(AVCodec *codec, int sample_rate)
-{
-    const int *p = codec->supported_samplerates;
+    m_uReadBytes = uReadSamples * cbFrame;
+    m_audioPipe = BufferPipe::Create(
+        max(m_audioAttribute.m_uSampleRate * AUDIO_PIPE_MS / 1000 * cbFrame, m_uReadBytes * 2), 0);
+    m_hSamplesReady = CreateEvent(NULL, FALSE, FALSE, NULL);
 
-    while (*p != 0) {
-        if (*p == sample_rate)
-            return 1;
-        p++;
+    m_pipeline = Pipeline::Create("audio");
+
+    if (m_pipeline == NULL || m_audioPipe == NULL || m_hSamplesReady == NULL ||
+        m_srcFrame == NULL || m_uReadBytes == 0)
+    {
+        StopPipeline();
+        return E_OUTOFMEMORY;
     }
-    return 0;
-}
 
-HRESULT CAudio::InitCodec() {
+    // Stages are stopped in the order they are added: upstream first.
+    m_captureSource = m_pipeline->AddSource("capture", &g_AVFrameItemOps);
+    int pcmWrite = m_pipeline->AddNode("pcm-write", PCMWriteNode, this,
+        AUDIO_QUEUE_FRAMES, QUEUE_DROP_OLDEST, NULL);
+    int resample = m_pipeline->AddNode("resample", ResampleNode, this,
+        AUDIO_QUEUE_FRAMES, QUEUE_DROP_OLDEST, &g_AVFrameItemOps);
+    int encode = m_pipeline->AddNode("aac-encode", EncodeNode, this,
+        STAGE_QUEUE_FRAMES, QUEUE_BLOCK, &g_AVPacketItemOps);
+    int aacWrite = m_pipeline->AddNode("aac-write", AACWriteNode, this,
+        STAGE_QUEUE_PACKETS, QUEUE_BLOCK, NULL);
+
+    if (m_pipeline->Connect(m_captureSource, pcmWrite) < 0 ||
+        m_pipeline->Connect(m_captureSource, resample) < 0 ||
+        m_pipeline->Connect(resample, encode) < 0 ||
+        m_pipeline->Connect(encode, aacWrite) < 0 ||
+        m_pipeline->Start() < 0)
+    {
+        StopPipeline();
+        return E_FAIL;
+    }
 
-    HRESULT hr = S_OK;
+    ZeroMemory(&m_hold, sizeof(m_hold));
+    m_lHoldReport = 0;
 
-    //m_codec = avcodec_find_encoder(AV_CODEC_ID_AAC);
-    m_codec = avcodec_find_encoder_by_name("libfdk_aac");
-    if (m_codec == NULL)
+    ZeroMemory(&m_drift, sizeof(m_drift));
+    m_llReadFrames = 0;
+    m_lDriftReport = 0;
+
+    // Before the callback sees the pipe: the first write anchors it.
+    m_llWrittenFrames = 0;
+    m_lAnchorStarts = 0;
+
+    m_bReading = TRUE;
+    if (pthread_create(&m_readThread, NULL, ReadProc, this) != 0)
     {
-        return !S_OK;
+        m_bReading = FALSE;
+        StopPipeline();
+        return E_FAIL;
     }
 
-    m_codecContext = avcodec_alloc_context3(m_codec);
+    InterlockedExchangePointer((PVOID volatile*)&m_pCapturePipe, m_audioPipe);
 
-    m_codecContext->channels = m_audioAttribute.m_uChannel;
-    m_codecContext->sample_rate = m_audioAttribute.m_uSampleRate;
-    m_codecContext->sample_fmt = AV_SAMPLE_FMT_S16;
-	m_codecContext->channel_layout = AV_CH_LAYOUT_STEREO; //av_get_default_channel_layout(m_codecContext->channels);
+    return S_OK;
+}
 
-    m_codecContext->bit_rate = 64000;
 
-    if (!check_sample_fmt(m_codec, m_codecContext->sample_fmt)) {
-        LOG_ERR("Encoder does not support sample format %s",
-            av_get_sample_fmt_name(m_codecContext->sample_fmt));
-    }
+//-------------------------------------------------------------------
+// StopPipeline
+//
+// Lets every stage finish its queued items and flush, then frees the
+// graph.
+//-------------------------------------------------------------------
 
-    if (!check_sample_rate(m_codec, m_codecContext->sample_rate)) {
-        LOG_ERR("Encoder does not support sample rate %d",
-            m_codecContext->sample_rate);
+void CAudio::StopPipeline()
+{
+    // No callback writes to the pipe after this.
+    InterlockedExchangePointer((PVOID volatile*)&m_pCapturePipe, NULL);
+    WaitForCallbacks();
+
+    // The read thread passes on what the callback has written.
+    if (m_bReading)
+    {
+        m_bReading = FALSE;
+        SetEvent(m_hSamplesReady);
+        pthread_join(m_readThread, NULL);
     }
 
-    int ret = avcodec_open2(m_codecContext, m_codec, NULL);
-    if (ret < 0) {
-        char strerr[100];
-        av_strerror(ret, strerr, 100);
-        LOG_ERR("open codex failed with %s!", strerr);
+    if (m_pipeline)
+    {
+        m_pipeline->Destory();
+        m_pipeline = NULL;
     }
 
-    int sample_size = av_samples_get_buffer_size(NULL, m_codecContext->channels, m_codecContext->frame_size, m_codecContext->sample_fmt, 0);
+    m_captureSource = -1;
 
-    m_dstFrame = av_frame_alloc();
-	if (m_dstFrame) {
-		m_dstFrame->channels = m_codecContext->channels;
-		m_dstFrame->channel_layout = m_codecContext->channel_layout;
-		m_dstFrame->sample_rate = m_codecContext->sample_rate;
-		m_dstFrame->format = m_codecContext->sample_fmt;
-		m_dstFrame->nb_samples = m_codecContext->frame_size;
+    if (m_fifo)
+    {
+        av_audio_fifo_free(m_fifo);
+        m_fifo = NULL;
     }
-	av_frame_get_buffer(m_dstFrame, 0);
 
-    m_srcFrame = av_frame_alloc();
-	if (m_srcFrame) {
-		m_srcFrame->channels = m_audioAttribute.m_uChannel;
-		m_srcFrame->channel_layout = av_get_default_channel_layout(m_srcFrame->channels);
-		m_srcFrame->sample_rate = m_audioAttribute.m_uSampleRate;
-		m_srcFrame->format = m_audioAttribute.m_iSampleFmt;
+    if (m_audioPipe)
+    {
+        m_audioPipe->Destory();
+        m_audioPipe = NULL;
     }
 
-	m_swrContext = swr_alloc();
-	ret = swr_config_frame(m_swrContext, m_dstFrame, m_srcFrame);
-	if (ret <0)
-	{
-		LOG_ERR("swr_config_frame failed with %d\n", ret);
-	}
-	if (!swr_is_initialized(m_swrContext))
-	{
-		ret = swr_init(m_swrContext);
-		if (ret<0)
-		{
-			LOG_ERR("swr_init failed with %d\n", ret);
-		}
-	}
-
-	m_audioPipe = BufferPipe::Create(sample_size*20, 0);
-
-    return hr;
+    if (m_hSamplesReady)
+    {
+        CloseHandle(m_hSamplesReady);
+        m_hSamplesReady = NULL;
+    }
 }
 
 
-void CAudio::UninitCodec() {
+//-------------------------------------------------------------------
+// ReadProc
+//
+// The read thread: waits for the capture callback and emits what it
+// wrote to m_audioPipe, until StopPipeline() ends it.
+//-------------------------------------------------------------------
+
+void *CAudio::ReadProc(void *arg)
+{
+    CAudio *pAudio = (CAudio*)arg;
+
+    while (pAudio->m_bReading)
+    {
+        WaitForSingleObject(pAudio->m_hSamplesReady, AUDIO_READ_TIMEOUT_MS);
+
+        if (pAudio->m_bDriftCompensation)
+        {
+            pAudio->UpdateDrift();
+        }
+
+        pAudio->ReadSamples(FALSE);
+
+        if (InterlockedExchange(&pAudio->m_lHoldReport, 0))
+        {
+            pAudio->LogHoldTime();
+        }
+    }
+
+    pAudio->ReadSamples(TRUE);
+
+    return NULL;
+}
+
+
+//-------------------------------------------------------------------
+// ReadSamples
+//
+// Emits the samples in m_audioPipe from the capture source, in frames
+// of m_uReadBytes. With bDrain the rest goes too, in a shorter frame.
+// Runs on the read thread.
+//-------------------------------------------------------------------
+
+void CAudio::ReadSamples(BOOL bDrain)
+{
+    UINT cbFrame = m_audioAttribute.m_uBlockAlign;
+
+    for (;;)
+    {
+        UINT cbRead = min(m_audioPipe->GetLength(), m_uReadBytes);
+        cbRead -= cbRead % cbFrame;
+
+        if (cbRead == 0 || (cbRead < m_uReadBytes && !bDrain))
+        {
+            break;
+        }
+
+        AVFrame *pFrame = av_frame_alloc();
+        if (pFrame == NULL)
+        {
+            break;
+        }
+
+        pFrame->channels = m_srcFrame->channels;
+        pFrame->channel_layout = m_srcFrame->channel_layout;
+        pFrame->sample_rate = m_srcFrame->sample_rate;
+        pFrame->format = m_srcFrame->format;
+        pFrame->nb_samples = cbRead / cbFrame;
+
+        if (av_frame_get_buffer(pFrame, 0) < 0)
+        {
+            av_frame_free(&pFrame);
+            break;
+        }
+
+        // Capture time of the first sample, in 100 ns.
+        pFrame->pts = AV_NOPTS_VALUE;
+        if (InterlockedCompareExchange(&m_lAnchorStarts, 0, 0) != 0)
+        {
+            pFrame->pts = m_llAnchorTime +
+                av_rescale(m_llReadFrames - m_llAnchorFrame, 10000000, pFrame->sample_rate);
+        }
+
+        // Packed: the samples are in one plane, as captured.
+        m_audioPipe->Read(pFrame->data[0], cbRead);
+        m_llReadFrames += pFrame->nb_samples;
+
+        m_pipeline->Push(m_captureSource, pFrame);
+    }
+}
+
+
+/////////////// Pipeline stages ///////////////
+
+void CAudio::PCMWriteNode(void *ctx, void *item, PipelineOutput * /* out */)
+{
+    AVFrame *pFrame = (AVFrame*)item;
+
+    if (pFrame)
+    {
+        ((CAudio*)ctx)->WritePCMFrame(pFrame);
+        av_frame_free(&pFrame);
+    }
+}
+
+
+void CAudio::ResampleNode(void *ctx, void *item, PipelineOutput *out)
+{
+    AVFrame *pFrame = (AVFrame*)item;
+
+    if (pFrame)
+    {
+        ((CAudio*)ctx)->ResampleFrame(pFrame, out);
+        av_frame_free(&pFrame);
+    }
+}
+
+
+void CAudio::EncodeNode(void *ctx, void *item, PipelineOutput *out)
+{
+    AVFrame *pFrame = (AVFrame*)item;
+
+    // NULL at the end of the stream flushes the encoder.
+    ((CAudio*)ctx)->EncodeFrame(pFrame, out);
+    av_frame_free(&pFrame);
+}
+
+
+void CAudio::AACWriteNode(void *ctx, void *item, PipelineOutput * /* out */)
+{
+    AVPacket *pPacket = (AVPacket*)item;
+
+    if (pPacket)
+    {
+        ((CAudio*)ctx)->WriteAACPacket(pPacket);
+        ((CAudio*)ctx)->WriteMP4Packet(pPacket);
+        av_packet_free(&pPacket);
+    }
+}
+
+
+//-------------------------------------------------------------------
+// WritePCMFrame
+//
+// Appends captured samples to the PCM file. Runs on the pcm-write
+// stage.
+//-------------------------------------------------------------------
+
+void CAudio::WritePCMFrame(AVFrame *pFrame)
+{
+    EnterCriticalSection(&m_filesec);
+
+    if (m_bPCMRecordStatus == TRUE && pcmfile)
+    {
+        int size = av_samples_get_buffer_size(NULL, pFrame->channels,
+            pFrame->nb_samples, (AVSampleFormat)pFrame->format, 1);
+
+        pcmfile->Write(pFrame->data[0], size);
+    }
+
+    LeaveCriticalSection(&m_filesec);
+}
+
+
+//-------------------------------------------------------------------
+// ResampleFrame
+//
+// Converts captured samples to the encoder format and emits them in
+// frames of the encoder frame size. Runs on the resample stage.
+//-------------------------------------------------------------------
+
+void CAudio::ResampleFrame(AVFrame *pFrame, PipelineOutput *out)
+{
+    if ((m_swrContext == NULL && m_pfnConvert == NULL) || m_fifo == NULL || m_dstFrame == NULL)
+    {
+        return;
+    }
+
+    // Nothing to encode: do not carry samples over to the next recording.
+    if (m_bAACRecordStatus != TRUE && m_bMP4RecordStatus != TRUE)
+    {
+        av_audio_fifo_reset(m_fifo);
+        m_bDriftBase = FALSE;
+        m_bPtsBase = FALSE;
+        return;
+    }
+
+    // The recording starts at the capture time of its first samples, on
+    // the clock of the video. The encoder pts count the samples from
+    // there, which drift compensation keeps in step with that clock.
+    if (!m_bPtsBase && pFrame->pts != AV_NOPTS_VALUE)
+    {
+        m_dstFrame->pts = av_rescale(pFrame->pts, m_dstFrame->sample_rate, 10000000) -
+            av_audio_fifo_size(m_fifo);
+        m_bPtsBase = TRUE;
+    }
+
+    if (m_pfnConvert)
+    {
+        ConvertFrame(pFrame);
+    }
+    else
+    {
+        SwrConvertFrame(pFrame);
+    }
+
+    EmitEncoderFrames(out);
+}
+
+
+//-------------------------------------------------------------------
+// ConvertFrame
+//
+// Converts captured float samples to S16 into m_fifo with m_pfnConvert,
+// mixed down with m_pfnDownmix first if it is set. Packed audio: the
+// channels take a single call.
+//-------------------------------------------------------------------
+
+void CAudio::ConvertFrame(AVFrame *pFrame)
+{
+    const float *pSamples = (const float*)pFrame->data[0];
+    DWORD dwChannels = pFrame->channels;
+
+    if (m_pfnDownmix)
+    {
+        av_fast_malloc(&m_pDownmixBuffer, &m_cbDownmixBuffer,
+            pFrame->nb_samples * m_downmix.dwOutChannels * sizeof(float));
+        if (m_pDownmixBuffer == NULL)
+        {
+            m_cbDownmixBuffer = 0;
+            return;
+        }
+
+        m_pfnDownmix(m_pDownmixBuffer, pSamples, pFrame->nb_samples, &m_downmix);
+
+        pSamples = m_pDownmixBuffer;
+        dwChannels = m_downmix.dwOutChannels;
+    }
+
+    DWORD dwSamples = (DWORD)pFrame->nb_samples * dwChannels;
+
+    av_fast_malloc(&m_pConvertBuffer, &m_cbConvertBuffer, dwSamples * sizeof(INT16));
+    if (m_pConvertBuffer == NULL)
+    {
+        m_cbConvertBuffer = 0;
+        return;
+    }
+
+    m_pfnConvert(m_pConvertBuffer, pSamples, dwSamples, m_bDither ? &m_dither : NULL);
+
+    void *pData = m_pConvertBuffer;
+    av_audio_fifo_write(m_fifo, &pData, pFrame->nb_samples);
+}
+
+
+//-------------------------------------------------------------------
+// SwrConvertFrame
+//
+// Converts captured samples to the encoder format into m_fifo with
+// swresample.
+//-------------------------------------------------------------------
+
+void CAudio::SwrConvertFrame(AVFrame *pFrame)
+{
+    AVFrame *pConverted = av_frame_alloc();
+    if (pConverted == NULL)
+    {
+        return;
+    }
+
+    pConverted->channels = m_dstFrame->channels;
+    pConverted->channel_layout = m_dstFrame->channel_layout;
+    pConverted->sample_rate = m_dstFrame->sample_rate;
+    pConverted->format = m_dstFrame->format;
+    if (m_bDriftCompensation && InterlockedExchange(&m_lDriftReport, 0))
+    {
+        CompensateDrift();
+    }
+
+    pConverted->nb_samples = swr_get_out_samples(m_swrContext, pFrame->nb_samples);
+
+    int ret = av_frame_get_buffer(pConverted, 0);
+
+    if (ret >= 0)
+    {
+        INT64 llStart = av_gettime_relative();
+
+        ret = swr_convert(m_swrContext, pConverted->data, pConverted->nb_samples,
+            (const uint8_t **)pFrame->data, pFrame->nb_samples);
+
+        m_llResampleTime += av_gettime_relative() - llStart;
+        m_llResampleSamples += pFrame->nb_samples;
+
+        if (m_llResampleSamples >= (INT64)AUDIO_RESAMPLE_STATS_SECONDS * m_srcFrame->sample_rate)
+        {
+            LogResampleStats();
+        }
+    }
+
+    if (ret < 0)
+    {
+        char strerr[100];
+        av_strerror(ret, strerr, 100);
+        LOG_ERR("swr_convert failed with %s\n", strerr);
+    }
+    else if (ret > 0)
+    {
+        av_audio_fifo_write(m_fifo, (void **)pConverted->data, ret);
+    }
+
+    av_frame_free(&pConverted);
+}
+
+
+//-------------------------------------------------------------------
+// EmitEncoderFrames
+//
+// Emits the samples in m_fifo in frames of the encoder frame size.
+//-------------------------------------------------------------------
+
+void CAudio::EmitEncoderFrames(PipelineOutput *out)
+{
+    int frameSize = m_codecContext->frame_size;
+
+    while (av_audio_fifo_size(m_fifo) >= frameSize)
+    {
+        AVFrame *pEncFrame = av_frame_alloc();
+        if (pEncFrame == NULL)
+        {
+            break;
+        }
+
+        pEncFrame->channels = m_dstFrame->channels;
+        pEncFrame->channel_layout = m_dstFrame->channel_layout;
+        pEncFrame->sample_rate = m_dstFrame->sample_rate;
+        pEncFrame->format = m_dstFrame->format;
+        pEncFrame->nb_samples = frameSize;
+
+        if (av_frame_get_buffer(pEncFrame, 0) < 0)
+        {
+            av_frame_free(&pEncFrame);
+            break;
+        }
+
+        av_audio_fifo_read(m_fifo, (void **)pEncFrame->data, frameSize);
+
+        pEncFrame->pts = m_dstFrame->pts;
+        m_dstFrame->pts += frameSize;
+
+        out->Emit(pEncFrame);
+    }
+}
+
+
+//-------------------------------------------------------------------
+// EncodeFrame
+//
+// Encodes a frame and emits the packets. pFrame is NULL at the end of
+// the stream, which drains the frames the encoder still holds. Runs
+// on the aac-encode stage.
+//-------------------------------------------------------------------
+
+void CAudio::EncodeFrame(AVFrame *pFrame, PipelineOutput *out)
+{
+    if (m_codecContext == NULL ||
+        (m_bAACRecordStatus != TRUE && m_bMP4RecordStatus != TRUE))
+    {
+        return;
+    }
+
+    for (;;)
+    {
+        AVPacket *pPacket = av_packet_alloc();
+        int got_packet = 0;
+
+        if (pPacket == NULL)
+        {
+            break;
+        }
+
+        int ret = avcodec_encode_audio2(m_codecContext, pPacket, pFrame, &got_packet);
+        if (ret < 0)
+        {
+            char strerr[100];
+            av_strerror(ret, strerr, 100);
+            LOG_ERR("avcodec_encode_audio2 failed with %s\n", strerr);
+        }
+
+        if (ret < 0 || !got_packet)
+        {
+            av_packet_free(&pPacket);
+            break;
+        }
+
+        out->Emit(pPacket);
+
+        // A frame gives at most one packet; a flush gives all of them.
+        if (pFrame)
+        {
+            break;
+        }
+    }
+}
+
+
+//-------------------------------------------------------------------
+// WriteAACPacket
+//
+// Appends a packet to the AAC file. Runs on the aac-write stage.
+//-------------------------------------------------------------------
+
+void CAudio::WriteAACPacket(AVPacket *pPacket)
+{
+    EnterCriticalSection(&m_filesec);
+
+    if (m_bAACRecordStatus == TRUE && aacfile)
+    {
+        aacfile->Write(pPacket->data, pPacket->size);
+    }
+
+    LeaveCriticalSection(&m_filesec);
+}
+
+
+//-------------------------------------------------------------------
+// WriteMP4Packet
+//
+// Passes a packet to the MP4 writer. Runs on the aac-write stage.
+//-------------------------------------------------------------------
+
+void CAudio::WriteMP4Packet(AVPacket *pPacket)
+{
+    EnterCriticalSection(&m_filesec);
+
+    if (m_bMP4RecordStatus == TRUE && m_mp4Writer)
+    {
+        m_mp4Writer->Write(m_iMP4Stream, pPacket);
+    }
+
+    LeaveCriticalSection(&m_filesec);
+}
+
+
+//-------------------------------------------------------------------
+// ChooseEncoderLayout
+//
+// The capture layout if the encoder takes it and no downmix is asked
+// for. Otherwise stereo, or mono for a mono capture or /downmix:mono.
+//-------------------------------------------------------------------
+
+static UINT64 ChooseEncoderLayout(const AVCodec *codec, UINT64 captureLayout, int iDownmixChannels)
+{
+    int nCapture = av_get_channel_layout_nb_channels(captureLayout);
+
+    if (iDownmixChannels > 0 && iDownmixChannels < nCapture)
+    {
+        return iDownmixChannels == 1 ? AV_CH_LAYOUT_MONO : AV_CH_LAYOUT_STEREO;
+    }
+
+    if (codec->channel_layouts == NULL)
+    {
+        return captureLayout;
+    }
+
+    for (const uint64_t *p = codec->channel_layouts; *p; p++)
+    {
+        if (*p == captureLayout)
+        {
+            return captureLayout;
+        }
+    }
+
+    return nCapture == 1 ? AV_CH_LAYOUT_MONO : AV_CH_LAYOUT_STEREO;
+}
+
+
+//-------------------------------------------------------------------
+// OpenResampler
+//
+// Sets up the conversion of m_srcFrame to m_dstFrame on pSwr with a
+// profile, the dither, and the downmix coefficients of pMix if it is
+// not NULL, and initializes it.
+//-------------------------------------------------------------------
+
+int CAudio::OpenResampler(SwrContext *pSwr, RESAMPLE_PROFILE profile, const AudioDownmix *pMix)
+{
+    if (pSwr == NULL)
+    {
+        return AVERROR(ENOMEM);
+    }
+
+    int ret = swr_config_frame(pSwr, m_dstFrame, m_srcFrame);
+    if (ret < 0)
+    {
+        LOG_ERR("swr_config_frame failed with %d\n", ret);
+        return ret;
+    }
+
+    ApplyResampleProfile(pSwr, profile);
+
+    if (m_bDither)
+    {
+        av_opt_set_int(pSwr, "dither_method", SWR_DITHER_TRIANGULAR, 0);
+    }
+
+    // Resample even at the same rate, so that swr_set_compensation()
+    // need not initialize it again.
+    if (m_bDriftCompensation)
+    {
+        av_opt_set_int(pSwr, "flags", SWR_FLAG_RESAMPLE, 0);
+    }
+
+    if (pMix)
+    {
+        double matrix[2][AUDIO_MAX_DOWNMIX_CHANNELS];
+        for (int o = 0; o < 2; o++)
+        {
+            for (DWORD c = 0; c < AUDIO_MAX_DOWNMIX_CHANNELS; c++)
+            {
+                matrix[o][c] = pMix->coef[o][c];
+            }
+        }
+        swr_set_matrix(pSwr, &matrix[0][0], AUDIO_MAX_DOWNMIX_CHANNELS);
+    }
+
+    return swr_init(pSwr);
+}
+
+
+static int check_sample_fmt(AVCodec *codec, enum AVSampleFormat sample_fmt)
+{
+    const enum AVSampleFormat *p = codec->sample_fmts;
+
+    while (*p != AV_SAMPLE_FMT_NONE) {
+        if (*p == sample_fmt)
+            return 1;
+        p++;
+    }
+    return 0;
+}
+
+static int check_sample_rate(AVCodec *codec, int sample_rate)
+{
+    const int *p = codec->supported_samplerates;
+
+    while (*p != 0) {
+        if (*p == sample_rate)
+            return 1;
+        p++;
+    }
+    return 0;
+}
+
+HRESULT CAudio::InitCodec() {
+
+    HRESULT hr = S_OK;
+
+    //m_codec = avcodec_find_encoder(AV_CODEC_ID_AAC);
+    m_codec = avcodec_find_encoder_by_name("libfdk_aac");
+    if (m_codec == NULL)
+    {
+        return !S_OK;
+    }
+
+    m_codecContext = avcodec_alloc_context3(m_codec);
+
+    m_codecContext->channel_layout = ChooseEncoderLayout(m_codec,
+        m_audioAttribute.m_ullChannelLayout, m_iDownmixChannels);
+    m_codecContext->channels = av_get_channel_layout_nb_channels(m_codecContext->channel_layout);
+    m_codecContext->sample_rate = m_audioAttribute.m_uSampleRate;
+    m_codecContext->sample_fmt = AV_SAMPLE_FMT_S16;
+
+    m_codecContext->bit_rate = AAC_BIT_RATE_PER_CHANNEL * m_codecContext->channels;
+
+    // Packet timestamps count samples.
+    m_codecContext->time_base.num = 1;
+    m_codecContext->time_base.den = m_codecContext->sample_rate;
+
+    if (!check_sample_fmt(m_codec, m_codecContext->sample_fmt)) {
+        LOG_ERR("Encoder does not support sample format %s",
+            av_get_sample_fmt_name(m_codecContext->sample_fmt));
+    }
+
+    if (!check_sample_rate(m_codec, m_codecContext->sample_rate)) {
+        LOG_ERR("Encoder does not support sample rate %d",
+            m_codecContext->sample_rate);
+    }
+
+    int ret = avcodec_open2(m_codecContext, m_codec, NULL);
+    if (ret < 0) {
+        char strerr[100];
+        av_strerror(ret, strerr, 100);
+        LOG_ERR("open codex failed with %s!", strerr);
+    }
+
+    m_dstFrame = av_frame_alloc();
+	if (m_dstFrame) {
+		m_dstFrame->channels = m_codecContext->channels;
+		m_dstFrame->channel_layout = m_codecContext->channel_layout;
+		m_dstFrame->sample_rate = m_codecContext->sample_rate;
+		m_dstFrame->format = m_codecContext->sample_fmt;
+		m_dstFrame->nb_samples = m_codecContext->frame_size;
+		m_dstFrame->pts = 0;
+    }
+
+    // m_dstFrame only describes the encoder input and carries the
+    // timestamp; the resample stage allocates the frames it emits.
+
+    m_srcFrame = av_frame_alloc();
+	if (m_srcFrame) {
+		m_srcFrame->channels = m_audioAttribute.m_uChannel;
+		m_srcFrame->channel_layout = m_audioAttribute.m_ullChannelLayout;
+		m_srcFrame->sample_rate = m_audioAttribute.m_uSampleRate;
+		m_srcFrame->format = m_audioAttribute.m_iSampleFmt;
+    }
+
+    char szCapture[64] = "";
+    char szEncoder[64] = "";
+    if (m_srcFrame && m_dstFrame)
+    {
+        av_get_channel_layout_string(szCapture, sizeof(szCapture), m_srcFrame->channels, m_srcFrame->channel_layout);
+        av_get_channel_layout_string(szEncoder, sizeof(szEncoder), m_dstFrame->channels, m_dstFrame->channel_layout);
+        LOG_INFO("audio: capture %s, encoder %s\n", szCapture, szEncoder);
+    }
+
+    // Fewer channels for the encoder: the coefficients of audioconvert,
+    // for either path.
+    BOOL bDownmix = m_srcFrame && m_dstFrame &&
+        m_srcFrame->channel_layout != m_dstFrame->channel_layout &&
+        InitAudioDownmix(&m_downmix, m_srcFrame->channel_layout, m_dstFrame->channel_layout);
+
+    // Same rate, and the same layout or one mixed down as above: only
+    // the sample format changes, which the kernels of audioconvert do
+    // without swresample. Drift compensation needs swresample.
+    m_pfnConvert = NULL;
+    m_pfnDownmix = NULL;
+
+    if (m_srcFrame && m_dstFrame &&
+        m_srcFrame->format == AV_SAMPLE_FMT_FLT && m_dstFrame->format == AV_SAMPLE_FMT_S16 &&
+        m_srcFrame->sample_rate == m_dstFrame->sample_rate && !m_bDriftCompensation &&
+        (bDownmix || m_srcFrame->channel_layout == m_dstFrame->channel_layout))
+    {
+        m_pfnConvert = GetFloatToS16Converter();
+        m_pfnDownmix = bDownmix ? GetFloatDownmixer() : NULL;
+        InitAudioDither(&m_dither, GetTickCount());
+
+        LOG_INFO("audio: float to S16 %s kernel%s%s\n",
+            m_pfnConvert == ConvertFloatToS16_SSE2 ? "SSE2" : "C",
+            bDownmix ? ", mixed down" : "", m_bDither ? ", dithered" : "");
+    }
+
+    RESAMPLE_PROFILE profile = m_resampleProfile;
+
+	m_swrContext = swr_alloc();
+    ret = OpenResampler(m_swrContext, profile, bDownmix ? &m_downmix : NULL);
+
+    // Without libsoxr in FFmpeg: the default profile.
+    if (ret < 0 && profile != RESAMPLE_PROFILE_DEFAULT)
+    {
+        LOG_ERR("resampler profile %s failed with %d, using %s\n", g_ResampleProfiles[profile].name,
+            ret, g_ResampleProfiles[RESAMPLE_PROFILE_DEFAULT].name);
+
+        profile = RESAMPLE_PROFILE_DEFAULT;
+        swr_free(&m_swrContext);
+        m_swrContext = swr_alloc();
+        ret = OpenResampler(m_swrContext, profile, bDownmix ? &m_downmix : NULL);
+    }
+    if (ret < 0)
+    {
+        LOG_ERR("swr_init failed with %d\n", ret);
+    }
+
+    m_resampleProfile = profile;
+    m_llResampleTime = 0;
+    m_llResampleSamples = 0;
+    m_bDriftBase = FALSE;
+
+    if (m_pfnConvert == NULL)
+    {
+        LOG_INFO("audio: resampler %s%s\n", g_ResampleProfiles[profile].name,
+            m_bDriftCompensation ? ", drift compensation" : "");
+    }
+
+    return hr;
+}
+
+
+void CAudio::UninitCodec() {
 
 	if (m_swrContext)
 	{
 		swr_free(&m_swrContext);
 	}
 
+    m_pfnConvert = NULL;
+    av_freep(&m_pConvertBuffer);
+    m_cbConvertBuffer = 0;
+
+    m_pfnDownmix = NULL;
+    av_freep(&m_pDownmixBuffer);
+    m_cbDownmixBuffer = 0;
+
 	if (m_srcFrame)
 	{
 		av_frame_free(&m_srcFrame);
@@ -529,10 +1624,6 @@ void CAudio::UninitCodec() {
 
     if (m_dstFrame)
     {
-        if (m_dstFrame->data[0])
-        {
-            av_freep(&m_dstFrame->data[0]);
-        }
         av_frame_free(&m_dstFrame);
     }
     if (m_codecContext)
@@ -542,53 +1633,98 @@ void CAudio::UninitCodec() {
         m_codecContext = NULL;
     }
 
-    if (aacfile)
-    {
-        aacfile->flush();
-        aacfile->close();
-        delete aacfile;
-        aacfile = NULL;
-    }
+    // The stream was added with the parameters of this encoder.
+    m_bMP4RecordStatus = FALSE;
+    m_mp4Writer = NULL;
+    m_iMP4Stream = -1;
+    UpdateCapturing();
 
-    if (pcmfile)
-    {
-        pcmfile->flush();
-        pcmfile->close();
-        delete pcmfile;
-        pcmfile = NULL;
-    }
+    CloseRecordFile(&aacfile, "audio.aac");
+    CloseRecordFile(&pcmfile, "audio.pcm");
+}
 
-	if (m_audioPipe)
-	{
-		m_audioPipe->Destory();
-		m_audioPipe = NULL;
-	}
+
+//-------------------------------------------------------------------
+// SetDither
+//
+// Adds TPDF dither when the samples are converted to 16 bits, by the
+// audioconvert kernels or by swresample. Set before the device.
+//-------------------------------------------------------------------
+
+void CAudio::SetDither(BOOL bDither)
+{
+    m_bDither = bDither;
+}
+
+
+//-------------------------------------------------------------------
+// SetDownmix
+//
+// Encodes iChannels, 1 or 2, when the capture has more, mixed down by
+// the coefficients of InitAudioDownmix(). 0 keeps the capture layout
+// where the encoder takes it. Set before the device.
+//-------------------------------------------------------------------
+
+void CAudio::SetDownmix(int iChannels)
+{
+    m_iDownmixChannels = iChannels;
+}
+
+
+//-------------------------------------------------------------------
+// SetResampleProfile
+//
+// The options of swresample, where the capture is resampled. HQ falls
+// back to the default without libsoxr. Set before the device.
+//-------------------------------------------------------------------
+
+void CAudio::SetResampleProfile(RESAMPLE_PROFILE profile)
+{
+    m_resampleProfile = profile;
+}
+
+
+//-------------------------------------------------------------------
+// SetDriftCompensation
+//
+// Keeps the recorded audio to the system clock, by swresample, even
+// when the device and the encoder run at the same rate. Set before the
+// device.
+//-------------------------------------------------------------------
+
+void CAudio::SetDriftCompensation(BOOL bCompensate)
+{
+    m_bDriftCompensation = bCompensate;
 }
 
 
 HRESULT CAudio::StartPCMRecord() {
     LOG_INFO("PCM Record Starting...\n");
 
-    pcmfile = new std::ofstream("audio.pcm", std::ios::binary);
+    EnterCriticalSection(&m_filesec);
 
-    m_bPCMRecordStatus = TRUE;
+    pcmfile = OpenRecordFile("audio.pcm", PCM_FILE_CONFIG);
 
-    return S_OK;
+    m_bPCMRecordStatus = pcmfile ? TRUE : FALSE;
+    UpdateCapturing();
+
+    LeaveCriticalSection(&m_filesec);
+
+    return pcmfile ? S_OK : E_FAIL;
 }
 
 HRESULT CAudio::StopPCMRecord() {
 
     LOG_INFO("PCM Record Stopping...\n");
 
+    EnterCriticalSection(&m_filesec);
+
     m_bPCMRecordStatus = FALSE;
+    UpdateCapturing();
 
-    if (pcmfile)
-    {
-        pcmfile->flush();
-        pcmfile->close();
-        delete pcmfile;
-        pcmfile = NULL;
-    }
+    CloseRecordFile(&pcmfile, "audio.pcm");
+
+    LeaveCriticalSection(&m_filesec);
 
     return S_OK;
 }
@@ -597,26 +1733,79 @@ HRESULT CAudio::StartAACRecord() {
 
     LOG_INFO("AAC Record Starting...\n");
 
-    aacfile = new std::ofstream("audio.aac", std::ios::binary);
+    EnterCriticalSection(&m_filesec);
 
-    m_bAACRecordStatus = TRUE;
+    aacfile = OpenRecordFile("audio.aac", AAC_FILE_CONFIG);
 
-    return S_OK;
+    m_bAACRecordStatus = aacfile ? TRUE : FALSE;
+    UpdateCapturing();
+
+    LeaveCriticalSection(&m_filesec);
+
+    return aacfile ? S_OK : E_FAIL;
 }
 
 HRESULT CAudio::StopAACRecord() {
 
     LOG_INFO("AAC Record Stopping...\n");
 
+    EnterCriticalSection(&m_filesec);
+
     m_bAACRecordStatus = FALSE;
+    UpdateCapturing();
+
+    CloseRecordFile(&aacfile, "audio.aac");
+
+    LeaveCriticalSection(&m_filesec);
+
+    return S_OK;
+}
+
+HRESULT CAudio::AddMP4Stream(Mp4Writer *pWriter, int *piStream) {
+
+    HRESULT hr = E_FAIL;
+
+    EnterCriticalSection(&m_filesec);
 
-    if (aacfile)
+    *piStream = m_codecContext ? pWriter->AddStream(m_codecContext) : -1;
+    if (*piStream >= 0)
     {
-        aacfile->flush();
-        aacfile->close();
-        delete aacfile;
-        aacfile = NULL;
+        hr = S_OK;
     }
 
+    LeaveCriticalSection(&m_filesec);
+
+    return hr;
+}
+
+HRESULT CAudio::StartMP4Record(Mp4Writer *pWriter, int iStream) {
+
+    LOG_INFO("MP4 Record Starting...\n");
+
+    EnterCriticalSection(&m_filesec);
+
+    m_mp4Writer = pWriter;
+    m_iMP4Stream = iStream;
+    m_bMP4RecordStatus = TRUE;
+    UpdateCapturing();
+
+    LeaveCriticalSection(&m_filesec);
+
+    return S_OK;
+}
+
+HRESULT CAudio::StopMP4Record() {
+
+    LOG_INFO("MP4 Record Stopping...\n");
+
+    EnterCriticalSection(&m_filesec);
+
+    m_bMP4RecordStatus = FALSE;
+    m_mp4Writer = NULL;
+    m_iMP4Stream = -1;
+    UpdateCapturing();
+
+    LeaveCriticalSection(&m_filesec);
+
     return S_OK;
 }
\ No newline at end of file
@@ -39,13 +39,49 @@ public:
     HRESULT       CloseDevice();
     HRESULT       InitCodec();
     void          UninitCodec();
+    void          SetDither(BOOL bDither);
+    void          SetDownmix(int iChannels);
+    void          SetResampleProfile(RESAMPLE_PROFILE profile);
+    void          SetDriftCompensation(BOOL bCompensate);
     HRESULT       StartPCMRecord();
     HRESULT       StopPCMRecord();
     HRESULT       StartAACRecord();
     HRESULT       StopAACRecord();
+    HRESULT       AddMP4Stream(Mp4Writer *pWriter, int *piStream);
+    HRESULT       StartMP4Record(Mp4Writer *pWriter, int iStream);
+    HRESULT       StopMP4Record();
 
 protected:
 
+    HRESULT StartPipeline();
+    void    StopPipeline();
+
+    static void *ReadProc(void *arg);
+    void    ReadSamples(BOOL bDrain);
+    void    UpdateHoldTime(INT64 llHold);
+    void    UpdateCapturing();
+    void    WaitForCallbacks();
+    void    LogHoldTime();
+    void    UpdateDrift();
+    void    CompensateDrift();
+    void    LogResampleStats();
+
+    // Pipeline stages. ctx is the CAudio.
+    static void PCMWriteNode(void *ctx, void *item, PipelineOutput *out);
+    static void ResampleNode(void *ctx, void *item, PipelineOutput *out);
+    static void EncodeNode(void *ctx, void *item, PipelineOutput *out);
+    static void AACWriteNode(void *ctx, void *item, PipelineOutput *out);
+
+    void    WritePCMFrame(AVFrame *pFrame);
+    void    ResampleFrame(AVFrame *pFrame, PipelineOutput *out);
+    int     OpenResampler(SwrContext *pSwr, RESAMPLE_PROFILE profile, const AudioDownmix *pMix);
+    void    ConvertFrame(AVFrame *pFrame);
+    void    SwrConvertFrame(AVFrame *pFrame);
+    void    EmitEncoderFrames(PipelineOutput *out);
+    void    EncodeFrame(AVFrame *pFrame, PipelineOutput *out);
+    void    WriteAACPacket(AVPacket *pPacket);
+    void    WriteMP4Packet(AVPacket *pPacket);
+
     long                    m_nRefCount;        // Reference count.
     CRITICAL_SECTION        m_critsec;
 
@@ -60,12 +96,148 @@ protected:
 
 	struct SwrContext		*m_swrContext;
 
-    std::ofstream           *aacfile;
-    std::ofstream           *pcmfile;
+    // Set when the capture differs from the encoder input only in the
+    // sample format, float against S16; ResampleFrame() then converts
+    // with it, into m_pConvertBuffer, instead of m_swrContext.
+    AUDIO_CONVERT_FN        m_pfnConvert;
+    INT16                   *m_pConvertBuffer;
+    unsigned int            m_cbConvertBuffer;
+
+    // Set with m_pfnConvert when the encoder takes fewer channels than
+    // the capture: the samples are mixed down into m_pDownmixBuffer
+    // first. swresample mixes with the same coefficients.
+    AUDIO_DOWNMIX_FN        m_pfnDownmix;
+    AudioDownmix            m_downmix;
+    float                   *m_pDownmixBuffer;
+    unsigned int            m_cbDownmixBuffer;
+
+    // /downmix: channels of the encoder, 1 or 2, if fewer than the
+    // capture; 0 leaves the layout to ChooseEncoderLayout().
+    int                     m_iDownmixChannels;
+
+    // /dither: TPDF dither on the way to S16, on either path.
+    BOOL                    m_bDither;
+    AudioDither             m_dither;
+
+    // /resample:<name>: the options of m_swrContext. The time spent in
+    // swr_convert() is logged with the delay of the resampler every
+    // AUDIO_RESAMPLE_STATS_SECONDS of captured audio.
+    RESAMPLE_PROFILE        m_resampleProfile;
+    INT64                   m_llResampleTime;       // us
+    INT64                   m_llResampleSamples;    // Input, per channel.
+
+    // /drift: the read thread compares the samples the device delivers
+    // with the system clock. Every AUDIO_DRIFT_WINDOW_MS it fits a line
+    // to the difference, copies it to m_driftReport and sets
+    // m_lDriftReport. The resample stage then has swresample add or drop
+    // samples over the next window, so that the recording keeps to the
+    // system clock as the video does. m_audioPipe must not overrun: lost
+    // samples look like a slow device.
+    //
+    // The callback copies samples only while a recording is on, so the
+    // fit is thrown away while none is and starts again with each start
+    // of the capture, counted by m_lCaptureStarts.
+    struct DriftFit
+    {
+        LONG    lStarts;        // m_lCaptureStarts of the points.
+        INT64   llFirst;        // us of the first read, 0 before it.
+        INT64   llStart;        // us of the first point, after AUDIO_DRIFT_SETTLE_MS.
+        INT64   llStartFrames;
+        INT64   llWindowStart;
+        double  dSumX;          // s since llStart.
+        double  dSumY;          // Samples the device is ahead of the system clock.
+        double  dSumXX;
+        double  dSumXY;
+        UINT    uPoints;
+    };
+    struct DriftStats
+    {
+        double  dExcess;        // Samples the device is ahead, at the end of the window.
+        double  dRate;          // Samples per second it gains.
+        LONG    lStarts;        // Of the fit.
+    };
+    BOOL                    m_bDriftCompensation;
+    INT64                   m_llReadFrames;         // Taken from m_audioPipe.
+    DriftFit                m_drift;
+    DriftStats              m_driftReport;
+    volatile LONG           m_lDriftReport;
+
+    // Kept by the resample stage: the excess when the recording started,
+    // and the output samples swresample has been asked to add since.
+    BOOL                    m_bDriftBase;
+    LONG                    m_lDriftBaseStarts;
+    double                  m_dDriftBase;
+    INT64                   m_llCompensated;
+
+    // Capture graph:
+    //
+    //   capture -> pcm-write
+    //           -> resample -> aac-encode -> aac-write (AAC and MP4)
+    //
+    // The capture callback only copies the samples into m_audioPipe and
+    // wakes m_readThread, which takes them out m_uReadBytes at a time
+    // and emits them from the capture source, so that the callback never
+    // allocates or waits for a lock another thread holds for long. The
+    // resample stage collects the converted audio in m_fifo and emits
+    // frames of exactly the encoder frame size.
+    Pipeline                *m_pipeline;
+    int                     m_captureSource;
+    AVAudioFifo             *m_fifo;
+    BufferPipe              *m_audioPipe;
+    pthread_t               m_readThread;
+    HANDLE                  m_hSamplesReady;    // Set after every write to m_audioPipe.
+    volatile BOOL           m_bReading;
+
+    // What the capture callback reads, without m_critsec: m_audioPipe
+    // while the read thread runs, and whether any recording is on.
+    // m_lCallbacks counts the callbacks running, so that StopPipeline()
+    // and CloseDevice() wait for them before freeing the pipe or the
+    // reader they have taken away.
+    BufferPipe * volatile   m_pCapturePipe;
+    volatile LONG           m_lCapturing;
+    volatile LONG           m_lCaptureStarts;
+    volatile LONG           m_lCallbacks;
+    UINT                    m_uReadBytes;
+
+    // The capture clock of the samples in m_audioPipe. The callback
+    // counts the frames it writes, and at the first write of every
+    // capture start keeps the sample time and the count, so that the read
+    // thread can stamp each frame with the capture time of its first
+    // sample. The video frames are stamped on the same clock.
+    INT64                   m_llWrittenFrames;
+    INT64                   m_llAnchorFrame;
+    LONGLONG                m_llAnchorTime;     // 100 ns
+    volatile LONG           m_lAnchorStarts;
+
+    // Kept by the resample stage: whether the encoder pts of the
+    // recording have been set from the capture time of its first frame.
+    BOOL                    m_bPtsBase;
+
+    // Time spent in the capture callback, kept by the callback. Every
+    // AUDIO_HOLD_STATS_CALLBACKS callbacks it is copied to m_holdReport
+    // and m_lHoldReport is set, and the read thread logs it.
+    struct HoldStats
+    {
+        UINT    uCallbacks;
+        INT64   llSum;          // us
+        INT64   llMax;
+        UINT    uOverBudget;    // Callbacks over AUDIO_HOLD_BUDGET.
+        UINT    uOverruns;      // Samples lost to a full m_audioPipe.
+    };
+    HoldStats               m_hold;
+    HoldStats               m_holdReport;
+    volatile LONG           m_lHoldReport;
+    CRITICAL_SECTION        m_filesec;          // Guards the record files.
+
+    FileWriter              *aacfile;
+    FileWriter              *pcmfile;
+
+    // Owned by the application, which adds the video stream as well.
+    Mp4Writer               *m_mp4Writer;
+    int                     m_iMP4Stream;
 
     BOOL					m_bAACRecordStatus = FALSE;
     BOOL					m_bPCMRecordStatus = FALSE;
-
-    BufferPipe				*m_audioPipe;
+    BOOL					m_bMP4RecordStatus = FALSE;
 };
 
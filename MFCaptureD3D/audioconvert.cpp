@@ -0,0 +1,406 @@
+//////////////////////////////////////////////////////////////////////////
+//
+// audioconvert.cpp: Sample format conversion for the audio encoder input.
+//
+//////////////////////////////////////////////////////////////////////////
+
+#include "MFCaptureD3D.h"
+#include <math.h>
+#include <emmintrin.h>
+
+
+//-------------------------------------------------------------------
+// InitAudioDither
+//
+// Seeds the generators. xorshift never leaves 0, so 0 is avoided.
+//-------------------------------------------------------------------
+
+void InitAudioDither(AudioDither *pDither, UINT32 seed)
+{
+    for (int i = 0; i < 4; i++)
+    {
+        seed = seed * 1664525 + 1013904223;
+        pDither->state[i] = seed ? seed : 1;
+    }
+}
+
+
+//-------------------------------------------------------------------
+// ConvertFloatToS16_C
+//-------------------------------------------------------------------
+
+void ConvertFloatToS16_C(INT16 *pDst, const float *pSrc, DWORD dwSamples, AudioDither *pDither)
+{
+    for (DWORD i = 0; i < dwSamples; i++)
+    {
+        float v = pSrc[i] * 32768.0f;
+
+        if (pDither)
+        {
+            UINT32 x = pDither->state[i & 3];
+            x ^= x << 13;
+            x ^= x >> 17;
+            x ^= x << 5;
+            pDither->state[i & 3] = x;
+
+            // The difference of two uniform values is triangular.
+            v += (float)((INT32)(x & 0xFFFF) - (INT32)(x >> 16)) * (1.0f / 65536.0f);
+        }
+
+        // Written so that NaN ends up at the top, as in the SSE2 kernel.
+        v = v < 32767.0f ? v : 32767.0f;
+        v = v > -32768.0f ? v : -32768.0f;
+
+        pDst[i] = (INT16)lrintf(v);
+    }
+}
+
+
+//-------------------------------------------------------------------
+// ConvertFloatToS16_SSE2
+//
+// Eight samples per step. The values are clamped while still float,
+// since cvtps2dq turns anything past the int32 range into INT_MIN;
+// the pack saturates nothing after that. The rest goes through the C
+// kernel, with the generators in the same order.
+//-------------------------------------------------------------------
+
+void ConvertFloatToS16_SSE2(INT16 *pDst, const float *pSrc, DWORD dwSamples, AudioDither *pDither)
+{
+    const __m128 scale = _mm_set1_ps(32768.0f);
+    const __m128 hi = _mm_set1_ps(32767.0f);
+    const __m128 lo = _mm_set1_ps(-32768.0f);
+    const __m128 step = _mm_set1_ps(1.0f / 65536.0f);
+    const __m128i low16 = _mm_set1_epi32(0xFFFF);
+
+    __m128i x = pDither ? _mm_loadu_si128((const __m128i*)pDither->state) : _mm_setzero_si128();
+
+    DWORD i = 0;
+
+    for (; i + 8 <= dwSamples; i += 8)
+    {
+        __m128 v0 = _mm_mul_ps(_mm_loadu_ps(pSrc + i), scale);
+        __m128 v1 = _mm_mul_ps(_mm_loadu_ps(pSrc + i + 4), scale);
+
+        if (pDither)
+        {
+            __m128i d;
+
+            x = _mm_xor_si128(x, _mm_slli_epi32(x, 13));
+            x = _mm_xor_si128(x, _mm_srli_epi32(x, 17));
+            x = _mm_xor_si128(x, _mm_slli_epi32(x, 5));
+            d = _mm_sub_epi32(_mm_and_si128(x, low16), _mm_srli_epi32(x, 16));
+            v0 = _mm_add_ps(v0, _mm_mul_ps(_mm_cvtepi32_ps(d), step));
+
+            x = _mm_xor_si128(x, _mm_slli_epi32(x, 13));
+            x = _mm_xor_si128(x, _mm_srli_epi32(x, 17));
+            x = _mm_xor_si128(x, _mm_slli_epi32(x, 5));
+            d = _mm_sub_epi32(_mm_and_si128(x, low16), _mm_srli_epi32(x, 16));
+            v1 = _mm_add_ps(v1, _mm_mul_ps(_mm_cvtepi32_ps(d), step));
+        }
+
+        v0 = _mm_max_ps(_mm_min_ps(v0, hi), lo);
+        v1 = _mm_max_ps(_mm_min_ps(v1, hi), lo);
+
+        __m128i s = _mm_packs_epi32(_mm_cvtps_epi32(v0), _mm_cvtps_epi32(v1));
+        _mm_storeu_si128((__m128i*)(pDst + i), s);
+    }
+
+    if (pDither)
+    {
+        _mm_storeu_si128((__m128i*)pDither->state, x);
+    }
+
+    // i is a multiple of 4: the lanes line up with the C kernel.
+    ConvertFloatToS16_C(pDst + i, pSrc + i, dwSamples - i, pDither);
+}
+
+
+//-------------------------------------------------------------------
+// GetFloatToS16Converter
+//-------------------------------------------------------------------
+
+AUDIO_CONVERT_FN GetFloatToS16Converter()
+{
+    if (av_get_cpu_flags() & AV_CPU_FLAG_SSE2)
+    {
+        return ConvertFloatToS16_SSE2;
+    }
+
+    return ConvertFloatToS16_C;
+}
+
+
+//-------------------------------------------------------------------
+// InitAudioDownmix
+//
+// The channels of inLayout, in the order of their bits, which is the
+// order of the samples in a frame.
+//-------------------------------------------------------------------
+
+BOOL InitAudioDownmix(AudioDownmix *pMix, UINT64 inLayout, UINT64 outLayout)
+{
+    const float k = 0.70710678f;    // -3 dB
+
+    int nIn = av_get_channel_layout_nb_channels(inLayout);
+    int nOut = av_get_channel_layout_nb_channels(outLayout);
+
+    if (nIn <= 0 || nIn > (int)AUDIO_MAX_DOWNMIX_CHANNELS ||
+        (outLayout != AV_CH_LAYOUT_MONO && outLayout != AV_CH_LAYOUT_STEREO))
+    {
+        return FALSE;
+    }
+
+    ZeroMemory(pMix, sizeof(*pMix));
+    pMix->dwInChannels = nIn;
+    pMix->dwOutChannels = nOut;
+
+    for (int c = 0; c < nIn; c++)
+    {
+        UINT64 ch = av_channel_layout_extract_channel(inLayout, c);
+        float l = 0, r = 0;
+
+        switch (ch)
+        {
+        case AV_CH_FRONT_LEFT:
+        case AV_CH_FRONT_LEFT_OF_CENTER:
+        case AV_CH_STEREO_LEFT:
+            l = 1;
+            break;
+
+        case AV_CH_FRONT_RIGHT:
+        case AV_CH_FRONT_RIGHT_OF_CENTER:
+        case AV_CH_STEREO_RIGHT:
+            r = 1;
+            break;
+
+        case AV_CH_BACK_LEFT:
+        case AV_CH_SIDE_LEFT:
+        case AV_CH_WIDE_LEFT:
+        case AV_CH_TOP_FRONT_LEFT:
+        case AV_CH_TOP_BACK_LEFT:
+            l = k;
+            break;
+
+        case AV_CH_BACK_RIGHT:
+        case AV_CH_SIDE_RIGHT:
+        case AV_CH_WIDE_RIGHT:
+        case AV_CH_TOP_FRONT_RIGHT:
+        case AV_CH_TOP_BACK_RIGHT:
+            r = k;
+            break;
+
+        case AV_CH_LOW_FREQUENCY:
+        case AV_CH_LOW_FREQUENCY_2:
+            break;
+
+        case AV_CH_BACK_CENTER:
+            l = r = 0.5f;
+            break;
+
+        default:
+            // Centre, and anything without a side.
+            l = r = k;
+            break;
+        }
+
+        // Mono in: the one channel goes to both sides.
+        if (nIn == 1)
+        {
+            l = r = 1;
+        }
+
+        if (nOut == 1)
+        {
+            pMix->coef[0][c] = (l + r) * 0.5f;
+        }
+        else
+        {
+            pMix->coef[0][c] = l;
+            pMix->coef[1][c] = r;
+        }
+    }
+
+    // The loudest output at full scale, the balance kept.
+    float sum = 0;
+    for (int o = 0; o < nOut; o++)
+    {
+        float row = 0;
+        for (int c = 0; c < nIn; c++)
+        {
+            row += pMix->coef[o][c];
+        }
+        sum = max(sum, row);
+    }
+
+    for (int o = 0; o < nOut && sum > 1; o++)
+    {
+        for (int c = 0; c < nIn; c++)
+        {
+            pMix->coef[o][c] /= sum;
+        }
+    }
+
+    return TRUE;
+}
+
+
+//-------------------------------------------------------------------
+// DownmixFloat_C
+//-------------------------------------------------------------------
+
+void DownmixFloat_C(float *pDst, const float *pSrc, DWORD dwFrames, const AudioDownmix *pMix)
+{
+    DWORD nIn = pMix->dwInChannels;
+    DWORD nOut = pMix->dwOutChannels;
+
+    for (DWORD f = 0; f < dwFrames; f++)
+    {
+        for (DWORD o = 0; o < nOut; o++)
+        {
+            float v = 0;
+            for (DWORD c = 0; c < nIn; c++)
+            {
+                v += pSrc[c] * pMix->coef[o][c];
+            }
+            pDst[o] = v;
+        }
+
+        pSrc += nIn;
+        pDst += nOut;
+    }
+}
+
+
+//-------------------------------------------------------------------
+// DownmixFloat_SSE2
+//
+// One frame per step, as one or two vectors of four channels against
+// the coefficient rows, summed across. A frame of fewer channels than
+// its vectors reads into the next frame; those lanes are masked to 0
+// before the multiply, so that an Inf or NaN there cannot reach this
+// frame. The frames at the end, where the vectors would read past the
+// buffer, go through the C kernel.
+//-------------------------------------------------------------------
+
+void DownmixFloat_SSE2(float *pDst, const float *pSrc, DWORD dwFrames, const AudioDownmix *pMix)
+{
+    DWORD nIn = pMix->dwInChannels;
+    DWORD nOut = pMix->dwOutChannels;
+    DWORD nLoad = nIn > 4 ? 8 : 4;
+
+    // Frames whose vectors stay inside the buffer.
+    DWORD dwSafe = 0;
+    if ((UINT64)dwFrames * nIn >= nLoad)
+    {
+        dwSafe = (DWORD)(((UINT64)dwFrames * nIn - nLoad) / nIn + 1);
+    }
+
+    const __m128 l0 = _mm_loadu_ps(&pMix->coef[0][0]);
+    const __m128 l1 = _mm_loadu_ps(&pMix->coef[0][4]);
+    const __m128 r0 = _mm_loadu_ps(&pMix->coef[1][0]);
+    const __m128 r1 = _mm_loadu_ps(&pMix->coef[1][4]);
+
+    // All ones in the lanes of this frame's channels.
+    const __m128i lane = _mm_set_epi32(3, 2, 1, 0);
+    const __m128i count = _mm_set1_epi32((int)nIn);
+    const __m128 m0 = _mm_castsi128_ps(_mm_cmplt_epi32(lane, count));
+    const __m128 m1 = _mm_castsi128_ps(_mm_cmplt_epi32(_mm_add_epi32(lane, _mm_set1_epi32(4)), count));
+
+    DWORD f = 0;
+
+    for (; f < dwSafe; f++)
+    {
+        __m128 a = _mm_and_ps(_mm_loadu_ps(pSrc), m0);
+        __m128 l = _mm_mul_ps(a, l0);
+        __m128 r = _mm_mul_ps(a, r0);
+
+        if (nLoad == 8)
+        {
+            __m128 b = _mm_and_ps(_mm_loadu_ps(pSrc + 4), m1);
+            l = _mm_add_ps(l, _mm_mul_ps(b, l1));
+            r = _mm_add_ps(r, _mm_mul_ps(b, r1));
+        }
+
+        if (nOut == 2)
+        {
+            // [l0+l2, r0+r2, l1+l3, r1+r3], then the halves added.
+            __m128 t = _mm_add_ps(_mm_unpacklo_ps(l, r), _mm_unpackhi_ps(l, r));
+            t = _mm_add_ps(t, _mm_movehl_ps(t, t));
+            _mm_storel_pi((__m64*)pDst, t);
+        }
+        else
+        {
+            __m128 t = _mm_add_ps(l, _mm_movehl_ps(l, l));
+            t = _mm_add_ss(t, _mm_shuffle_ps(t, t, 1));
+            _mm_store_ss(pDst, t);
+        }
+
+        pSrc += nIn;
+        pDst += nOut;
+    }
+
+    DownmixFloat_C(pDst, pSrc, dwFrames - f, pMix);
+}
+
+
+//-------------------------------------------------------------------
+// GetFloatDownmixer
+//-------------------------------------------------------------------
+
+AUDIO_DOWNMIX_FN GetFloatDownmixer()
+{
+    if (av_get_cpu_flags() & AV_CPU_FLAG_SSE2)
+    {
+        return DownmixFloat_SSE2;
+    }
+
+    return DownmixFloat_C;
+}
+
+
+const ResampleProfile g_ResampleProfiles[RESAMPLE_PROFILE_COUNT] =
+{
+    // 8 taps and 64 phases: a few multiplies per sample, and images
+    // above 0.9 of Nyquist that AAC cuts away anyway.
+    { "fast",       SWR_ENGINE_SWR,     8,  6,  TRUE,   0.90,   0 },
+
+    // 32 taps, 1024 phases, cutoff 0.97.
+    { "default",    SWR_ENGINE_SWR,     0,  0,  FALSE,  0,      0 },
+
+    // 28 bits: the VHQ recipe of soxr, well past 16-bit output.
+    { "hq",         SWR_ENGINE_SOXR,    0,  0,  FALSE,  0,      28 }
+};
+
+
+//-------------------------------------------------------------------
+// ApplyResampleProfile
+//-------------------------------------------------------------------
+
+void ApplyResampleProfile(SwrContext *pSwr, RESAMPLE_PROFILE profile)
+{
+    const ResampleProfile &p = g_ResampleProfiles[profile];
+
+    av_opt_set_int(pSwr, "resampler", p.engine, 0);
+
+    if (p.filterSize)
+    {
+        av_opt_set_int(pSwr, "filter_size", p.filterSize, 0);
+    }
+    if (p.phaseShift)
+    {
+        av_opt_set_int(pSwr, "phase_shift", p.phaseShift, 0);
+    }
+    if (p.bLinear)
+    {
+        av_opt_set_int(pSwr, "linear_interp", 1, 0);
+    }
+    if (p.cutoff > 0)
+    {
+        av_opt_set_double(pSwr, "cutoff", p.cutoff, 0);
+    }
+    if (p.precision > 0)
+    {
+        av_opt_set_double(pSwr, "precision", p.precision, 0);
+    }
+}
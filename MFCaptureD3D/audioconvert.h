@@ -0,0 +1,100 @@
+//////////////////////////////////////////////////////////////////////////
+//
+// audioconvert.h: Sample format conversion for the audio encoder input.
+//
+//////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+// TPDF dither: noise of -1 to +1 LSB, triangular, added before rounding.
+// One xorshift generator per SSE2 lane; sample i of a call draws from
+// state[i % 4], so the kernels give the same output.
+
+struct AudioDither
+{
+    UINT32 state[4];
+};
+
+void InitAudioDither(AudioDither *pDither, UINT32 seed);
+
+// Float samples in [-1, 1] to signed 16 bits, rounded to nearest and
+// saturated, like swresample without dither. dwSamples counts the
+// samples of every channel, so interleaved audio of any layout takes
+// one call. pDither may be NULL.
+
+typedef void (*AUDIO_CONVERT_FN)(
+    INT16*          pDst,
+    const float*    pSrc,
+    DWORD           dwSamples,
+    AudioDither*    pDither
+    );
+
+void ConvertFloatToS16_C(INT16 *pDst, const float *pSrc, DWORD dwSamples, AudioDither *pDither);
+void ConvertFloatToS16_SSE2(INT16 *pDst, const float *pSrc, DWORD dwSamples, AudioDither *pDither);
+
+// The fastest kernel the CPU runs.
+
+AUDIO_CONVERT_FN GetFloatToS16Converter();
+
+// Downmix of interleaved float audio of up to AUDIO_MAX_DOWNMIX_CHANNELS
+// channels to stereo or mono: every output sample is a weighted sum of
+// the input samples of its frame. The coefficients follow ITU-R BS.775:
+// centre and surrounds at -3 dB, LFE left out; for mono the two stereo
+// sums are averaged. They are scaled so that no output can exceed full
+// scale, as swresample does by default.
+
+const DWORD AUDIO_MAX_DOWNMIX_CHANNELS = 8;
+
+struct AudioDownmix
+{
+    DWORD   dwInChannels;
+    DWORD   dwOutChannels;
+    float   coef[2][AUDIO_MAX_DOWNMIX_CHANNELS];    // [out][in], 0 past dwInChannels.
+};
+
+// Returns FALSE if the layouts cannot be mixed this way: more than
+// AUDIO_MAX_DOWNMIX_CHANNELS in, or out other than mono or stereo.
+
+BOOL InitAudioDownmix(AudioDownmix *pMix, UINT64 inLayout, UINT64 outLayout);
+
+typedef void (*AUDIO_DOWNMIX_FN)(
+    float*              pDst,
+    const float*        pSrc,
+    DWORD               dwFrames,
+    const AudioDownmix* pMix
+    );
+
+void DownmixFloat_C(float *pDst, const float *pSrc, DWORD dwFrames, const AudioDownmix *pMix);
+void DownmixFloat_SSE2(float *pDst, const float *pSrc, DWORD dwFrames, const AudioDownmix *pMix);
+
+AUDIO_DOWNMIX_FN GetFloatDownmixer();
+
+// swresample settings, from cheapest to best. The encoder input differs
+// in rate from the capture only on devices that AAC does not take at
+// their own rate, but drift compensation resamples every capture.
+
+enum RESAMPLE_PROFILE
+{
+    RESAMPLE_PROFILE_FAST,          // Short filter, linear between few phases.
+    RESAMPLE_PROFILE_DEFAULT,       // swresample as it comes.
+    RESAMPLE_PROFILE_HQ,            // libsoxr at very high precision.
+    RESAMPLE_PROFILE_COUNT
+};
+
+struct ResampleProfile
+{
+    const char  *name;              // As selected with /resample:<name>.
+    int         engine;             // SWR_ENGINE_SWR or SWR_ENGINE_SOXR.
+    int         filterSize;         // Taps per phase. 0: default.
+    int         phaseShift;         // log2 of the phases. 0: default.
+    BOOL        bLinear;            // Interpolate between phases.
+    double      cutoff;             // Of the Nyquist frequency. 0: default.
+    double      precision;          // soxr bits. 0: default.
+};
+
+extern const ResampleProfile g_ResampleProfiles[RESAMPLE_PROFILE_COUNT];
+
+// Sets the options of a profile on a context before swr_init(). libsoxr
+// is optional in FFmpeg: without it, swr_init() fails for the HQ profile.
+
+void ApplyResampleProfile(SwrContext *pSwr, RESAMPLE_PROFILE profile);
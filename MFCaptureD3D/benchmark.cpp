@@ -0,0 +1,2442 @@
+//////////////////////////////////////////////////////////////////////////
+//
+// benchmark.cpp: Benchmark and correctness check for the frame
+// conversion functions.
+//
+// Every format in g_FormatConversions is converted at several
+// resolutions and memory layouts, with each available variant of the
+// kernel. For each case the report gives the mean time per frame, the
+// run-to-run variation, the bandwidth (bytes read + written) and CPU
+// cycles per pixel. SliceScaler is timed on the resolutions of the
+// encoder input with pools of several sizes.
+//
+// The latency of each H.264 encoding profile is measured separately,
+// and so is the cost of a simulcast ladder, and of the conversion of
+// the audio encoder input.
+//
+// It runs in the application, on Windows only. The kernels are built
+// with device.cpp, against the Direct3D and Media Foundation headers,
+// and are looked up by subtype GUID; the timing uses the performance
+// counter and __rdtsc.
+//
+//////////////////////////////////////////////////////////////////////////
+
+#include "MFCaptureD3D.h"
+#include <intrin.h>
+#include <math.h>
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+
+// Runs per case: at least BENCH_MIN_RUNS, and at least BENCH_MIN_TIME
+// microseconds, but never more than BENCH_MAX_RUNS.
+const UINT   BENCH_WARMUP_RUNS = 2;
+const UINT   BENCH_MIN_RUNS = 10;
+const UINT   BENCH_MAX_RUNS = 200;
+const double BENCH_MIN_TIME = 300000;
+
+struct BenchResolution
+{
+    DWORD width;
+    DWORD height;
+};
+
+static const BenchResolution g_BenchResolutions[] =
+{
+    {  640,  480 },
+    { 1280,  720 },
+    { 1920, 1080 },
+    { 3840, 2160 }
+};
+
+enum BENCH_LAYOUT
+{
+    BENCH_LAYOUT_PACKED,        // Stride = width in bytes.
+    BENCH_LAYOUT_ODD_STRIDE,    // Stride padded to a non-multiple of 4.
+    BENCH_LAYOUT_BOTTOM_UP,     // Negative stride (RGB formats only).
+    BENCH_LAYOUT_COUNT
+};
+
+static const char * g_BenchLayoutNames[BENCH_LAYOUT_COUNT] =
+{
+    "packed",
+    "odd-stride",
+    "bottom-up"
+};
+
+// Kernel variants compared side by side. Multithreaded variants use
+// TransformImage_Parallel with a pool of the given size; the scaled
+// variant is the fused convert-and-downscale kernel at half size.
+// SIMD kernels would be added to g_FormatConversions and show up here
+// as their own rows.
+enum BENCH_KIND
+{
+    BENCH_KIND_SCALAR,
+    BENCH_KIND_THREADED,
+    BENCH_KIND_SCALED
+};
+
+struct BenchVariant
+{
+    const char  *name;
+    BENCH_KIND  kind;
+    UINT        threads;
+};
+
+static const BenchVariant g_BenchVariants[] =
+{
+    { "scalar",     BENCH_KIND_SCALAR,   1 },
+    { "mt-2",       BENCH_KIND_THREADED, 2 },
+    { "mt-4",       BENCH_KIND_THREADED, 4 },
+    { "mt-8",       BENCH_KIND_THREADED, 8 },
+    { "scale-1/2",  BENCH_KIND_SCALED,   1 }
+};
+
+struct BenchResult
+{
+    double minUs;
+    double meanUs;
+    double stddevUs;
+    double gbps;
+    double cyclesPerPixel;
+};
+
+
+//-------------------------------------------------------------------
+// Format helpers
+//-------------------------------------------------------------------
+
+static const char * BenchFormatName(REFGUID subtype)
+{
+    if (subtype == MFVideoFormat_RGB32) return "RGB32";
+    if (subtype == MFVideoFormat_RGB24) return "RGB24";
+    if (subtype == MFVideoFormat_YUY2)  return "YUY2";
+    if (subtype == MFVideoFormat_I420)  return "I420";
+    if (subtype == MFVideoFormat_NV12)  return "NV12";
+    return "?";
+}
+
+static BOOL IsPlanarFormat(REFGUID subtype)
+{
+    return (subtype == MFVideoFormat_I420 || subtype == MFVideoFormat_NV12);
+}
+
+static BOOL IsRGBFormat(REFGUID subtype)
+{
+    return (subtype == MFVideoFormat_RGB32 || subtype == MFVideoFormat_RGB24);
+}
+
+// Bytes in one row of the first plane, without padding. Odd widths
+// round up to whole YUY2 pairs, and to an even stride for 4:2:0, whose
+// chroma stride is half the luma stride.
+static LONG BenchRowBytes(REFGUID subtype, DWORD width)
+{
+    if (subtype == MFVideoFormat_RGB32) return width * 4;
+    if (subtype == MFVideoFormat_RGB24) return width * 3;
+    if (subtype == MFVideoFormat_YUY2)  return ((width + 1) / 2) * 4;
+    return (width + 1) & ~1;
+}
+
+// Bytes in a whole frame with the given (positive) stride.
+static DWORD BenchFrameBytes(REFGUID subtype, LONG lStride, DWORD height)
+{
+    if (IsPlanarFormat(subtype))
+    {
+        return lStride * height * 3 / 2;
+    }
+    return lStride * height;
+}
+
+static LONG BenchStride(REFGUID subtype, DWORD width, BENCH_LAYOUT layout)
+{
+    LONG lStride = BenchRowBytes(subtype, width);
+
+    if (layout == BENCH_LAYOUT_ODD_STRIDE)
+    {
+        // Planar kernels derive the chroma stride as stride / 2, so keep
+        // their stride even. It is still not a multiple of 4.
+        lStride += IsPlanarFormat(subtype) ? 38 : 37;
+    }
+    return lStride;
+}
+
+
+//-------------------------------------------------------------------
+// FillSyntheticFrame
+//
+// Fills a frame with pseudo-random data. YUV samples are kept within
+// the nominal range so the kernels do not just clip.
+//-------------------------------------------------------------------
+
+static void FillSyntheticFrame(BYTE *pData, DWORD cbData, BOOL bYUV, UINT32 seed)
+{
+    for (DWORD i = 0; i < cbData; i++)
+    {
+        seed = seed * 1664525 + 1013904223;
+
+        BYTE v = (BYTE)(seed >> 24);
+        pData[i] = bYUV ? (BYTE)(16 + v % 225) : v;
+    }
+}
+
+
+//-------------------------------------------------------------------
+// TimeRuns
+//
+// Times fn until enough runs have been collected.
+//-------------------------------------------------------------------
+
+typedef void (*BENCH_RUN_FN)(void *ctx);
+
+static BenchResult TimeRuns(BENCH_RUN_FN fn, void *ctx, double pixels, DWORD cbMoved)
+{
+    std::vector<double> times;
+    std::vector<double> cycles;
+
+    LARGE_INTEGER freq;
+    QueryPerformanceFrequency(&freq);
+
+    double total = 0;
+
+    for (UINT run = 0; run < BENCH_WARMUP_RUNS + BENCH_MAX_RUNS; run++)
+    {
+        LARGE_INTEGER t0, t1;
+
+        QueryPerformanceCounter(&t0);
+        unsigned __int64 c0 = __rdtsc();
+
+        fn(ctx);
+
+        unsigned __int64 c1 = __rdtsc();
+        QueryPerformanceCounter(&t1);
+
+        if (run < BENCH_WARMUP_RUNS)
+        {
+            continue;
+        }
+
+        double us = (double)(t1.QuadPart - t0.QuadPart) * 1e6 / (double)freq.QuadPart;
+        total += us;
+
+        times.push_back(us);
+        cycles.push_back((double)(c1 - c0));
+
+        if (times.size() >= BENCH_MIN_RUNS && total >= BENCH_MIN_TIME)
+        {
+            break;
+        }
+    }
+
+    BenchResult r;
+    r.minUs = times[0];
+
+    double sum = 0, sumCycles = 0;
+    for (size_t i = 0; i < times.size(); i++)
+    {
+        if (times[i] < r.minUs)
+        {
+            r.minUs = times[i];
+        }
+        sum += times[i];
+        sumCycles += cycles[i];
+    }
+
+    r.meanUs = sum / times.size();
+
+    double var = 0;
+    for (size_t i = 0; i < times.size(); i++)
+    {
+        var += (times[i] - r.meanUs) * (times[i] - r.meanUs);
+    }
+    r.stddevUs = sqrt(var / times.size());
+    r.gbps = (double)cbMoved / (r.meanUs * 1000.0);
+    r.cyclesPerPixel = sumCycles / times.size() / pixels;
+
+    return r;
+}
+
+
+//-------------------------------------------------------------------
+// RunCase
+//
+// Times one kernel variant on one frame.
+//-------------------------------------------------------------------
+
+struct ConvertRun
+{
+    const ConversionFunction    *conv;
+    const BenchVariant          *variant;
+    WorkerPool                  *pPool;
+    BYTE                        *pDest;
+    LONG                        lDestStride;
+    const BYTE                  *pSrc;
+    LONG                        lSrcStride;
+    DWORD                       width;
+    DWORD                       height;
+    const ScaleTable            *pScale;    // For BENCH_KIND_SCALED.
+};
+
+static void RunConvert(void *ctx)
+{
+    const ConvertRun *run = (const ConvertRun*)ctx;
+
+    IMAGE_TRANSFORM_FN xform = run->conv->xform[YUV_MATRIX_BT601][YUV_RANGE_LIMITED];
+    IMAGE_SCALE_FN scale = run->conv->scale[YUV_MATRIX_BT601][YUV_RANGE_LIMITED];
+
+    DWORD width = run->width;
+    DWORD height = run->height;
+
+    switch (run->variant->kind)
+    {
+    case BENCH_KIND_SCALAR:
+        xform(run->pDest, run->lDestStride, run->pSrc, run->lSrcStride, width, height, 0, height);
+        break;
+
+    case BENCH_KIND_THREADED:
+        TransformImage_Parallel(run->pPool, xform, run->conv->rowAlign,
+            run->pDest, run->lDestStride, run->pSrc, run->lSrcStride, width, height);
+        break;
+
+    case BENCH_KIND_SCALED:
+        scale(run->pDest, run->lDestStride, width / 2, height / 2,
+            run->pSrc, run->lSrcStride, width, height, 0, height / 2,
+            run->pScale->pBoxX, run->pScale->pSums);
+        break;
+    }
+}
+
+static BenchResult RunCase(
+    const ConversionFunction &conv,
+    const BenchVariant &variant,
+    WorkerPool *pPool,
+    BYTE *pDest,
+    LONG lDestStride,
+    const BYTE *pSrc,
+    LONG lSrcStride,
+    DWORD width,
+    DWORD height,
+    DWORD cbMoved
+    )
+{
+    // Made once, as DrawDevice does, outside the timed runs.
+    ScaleTable table;
+    ZeroMemory(&table, sizeof(table));
+
+    if (variant.kind == BENCH_KIND_SCALED && FAILED(InitScaleTable(&table, width / 2, width, 1)))
+    {
+        BenchResult none = { 0 };
+        return none;
+    }
+
+    ConvertRun run = { &conv, &variant, pPool, pDest, lDestStride, pSrc, lSrcStride, width, height, &table };
+
+    BenchResult res = TimeRuns(RunConvert, &run, (double)width * height, cbMoved);
+
+    FreeScaleTable(&table);
+
+    return res;
+}
+
+
+//-------------------------------------------------------------------
+// RunScalerBenchmark
+//
+// Times SliceScaler on capture formats with pools of each size, for
+// the filter of a preview and of a recording. The output of every
+// pool size is compared with that of a single band.
+//-------------------------------------------------------------------
+
+struct ScaleBenchCase
+{
+    int srcWidth;
+    int srcHeight;
+    int dstWidth;
+    int dstHeight;
+};
+
+static const ScaleBenchCase g_ScaleBenchCases[] =
+{
+    { 3840, 2160, 1920, 1080 },
+    { 1920, 1080, 1280,  720 }
+};
+
+static const AVPixelFormat g_ScaleBenchFormats[] =
+{
+    AV_PIX_FMT_YUYV422,
+    AV_PIX_FMT_NV12,
+    AV_PIX_FMT_YUV420P
+};
+
+struct ScaleBenchFilter
+{
+    const char  *name;
+    int         flags;
+};
+
+static const ScaleBenchFilter g_ScaleBenchFilters[] =
+{
+    { "fast-bilinear",  SWS_FAST_BILINEAR },
+    { "bicubic",        SWS_BICUBIC }
+};
+
+static const UINT g_ScaleBenchThreads[] = { 1, 2, 4, 8 };
+
+struct ScaleRun
+{
+    SliceScaler *pScaler;
+    AVFrame     *pSrc;
+    AVFrame     *pDest;
+};
+
+static void RunScale(void *ctx)
+{
+    ScaleRun *run = (ScaleRun*)ctx;
+
+    run->pScaler->Scale(run->pSrc->data, run->pSrc->linesize,
+        run->pDest->data, run->pDest->linesize);
+}
+
+static AVFrame * AllocBenchFrame(AVPixelFormat format, int width, int height)
+{
+    AVFrame *frame = av_frame_alloc();
+    if (frame == NULL)
+    {
+        return NULL;
+    }
+
+    frame->format = format;
+    frame->width = width;
+    frame->height = height;
+
+    if (av_frame_get_buffer(frame, 32) < 0)
+    {
+        av_frame_free(&frame);
+    }
+    return frame;
+}
+
+// Largest difference between two frames of the same format and size.
+static int MaxFrameDiff(const AVFrame *a, const AVFrame *b)
+{
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get((AVPixelFormat)a->format);
+    int maxDiff = 0;
+
+    for (int p = 0; p < 4 && a->data[p]; p++)
+    {
+        int rows = (p == 1 || p == 2) ? AV_CEIL_RSHIFT(a->height, desc->log2_chroma_h) : a->height;
+        int bytes = av_image_get_linesize((AVPixelFormat)a->format, a->width, p);
+
+        for (int y = 0; y < rows; y++)
+        {
+            const uint8_t *pa = a->data[p] + y * a->linesize[p];
+            const uint8_t *pb = b->data[p] + y * b->linesize[p];
+
+            for (int x = 0; x < bytes; x++)
+            {
+                int diff = abs(pa[x] - pb[x]);
+                if (diff > maxDiff)
+                {
+                    maxDiff = diff;
+                }
+            }
+        }
+    }
+    return maxDiff;
+}
+
+static void RunScalerBenchmark(std::ofstream &report)
+{
+    char line[260];
+
+    snprintf(line, sizeof(line), "\n%-8s %-20s %-14s %-8s %5s %10s %8s %8s %8s\n",
+        "format", "size", "filter", "variant", "bands", "us/frame", "stddev", "speedup", "maxdiff");
+    report << line;
+    OutputDebugStringA(line);
+
+    for (DWORD c = 0; c < ARRAYSIZE(g_ScaleBenchCases); c++)
+    {
+        const ScaleBenchCase &sc = g_ScaleBenchCases[c];
+
+        AVFrame *pRef = AllocBenchFrame(AV_PIX_FMT_YUV420P, sc.dstWidth, sc.dstHeight);
+        AVFrame *pDest = AllocBenchFrame(AV_PIX_FMT_YUV420P, sc.dstWidth, sc.dstHeight);
+
+        for (DWORD f = 0; f < ARRAYSIZE(g_ScaleBenchFormats); f++)
+        {
+            AVPixelFormat format = g_ScaleBenchFormats[f];
+            AVFrame *pSrc = AllocBenchFrame(format, sc.srcWidth, sc.srcHeight);
+
+            if (pSrc == NULL || pRef == NULL || pDest == NULL)
+            {
+                av_frame_free(&pSrc);
+                continue;
+            }
+
+            for (int i = 0; i < AV_NUM_DATA_POINTERS && pSrc->buf[i]; i++)
+            {
+                FillSyntheticFrame(pSrc->buf[i]->data, pSrc->buf[i]->size, TRUE, sc.srcWidth * 31 + f * 7 + i);
+            }
+
+            char size[32];
+            snprintf(size, sizeof(size), "%dx%d->%dx%d", sc.srcWidth, sc.srcHeight, sc.dstWidth, sc.dstHeight);
+
+            for (DWORD k = 0; k < ARRAYSIZE(g_ScaleBenchFilters); k++)
+            {
+                const ScaleBenchFilter &filter = g_ScaleBenchFilters[k];
+
+                // Reference: the whole frame through one context.
+                SliceScaler *pSingle = SliceScaler::Create(NULL);
+                if (pSingle == NULL ||
+                    pSingle->Configure(sc.srcWidth, sc.srcHeight, format,
+                        sc.dstWidth, sc.dstHeight, AV_PIX_FMT_YUV420P, filter.flags, 1) < 0 ||
+                    pSingle->Scale(pSrc->data, pSrc->linesize, pRef->data, pRef->linesize) < 0)
+                {
+                    if (pSingle)
+                    {
+                        pSingle->Destory();
+                    }
+                    continue;
+                }
+                pSingle->Destory();
+
+                double baseUs = 0;
+
+                for (DWORD t = 0; t < ARRAYSIZE(g_ScaleBenchThreads); t++)
+                {
+                    WorkerPool *pPool = WorkerPool::Create(g_ScaleBenchThreads[t]);
+                    SliceScaler *pScaler = SliceScaler::Create(pPool);
+
+                    if (pScaler == NULL ||
+                        pScaler->Configure(sc.srcWidth, sc.srcHeight, format,
+                            sc.dstWidth, sc.dstHeight, AV_PIX_FMT_YUV420P, filter.flags, 0) < 0)
+                    {
+                        if (pScaler)
+                        {
+                            pScaler->Destory();
+                        }
+                        if (pPool)
+                        {
+                            pPool->Destory();
+                        }
+                        continue;
+                    }
+
+                    ScaleRun run = { pScaler, pSrc, pDest };
+
+                    DWORD cbMoved = av_image_get_buffer_size(format, sc.srcWidth, sc.srcHeight, 1) +
+                        av_image_get_buffer_size(AV_PIX_FMT_YUV420P, sc.dstWidth, sc.dstHeight, 1);
+
+                    BenchResult res = TimeRuns(RunScale, &run, (double)sc.dstWidth * sc.dstHeight, cbMoved);
+
+                    if (t == 0)
+                    {
+                        baseUs = res.meanUs;
+                    }
+
+                    char variant[16];
+                    snprintf(variant, sizeof(variant), "mt-%u", g_ScaleBenchThreads[t]);
+
+                    snprintf(line, sizeof(line), "%-8s %-20s %-14s %-8s %5u %10.1f %7.1f%% %7.2fx %8d\n",
+                        av_get_pix_fmt_name(format), size, filter.name, variant, pScaler->GetSliceCount(),
+                        res.meanUs, 100.0 * res.stddevUs / res.meanUs, baseUs / res.meanUs,
+                        MaxFrameDiff(pRef, pDest));
+                    report << line;
+                    OutputDebugStringA(line);
+
+                    pScaler->Destory();
+                    pPool->Destory();
+                }
+            }
+
+            av_frame_free(&pSrc);
+        }
+
+        av_frame_free(&pRef);
+        av_frame_free(&pDest);
+    }
+}
+
+
+//-------------------------------------------------------------------
+// RunConverterBenchmark
+//-------------------------------------------------------------------
+
+HRESULT RunConverterBenchmark(const char *pszReport)
+{
+    std::ofstream report(pszReport);
+    if (!report)
+    {
+        return E_FAIL;
+    }
+
+    char line[260];
+
+    snprintf(line, sizeof(line), "%-6s %-10s %-11s %-10s %10s %8s %9s %9s\n",
+        "format", "size", "layout", "variant", "us/frame", "stddev", "GB/s", "cyc/px");
+    report << line;
+    OutputDebugStringA(line);
+
+    // One pool per thread count, created once.
+    WorkerPool *pools[ARRAYSIZE(g_BenchVariants)] = { 0 };
+    for (DWORD v = 0; v < ARRAYSIZE(g_BenchVariants); v++)
+    {
+        if (g_BenchVariants[v].kind == BENCH_KIND_THREADED)
+        {
+            pools[v] = WorkerPool::Create(g_BenchVariants[v].threads);
+        }
+    }
+
+    for (DWORD r = 0; r < ARRAYSIZE(g_BenchResolutions); r++)
+    {
+        DWORD width = g_BenchResolutions[r].width;
+        DWORD height = g_BenchResolutions[r].height;
+
+        // RGB-32 destination, like the Direct3D surface.
+        LONG lDestStride = width * 4;
+        BYTE *pDest = (BYTE*)_aligned_malloc(lDestStride * height, 64);
+
+        for (DWORD f = 0; f < g_cFormats; f++)
+        {
+            const ConversionFunction &conv = g_FormatConversions[f];
+
+            for (int layout = 0; layout < BENCH_LAYOUT_COUNT; layout++)
+            {
+                if (layout == BENCH_LAYOUT_BOTTOM_UP && !IsRGBFormat(conv.subtype))
+                {
+                    continue;
+                }
+
+                LONG lStride = BenchStride(conv.subtype, width, (BENCH_LAYOUT)layout);
+                DWORD cbSrc = BenchFrameBytes(conv.subtype, lStride, height);
+                BYTE *pBuffer = (BYTE*)_aligned_malloc(cbSrc, 64);
+
+                if (pDest == NULL || pBuffer == NULL)
+                {
+                    _aligned_free(pBuffer);
+                    continue;
+                }
+
+                FillSyntheticFrame(pBuffer, cbSrc, !IsRGBFormat(conv.subtype), width * 31 + f);
+
+                const BYTE *pSrc = pBuffer;
+                LONG lSrcStride = lStride;
+
+                if (layout == BENCH_LAYOUT_BOTTOM_UP)
+                {
+                    // Scan line 0 is the last row in memory.
+                    pSrc = pBuffer + lStride * (height - 1);
+                    lSrcStride = -lStride;
+                }
+
+                for (DWORD v = 0; v < ARRAYSIZE(g_BenchVariants); v++)
+                {
+                    const BenchVariant &variant = g_BenchVariants[v];
+
+                    DWORD cbMoved = BenchFrameBytes(conv.subtype, BenchRowBytes(conv.subtype, width), height);
+                    cbMoved += (variant.kind == BENCH_KIND_SCALED) ? (width / 2) * (height / 2) * 4 : width * height * 4;
+
+                    BenchResult res = RunCase(conv, variant, pools[v],
+                        pDest, lDestStride, pSrc, lSrcStride, width, height, cbMoved);
+
+                    char size[16];
+                    snprintf(size, sizeof(size), "%ux%u", width, height);
+
+                    snprintf(line, sizeof(line), "%-6s %-10s %-11s %-10s %10.1f %7.1f%% %9.2f %9.2f\n",
+                        BenchFormatName(conv.subtype), size, g_BenchLayoutNames[layout], variant.name,
+                        res.meanUs, 100.0 * res.stddevUs / res.meanUs, res.gbps, res.cyclesPerPixel);
+                    report << line;
+                    OutputDebugStringA(line);
+                }
+
+                _aligned_free(pBuffer);
+            }
+        }
+
+        _aligned_free(pDest);
+    }
+
+    for (DWORD v = 0; v < ARRAYSIZE(g_BenchVariants); v++)
+    {
+        if (pools[v])
+        {
+            pools[v]->Destory();
+        }
+    }
+
+    RunScalerBenchmark(report);
+
+    report.close();
+    return S_OK;
+}
+
+
+//-------------------------------------------------------------------
+//
+// Correctness check
+//
+// Every kernel is compared with a double-precision reference of the
+// same conversion, and with sws_scale. The multithreaded and fused
+// scaling paths are checked as well. Errors are per color channel.
+//
+//-------------------------------------------------------------------
+
+// Largest error against the reference before a kernel fails. The
+// kernels use x256 fixed-point coefficients, and the scalers round
+// the box average before converting it.
+const double VERIFY_MAX_ERROR = 2.0;
+const double VERIFY_MAX_SCALE_ERROR = 3.0;
+
+// A kernel that is slower than its stored baseline by more than this
+// factor is flagged.
+const double VERIFY_SLOWDOWN = 1.10;
+
+// Destination rows are padded with a known byte to catch writes past
+// the end of a row.
+const LONG VERIFY_DEST_PADDING = 64;
+const BYTE VERIFY_GUARD = 0xCD;
+
+enum VERIFY_IMAGE
+{
+    VERIFY_IMAGE_RANDOM,            // Every byte random, full range.
+    VERIFY_IMAGE_EXTREME_CHROMA     // Chroma only 0, 16, 240 or 255.
+};
+
+struct VerifyCase
+{
+    const char      *name;
+    DWORD           width;
+    DWORD           height;
+    BENCH_LAYOUT    layout;
+    VERIFY_IMAGE    image;
+};
+
+static const VerifyCase g_VerifyCases[] =
+{
+    { "random",         640, 480, BENCH_LAYOUT_PACKED,     VERIFY_IMAGE_RANDOM },
+    { "odd-width",      641, 360, BENCH_LAYOUT_PACKED,     VERIFY_IMAGE_RANDOM },
+    { "narrow",           3,  18, BENCH_LAYOUT_PACKED,     VERIFY_IMAGE_RANDOM },
+    { "padded",         640, 480, BENCH_LAYOUT_ODD_STRIDE, VERIFY_IMAGE_RANDOM },
+    { "padded-odd",     177, 100, BENCH_LAYOUT_ODD_STRIDE, VERIFY_IMAGE_RANDOM },
+    { "bottom-up",      320, 240, BENCH_LAYOUT_BOTTOM_UP,  VERIFY_IMAGE_RANDOM },
+    { "extreme-chroma", 320, 240, BENCH_LAYOUT_PACKED,     VERIFY_IMAGE_EXTREME_CHROMA }
+};
+
+// Frame size used for the timing regression check.
+const DWORD VERIFY_TIMING_WIDTH = 1280;
+const DWORD VERIFY_TIMING_HEIGHT = 720;
+
+struct ErrorStats
+{
+    double  maxErr;
+    double  sumErr;
+    UINT64  count;
+
+    ErrorStats() : maxErr(0), sumErr(0), count(0) {}
+
+    void Add(double err)
+    {
+        err = fabs(err);
+        if (err > maxErr)
+        {
+            maxErr = err;
+        }
+        sumErr += err;
+        count++;
+    }
+
+    double Mean() const
+    {
+        return count ? sumErr / count : 0;
+    }
+};
+
+
+//-------------------------------------------------------------------
+// SetExtremeChroma
+//
+// Replaces every chroma sample with one of the extreme values.
+//-------------------------------------------------------------------
+
+static void SetExtremeChroma(REFGUID subtype, BYTE *pBuffer, LONG lStride, DWORD height, UINT32 seed)
+{
+    static const BYTE values[] = { 0, 16, 240, 255 };
+
+    if (subtype == MFVideoFormat_YUY2)
+    {
+        for (DWORD y = 0; y < height; y++)
+        {
+            BYTE *row = pBuffer + y * lStride;
+            for (LONG i = 1; i < lStride; i += 2)
+            {
+                seed = seed * 1664525 + 1013904223;
+                row[i] = values[seed >> 30];
+            }
+        }
+    }
+    else if (IsPlanarFormat(subtype))
+    {
+        BYTE *pChroma = pBuffer + lStride * height;
+        for (DWORD i = 0; i < (DWORD)lStride * height / 2; i++)
+        {
+            seed = seed * 1664525 + 1013904223;
+            pChroma[i] = values[seed >> 30];
+        }
+    }
+}
+
+
+//-------------------------------------------------------------------
+// ReadSourcePixel
+//
+// Reads pixel (x, y). c[] is Y, Cb, Cr for YUV formats and B, G, R
+// for RGB formats. Chroma is shared by each pair of pixels, and by
+// each pair of rows for 4:2:0, without interpolation.
+//-------------------------------------------------------------------
+
+static void ReadSourcePixel(
+    REFGUID     subtype,
+    const BYTE  *pSrc,
+    LONG        lStride,
+    DWORD       height,
+    DWORD       x,
+    DWORD       y,
+    double      c[3]
+    )
+{
+    const BYTE *row = pSrc + (LONG)y * lStride;
+
+    if (subtype == MFVideoFormat_RGB32 || subtype == MFVideoFormat_RGB24)
+    {
+        DWORD bpp = (subtype == MFVideoFormat_RGB32) ? 4 : 3;
+        c[0] = row[x * bpp + 0];
+        c[1] = row[x * bpp + 1];
+        c[2] = row[x * bpp + 2];
+    }
+    else if (subtype == MFVideoFormat_YUY2)
+    {
+        // Byte order is Y0 U0 Y1 V0
+        const BYTE *pair = row + (x & ~1) * 2;
+        c[0] = row[x * 2];
+        c[1] = pair[1];
+        c[2] = pair[3];
+    }
+    else if (subtype == MFVideoFormat_I420)
+    {
+        const BYTE *pCb = pSrc + height * lStride;
+        const BYTE *pCr = pCb + height * lStride / 4;
+        c[0] = row[x];
+        c[1] = pCb[(y / 2) * (lStride / 2) + x / 2];
+        c[2] = pCr[(y / 2) * (lStride / 2) + x / 2];
+    }
+    else
+    {
+        const BYTE *pUV = pSrc + height * lStride + (y / 2) * lStride;
+        c[0] = row[x];
+        c[1] = pUV[x & ~1];
+        c[2] = pUV[(x & ~1) + 1];
+    }
+}
+
+
+//-------------------------------------------------------------------
+// ReferenceToRGB
+//
+// Converts one sample to B, G, R with the exact matrix coefficients.
+//-------------------------------------------------------------------
+
+static void ReferenceToRGB(REFGUID subtype, YUV_MATRIX matrix, YUV_RANGE range, const double c[3], double bgr[3])
+{
+    if (IsRGBFormat(subtype))
+    {
+        bgr[0] = c[0];
+        bgr[1] = c[1];
+        bgr[2] = c[2];
+        return;
+    }
+
+    double kr = (matrix == YUV_MATRIX_BT709) ? 0.2126 : 0.299;
+    double kb = (matrix == YUV_MATRIX_BT709) ? 0.0722 : 0.114;
+    double kg = 1.0 - kr - kb;
+
+    double y  = c[0];
+    double cb = c[1] - 128.0;
+    double cr = c[2] - 128.0;
+
+    if (range == YUV_RANGE_LIMITED)
+    {
+        y  = (y - 16.0) * 255.0 / 219.0;
+        cb = cb * 255.0 / 224.0;
+        cr = cr * 255.0 / 224.0;
+    }
+
+    bgr[0] = y + 2.0 * (1.0 - kb) * cb;
+    bgr[1] = y - 2.0 * kb * (1.0 - kb) / kg * cb - 2.0 * kr * (1.0 - kr) / kg * cr;
+    bgr[2] = y + 2.0 * (1.0 - kr) * cr;
+
+    for (int i = 0; i < 3; i++)
+    {
+        bgr[i] = bgr[i] < 0.0 ? 0.0 : (bgr[i] > 255.0 ? 255.0 : bgr[i]);
+    }
+}
+
+
+//-------------------------------------------------------------------
+// CompareWithReference
+//
+// Compares an RGB-32 image with the reference conversion. With a
+// destination smaller than the source, the reference is the box
+// average of the source samples, using the boxes of ScaleImage.
+//-------------------------------------------------------------------
+
+static void CompareWithReference(
+    REFGUID     subtype,
+    YUV_MATRIX  matrix,
+    YUV_RANGE   range,
+    const BYTE  *pSrc,
+    LONG        lSrcStride,
+    DWORD       width,
+    DWORD       height,
+    const BYTE  *pDest,
+    LONG        lDestStride,
+    DWORD       dwDestWidth,
+    DWORD       dwDestHeight,
+    ErrorStats  *pStats
+    )
+{
+    for (DWORD oy = 0; oy < dwDestHeight; oy++)
+    {
+        DWORD sy0 = (DWORD)((UINT64)oy * height / dwDestHeight);
+        DWORD sy1 = (DWORD)((UINT64)(oy + 1) * height / dwDestHeight);
+
+        const BYTE *row = pDest + (LONG)oy * lDestStride;
+
+        for (DWORD ox = 0; ox < dwDestWidth; ox++)
+        {
+            DWORD sx0 = (DWORD)((UINT64)ox * width / dwDestWidth);
+            DWORD sx1 = (DWORD)((UINT64)(ox + 1) * width / dwDestWidth);
+
+            double sum[3] = { 0, 0, 0 };
+            for (DWORD sy = sy0; sy < sy1; sy++)
+            {
+                for (DWORD sx = sx0; sx < sx1; sx++)
+                {
+                    double c[3];
+                    ReadSourcePixel(subtype, pSrc, lSrcStride, height, sx, sy, c);
+                    sum[0] += c[0];
+                    sum[1] += c[1];
+                    sum[2] += c[2];
+                }
+            }
+
+            double n = (double)(sx1 - sx0) * (sy1 - sy0);
+            double avg[3] = { sum[0] / n, sum[1] / n, sum[2] / n };
+            double bgr[3];
+
+            ReferenceToRGB(subtype, matrix, range, avg, bgr);
+
+            for (int i = 0; i < 3; i++)
+            {
+                pStats->Add(row[ox * 4 + i] - bgr[i]);
+            }
+        }
+    }
+}
+
+
+//-------------------------------------------------------------------
+// CompareImages
+//
+// Compares two RGB-32 images of the same size.
+//-------------------------------------------------------------------
+
+static void CompareImages(
+    const BYTE  *pA,
+    LONG        lStrideA,
+    const BYTE  *pB,
+    LONG        lStrideB,
+    DWORD       width,
+    DWORD       height,
+    ErrorStats  *pStats
+    )
+{
+    for (DWORD y = 0; y < height; y++)
+    {
+        const BYTE *a = pA + (LONG)y * lStrideA;
+        const BYTE *b = pB + (LONG)y * lStrideB;
+
+        for (DWORD x = 0; x < width; x++)
+        {
+            for (int i = 0; i < 3; i++)
+            {
+                pStats->Add((double)a[x * 4 + i] - b[x * 4 + i]);
+            }
+        }
+    }
+}
+
+
+//-------------------------------------------------------------------
+// CheckGuard
+//
+// Returns FALSE if anything was written to the row padding.
+//-------------------------------------------------------------------
+
+static BOOL CheckGuard(const BYTE *pDest, LONG lDestStride, DWORD width, DWORD height)
+{
+    for (DWORD y = 0; y < height; y++)
+    {
+        const BYTE *row = pDest + (LONG)y * lDestStride;
+
+        for (LONG i = width * 4; i < lDestStride; i++)
+        {
+            if (row[i] != VERIFY_GUARD)
+            {
+                return FALSE;
+            }
+        }
+    }
+    return TRUE;
+}
+
+
+//-------------------------------------------------------------------
+// SwsConvert
+//
+// Converts the source to RGB-32 with sws_scale, using the same matrix
+// and range. Chroma is not interpolated, as in the kernels.
+//-------------------------------------------------------------------
+
+static BOOL SwsConvert(
+    REFGUID     subtype,
+    YUV_MATRIX  matrix,
+    YUV_RANGE   range,
+    const BYTE  *pSrc,
+    LONG        lSrcStride,
+    DWORD       width,
+    DWORD       height,
+    BYTE        *pDest,
+    LONG        lDestStride
+    )
+{
+    AVPixelFormat fmt;
+
+    if (subtype == MFVideoFormat_RGB32)     fmt = AV_PIX_FMT_RGB32;
+    else if (subtype == MFVideoFormat_RGB24) fmt = AV_PIX_FMT_BGR24;
+    else if (subtype == MFVideoFormat_YUY2)  fmt = AV_PIX_FMT_YUYV422;
+    else if (subtype == MFVideoFormat_I420)  fmt = AV_PIX_FMT_YUV420P;
+    else if (subtype == MFVideoFormat_NV12)  fmt = AV_PIX_FMT_NV12;
+    else return FALSE;
+
+    AVFrame *frame = av_frame_alloc();
+    if (frame == NULL)
+    {
+        return FALSE;
+    }
+    frame->format = fmt;
+    frame->width = width;
+    frame->height = height;
+    FillFramePlanes(frame, (BYTE*)pSrc, lSrcStride);
+
+    SwsContext *ctx = sws_getContext(width, height, fmt, width, height, AV_PIX_FMT_RGB32,
+        SWS_POINT | SWS_ACCURATE_RND | SWS_FULL_CHR_H_INT, NULL, NULL, NULL);
+    if (ctx == NULL)
+    {
+        av_frame_free(&frame);
+        return FALSE;
+    }
+
+    if (!IsRGBFormat(subtype))
+    {
+        int cs = (matrix == YUV_MATRIX_BT709) ? SWS_CS_ITU709 : SWS_CS_ITU601;
+        sws_setColorspaceDetails(ctx,
+            sws_getCoefficients(cs), range == YUV_RANGE_FULL,
+            sws_getCoefficients(SWS_CS_DEFAULT), 1,
+            0, 1 << 16, 1 << 16);
+    }
+
+    uint8_t *dstData[4] = { pDest, NULL, NULL, NULL };
+    int dstLinesize[4] = { lDestStride, 0, 0, 0 };
+
+    sws_scale(ctx, frame->data, frame->linesize, 0, height, dstData, dstLinesize);
+
+    sws_freeContext(ctx);
+    av_frame_free(&frame);
+    return TRUE;
+}
+
+
+//-------------------------------------------------------------------
+// VerifyCaseFormat
+//
+// Runs all checks of one test image on one format. Returns FALSE if
+// any of them fails.
+//-------------------------------------------------------------------
+
+static BOOL VerifyCaseFormat(
+    const VerifyCase &vc,
+    const ConversionFunction &conv,
+    UINT32 seed,
+    WorkerPool *pPool,
+    std::ofstream &report
+    )
+{
+    if (vc.layout == BENCH_LAYOUT_BOTTOM_UP && !IsRGBFormat(conv.subtype))
+    {
+        return TRUE;
+    }
+
+    BOOL bPass = TRUE;
+    char line[260];
+
+    LONG lStride = BenchStride(conv.subtype, vc.width, vc.layout);
+    DWORD cbSrc = BenchFrameBytes(conv.subtype, lStride, vc.height);
+
+    LONG lDestStride = vc.width * 4 + VERIFY_DEST_PADDING;
+    DWORD cbDest = lDestStride * vc.height;
+
+    BYTE *pBuffer = (BYTE*)_aligned_malloc(cbSrc, 64);
+    BYTE *pScalar = (BYTE*)_aligned_malloc(cbDest, 64);
+    BYTE *pOther = (BYTE*)_aligned_malloc(cbDest, 64);
+
+    if (pBuffer == NULL || pScalar == NULL || pOther == NULL)
+    {
+        _aligned_free(pBuffer);
+        _aligned_free(pScalar);
+        _aligned_free(pOther);
+        return FALSE;
+    }
+
+    FillSyntheticFrame(pBuffer, cbSrc, FALSE, seed);
+    if (vc.image == VERIFY_IMAGE_EXTREME_CHROMA)
+    {
+        SetExtremeChroma(conv.subtype, pBuffer, lStride, vc.height, seed);
+    }
+
+    const BYTE *pSrc = pBuffer;
+    LONG lSrcStride = lStride;
+
+    if (vc.layout == BENCH_LAYOUT_BOTTOM_UP)
+    {
+        pSrc = pBuffer + lStride * (vc.height - 1);
+        lSrcStride = -lStride;
+    }
+
+    // RGB formats have the same kernel in every slot.
+    int nMatrix = IsRGBFormat(conv.subtype) ? 1 : YUV_MATRIX_COUNT;
+    int nRange = IsRGBFormat(conv.subtype) ? 1 : YUV_RANGE_COUNT;
+
+    for (int m = 0; m < nMatrix; m++)
+    {
+        for (int r = 0; r < nRange; r++)
+        {
+            YUV_MATRIX matrix = (YUV_MATRIX)m;
+            YUV_RANGE range = (YUV_RANGE)r;
+
+            // Scalar kernel against the reference.
+            ErrorStats ref;
+            memset(pScalar, VERIFY_GUARD, cbDest);
+            conv.xform[m][r](pScalar, lDestStride, pSrc, lSrcStride, vc.width, vc.height, 0, vc.height);
+            CompareWithReference(conv.subtype, matrix, range, pSrc, lSrcStride, vc.width, vc.height,
+                pScalar, lDestStride, vc.width, vc.height, &ref);
+            BOOL bGuard = CheckGuard(pScalar, lDestStride, vc.width, vc.height);
+
+            // Multithreaded kernel against the scalar one. Must match exactly.
+            ErrorStats mt;
+            memset(pOther, VERIFY_GUARD, cbDest);
+            TransformImage_Parallel(pPool, conv.xform[m][r], conv.rowAlign,
+                pOther, lDestStride, pSrc, lSrcStride, vc.width, vc.height);
+            CompareImages(pOther, lDestStride, pScalar, lDestStride, vc.width, vc.height, &mt);
+            bGuard = bGuard && CheckGuard(pOther, lDestStride, vc.width, vc.height);
+
+            // Fused half-size scaler against the box-averaged reference.
+            ErrorStats scaled;
+            DWORD dw = vc.width / 2 ? vc.width / 2 : 1;
+            DWORD dh = vc.height / 2 ? vc.height / 2 : 1;
+            memset(pOther, VERIFY_GUARD, cbDest);
+            ScaleTable table;
+            ZeroMemory(&table, sizeof(table));
+            InitScaleTable(&table, dw, vc.width, pPool ? pPool->GetThreadCount() : 1);
+            ScaleImage_Parallel(pPool, conv.scale[m][r], &table, pOther, lDestStride, dw, dh,
+                pSrc, lSrcStride, vc.width, vc.height);
+            FreeScaleTable(&table);
+            CompareWithReference(conv.subtype, matrix, range, pSrc, lSrcStride, vc.width, vc.height,
+                pOther, lDestStride, dw, dh, &scaled);
+
+            // sws_scale against the scalar kernel. Reported, not checked:
+            // swscale rounds differently and is the second opinion.
+            ErrorStats sws;
+            memset(pOther, VERIFY_GUARD, cbDest);
+            BOOL bSws = SwsConvert(conv.subtype, matrix, range, pSrc, lSrcStride, vc.width, vc.height,
+                pOther, lDestStride);
+            if (bSws)
+            {
+                CompareImages(pOther, lDestStride, pScalar, lDestStride, vc.width, vc.height, &sws);
+            }
+
+            BOOL bOk = bGuard &&
+                ref.maxErr <= VERIFY_MAX_ERROR &&
+                mt.maxErr == 0 &&
+                scaled.maxErr <= VERIFY_MAX_SCALE_ERROR;
+
+            char cs[16];
+            if (IsRGBFormat(conv.subtype))
+            {
+                snprintf(cs, sizeof(cs), "-");
+            }
+            else
+            {
+                snprintf(cs, sizeof(cs), "%s/%s",
+                    matrix == YUV_MATRIX_BT709 ? "709" : "601",
+                    range == YUV_RANGE_FULL ? "full" : "ltd");
+            }
+
+            snprintf(line, sizeof(line),
+                "%-6s %-15s %-9s ref %5.2f/%5.3f  mt %5.2f  scale %5.2f/%5.3f  sws %6.2f/%6.3f  %s%s\n",
+                BenchFormatName(conv.subtype), vc.name, cs,
+                ref.maxErr, ref.Mean(), mt.maxErr, scaled.maxErr, scaled.Mean(),
+                bSws ? sws.maxErr : -1.0, bSws ? sws.Mean() : -1.0,
+                bOk ? "ok" : "FAIL", bGuard ? "" : " (wrote past row end)");
+            report << line;
+            OutputDebugStringA(line);
+
+            bPass = bPass && bOk;
+        }
+    }
+
+    _aligned_free(pBuffer);
+    _aligned_free(pScalar);
+    _aligned_free(pOther);
+
+    return bPass;
+}
+
+
+//-------------------------------------------------------------------
+// CheckTimings
+//
+// Times the scalar and scaling kernels and compares the best time of
+// each with the baseline file. The best time is far less noisy than
+// the mean. A missing baseline is created from this run;
+// delete the file to take a new baseline.
+//-------------------------------------------------------------------
+
+static BOOL CheckTimings(const char *pszBaseline, std::ofstream &report)
+{
+    std::map<std::string, double> baseline;
+
+    std::ifstream in(pszBaseline);
+    BOOL bHaveBaseline = in.is_open();
+    if (bHaveBaseline)
+    {
+        std::string key;
+        double us;
+        while (in >> key >> us)
+        {
+            baseline[key] = us;
+        }
+        in.close();
+    }
+
+    std::ofstream out;
+    if (!bHaveBaseline)
+    {
+        out.open(pszBaseline);
+    }
+
+    BOOL bPass = TRUE;
+    char line[260];
+
+    DWORD width = VERIFY_TIMING_WIDTH;
+    DWORD height = VERIFY_TIMING_HEIGHT;
+
+    LONG lDestStride = width * 4;
+    BYTE *pDest = (BYTE*)_aligned_malloc(lDestStride * height, 64);
+
+    for (DWORD f = 0; f < g_cFormats && pDest; f++)
+    {
+        const ConversionFunction &conv = g_FormatConversions[f];
+
+        LONG lStride = BenchStride(conv.subtype, width, BENCH_LAYOUT_PACKED);
+        DWORD cbSrc = BenchFrameBytes(conv.subtype, lStride, height);
+        BYTE *pSrc = (BYTE*)_aligned_malloc(cbSrc, 64);
+        if (pSrc == NULL)
+        {
+            continue;
+        }
+        FillSyntheticFrame(pSrc, cbSrc, !IsRGBFormat(conv.subtype), f);
+
+        for (DWORD v = 0; v < ARRAYSIZE(g_BenchVariants); v++)
+        {
+            const BenchVariant &variant = g_BenchVariants[v];
+            if (variant.kind == BENCH_KIND_THREADED)
+            {
+                continue;
+            }
+
+            BenchResult res = RunCase(conv, variant, NULL, pDest, lDestStride,
+                pSrc, lStride, width, height, 0);
+
+            std::string key = std::string(BenchFormatName(conv.subtype)) + "/" + variant.name;
+
+            if (!bHaveBaseline)
+            {
+                out << key << " " << res.minUs << "\n";
+                snprintf(line, sizeof(line), "%-16s %10.1f us  (baseline)\n", key.c_str(), res.minUs);
+            }
+            else if (baseline.count(key) == 0)
+            {
+                snprintf(line, sizeof(line), "%-16s %10.1f us  (not in baseline)\n", key.c_str(), res.minUs);
+            }
+            else
+            {
+                double ratio = res.minUs / baseline[key];
+                BOOL bSlow = ratio > VERIFY_SLOWDOWN;
+
+                snprintf(line, sizeof(line), "%-16s %10.1f us  baseline %10.1f us  %+6.1f%%  %s\n",
+                    key.c_str(), res.minUs, baseline[key], (ratio - 1.0) * 100.0,
+                    bSlow ? "SLOWER" : "ok");
+
+                bPass = bPass && !bSlow;
+            }
+            report << line;
+            OutputDebugStringA(line);
+        }
+
+        _aligned_free(pSrc);
+    }
+
+    _aligned_free(pDest);
+    return bPass;
+}
+
+
+//-------------------------------------------------------------------
+// VerifySliceScaler
+//
+// The bands of SliceScaler must give the output of a single context,
+// for the encoder formats and for sizes that do not split evenly.
+//-------------------------------------------------------------------
+
+// Rounding of an inexact vertical step (see slicescaler.h). A seam at
+// a band edge is much larger.
+const int VERIFY_MAX_SCALE_DIFF = 1;
+
+static const ScaleBenchCase g_VerifyScaleCases[] =
+{
+    { 1920, 1080, 1280,  720 },
+    { 1280,  720, 1280,  720 },
+    { 1366,  768,  854,  480 },
+    {  642,  362,  320,  180 }
+};
+
+static const AVPixelFormat g_VerifyScaleFormats[] =
+{
+    AV_PIX_FMT_RGB32,
+    AV_PIX_FMT_RGB24,
+    AV_PIX_FMT_YUYV422,
+    AV_PIX_FMT_NV12
+};
+
+static BOOL VerifySliceScaler(WorkerPool *pPool, std::ofstream &report)
+{
+    BOOL bPass = TRUE;
+    char line[260];
+
+    report << "\nSliceScaler, 4 bands against one\n";
+
+    for (DWORD c = 0; c < ARRAYSIZE(g_VerifyScaleCases); c++)
+    {
+        const ScaleBenchCase &sc = g_VerifyScaleCases[c];
+
+        for (DWORD f = 0; f < ARRAYSIZE(g_VerifyScaleFormats); f++)
+        {
+            AVPixelFormat format = g_VerifyScaleFormats[f];
+
+            AVFrame *pSrc = AllocBenchFrame(format, sc.srcWidth, sc.srcHeight);
+            AVFrame *pRef = AllocBenchFrame(AV_PIX_FMT_YUV420P, sc.dstWidth, sc.dstHeight);
+            AVFrame *pDest = AllocBenchFrame(AV_PIX_FMT_YUV420P, sc.dstWidth, sc.dstHeight);
+            SliceScaler *pSingle = SliceScaler::Create(NULL);
+            SliceScaler *pSliced = SliceScaler::Create(pPool);
+
+            BOOL bOk = FALSE;
+            int maxDiff = -1;
+
+            if (pSrc && pRef && pDest && pSingle && pSliced)
+            {
+                for (int i = 0; i < AV_NUM_DATA_POINTERS && pSrc->buf[i]; i++)
+                {
+                    FillSyntheticFrame(pSrc->buf[i]->data, pSrc->buf[i]->size, FALSE, c * 131 + f * 17 + i);
+                }
+
+                if (pSingle->Configure(sc.srcWidth, sc.srcHeight, format,
+                        sc.dstWidth, sc.dstHeight, AV_PIX_FMT_YUV420P, SWS_BICUBIC, 1) == 0 &&
+                    pSliced->Configure(sc.srcWidth, sc.srcHeight, format,
+                        sc.dstWidth, sc.dstHeight, AV_PIX_FMT_YUV420P, SWS_BICUBIC, 4) == 0 &&
+                    pSingle->Scale(pSrc->data, pSrc->linesize, pRef->data, pRef->linesize) == 0 &&
+                    pSliced->Scale(pSrc->data, pSrc->linesize, pDest->data, pDest->linesize) == 0)
+                {
+                    maxDiff = MaxFrameDiff(pRef, pDest);
+                    bOk = (maxDiff <= VERIFY_MAX_SCALE_DIFF);
+                }
+            }
+
+            snprintf(line, sizeof(line), "%-8s %4dx%-4d -> %4dx%-4d  %u bands  max diff %d  %s\n",
+                av_get_pix_fmt_name(format), sc.srcWidth, sc.srcHeight, sc.dstWidth, sc.dstHeight,
+                pSliced ? pSliced->GetSliceCount() : 0, maxDiff, bOk ? "ok" : "FAIL");
+            report << line;
+
+            bPass = bPass && bOk;
+
+            if (pSliced)
+            {
+                pSliced->Destory();
+            }
+            if (pSingle)
+            {
+                pSingle->Destory();
+            }
+            av_frame_free(&pSrc);
+            av_frame_free(&pRef);
+            av_frame_free(&pDest);
+        }
+    }
+
+    return bPass;
+}
+
+
+//-------------------------------------------------------------------
+// RunConverterVerify
+//-------------------------------------------------------------------
+
+HRESULT RunConverterVerify(const char *pszReport, const char *pszBaseline)
+{
+    std::ofstream report(pszReport);
+    if (!report)
+    {
+        return E_FAIL;
+    }
+
+    report << "Errors are max/mean absolute, per channel.\n";
+
+    WorkerPool *pPool = WorkerPool::Create(4);
+    BOOL bPass = TRUE;
+
+    for (DWORD i = 0; i < ARRAYSIZE(g_VerifyCases); i++)
+    {
+        for (DWORD f = 0; f < g_cFormats; f++)
+        {
+            UINT32 seed = i * 7919 + f;
+            bPass = VerifyCaseFormat(g_VerifyCases[i], g_FormatConversions[f], seed, pPool, report) && bPass;
+        }
+    }
+
+    bPass = VerifySliceScaler(pPool, report) && bPass;
+
+    if (pPool)
+    {
+        pPool->Destory();
+    }
+
+    report << "\nTimings (" << VERIFY_TIMING_WIDTH << "x" << VERIFY_TIMING_HEIGHT << ")\n";
+
+    bPass = CheckTimings(pszBaseline, report) && bPass;
+
+    report << (bPass ? "\nPASS\n" : "\nFAIL\n");
+    report.close();
+
+    LOG_INFO("Converter check %s, see %s", bPass ? "passed" : "FAILED", pszReport);
+
+    return bPass ? S_OK : S_FALSE;
+}
+
+
+//-------------------------------------------------------------------
+//
+// Encoder latency
+//
+// Every encoding profile encodes the same synthetic frames. Frames
+// arrive every 1/LATENCY_FPS s on a simulated clock, and each is
+// encoded as soon as the encoder is free, so that the report shows the
+// latency a live source would see, without waiting in real time.
+//
+//-------------------------------------------------------------------
+
+const int    LATENCY_WIDTH = 1280;
+const int    LATENCY_HEIGHT = 720;
+const int    LATENCY_FPS = 30;
+const int    LATENCY_FRAMES = 150;
+const int64_t LATENCY_BIT_RATE = 4000000;
+
+// Moving gradient with a square that crosses it, so that the encoder
+// has motion to estimate.
+static void FillLatencyFrame(AVFrame *frame, int index)
+{
+    for (int y = 0; y < frame->height; y++)
+    {
+        uint8_t *row = frame->data[0] + y * frame->linesize[0];
+
+        for (int x = 0; x < frame->width; x++)
+        {
+            row[x] = (uint8_t)(16 + ((x + y + index * 4) & 0x7F) + ((x * 7 + y * 13) & 0x0F));
+        }
+    }
+
+    int left = (index * 8) % (frame->width - 128);
+    for (int y = 256; y < 384 && y < frame->height; y++)
+    {
+        memset(frame->data[0] + y * frame->linesize[0] + left, 235, 128);
+    }
+
+    for (int p = 1; p < 3; p++)
+    {
+        for (int y = 0; y < frame->height / 2; y++)
+        {
+            memset(frame->data[p] + y * frame->linesize[p], p == 1 ? 96 + (index & 31) : 160, frame->width / 2);
+        }
+    }
+}
+
+
+//-------------------------------------------------------------------
+// MeasureProfileLatency
+//
+// Encodes LATENCY_FRAMES frames with one profile. Writes one line per
+// packet: the frame, its latency, and the frames sent to the encoder
+// after it before its packet came out. Packets drained at the end of
+// the stream are left out.
+//-------------------------------------------------------------------
+
+static void MeasureProfileLatency(ENCODE_PROFILE profile, std::ofstream &report)
+{
+    const char *name = g_EncodeProfiles[profile].name;
+    char line[260];
+
+    AVCodec *codec = avcodec_find_encoder(AV_CODEC_ID_H264);
+    AVCodecContext *context = codec ? avcodec_alloc_context3(codec) : NULL;
+    AVFrame *frame = av_frame_alloc();
+    AVPacket *packet = av_packet_alloc();
+
+    if (context == NULL || frame == NULL || packet == NULL)
+    {
+        report << name << ": no H.264 encoder\n";
+        goto done;
+    }
+
+    context->width = LATENCY_WIDTH;
+    context->height = LATENCY_HEIGHT;
+    context->pix_fmt = AV_PIX_FMT_YUV420P;
+    context->framerate.num = LATENCY_FPS;
+    context->framerate.den = 1;
+    context->time_base.num = 1;
+    context->time_base.den = LATENCY_FPS;
+
+    ApplyEncodeProfile(context, profile, LATENCY_FPS, LATENCY_BIT_RATE);
+
+    if (avcodec_open2(context, codec, NULL) < 0)
+    {
+        report << name << ": cannot open the encoder\n";
+        goto done;
+    }
+
+    frame->format = context->pix_fmt;
+    frame->width = context->width;
+    frame->height = context->height;
+
+    if (av_frame_get_buffer(frame, 32) < 0)
+    {
+        goto done;
+    }
+
+    {
+        const double intervalUs = 1000000.0 / LATENCY_FPS;
+        double encoderFreeUs = 0;
+        double encodeSum = 0;
+        std::vector<double> latencies;
+
+        snprintf(line, sizeof(line), "\n%-10s %6s %12s %8s\n", "profile", "frame", "latency ms", "delay");
+        report << line;
+
+        for (int i = 0; i < LATENCY_FRAMES; i++)
+        {
+            FillLatencyFrame(frame, i);
+            frame->pts = i;
+
+            double arrivalUs = i * intervalUs;
+            double startUs = arrivalUs > encoderFreeUs ? arrivalUs : encoderFreeUs;
+
+            int got_packet = 0;
+            INT64 llStart = av_gettime_relative();
+            int ret = avcodec_encode_video2(context, packet, frame, &got_packet);
+            double encodeUs = (double)(av_gettime_relative() - llStart);
+
+            encodeSum += encodeUs;
+            encoderFreeUs = startUs + encodeUs;
+
+            if (ret < 0)
+            {
+                report << name << ": avcodec_encode_video2 failed\n";
+                break;
+            }
+
+            if (got_packet)
+            {
+                double latencyUs = encoderFreeUs - packet->pts * intervalUs;
+                latencies.push_back(latencyUs);
+
+                snprintf(line, sizeof(line), "%-10s %6lld %12.2f %8lld\n",
+                    name, packet->pts, latencyUs / 1000.0, i - packet->pts);
+                report << line;
+
+                av_packet_unref(packet);
+            }
+        }
+
+        if (!latencies.empty())
+        {
+            std::vector<double> sorted(latencies);
+            std::sort(sorted.begin(), sorted.end());
+
+            double sum = 0;
+            for (size_t i = 0; i < sorted.size(); i++)
+            {
+                sum += sorted[i];
+            }
+
+            snprintf(line, sizeof(line),
+                "%-10s mean %.2f ms, p95 %.2f ms, max %.2f ms, encode %.2f ms/frame, %d frames held at the end\n",
+                name, sum / sorted.size() / 1000.0, sorted[sorted.size() * 95 / 100] / 1000.0,
+                sorted.back() / 1000.0, encodeSum / LATENCY_FRAMES / 1000.0,
+                LATENCY_FRAMES - (int)sorted.size());
+            report << line;
+            OutputDebugStringA(line);
+        }
+    }
+
+done:
+    av_packet_free(&packet);
+    av_frame_free(&frame);
+    avcodec_free_context(&context);
+}
+
+
+//-------------------------------------------------------------------
+// RunEncoderLatency
+//-------------------------------------------------------------------
+
+HRESULT RunEncoderLatency(const char *pszReport)
+{
+    std::ofstream report(pszReport);
+    if (!report)
+    {
+        return E_FAIL;
+    }
+
+    report << LATENCY_WIDTH << "x" << LATENCY_HEIGHT << " at " << LATENCY_FPS
+        << " fps, latency from the arrival of a frame to its packet.\n";
+
+    for (int p = 0; p < ENCODE_PROFILE_COUNT; p++)
+    {
+        MeasureProfileLatency((ENCODE_PROFILE)p, report);
+    }
+
+    report.close();
+    return S_OK;
+}
+
+
+//-------------------------------------------------------------------
+//
+// Simulcast
+//
+// The renditions of g_SimulcastLadder are encoded from the same
+// synthetic frames, once as a ladder, each rung scaled from the one
+// above it, and once as independent pipelines that each scale the full
+// source for one rung. The report compares the CPU time of the process
+// and checks that the IDR frames of every rung fall on the same frames.
+//
+//-------------------------------------------------------------------
+
+const int    SIMULCAST_WIDTH = 1920;
+const int    SIMULCAST_HEIGHT = 1080;
+const int    SIMULCAST_FPS = 30;
+const int    SIMULCAST_FRAMES = 120;
+
+struct SimulcastBenchSink
+{
+    std::vector<int64_t> keyFrames[MAX_SIMULCAST_RUNGS];
+    uint64_t bytes[MAX_SIMULCAST_RUNGS];
+    int rungBase;       // Rung of the ladder that rung 0 stands for.
+};
+
+static void SimulcastBenchPacket(void *ctx, int rung, const AVPacket *packet)
+{
+    SimulcastBenchSink *sink = (SimulcastBenchSink*)ctx;
+    int index = sink->rungBase + rung;
+
+    // Rungs run on different threads but never share an entry.
+    if (index < MAX_SIMULCAST_RUNGS)
+    {
+        sink->bytes[index] += packet->size;
+
+        if (packet->flags & AV_PKT_FLAG_KEY)
+        {
+            sink->keyFrames[index].push_back(packet->pts);
+        }
+    }
+}
+
+// User and kernel time of the process, in us.
+static INT64 GetProcessCpuTime()
+{
+    FILETIME ftCreation, ftExit, ftKernel, ftUser;
+
+    if (!GetProcessTimes(GetCurrentProcess(), &ftCreation, &ftExit, &ftKernel, &ftUser))
+    {
+        return 0;
+    }
+
+    ULARGE_INTEGER kernel, user;
+    kernel.LowPart = ftKernel.dwLowDateTime;
+    kernel.HighPart = ftKernel.dwHighDateTime;
+    user.LowPart = ftUser.dwLowDateTime;
+    user.HighPart = ftUser.dwHighDateTime;
+
+    return (INT64)((kernel.QuadPart + user.QuadPart) / 10);
+}
+
+
+//-------------------------------------------------------------------
+// EncodeSimulcastRun
+//
+// Encodes SIMULCAST_FRAMES frames through every Simulcast of the run,
+// one after the other for each frame, then drains them. Writes one
+// line with the CPU and wall time, and the scale and encode time of
+// the Simulcast objects.
+//-------------------------------------------------------------------
+
+static void EncodeSimulcastRun(
+    const char *name,
+    Simulcast **ppSimulcast,
+    int cSimulcast,
+    std::ofstream &report
+    )
+{
+    char line[260];
+
+    AVFrame *frame = AllocBenchFrame(AV_PIX_FMT_YUV420P, SIMULCAST_WIDTH, SIMULCAST_HEIGHT);
+    if (frame == NULL)
+    {
+        return;
+    }
+
+    SimulcastStats total = {};
+    INT64 llCpu = GetProcessCpuTime();
+    INT64 llStart = av_gettime_relative();
+
+    for (int i = 0; i < SIMULCAST_FRAMES; i++)
+    {
+        FillLatencyFrame(frame, i);
+
+        for (int s = 0; s < cSimulcast; s++)
+        {
+            ppSimulcast[s]->Encode(frame);
+        }
+    }
+
+    for (int s = 0; s < cSimulcast; s++)
+    {
+        SimulcastStats stats;
+
+        ppSimulcast[s]->Flush();
+        ppSimulcast[s]->GetStats(&stats, true);
+
+        total.scaleTime += stats.scaleTime;
+        total.encodeTime += stats.encodeTime;
+    }
+
+    INT64 llWall = av_gettime_relative() - llStart;
+    llCpu = GetProcessCpuTime() - llCpu;
+
+    snprintf(line, sizeof(line),
+        "%-12s cpu %8.2f ms/frame, wall %7.2f ms/frame, scale %6.2f ms/frame, encode %7.2f ms/frame\n",
+        name, llCpu / 1000.0 / SIMULCAST_FRAMES, llWall / 1000.0 / SIMULCAST_FRAMES,
+        total.scaleTime / 1000.0 / SIMULCAST_FRAMES, total.encodeTime / 1000.0 / SIMULCAST_FRAMES);
+    report << line;
+    OutputDebugStringA(line);
+
+    av_frame_free(&frame);
+}
+
+
+//-------------------------------------------------------------------
+// ReportSimulcastKeyFrames
+//
+// Lists the size and IDR frames of each rung, and whether they match
+// those of the first rung.
+//-------------------------------------------------------------------
+
+static void ReportSimulcastKeyFrames(const SimulcastBenchSink &sink, int cRungs, std::ofstream &report)
+{
+    char line[260];
+
+    for (int r = 0; r < cRungs; r++)
+    {
+        const std::vector<int64_t> &keys = sink.keyFrames[r];
+
+        snprintf(line, sizeof(line), "  %dp: %llu kB, %u IDR frames%s:",
+            g_SimulcastLadder[r].height, sink.bytes[r] / 1024, (UINT)keys.size(),
+            keys == sink.keyFrames[0] ? "" : " (MISALIGNED)");
+        report << line;
+
+        for (size_t k = 0; k < keys.size(); k++)
+        {
+            report << " " << keys[k];
+        }
+        report << "\n";
+    }
+}
+
+
+//-------------------------------------------------------------------
+// RunSimulcastBenchmark
+//-------------------------------------------------------------------
+
+HRESULT RunSimulcastBenchmark(const char *pszReport)
+{
+    std::ofstream report(pszReport);
+    if (!report)
+    {
+        return E_FAIL;
+    }
+
+    SYSTEM_INFO si;
+    GetSystemInfo(&si);
+
+    WorkerPool *pPool = WorkerPool::Create(si.dwNumberOfProcessors);
+    if (pPool == NULL)
+    {
+        return E_OUTOFMEMORY;
+    }
+
+    int cRungs = min(g_cSimulcastRungs, MAX_SIMULCAST_RUNGS);
+
+    report << SIMULCAST_WIDTH << "x" << SIMULCAST_HEIGHT << " at " << SIMULCAST_FPS << " fps, "
+        << SIMULCAST_FRAMES << " frames, profile " << g_EncodeProfiles[ENCODE_PROFILE_LOW_LATENCY].name
+        << ", " << si.dwNumberOfProcessors << " threads.\n\n";
+
+    // One ladder: every rung scaled from the one above, encoded in
+    // parallel.
+    {
+        SimulcastBenchSink sink = {};
+        Simulcast *pLadder = Simulcast::Create(pPool);
+
+        if (pLadder &&
+            pLadder->Configure(SIMULCAST_WIDTH, SIMULCAST_HEIGHT, AV_PIX_FMT_YUV420P,
+                g_SimulcastLadder, cRungs, ENCODE_PROFILE_LOW_LATENCY,
+                av_make_q(SIMULCAST_FPS, 1), av_make_q(1, SIMULCAST_FPS),
+                SimulcastBenchPacket, &sink) == cRungs)
+        {
+            EncodeSimulcastRun("ladder", &pLadder, 1, report);
+            ReportSimulcastKeyFrames(sink, cRungs, report);
+        }
+        else
+        {
+            report << "ladder: cannot set up the rungs\n";
+        }
+
+        if (pLadder)
+        {
+            pLadder->Destory();
+        }
+    }
+
+    // Independent pipelines: each rung scaled from the source by its
+    // own Simulcast.
+    {
+        SimulcastBenchSink sinks[MAX_SIMULCAST_RUNGS] = {};
+        Simulcast *pSingle[MAX_SIMULCAST_RUNGS] = {};
+        int cSingle = 0;
+
+        for (int r = 0; r < cRungs; r++)
+        {
+            sinks[r].rungBase = r;
+            pSingle[r] = Simulcast::Create(pPool);
+
+            if (pSingle[r] &&
+                pSingle[r]->Configure(SIMULCAST_WIDTH, SIMULCAST_HEIGHT, AV_PIX_FMT_YUV420P,
+                    &g_SimulcastLadder[r], 1, ENCODE_PROFILE_LOW_LATENCY,
+                    av_make_q(SIMULCAST_FPS, 1), av_make_q(1, SIMULCAST_FPS),
+                    SimulcastBenchPacket, &sinks[r]) == 1)
+            {
+                cSingle++;
+            }
+        }
+
+        if (cSingle == cRungs)
+        {
+            EncodeSimulcastRun("independent", pSingle, cSingle, report);
+        }
+        else
+        {
+            report << "independent: cannot set up the rungs\n";
+        }
+
+        for (int r = 0; r < cRungs; r++)
+        {
+            if (pSingle[r])
+            {
+                pSingle[r]->Destory();
+            }
+        }
+    }
+
+    pPool->Destory();
+
+    report.close();
+    return S_OK;
+}
+
+
+//-------------------------------------------------------------------
+//
+// Audio conversion
+//
+// Float to S16 at 48 kHz for several channel counts, as the resample
+// stage sees it: packed audio in frames of AUDIO_BENCH_FRAME samples.
+// swresample converts the same layout, so it only changes the sample
+// format as well.
+//
+//-------------------------------------------------------------------
+
+const int  AUDIO_BENCH_RATE = 48000;
+const int  AUDIO_BENCH_FRAME = 1024;     // Samples per channel and call.
+
+static const int g_AudioBenchChannels[] = { 2, 6, 8 };
+
+struct AudioConvertRun
+{
+    AUDIO_CONVERT_FN    fn;             // NULL: swresample.
+    SwrContext          *swr;
+    AudioDither         *pDither;
+    INT16               *pDst;
+    const float         *pSrc;
+    int                 channels;
+};
+
+// Converts one second.
+static void RunAudioConvert(void *ctx)
+{
+    const AudioConvertRun *run = (const AudioConvertRun*)ctx;
+
+    for (int i = 0; i < AUDIO_BENCH_RATE; i += AUDIO_BENCH_FRAME)
+    {
+        int count = min(AUDIO_BENCH_FRAME, AUDIO_BENCH_RATE - i);
+        const float *pSrc = run->pSrc + i * run->channels;
+        INT16 *pDst = run->pDst + i * run->channels;
+
+        if (run->fn)
+        {
+            run->fn(pDst, pSrc, count * run->channels, run->pDither);
+        }
+        else
+        {
+            swr_convert(run->swr, (uint8_t **)&pDst, count, (const uint8_t **)&pSrc, count);
+        }
+    }
+}
+
+static SwrContext * OpenBenchResampler(int channels, BOOL bDither)
+{
+    int64_t layout = av_get_default_channel_layout(channels);
+
+    SwrContext *swr = swr_alloc_set_opts(NULL,
+        layout, AV_SAMPLE_FMT_S16, AUDIO_BENCH_RATE,
+        layout, AV_SAMPLE_FMT_FLT, AUDIO_BENCH_RATE, 0, NULL);
+
+    if (swr && bDither)
+    {
+        av_opt_set_int(swr, "dither_method", SWR_DITHER_TRIANGULAR, 0);
+    }
+
+    if (swr && swr_init(swr) < 0)
+    {
+        swr_free(&swr);
+    }
+
+    return swr;
+}
+
+
+// Downmix layouts, as ChooseEncoderLayout() of the encoder asks for them.
+struct DownmixBench
+{
+    const char  *name;
+    UINT64      inLayout;
+    UINT64      outLayout;
+};
+
+static const DownmixBench g_AudioBenchDownmix[] =
+{
+    { "2->1",       AV_CH_LAYOUT_STEREO,        AV_CH_LAYOUT_MONO },
+    { "5.1->2",     AV_CH_LAYOUT_5POINT1,       AV_CH_LAYOUT_STEREO },
+    { "7.1->2",     AV_CH_LAYOUT_7POINT1,       AV_CH_LAYOUT_STEREO },
+    { "7.1->1",     AV_CH_LAYOUT_7POINT1,       AV_CH_LAYOUT_MONO }
+};
+
+struct AudioDownmixRun
+{
+    AUDIO_DOWNMIX_FN    fn;             // NULL: swresample.
+    SwrContext          *swr;
+    const AudioDownmix  *pMix;
+    float               *pDst;
+    const float         *pSrc;
+};
+
+// Mixes down one second.
+static void RunAudioDownmix(void *ctx)
+{
+    const AudioDownmixRun *run = (const AudioDownmixRun*)ctx;
+    DWORD dwIn = run->pMix->dwInChannels;
+    DWORD dwOut = run->pMix->dwOutChannels;
+
+    for (int i = 0; i < AUDIO_BENCH_RATE; i += AUDIO_BENCH_FRAME)
+    {
+        int count = min(AUDIO_BENCH_FRAME, AUDIO_BENCH_RATE - i);
+        const float *pSrc = run->pSrc + i * dwIn;
+        float *pDst = run->pDst + i * dwOut;
+
+        if (run->fn)
+        {
+            run->fn(pDst, pSrc, count, run->pMix);
+        }
+        else
+        {
+            swr_convert(run->swr, (uint8_t **)&pDst, count, (const uint8_t **)&pSrc, count);
+        }
+    }
+}
+
+// Float to float with the matrix of the kernels, as CAudio sets it.
+static SwrContext * OpenBenchDownmixer(const DownmixBench &bench, const AudioDownmix &mix)
+{
+    SwrContext *swr = swr_alloc_set_opts(NULL,
+        bench.outLayout, AV_SAMPLE_FMT_FLT, AUDIO_BENCH_RATE,
+        bench.inLayout, AV_SAMPLE_FMT_FLT, AUDIO_BENCH_RATE, 0, NULL);
+
+    double matrix[2][AUDIO_MAX_DOWNMIX_CHANNELS];
+    for (int o = 0; o < 2; o++)
+    {
+        for (DWORD c = 0; c < AUDIO_MAX_DOWNMIX_CHANNELS; c++)
+        {
+            matrix[o][c] = mix.coef[o][c];
+        }
+    }
+
+    if (swr && (swr_set_matrix(swr, &matrix[0][0], AUDIO_MAX_DOWNMIX_CHANNELS) < 0 || swr_init(swr) < 0))
+    {
+        swr_free(&swr);
+    }
+
+    return swr;
+}
+
+// Times the downmix kernels against swresample; per input sample, so
+// that the rows compare with the conversion above.
+static void ReportAudioDownmix(std::ofstream &report)
+{
+    const char *names[] = { "swr", "C", "SSE2" };
+    const AUDIO_DOWNMIX_FN fns[] = { NULL, DownmixFloat_C, DownmixFloat_SSE2 };
+
+    BOOL bSSE2 = (av_get_cpu_flags() & AV_CPU_FLAG_SSE2) != 0;
+
+    char line[256];
+    snprintf(line, sizeof(line), "Float downmix, %d Hz, %d samples per call, 1 s per run. "
+        "Time per second of audio; rates per input sample; largest difference from C.\n\n"
+        "%-8s %-10s %10s %7s %9s %9s %8s %9s\n",
+        AUDIO_BENCH_RATE, AUDIO_BENCH_FRAME,
+        "layout", "kernel", "us", "stddev", "Msmp/s", "cyc/smp", "speedup", "maxdiff");
+    report << line;
+    OutputDebugStringA(line);
+
+    for (DWORD d = 0; d < ARRAYSIZE(g_AudioBenchDownmix); d++)
+    {
+        const DownmixBench &bench = g_AudioBenchDownmix[d];
+
+        AudioDownmix mix;
+        if (!InitAudioDownmix(&mix, bench.inLayout, bench.outLayout))
+        {
+            continue;
+        }
+
+        DWORD dwSamples = (DWORD)AUDIO_BENCH_RATE * mix.dwInChannels;
+        DWORD dwOutSamples = (DWORD)AUDIO_BENCH_RATE * mix.dwOutChannels;
+
+        float *pSrc = (float*)_aligned_malloc(dwSamples * sizeof(float), 64);
+        float *pRef = (float*)_aligned_malloc(dwOutSamples * sizeof(float), 64);
+        float *pDst = (float*)_aligned_malloc(dwOutSamples * sizeof(float), 64);
+
+        if (pSrc == NULL || pRef == NULL || pDst == NULL)
+        {
+            _aligned_free(pSrc);
+            _aligned_free(pRef);
+            _aligned_free(pDst);
+            continue;
+        }
+
+        UINT32 seed = 54321 + (UINT32)d;
+        for (DWORD i = 0; i < dwSamples; i++)
+        {
+            seed = seed * 1664525 + 1013904223;
+            pSrc[i] = (float)(seed >> 8) / (float)(1 << 24) * 2.0f - 1.0f;
+        }
+
+        DownmixFloat_C(pRef, pSrc, AUDIO_BENCH_RATE, &mix);
+
+        double swrUs = 0;
+
+        for (DWORD k = 0; k < ARRAYSIZE(fns); k++)
+        {
+            if (fns[k] == DownmixFloat_SSE2 && !bSSE2)
+            {
+                continue;
+            }
+
+            AudioDownmixRun run = { fns[k], NULL, &mix, pDst, pSrc };
+
+            if (fns[k] == NULL)
+            {
+                run.swr = OpenBenchDownmixer(bench, mix);
+                if (run.swr == NULL)
+                {
+                    report << bench.name << ": cannot open swresample\n";
+                    continue;
+                }
+            }
+
+            BenchResult res = TimeRuns(RunAudioDownmix, &run, (double)dwSamples,
+                (dwSamples + dwOutSamples) * sizeof(float));
+
+            swr_free(&run.swr);
+
+            if (k == 0)
+            {
+                swrUs = res.meanUs;
+            }
+
+            float maxDiff = 0;
+            for (DWORD i = 0; i < dwOutSamples; i++)
+            {
+                maxDiff = max(maxDiff, fabsf(pDst[i] - pRef[i]));
+            }
+
+            snprintf(line, sizeof(line), "%-8s %-10s %10.1f %6.1f%% %9.1f %9.2f %7.2fx %9.2g\n",
+                bench.name, names[k], res.meanUs, 100.0 * res.stddevUs / res.meanUs,
+                dwSamples / res.meanUs, res.cyclesPerPixel,
+                swrUs > 0 ? swrUs / res.meanUs : 0.0, maxDiff);
+            report << line;
+            OutputDebugStringA(line);
+        }
+
+        _aligned_free(pSrc);
+        _aligned_free(pRef);
+        _aligned_free(pDst);
+    }
+
+    report << "\n";
+}
+
+
+// Conversions of the resampler profiles, stereo float to S16. The
+// drift row resamples at the same rate with the largest correction of
+// /drift, which is what drift compensation costs a 48 kHz device.
+struct ResampleBench
+{
+    const char  *name;
+    int         inRate;
+    int         outRate;
+    double      compensationPpm;
+};
+
+static const ResampleBench g_AudioBenchResample[] =
+{
+    { "44.1->48",   44100,  48000,  0 },
+    { "48->44.1",   48000,  44100,  0 },
+    { "48 drift",   48000,  48000,  1000 }
+};
+
+const int AUDIO_BENCH_RESAMPLE_CHANNELS = 2;
+
+struct AudioResampleRun
+{
+    SwrContext      *swr;
+    INT16           *pDst;
+    int             dstSamples;     // Per channel.
+    const float     *pSrc;
+    int             inRate;
+    int             compensation;   // Samples per second.
+};
+
+// Resamples one second.
+static void RunAudioResample(void *ctx)
+{
+    const AudioResampleRun *run = (const AudioResampleRun*)ctx;
+    int written = 0;
+
+    if (run->compensation)
+    {
+        swr_set_compensation(run->swr, run->compensation, run->dstSamples);
+    }
+
+    for (int i = 0; i < run->inRate; i += AUDIO_BENCH_FRAME)
+    {
+        int count = min(AUDIO_BENCH_FRAME, run->inRate - i);
+        const float *pSrc = run->pSrc + i * AUDIO_BENCH_RESAMPLE_CHANNELS;
+        INT16 *pDst = run->pDst + written * AUDIO_BENCH_RESAMPLE_CHANNELS;
+
+        int ret = swr_convert(run->swr, (uint8_t **)&pDst, run->dstSamples - written,
+            (const uint8_t **)&pSrc, count);
+        if (ret > 0)
+        {
+            written += ret;
+        }
+    }
+}
+
+static SwrContext * OpenBenchProfile(const ResampleBench &bench, RESAMPLE_PROFILE profile)
+{
+    int64_t layout = av_get_default_channel_layout(AUDIO_BENCH_RESAMPLE_CHANNELS);
+
+    SwrContext *swr = swr_alloc_set_opts(NULL,
+        layout, AV_SAMPLE_FMT_S16, bench.outRate,
+        layout, AV_SAMPLE_FMT_FLT, bench.inRate, 0, NULL);
+
+    if (swr)
+    {
+        ApplyResampleProfile(swr, profile);
+
+        if (bench.compensationPpm > 0)
+        {
+            av_opt_set_int(swr, "flags", SWR_FLAG_RESAMPLE, 0);
+        }
+    }
+
+    if (swr && swr_init(swr) < 0)
+    {
+        swr_free(&swr);
+    }
+
+    return swr;
+}
+
+// Times every profile of g_ResampleProfiles. The delay is the input
+// swresample holds after a second of audio, which the filter adds to
+// the latency of the recording.
+static void ReportResampleProfiles(std::ofstream &report)
+{
+    char line[256];
+    snprintf(line, sizeof(line), "Resampler profiles, %d channels, float to S16, %d samples per call, 1 s per run. "
+        "Time per second of audio; rates per input sample; delay added.\n\n"
+        "%-10s %-8s %10s %7s %9s %9s %9s\n",
+        AUDIO_BENCH_RESAMPLE_CHANNELS, AUDIO_BENCH_FRAME,
+        "rate", "profile", "us", "stddev", "Msmp/s", "cyc/smp", "delay ms");
+    report << line;
+    OutputDebugStringA(line);
+
+    for (DWORD r = 0; r < ARRAYSIZE(g_AudioBenchResample); r++)
+    {
+        const ResampleBench &bench = g_AudioBenchResample[r];
+
+        DWORD dwSamples = (DWORD)bench.inRate * AUDIO_BENCH_RESAMPLE_CHANNELS;
+        int dstSamples = bench.outRate + bench.outRate / 100;
+
+        float *pSrc = (float*)_aligned_malloc(dwSamples * sizeof(float), 64);
+        INT16 *pDst = (INT16*)_aligned_malloc(dstSamples * AUDIO_BENCH_RESAMPLE_CHANNELS * sizeof(INT16), 64);
+
+        if (pSrc == NULL || pDst == NULL)
+        {
+            _aligned_free(pSrc);
+            _aligned_free(pDst);
+            continue;
+        }
+
+        // A 1 kHz tone: noise would be cut by the filter as well.
+        for (DWORD i = 0; i < dwSamples; i++)
+        {
+            pSrc[i] = 0.5f * (float)sin(2 * M_PI * 1000 * (i / AUDIO_BENCH_RESAMPLE_CHANNELS) / bench.inRate);
+        }
+
+        for (int p = 0; p < RESAMPLE_PROFILE_COUNT; p++)
+        {
+            const char *name = g_ResampleProfiles[p].name;
+
+            AudioResampleRun run = { OpenBenchProfile(bench, (RESAMPLE_PROFILE)p), pDst, dstSamples, pSrc,
+                bench.inRate, (int)(bench.outRate * bench.compensationPpm / 1000000) };
+
+            if (run.swr == NULL)
+            {
+                snprintf(line, sizeof(line), "%-10s %-8s cannot open swresample\n", bench.name, name);
+                report << line;
+                OutputDebugStringA(line);
+                continue;
+            }
+
+            BenchResult res = TimeRuns(RunAudioResample, &run, (double)dwSamples,
+                dwSamples * sizeof(float) + bench.outRate * AUDIO_BENCH_RESAMPLE_CHANNELS * sizeof(INT16));
+
+            double delayMs = swr_get_delay(run.swr, 1000000) / 1000.0;
+
+            swr_free(&run.swr);
+
+            snprintf(line, sizeof(line), "%-10s %-8s %10.1f %6.1f%% %9.1f %9.2f %9.2f\n",
+                bench.name, name, res.meanUs, 100.0 * res.stddevUs / res.meanUs,
+                dwSamples / res.meanUs, res.cyclesPerPixel, delayMs);
+            report << line;
+            OutputDebugStringA(line);
+        }
+
+        _aligned_free(pSrc);
+        _aligned_free(pDst);
+    }
+
+    report << "\n";
+}
+
+
+//-------------------------------------------------------------------
+// RunAudioBenchmark
+//-------------------------------------------------------------------
+
+HRESULT RunAudioBenchmark(const char *pszReport)
+{
+    std::ofstream report(pszReport);
+    if (!report)
+    {
+        return E_FAIL;
+    }
+
+    struct AudioVariant
+    {
+        const char          *name;
+        AUDIO_CONVERT_FN    fn;
+        BOOL                bDither;
+    };
+
+    const AudioVariant variants[] =
+    {
+        { "swr",        NULL,                   FALSE },
+        { "swr-tpdf",   NULL,                   TRUE },
+        { "C",          ConvertFloatToS16_C,    FALSE },
+        { "C-tpdf",     ConvertFloatToS16_C,    TRUE },
+        { "SSE2",       ConvertFloatToS16_SSE2, FALSE },
+        { "SSE2-tpdf",  ConvertFloatToS16_SSE2, TRUE }
+    };
+
+    BOOL bSSE2 = (av_get_cpu_flags() & AV_CPU_FLAG_SSE2) != 0;
+
+    char line[256];
+    snprintf(line, sizeof(line), "Float to S16, %d Hz, %d samples per call, 1 s per run. "
+        "Time per second of audio; speed against swr; largest difference from swr without dither.\n\n"
+        "%-4s %-10s %10s %7s %9s %9s %8s %7s\n",
+        AUDIO_BENCH_RATE, AUDIO_BENCH_FRAME,
+        "ch", "kernel", "us", "stddev", "Msmp/s", "cyc/smp", "speedup", "maxdiff");
+    report << line;
+    OutputDebugStringA(line);
+
+    for (DWORD c = 0; c < ARRAYSIZE(g_AudioBenchChannels); c++)
+    {
+        int channels = g_AudioBenchChannels[c];
+        DWORD dwSamples = (DWORD)AUDIO_BENCH_RATE * channels;
+
+        float *pSrc = (float*)_aligned_malloc(dwSamples * sizeof(float), 64);
+        INT16 *pRef = (INT16*)_aligned_malloc(dwSamples * sizeof(INT16), 64);
+        INT16 *pDst = (INT16*)_aligned_malloc(dwSamples * sizeof(INT16), 64);
+
+        if (pSrc == NULL || pRef == NULL || pDst == NULL)
+        {
+            _aligned_free(pSrc);
+            _aligned_free(pRef);
+            _aligned_free(pDst);
+            continue;
+        }
+
+        // A little past full scale, so that the saturation is timed too.
+        UINT32 seed = 12345 + channels;
+        for (DWORD i = 0; i < dwSamples; i++)
+        {
+            seed = seed * 1664525 + 1013904223;
+            pSrc[i] = ((float)(seed >> 8) / (float)(1 << 24) * 2.0f - 1.0f) * 1.05f;
+        }
+
+        double swrUs = 0;
+
+        for (DWORD v = 0; v < ARRAYSIZE(variants); v++)
+        {
+            const AudioVariant &variant = variants[v];
+
+            if (variant.fn == ConvertFloatToS16_SSE2 && !bSSE2)
+            {
+                continue;
+            }
+
+            AudioDither dither;
+            InitAudioDither(&dither, channels);
+
+            AudioConvertRun run = { variant.fn, NULL, variant.bDither ? &dither : NULL, pDst, pSrc, channels };
+
+            if (variant.fn == NULL)
+            {
+                run.swr = OpenBenchResampler(channels, variant.bDither);
+                if (run.swr == NULL)
+                {
+                    report << channels << " ch: cannot open swresample\n";
+                    continue;
+                }
+            }
+
+            BenchResult res = TimeRuns(RunAudioConvert, &run, (double)dwSamples,
+                dwSamples * (sizeof(float) + sizeof(INT16)));
+
+            swr_free(&run.swr);
+
+            if (v == 0)
+            {
+                swrUs = res.meanUs;
+            }
+
+            // The last run of the undithered swr is the reference.
+            int maxDiff = 0;
+            if (variant.fn == NULL && !variant.bDither)
+            {
+                memcpy(pRef, pDst, dwSamples * sizeof(INT16));
+            }
+            for (DWORD i = 0; i < dwSamples && !variant.bDither; i++)
+            {
+                maxDiff = max(maxDiff, abs(pDst[i] - pRef[i]));
+            }
+
+            char diff[16];
+            snprintf(diff, sizeof(diff), variant.bDither ? "-" : "%d", maxDiff);
+
+            snprintf(line, sizeof(line), "%-4d %-10s %10.1f %6.1f%% %9.1f %9.2f %7.2fx %7s\n",
+                channels, variant.name, res.meanUs, 100.0 * res.stddevUs / res.meanUs,
+                dwSamples / res.meanUs, res.cyclesPerPixel,
+                swrUs > 0 ? swrUs / res.meanUs : 0.0, diff);
+            report << line;
+            OutputDebugStringA(line);
+        }
+
+        report << "\n";
+
+        _aligned_free(pSrc);
+        _aligned_free(pRef);
+        _aligned_free(pDst);
+    }
+
+    ReportAudioDownmix(report);
+    ReportResampleProfiles(report);
+
+    report.close();
+    return S_OK;
+}
@@ -0,0 +1,45 @@
+//////////////////////////////////////////////////////////////////////////
+//
+// benchmark.h: Benchmark and correctness check for the frame
+// conversion functions.
+//
+//////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+// Runs every entry of g_FormatConversions on synthetic frames and writes
+// the results to pszReport, followed by SliceScaler timings for each
+// pool size. Needs neither a Direct3D device nor a camera;
+// start the application with /benchmark to run it.
+
+HRESULT RunConverterBenchmark(const char *pszReport);
+
+// Checks every entry of g_FormatConversions against a double-precision
+// reference and against sws_scale, on random and edge-case images,
+// checks that SliceScaler bands match a single context, and compares kernel timings with the baseline in pszBaseline (created on
+// the first run). Returns S_FALSE if a check fails. Start the
+// application with /verify to run it.
+
+HRESULT RunConverterVerify(const char *pszReport, const char *pszBaseline);
+
+// Encodes synthetic frames with every entry of g_EncodeProfiles and
+// writes the latency from the arrival of each frame to its packet to
+// pszReport. Start the application with /latency to run it.
+
+HRESULT RunEncoderLatency(const char *pszReport);
+
+// Encodes synthetic frames as the renditions of g_SimulcastLadder, as a
+// ladder and as independent pipelines, and writes the CPU time of each
+// and the IDR frames of every rung to pszReport. Start the application
+// with /ladder to run it.
+
+HRESULT RunSimulcastBenchmark(const char *pszReport);
+
+// Times the float to S16 conversion of the audio encoder input with
+// swresample and with each audioconvert kernel, with and without
+// dither, at 48 kHz for 2, 6 and 8 channels, then the downmix kernels
+// against swresample and the CPU time and delay of every resampler
+// profile, and writes the results to pszReport. Start the application
+// with /audiobench to run it.
+
+HRESULT RunAudioBenchmark(const char *pszReport);
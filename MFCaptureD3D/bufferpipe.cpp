@@ -3,7 +3,7 @@
 #include <stdlib.h>
 #include <string.h>
 
-#include <pthread.h>
+#include <atomic>
 
 #include "bufferpipe.h"
 
@@ -20,25 +20,23 @@ public:
 
 	uint32_t Write(const void * data, uint32_t len);
 	uint32_t Read(void * data, uint32_t len);
+	uint32_t GetLength();
 
 private:
 	void Init();
 	void Uninit();
 
 private:
-	bool created = false;
+	char * head = NULL;
+	uint32_t size = 0;
 
-	void * head;
-	void * tail;
-	uint32_t size;
-	uint32_t length;
+	// Bytes written and read so far, modulo 2^32. Only the writer stores
+	// wpos and only the reader rpos; the release store of one makes the
+	// bytes it covers visible to the other side.
+	std::atomic<uint32_t> wpos;
+	std::atomic<uint32_t> rpos;
 
-	void * rptr;
-	void * wptr;
-
-	uint32_t flag;
-
-	pthread_mutex_t mutex;
+	uint32_t flag = 0;
 };
 
 
@@ -69,87 +67,77 @@ BufferPipeImpl::~BufferPipeImpl()
 
 void BufferPipeImpl::Init()
 {
-	pthread_mutex_init(&mutex, NULL);
+	wpos.store(0);
+	rpos.store(0);
 }
 
 
 void BufferPipeImpl::Uninit()
 {
-	pthread_mutex_destroy(&mutex);
+	free(head);
+	head = NULL;
+	size = 0;
 }
 
 
 void BufferPipeImpl::Create(uint32_t _size, uint32_t _flag)
 {
-	if (_size <= 0)
+	if (_size <= 0 || _size > 0x80000000 || head != NULL)
 	{
 		return;
 	}
-	pthread_mutex_lock(&mutex);
-	if (!created)
+
+	// A power of two, so that the offsets stay right when the positions
+	// wrap around.
+	uint32_t bytes = 1;
+	while (bytes < _size)
+	{
+		bytes <<= 1;
+	}
+
+	head = (char *)malloc(bytes);
+	if (head)
 	{
-		this->head = malloc(_size);
-		if (this->head==NULL)
-		{
-			goto failed;
-		}
-		this->tail = (char *)this->head + _size;
-		this->size = _size;
-		this->length = 0;
-		this->rptr = this->wptr = this->head;
-		this->flag = _flag;
-		this->created = true;
+		size = bytes;
 	}
-failed:
-	pthread_mutex_unlock(&mutex);
+	flag = _flag;
 }
 
 
 void BufferPipeImpl::Destory()
 {
-	pthread_mutex_lock(&mutex);
-	if (created)
-	{
-		free(this->head);
-		this->created = false;
-	}
-	pthread_mutex_unlock(&mutex);
-
 	delete this;
 }
 
 
 uint32_t BufferPipeImpl::Write(const void * data, uint32_t len)
 {
-	if (data==NULL || len<=0)
+	if (data == NULL || len <= 0 || head == NULL)
 	{
 		return 0;
 	}
 
-	pthread_mutex_lock(&mutex);
-	if (created)
+	uint32_t w = wpos.load(std::memory_order_relaxed);
+	uint32_t r = rpos.load(std::memory_order_acquire);
+
+	if (len > size - (w - r))
+	{
+		return 0;
+	}
+
+	uint32_t offset = w & (size - 1);
+	uint32_t taillen = size - offset;
+	if (len > taillen)
+	{
+		memcpy(head + offset, data, taillen);
+		memcpy(head, (const char *)data + taillen, len - taillen);
+	}
+	else
 	{
-		if (len > this->size - this->length)
-		{
-			pthread_mutex_unlock(&mutex);
-			return 0;
-		}
-
-		uint32_t taillen = (char*)this->tail - (char*)this->wptr;
-		if (len > taillen)
-		{
-			memcpy(this->wptr, data, taillen);
-			memcpy(this->head, &((char*)data)[taillen], len - taillen);
-			this->wptr = (char *)this->head + (len - taillen);
-		}
-		else
-		{
-			memcpy(this->wptr, data, len);
-			this->wptr = (char *)this->wptr + len;
-		}
-		this->length += len;
+		memcpy(head + offset, data, len);
 	}
-	pthread_mutex_unlock(&mutex);
+
+	wpos.store(w + len, std::memory_order_release);
 
 	return len;
 }
@@ -157,35 +145,38 @@ uint32_t BufferPipeImpl::Write(const void * data, uint32_t len)
 
 uint32_t BufferPipeImpl::Read(void * data, uint32_t len)
 {
-	if (data == NULL || len <= 0)
+	if (data == NULL || len <= 0 || head == NULL)
 	{
 		return 0;
 	}
 
-	pthread_mutex_lock(&mutex);
-	if (created)
+	uint32_t r = rpos.load(std::memory_order_relaxed);
+	uint32_t w = wpos.load(std::memory_order_acquire);
+
+	if (len > w - r)
 	{
-		if (len > this->length)
-		{
-			pthread_mutex_unlock(&mutex);
-			return 0;
-		}
-
-		uint32_t taillen = (char*)this->tail - (char*)this->rptr;
-		if (len > taillen)
-		{
-			memcpy(data, this->rptr, taillen);
-			memcpy(&((char*)data)[taillen], this->head, len - taillen);
-			this->rptr = (char *)this->head + (len - taillen);
-		}
-		else 
-		{
-			memcpy(data, this->rptr, len);
-			this->rptr = (char*)this->rptr + len;
-		}
-		this->length -= len;
+		return 0;
 	}
-	pthread_mutex_unlock(&mutex);
+
+	uint32_t offset = r & (size - 1);
+	uint32_t taillen = size - offset;
+	if (len > taillen)
+	{
+		memcpy(data, head + offset, taillen);
+		memcpy((char *)data + taillen, head, len - taillen);
+	}
+	else
+	{
+		memcpy(data, head + offset, len);
+	}
+
+	rpos.store(r + len, std::memory_order_release);
 
 	return len;
-}
\ No newline at end of file
+}
+
+
+uint32_t BufferPipeImpl::GetLength()
+{
+	return wpos.load(std::memory_order_acquire) - rpos.load(std::memory_order_acquire);
+}
@@ -1,5 +1,12 @@
 #pragma once
 
+// A byte ring between one writer thread and one reader thread, without
+// locks: each side only moves its own position, so Write() never waits
+// for Read() and the other way round. Neither may be called from two
+// threads at once.
+//
+// Write() and Read() move len bytes or nothing. The size is rounded up
+// to a power of two.
 class BufferPipe
 {
 
@@ -8,8 +15,13 @@ public:
 	static BufferPipe * Create(uint32_t _size, uint32_t _flag);
 	virtual void Destory() = 0;
 
+	// Returns len, or 0 if there is no room for all of it.
 	virtual uint32_t Write(const void * data, uint32_t len) = 0;
+
+	// Returns len, or 0 if fewer bytes are there.
 	virtual uint32_t Read(void * data, uint32_t len) = 0;
 
-};
+	// Bytes that Read() can take; more may arrive meanwhile.
+	virtual uint32_t GetLength() = 0;
 
+};
@@ -15,13 +15,21 @@
 
 const DWORD NUM_BACK_BUFFERS = 2;
 
+// Frames smaller than this are converted on the calling thread only.
+const DWORD MIN_PARALLEL_PIXELS = 1280 * 720;
+
+// Upper bound for the conversion worker pool.
+const DWORD MAX_CONVERT_THREADS = 8;
+
 void TransformImage_RGB24(
     BYTE*       pDest,
     LONG        lDestStride,
     const BYTE* pSrc,
     LONG        lSrcStride,
     DWORD       dwWidthInPixels,
-    DWORD       dwHeightInPixels
+    DWORD       dwHeightInPixels,
+    DWORD       dwStartRow,
+    DWORD       dwEndRow
     );
 
 void TransformImage_RGB32(
@@ -30,34 +38,45 @@ void TransformImage_RGB32(
     const BYTE* pSrc,
     LONG        lSrcStride,
     DWORD       dwWidthInPixels,
-    DWORD       dwHeightInPixels
+    DWORD       dwHeightInPixels,
+    DWORD       dwStartRow,
+    DWORD       dwEndRow
     );
 
+template <int Matrix, int Range>
 void TransformImage_YUY2(
     BYTE*       pDest,
     LONG        lDestStride,
     const BYTE* pSrc,
     LONG        lSrcStride,
     DWORD       dwWidthInPixels,
-    DWORD       dwHeightInPixels
+    DWORD       dwHeightInPixels,
+    DWORD       dwStartRow,
+    DWORD       dwEndRow
     );
 
+template <int Matrix, int Range>
 void TransformImage_I420(
     BYTE* pDst,
     LONG dstStride,
     const BYTE* pSrc,
     LONG srcStride,
     DWORD dwWidthInPixels,
-    DWORD dwHeightInPixels
+    DWORD dwHeightInPixels,
+    DWORD dwStartRow,
+    DWORD dwEndRow
     );
 
+template <int Matrix, int Range>
 void TransformImage_NV12(
     BYTE* pDst, 
     LONG dstStride, 
     const BYTE* pSrc, 
     LONG srcStride,
     DWORD dwWidthInPixels,
-    DWORD dwHeightInPixels
+    DWORD dwHeightInPixels,
+    DWORD dwStartRow,
+    DWORD dwEndRow
     );
 
 
@@ -77,24 +96,57 @@ inline LONG Height(const RECT& r)
 }
 
 
+template <int Matrix, int Range, class Format>
+void ScaleImage(
+    BYTE*       pDest,
+    LONG        lDestStride,
+    DWORD       dwDestWidth,
+    DWORD       dwDestHeight,
+    const BYTE* pSrc,
+    LONG        lSrcStride,
+    DWORD       dwWidthInPixels,
+    DWORD       dwHeightInPixels,
+    DWORD       dwStartRow,
+    DWORD       dwEndRow,
+    const DWORD* pBoxX,
+    int*        pSum
+    );
+
+struct FormatRGB32;
+struct FormatRGB24;
+struct FormatYUY2;
+struct FormatI420;
+struct FormatNV12;
+
+
 // Static table of output formats and conversion functions.
-struct ConversionFunction
-{
-    GUID               subtype;
-    IMAGE_TRANSFORM_FN xform;
-};
+
+#define RGB_TRANSFORMS(fn) \
+    { { fn, fn }, { fn, fn } }
+
+#define YUV_TRANSFORMS(fn) \
+    { { fn<YUV_MATRIX_BT601, YUV_RANGE_LIMITED>, fn<YUV_MATRIX_BT601, YUV_RANGE_FULL> }, \
+      { fn<YUV_MATRIX_BT709, YUV_RANGE_LIMITED>, fn<YUV_MATRIX_BT709, YUV_RANGE_FULL> } }
+
+#define RGB_SCALERS(format) \
+    { { ScaleImage<YUV_MATRIX_BT601, YUV_RANGE_LIMITED, format>, ScaleImage<YUV_MATRIX_BT601, YUV_RANGE_LIMITED, format> }, \
+      { ScaleImage<YUV_MATRIX_BT601, YUV_RANGE_LIMITED, format>, ScaleImage<YUV_MATRIX_BT601, YUV_RANGE_LIMITED, format> } }
+
+#define YUV_SCALERS(format) \
+    { { ScaleImage<YUV_MATRIX_BT601, YUV_RANGE_LIMITED, format>, ScaleImage<YUV_MATRIX_BT601, YUV_RANGE_FULL, format> }, \
+      { ScaleImage<YUV_MATRIX_BT709, YUV_RANGE_LIMITED, format>, ScaleImage<YUV_MATRIX_BT709, YUV_RANGE_FULL, format> } }
 
 
 ConversionFunction   g_FormatConversions[] =
 {
-    { MFVideoFormat_RGB32, TransformImage_RGB32 },
-    { MFVideoFormat_RGB24, TransformImage_RGB24 },
-    { MFVideoFormat_YUY2,  TransformImage_YUY2  },
-    { MFVideoFormat_I420,  TransformImage_I420  },
-    { MFVideoFormat_NV12,  TransformImage_NV12  }
+    { MFVideoFormat_RGB32, RGB_TRANSFORMS(TransformImage_RGB32), RGB_SCALERS(FormatRGB32), 1 },
+    { MFVideoFormat_RGB24, RGB_TRANSFORMS(TransformImage_RGB24), RGB_SCALERS(FormatRGB24), 1 },
+    { MFVideoFormat_YUY2,  YUV_TRANSFORMS(TransformImage_YUY2),  YUV_SCALERS(FormatYUY2),  1 },
+    { MFVideoFormat_I420,  YUV_TRANSFORMS(TransformImage_I420),  YUV_SCALERS(FormatI420),  2 },
+    { MFVideoFormat_NV12,  YUV_TRANSFORMS(TransformImage_NV12),  YUV_SCALERS(FormatNV12),  2 }
 };
 
-const DWORD   g_cFormats = ARRAYSIZE(g_FormatConversions);
+extern const DWORD g_cFormats = ARRAYSIZE(g_FormatConversions);
 
 
 //-------------------------------------------------------------------
@@ -110,12 +162,25 @@ DrawDevice::DrawDevice() :
     m_width(0),
     m_height(0),
     m_lDefaultStride(0),
+    m_surfaceWidth(0),
+    m_surfaceHeight(0),
     m_interlace(MFVideoInterlace_Unknown),
-    m_convertFn(NULL)
+    m_convertFn(NULL),
+    m_convertRowAlign(1),
+    m_scaleFn(NULL),
+    m_yuvMatrix(YUV_MATRIX_BT601),
+    m_yuvRange(YUV_RANGE_LIMITED),
+    m_pWorkerPool(NULL)
 {
     m_PixelAR.Denominator = m_PixelAR.Numerator = 1; 
 
     ZeroMemory(&m_d3dpp, sizeof(m_d3dpp));
+    ZeroMemory(&m_scaleTable, sizeof(m_scaleTable));
+
+    SYSTEM_INFO si;
+    GetSystemInfo(&si);
+
+    m_pWorkerPool = WorkerPool::Create(min(si.dwNumberOfProcessors, MAX_CONVERT_THREADS));
 }
 
 
@@ -126,6 +191,14 @@ DrawDevice::DrawDevice() :
 DrawDevice::~DrawDevice()
 {
     DestroyDevice();
+
+    if (m_pWorkerPool)
+    {
+        m_pWorkerPool->Destory();
+        m_pWorkerPool = NULL;
+    }
+
+    FreeScaleTable(&m_scaleTable);
 }
 
 
@@ -240,10 +313,11 @@ done:
 //-------------------------------------------------------------------
 // SetConversionFunction
 //
-// Set the conversion function for the specified video format.
+// Set the conversion function for the specified video format,
+// color matrix and nominal range.
 //-------------------------------------------------------------------
 
-HRESULT DrawDevice::SetConversionFunction(REFGUID subtype)
+HRESULT DrawDevice::SetConversionFunction(REFGUID subtype, YUV_MATRIX matrix, YUV_RANGE range)
 {
     m_convertFn = NULL;
 
@@ -251,7 +325,9 @@ HRESULT DrawDevice::SetConversionFunction(REFGUID subtype)
     {
         if (g_FormatConversions[i].subtype == subtype)
         {
-            m_convertFn = g_FormatConversions[i].xform;
+            m_convertFn = g_FormatConversions[i].xform[matrix][range];
+            m_convertRowAlign = g_FormatConversions[i].rowAlign;
+            m_scaleFn = g_FormatConversions[i].scale[matrix][range];
             return S_OK;
         }
     }
@@ -277,10 +353,34 @@ HRESULT DrawDevice::SetVideoType(IMFMediaType *pType)
 
     if (FAILED(hr)) { goto done; }
 
+    // Get the YUV color matrix and nominal range.
+    // Default: BT.601, limited range (16-235).
+
+    switch (MFGetAttributeUINT32(pType, MF_MT_YUV_MATRIX, MFVideoTransferMatrix_Unknown))
+    {
+    case MFVideoTransferMatrix_BT709:
+    case MFVideoTransferMatrix_SMPTE240M:
+        m_yuvMatrix = YUV_MATRIX_BT709;
+        break;
+
+    default:
+        m_yuvMatrix = YUV_MATRIX_BT601;
+        break;
+    }
+
+    if (MFGetAttributeUINT32(pType, MF_MT_VIDEO_NOMINAL_RANGE, MFNominalRange_Unknown) == MFNominalRange_0_255)
+    {
+        m_yuvRange = YUV_RANGE_FULL;
+    }
+    else
+    {
+        m_yuvRange = YUV_RANGE_LIMITED;
+    }
+
     // Choose a conversion function.
     // (This also validates the format type.)
 
-    hr = SetConversionFunction(subtype); 
+    hr = SetConversionFunction(subtype, m_yuvMatrix, m_yuvRange); 
     
     if (FAILED(hr)) { goto done; }
 
@@ -325,23 +425,23 @@ HRESULT DrawDevice::SetVideoType(IMFMediaType *pType)
 
     m_format = (D3DFORMAT)subtype.Data1;
 
+    // Update the destination rectangle for the correct
+    // aspect ratio. This also sizes the swap-chain surface.
+
+    UpdateDestinationRect();
+
     // Create Direct3D swap chains.
 
     hr = CreateSwapChains();
 
     if (FAILED(hr)) { goto done; }
 
-
-    // Update the destination rectangle for the correct
-    // aspect ratio.
-
-    UpdateDestinationRect();
-
 done:
     if (FAILED(hr))
     {
         m_format = D3DFMT_UNKNOWN;
         m_convertFn = NULL;
+        m_scaleFn = NULL;
     }
     return hr;
 }
@@ -352,6 +452,11 @@ done:
 //  Update the destination rectangle for the current window size.
 //  The destination rectangle is letterboxed to preserve the 
 //  aspect ratio of the video image.
+//
+//  When the destination is smaller than the frame in both directions,
+//  the swap-chain surface is made the size of the destination and
+//  frames are converted and downscaled in one pass, with a box table
+//  and scratch rows made here, one per stripe of the worker pool.
 //-------------------------------------------------------------------
 
 void DrawDevice::UpdateDestinationRect()
@@ -364,6 +469,22 @@ void DrawDevice::UpdateDestinationRect()
     rcSrc = CorrectAspectRatio(rcSrc, m_PixelAR);
 
     m_rcDest = LetterBoxRect(rcSrc, rcClient);
+
+    DWORD cStripes = m_pWorkerPool ? m_pWorkerPool->GetThreadCount() : 1;
+
+    if (m_scaleFn &&
+        Width(m_rcDest) > 0 && (UINT)Width(m_rcDest) < m_width &&
+        Height(m_rcDest) > 0 && (UINT)Height(m_rcDest) < m_height &&
+        SUCCEEDED(InitScaleTable(&m_scaleTable, Width(m_rcDest), m_width, cStripes)))
+    {
+        m_surfaceWidth = Width(m_rcDest);
+        m_surfaceHeight = Height(m_rcDest);
+    }
+    else
+    {
+        m_surfaceWidth = m_width;
+        m_surfaceHeight = m_height;
+    }
 }
 
 
@@ -381,8 +502,8 @@ HRESULT DrawDevice::CreateSwapChains()
 
     SafeRelease(&m_pSwapChain);
 
-    pp.BackBufferWidth  = m_width;
-    pp.BackBufferHeight = m_height;
+    pp.BackBufferWidth  = m_surfaceWidth;
+    pp.BackBufferHeight = m_surfaceHeight;
     pp.Windowed = TRUE;
     pp.SwapEffect = D3DSWAPEFFECT_FLIP;
     pp.hDeviceWindow = m_hwnd;
@@ -440,15 +561,53 @@ HRESULT DrawDevice::DrawFrame(BYTE * data, LONG lStride)
 
 
     // Convert the frame. This also copies it to the Direct3D surface.
-    
-    m_convertFn(
-        (BYTE*)lr.pBits,
-        lr.Pitch,
-		data,
-        lStride,
-        m_width,
-        m_height
-        );
+    // Large frames are split into row stripes and converted in parallel.
+
+    if (m_surfaceWidth != m_width || m_surfaceHeight != m_height)
+    {
+        // The preview is smaller than the frame: convert and downscale
+        // in one pass, producing only the destination-size image.
+        ScaleImage_Parallel(
+            m_pWorkerPool,
+            m_scaleFn,
+            &m_scaleTable,
+            (BYTE*)lr.pBits,
+            lr.Pitch,
+            m_surfaceWidth,
+            m_surfaceHeight,
+            data,
+            lStride,
+            m_width,
+            m_height
+            );
+    }
+    else if (m_pWorkerPool && m_width * m_height >= MIN_PARALLEL_PIXELS)
+    {
+        TransformImage_Parallel(
+            m_pWorkerPool,
+            m_convertFn,
+            m_convertRowAlign,
+            (BYTE*)lr.pBits,
+            lr.Pitch,
+            data,
+            lStride,
+            m_width,
+            m_height
+            );
+    }
+    else
+    {
+        m_convertFn(
+            (BYTE*)lr.pBits,
+            lr.Pitch,
+            data,
+            lStride,
+            m_width,
+            m_height,
+            0,
+            m_height
+            );
+    }
 
     hr = pSurf->UnlockRect();
 
@@ -532,6 +691,10 @@ HRESULT DrawDevice::ResetDevice()
 {
     HRESULT hr = S_OK;
 
+    // The swap chain must be released before the device is reset. It is
+    // recreated below, sized for the new destination rectangle.
+    SafeRelease(&m_pSwapChain);
+
     if (m_pDevice)
     {
         D3DPRESENT_PARAMETERS d3dpp = m_d3dpp;
@@ -553,11 +716,11 @@ HRESULT DrawDevice::ResetDevice()
 
     if ((m_pSwapChain == NULL) && (m_format != D3DFMT_UNKNOWN))
     {
+        UpdateDestinationRect();
+
         hr = CreateSwapChains();
         
         if (FAILED(hr)) { goto done; }
-
-        UpdateDestinationRect();
     }
 
 done:
@@ -592,21 +755,54 @@ __forceinline BYTE Clip(int clr)
     return (BYTE)(clr < 0 ? 0 : ( clr > 255 ? 255 : clr ));
 }
 
+//-------------------------------------------------------------------
+// YCbCrCoefficients
+//
+// Fixed-point (x256) YCbCr -> RGB coefficients for each matrix and
+// range. The kernels are instantiated once per combination, so the
+// compiler folds these into constants.
+//-------------------------------------------------------------------
+
+template <int Matrix, int Range> struct YCbCrCoefficients;
+
+template <> struct YCbCrCoefficients<YUV_MATRIX_BT601, YUV_RANGE_LIMITED>
+{
+    enum { Offset = 16, Y = 298, RV = 409, GU = 100, GV = 208, BU = 516 };
+};
+
+template <> struct YCbCrCoefficients<YUV_MATRIX_BT601, YUV_RANGE_FULL>
+{
+    enum { Offset = 0, Y = 256, RV = 359, GU = 88, GV = 183, BU = 454 };
+};
+
+template <> struct YCbCrCoefficients<YUV_MATRIX_BT709, YUV_RANGE_LIMITED>
+{
+    enum { Offset = 16, Y = 298, RV = 459, GU = 55, GV = 136, BU = 541 };
+};
+
+template <> struct YCbCrCoefficients<YUV_MATRIX_BT709, YUV_RANGE_FULL>
+{
+    enum { Offset = 0, Y = 256, RV = 403, GU = 48, GV = 120, BU = 475 };
+};
+
+template <int Matrix, int Range>
 __forceinline RGBQUAD ConvertYCrCbToRGB(
     int y,
     int cr,
     int cb
     )
 {
+    typedef YCbCrCoefficients<Matrix, Range> K;
+
     RGBQUAD rgbq;
 
-    int c = y - 16;
+    int c = y - K::Offset;
     int d = cb - 128;
     int e = cr - 128;
 
-    rgbq.rgbRed =   Clip(( 298 * c           + 409 * e + 128) >> 8);
-    rgbq.rgbGreen = Clip(( 298 * c - 100 * d - 208 * e + 128) >> 8);
-    rgbq.rgbBlue =  Clip(( 298 * c + 516 * d           + 128) >> 8);
+    rgbq.rgbRed =   Clip(( K::Y * c             + K::RV * e + 128) >> 8);
+    rgbq.rgbGreen = Clip(( K::Y * c - K::GU * d - K::GV * e + 128) >> 8);
+    rgbq.rgbBlue =  Clip(( K::Y * c + K::BU * d             + 128) >> 8);
 
     return rgbq;
 }
@@ -624,10 +820,15 @@ void TransformImage_RGB24(
     const BYTE* pSrc,
     LONG        lSrcStride,
     DWORD       dwWidthInPixels,
-    DWORD       dwHeightInPixels
+    DWORD       dwHeightInPixels,
+    DWORD       dwStartRow,
+    DWORD       dwEndRow
     )
 {
-    for (DWORD y = 0; y < dwHeightInPixels; y++)
+    pSrc += (LONG)dwStartRow * lSrcStride;
+    pDest += (LONG)dwStartRow * lDestStride;
+
+    for (DWORD y = dwStartRow; y < dwEndRow; y++)
     {
         RGBTRIPLE *pSrcPel = (RGBTRIPLE*)pSrc;
         DWORD *pDestPel = (DWORD*)pDest;
@@ -661,10 +862,19 @@ void TransformImage_RGB32(
     const BYTE* pSrc,
     LONG        lSrcStride,
     DWORD       dwWidthInPixels,
-    DWORD       dwHeightInPixels
+    DWORD       dwHeightInPixels,
+    DWORD       dwStartRow,
+    DWORD       dwEndRow
     )
 {
-    MFCopyImage(pDest, lDestStride, pSrc, lSrcStride, dwWidthInPixels * 4, dwHeightInPixels);
+    MFCopyImage(
+        pDest + (LONG)dwStartRow * lDestStride,
+        lDestStride,
+        pSrc + (LONG)dwStartRow * lSrcStride,
+        lSrcStride,
+        dwWidthInPixels * 4,
+        dwEndRow - dwStartRow
+        );
 }
 
 //-------------------------------------------------------------------
@@ -673,21 +883,29 @@ void TransformImage_RGB32(
 // YUY2 to RGB-32
 //-------------------------------------------------------------------
 
+template <int Matrix, int Range>
 void TransformImage_YUY2(
     BYTE*       pDest,
     LONG        lDestStride,
     const BYTE* pSrc,
     LONG        lSrcStride,
     DWORD       dwWidthInPixels,
-    DWORD       dwHeightInPixels
+    DWORD       dwHeightInPixels,
+    DWORD       dwStartRow,
+    DWORD       dwEndRow
     )
 {
-    for (DWORD y = 0; y < dwHeightInPixels; y++)
+    pSrc += (LONG)dwStartRow * lSrcStride;
+    pDest += (LONG)dwStartRow * lDestStride;
+
+    for (DWORD y = dwStartRow; y < dwEndRow; y++)
     {
         RGBQUAD *pDestPel = (RGBQUAD*)pDest;
         WORD    *pSrcPel = (WORD*)pSrc;
 
-        for (DWORD x = 0; x < dwWidthInPixels; x += 2)
+        DWORD x = 0;
+
+        for (; x + 1 < dwWidthInPixels; x += 2)
         {
             // Byte order is U0 Y0 V0 Y1
 
@@ -696,8 +914,18 @@ void TransformImage_YUY2(
             int y1 = (int)LOBYTE(pSrcPel[x + 1]);
             int v0 = (int)HIBYTE(pSrcPel[x + 1]);
 
-            pDestPel[x] = ConvertYCrCbToRGB(y0, v0, u0);
-            pDestPel[x + 1] = ConvertYCrCbToRGB(y1, v0, u0);
+            pDestPel[x] = ConvertYCrCbToRGB<Matrix, Range>(y0, v0, u0);
+            pDestPel[x + 1] = ConvertYCrCbToRGB<Matrix, Range>(y1, v0, u0);
+        }
+
+        if (x < dwWidthInPixels)
+        {
+            // Odd width: the last pixel is the first half of a pair.
+            int y0 = (int)LOBYTE(pSrcPel[x]);
+            int u0 = (int)HIBYTE(pSrcPel[x]);
+            int v0 = (int)HIBYTE(pSrcPel[x + 1]);
+
+            pDestPel[x] = ConvertYCrCbToRGB<Matrix, Range>(y0, v0, u0);
         }
 
         pSrc += lSrcStride;
@@ -713,20 +941,29 @@ void TransformImage_YUY2(
 // I420 to RGB-32
 //-------------------------------------------------------------------
 
+template <int Matrix, int Range>
 void TransformImage_I420(
     BYTE* pDst,
     LONG dstStride,
     const BYTE* pSrc,
     LONG srcStride,
     DWORD dwWidthInPixels,
-    DWORD dwHeightInPixels
+    DWORD dwHeightInPixels,
+    DWORD dwStartRow,
+    DWORD dwEndRow
     )
 {
     const BYTE* lpBitsY = pSrc;
     const BYTE* lpBitsCb = lpBitsY + (dwHeightInPixels * srcStride);
     const BYTE* lpBitsCr = lpBitsCb + (dwHeightInPixels * srcStride) / 4;
 
-    for (UINT y = 0; y < dwHeightInPixels; y += 2)
+    // Move to the first row of the stripe. dwStartRow is even.
+    pDst     += (LONG)dwStartRow * dstStride;
+    lpBitsY  += (LONG)dwStartRow * srcStride;
+    lpBitsCb += (LONG)(dwStartRow / 2) * (srcStride / 2);
+    lpBitsCr += (LONG)(dwStartRow / 2) * (srcStride / 2);
+
+    for (UINT y = dwStartRow; y < dwEndRow; y += 2)
     {
         const BYTE* lpLineY1 = lpBitsY;
         const BYTE* lpLineY2 = lpBitsY + srcStride;
@@ -736,7 +973,7 @@ void TransformImage_I420(
         LPBYTE lpDibLine1 = pDst;
         LPBYTE lpDibLine2 = pDst + dstStride;
 
-        for (UINT x = 0; x < dwWidthInPixels; x += 2)
+        for (UINT x = 0; x + 1 < dwWidthInPixels; x += 2)
         {
             int  y0 = (int)lpLineY1[0];
             int  y1 = (int)lpLineY1[1];
@@ -745,25 +982,25 @@ void TransformImage_I420(
             int  cb = (int)lpLineCb[0];
             int  cr = (int)lpLineCr[0];
 
-            RGBQUAD r = ConvertYCrCbToRGB(y0, cr, cb);
+            RGBQUAD r = ConvertYCrCbToRGB<Matrix, Range>(y0, cr, cb);
             lpDibLine1[0] = r.rgbBlue;
             lpDibLine1[1] = r.rgbGreen;
             lpDibLine1[2] = r.rgbRed;
             lpDibLine1[3] = 0; // Alpha
 
-            r = ConvertYCrCbToRGB(y1, cr, cb);
+            r = ConvertYCrCbToRGB<Matrix, Range>(y1, cr, cb);
             lpDibLine1[4] = r.rgbBlue;
             lpDibLine1[5] = r.rgbGreen;
             lpDibLine1[6] = r.rgbRed;
             lpDibLine1[7] = 0; // Alpha
 
-            r = ConvertYCrCbToRGB(y2, cr, cb);
+            r = ConvertYCrCbToRGB<Matrix, Range>(y2, cr, cb);
             lpDibLine2[0] = r.rgbBlue;
             lpDibLine2[1] = r.rgbGreen;
             lpDibLine2[2] = r.rgbRed;
             lpDibLine2[3] = 0; // Alpha
 
-            r = ConvertYCrCbToRGB(y3, cr, cb);
+            r = ConvertYCrCbToRGB<Matrix, Range>(y3, cr, cb);
             lpDibLine2[4] = r.rgbBlue;
             lpDibLine2[5] = r.rgbGreen;
             lpDibLine2[6] = r.rgbRed;
@@ -778,6 +1015,25 @@ void TransformImage_I420(
             lpDibLine2 += 8;
         }
 
+        if (dwWidthInPixels & 1)
+        {
+            // Odd width: one pixel per row is left.
+            int  cb = (int)lpLineCb[0];
+            int  cr = (int)lpLineCr[0];
+
+            RGBQUAD r = ConvertYCrCbToRGB<Matrix, Range>(lpLineY1[0], cr, cb);
+            lpDibLine1[0] = r.rgbBlue;
+            lpDibLine1[1] = r.rgbGreen;
+            lpDibLine1[2] = r.rgbRed;
+            lpDibLine1[3] = 0; // Alpha
+
+            r = ConvertYCrCbToRGB<Matrix, Range>(lpLineY2[0], cr, cb);
+            lpDibLine2[0] = r.rgbBlue;
+            lpDibLine2[1] = r.rgbGreen;
+            lpDibLine2[2] = r.rgbRed;
+            lpDibLine2[3] = 0; // Alpha
+        }
+
         pDst += (2 * dstStride);
         lpBitsY += (2 * srcStride);
         lpBitsCr += srcStride / 2;
@@ -792,20 +1048,29 @@ void TransformImage_I420(
 // NV12 to RGB-32
 //-------------------------------------------------------------------
 
+template <int Matrix, int Range>
 void TransformImage_NV12(
     BYTE* pDst, 
     LONG dstStride, 
     const BYTE* pSrc, 
     LONG srcStride,
     DWORD dwWidthInPixels,
-    DWORD dwHeightInPixels
+    DWORD dwHeightInPixels,
+    DWORD dwStartRow,
+    DWORD dwEndRow
     )
 {
     const BYTE* lpBitsY = pSrc;
     const BYTE* lpBitsCb = lpBitsY  + (dwHeightInPixels * srcStride);
     const BYTE* lpBitsCr = lpBitsCb + 1;
 
-    for (UINT y = 0; y < dwHeightInPixels; y += 2)
+    // Move to the first row of the stripe. dwStartRow is even.
+    pDst     += (LONG)dwStartRow * dstStride;
+    lpBitsY  += (LONG)dwStartRow * srcStride;
+    lpBitsCb += (LONG)(dwStartRow / 2) * srcStride;
+    lpBitsCr += (LONG)(dwStartRow / 2) * srcStride;
+
+    for (UINT y = dwStartRow; y < dwEndRow; y += 2)
     {
         const BYTE* lpLineY1 = lpBitsY;
         const BYTE* lpLineY2 = lpBitsY + srcStride;
@@ -815,7 +1080,7 @@ void TransformImage_NV12(
         LPBYTE lpDibLine1 = pDst;
         LPBYTE lpDibLine2 = pDst + dstStride;
 
-        for (UINT x = 0; x < dwWidthInPixels; x += 2)
+        for (UINT x = 0; x + 1 < dwWidthInPixels; x += 2)
         {
             int  y0 = (int)lpLineY1[0];
             int  y1 = (int)lpLineY1[1];
@@ -824,25 +1089,25 @@ void TransformImage_NV12(
             int  cb = (int)lpLineCb[0];
             int  cr = (int)lpLineCr[0];
 
-            RGBQUAD r = ConvertYCrCbToRGB(y0, cr, cb);
+            RGBQUAD r = ConvertYCrCbToRGB<Matrix, Range>(y0, cr, cb);
             lpDibLine1[0] = r.rgbBlue;
             lpDibLine1[1] = r.rgbGreen;
             lpDibLine1[2] = r.rgbRed;
             lpDibLine1[3] = 0; // Alpha
 
-            r = ConvertYCrCbToRGB(y1, cr, cb);
+            r = ConvertYCrCbToRGB<Matrix, Range>(y1, cr, cb);
             lpDibLine1[4] = r.rgbBlue;
             lpDibLine1[5] = r.rgbGreen;
             lpDibLine1[6] = r.rgbRed;
             lpDibLine1[7] = 0; // Alpha
 
-            r = ConvertYCrCbToRGB(y2, cr, cb);
+            r = ConvertYCrCbToRGB<Matrix, Range>(y2, cr, cb);
             lpDibLine2[0] = r.rgbBlue;
             lpDibLine2[1] = r.rgbGreen;
             lpDibLine2[2] = r.rgbRed;
             lpDibLine2[3] = 0; // Alpha
 
-            r = ConvertYCrCbToRGB(y3, cr, cb);
+            r = ConvertYCrCbToRGB<Matrix, Range>(y3, cr, cb);
             lpDibLine2[4] = r.rgbBlue;
             lpDibLine2[5] = r.rgbGreen;
             lpDibLine2[6] = r.rgbRed;
@@ -857,6 +1122,25 @@ void TransformImage_NV12(
             lpDibLine2 += 8;
         }
 
+        if (dwWidthInPixels & 1)
+        {
+            // Odd width: one pixel per row is left.
+            int  cb = (int)lpLineCb[0];
+            int  cr = (int)lpLineCr[0];
+
+            RGBQUAD r = ConvertYCrCbToRGB<Matrix, Range>(lpLineY1[0], cr, cb);
+            lpDibLine1[0] = r.rgbBlue;
+            lpDibLine1[1] = r.rgbGreen;
+            lpDibLine1[2] = r.rgbRed;
+            lpDibLine1[3] = 0; // Alpha
+
+            r = ConvertYCrCbToRGB<Matrix, Range>(lpLineY2[0], cr, cb);
+            lpDibLine2[0] = r.rgbBlue;
+            lpDibLine2[1] = r.rgbGreen;
+            lpDibLine2[2] = r.rgbRed;
+            lpDibLine2[3] = 0; // Alpha
+        }
+
         pDst += (2 * dstStride);
         lpBitsY   += (2 * srcStride);
         lpBitsCr  += srcStride;
@@ -865,6 +1149,405 @@ void TransformImage_NV12(
 }
 
 
+//-------------------------------------------------------------------
+//
+// Fused convert-and-downscale functions
+//
+// Each destination pixel covers a box of source pixels. The source rows
+// of a destination row are summed per box, and the box average is
+// converted to RGB once. Conversion work is proportional to the
+// destination size, not to the frame size.
+//
+//-------------------------------------------------------------------
+
+//-------------------------------------------------------------------
+// Format readers
+//
+// AccumulateRow adds one source row to the per-box sums. For YUV
+// formats the sums are Y, Cb, Cr; for RGB formats they are B, G, R.
+//-------------------------------------------------------------------
+
+struct FormatRGB32
+{
+    static const bool IsYUV = false;
+
+    static __forceinline void AccumulateRow(
+        const BYTE* pSrc, LONG lSrcStride, DWORD /* dwHeight */, DWORD sy,
+        const DWORD* pBoxX, DWORD dwDestWidth, int* pSum)
+    {
+        const BYTE* row = pSrc + (LONG)sy * lSrcStride;
+
+        for (DWORD ox = 0; ox < dwDestWidth; ox++, pSum += 3)
+        {
+            for (DWORD sx = pBoxX[ox]; sx < pBoxX[ox + 1]; sx++)
+            {
+                pSum[0] += row[sx * 4 + 0];
+                pSum[1] += row[sx * 4 + 1];
+                pSum[2] += row[sx * 4 + 2];
+            }
+        }
+    }
+};
+
+struct FormatRGB24
+{
+    static const bool IsYUV = false;
+
+    static __forceinline void AccumulateRow(
+        const BYTE* pSrc, LONG lSrcStride, DWORD /* dwHeight */, DWORD sy,
+        const DWORD* pBoxX, DWORD dwDestWidth, int* pSum)
+    {
+        const BYTE* row = pSrc + (LONG)sy * lSrcStride;
+
+        for (DWORD ox = 0; ox < dwDestWidth; ox++, pSum += 3)
+        {
+            for (DWORD sx = pBoxX[ox]; sx < pBoxX[ox + 1]; sx++)
+            {
+                pSum[0] += row[sx * 3 + 0];
+                pSum[1] += row[sx * 3 + 1];
+                pSum[2] += row[sx * 3 + 2];
+            }
+        }
+    }
+};
+
+struct FormatYUY2
+{
+    static const bool IsYUV = true;
+
+    static __forceinline void AccumulateRow(
+        const BYTE* pSrc, LONG lSrcStride, DWORD /* dwHeight */, DWORD sy,
+        const DWORD* pBoxX, DWORD dwDestWidth, int* pSum)
+    {
+        const BYTE* row = pSrc + (LONG)sy * lSrcStride;
+
+        for (DWORD ox = 0; ox < dwDestWidth; ox++, pSum += 3)
+        {
+            for (DWORD sx = pBoxX[ox]; sx < pBoxX[ox + 1]; sx++)
+            {
+                // Byte order is Y0 U0 Y1 V0
+                const BYTE* pair = row + (sx & ~1) * 2;
+
+                pSum[0] += row[sx * 2];
+                pSum[1] += pair[1];
+                pSum[2] += pair[3];
+            }
+        }
+    }
+};
+
+struct FormatI420
+{
+    static const bool IsYUV = true;
+
+    static __forceinline void AccumulateRow(
+        const BYTE* pSrc, LONG lSrcStride, DWORD dwHeight, DWORD sy,
+        const DWORD* pBoxX, DWORD dwDestWidth, int* pSum)
+    {
+        const BYTE* rowY  = pSrc + (LONG)sy * lSrcStride;
+        const BYTE* rowCb = pSrc + (dwHeight * lSrcStride) + (LONG)(sy / 2) * (lSrcStride / 2);
+        const BYTE* rowCr = rowCb + (dwHeight * lSrcStride) / 4;
+
+        for (DWORD ox = 0; ox < dwDestWidth; ox++, pSum += 3)
+        {
+            for (DWORD sx = pBoxX[ox]; sx < pBoxX[ox + 1]; sx++)
+            {
+                pSum[0] += rowY[sx];
+                pSum[1] += rowCb[sx / 2];
+                pSum[2] += rowCr[sx / 2];
+            }
+        }
+    }
+};
+
+struct FormatNV12
+{
+    static const bool IsYUV = true;
+
+    static __forceinline void AccumulateRow(
+        const BYTE* pSrc, LONG lSrcStride, DWORD dwHeight, DWORD sy,
+        const DWORD* pBoxX, DWORD dwDestWidth, int* pSum)
+    {
+        const BYTE* rowY  = pSrc + (LONG)sy * lSrcStride;
+        const BYTE* rowUV = pSrc + (dwHeight * lSrcStride) + (LONG)(sy / 2) * lSrcStride;
+
+        for (DWORD ox = 0; ox < dwDestWidth; ox++, pSum += 3)
+        {
+            for (DWORD sx = pBoxX[ox]; sx < pBoxX[ox + 1]; sx++)
+            {
+                pSum[0] += rowY[sx];
+                pSum[1] += rowUV[sx & ~1];
+                pSum[2] += rowUV[(sx & ~1) + 1];
+            }
+        }
+    }
+};
+
+
+//-------------------------------------------------------------------
+// ScaleImage
+//
+// Any supported format to RGB-32, area-downsampled to the
+// destination size. The destination must not be larger than the
+// source in either direction.
+//-------------------------------------------------------------------
+
+template <int Matrix, int Range, class Format>
+void ScaleImage(
+    BYTE*       pDest,
+    LONG        lDestStride,
+    DWORD       dwDestWidth,
+    DWORD       dwDestHeight,
+    const BYTE* pSrc,
+    LONG        lSrcStride,
+    DWORD       dwWidthInPixels,
+    DWORD       dwHeightInPixels,
+    DWORD       dwStartRow,
+    DWORD       dwEndRow,
+    const DWORD* pBoxX,
+    int*        pSum
+    )
+{
+    pDest += (LONG)dwStartRow * lDestStride;
+
+    for (DWORD oy = dwStartRow; oy < dwEndRow; oy++)
+    {
+        DWORD sy0 = (DWORD)((UINT64)oy * dwHeightInPixels / dwDestHeight);
+        DWORD sy1 = (DWORD)((UINT64)(oy + 1) * dwHeightInPixels / dwDestHeight);
+
+        ZeroMemory(pSum, dwDestWidth * 3 * sizeof(int));
+
+        for (DWORD sy = sy0; sy < sy1; sy++)
+        {
+            Format::AccumulateRow(pSrc, lSrcStride, dwHeightInPixels, sy, pBoxX, dwDestWidth, pSum);
+        }
+
+        RGBQUAD *pDestPel = (RGBQUAD*)pDest;
+        const int *sum = pSum;
+
+        for (DWORD ox = 0; ox < dwDestWidth; ox++, sum += 3)
+        {
+            int n = (int)((pBoxX[ox + 1] - pBoxX[ox]) * (sy1 - sy0));
+            int half = n / 2;
+
+            if (Format::IsYUV)
+            {
+                pDestPel[ox] = ConvertYCrCbToRGB<Matrix, Range>(
+                    (sum[0] + half) / n,
+                    (sum[2] + half) / n,
+                    (sum[1] + half) / n
+                    );
+            }
+            else
+            {
+                pDestPel[ox].rgbBlue  = (BYTE)((sum[0] + half) / n);
+                pDestPel[ox].rgbGreen = (BYTE)((sum[1] + half) / n);
+                pDestPel[ox].rgbRed   = (BYTE)((sum[2] + half) / n);
+            }
+            pDestPel[ox].rgbReserved = 0;
+        }
+
+        pDest += lDestStride;
+    }
+}
+
+
+//-------------------------------------------------------------------
+// InitScaleTable
+//-------------------------------------------------------------------
+
+HRESULT InitScaleTable(ScaleTable *pTable, DWORD dwDestWidth, DWORD dwWidthInPixels, DWORD cStripes)
+{
+    if (pTable->pBoxX && pTable->dwDestWidth == dwDestWidth &&
+        pTable->dwWidthInPixels == dwWidthInPixels && pTable->cStripes == cStripes)
+    {
+        return S_OK;
+    }
+
+    FreeScaleTable(pTable);
+
+    if (dwDestWidth == 0 || cStripes == 0)
+    {
+        return E_INVALIDARG;
+    }
+
+    // Rows of whole cache lines, so that the stripes do not share one.
+    DWORD dwSumStride = (dwDestWidth * 3 + 15) & ~15;
+
+    pTable->pBoxX = (DWORD*)malloc((dwDestWidth + 1) * sizeof(DWORD));
+    pTable->pSums = (int*)_aligned_malloc((size_t)dwSumStride * cStripes * sizeof(int), 64);
+
+    if (pTable->pBoxX == NULL || pTable->pSums == NULL)
+    {
+        FreeScaleTable(pTable);
+        return E_OUTOFMEMORY;
+    }
+
+    for (DWORD ox = 0; ox <= dwDestWidth; ox++)
+    {
+        pTable->pBoxX[ox] = (DWORD)((UINT64)ox * dwWidthInPixels / dwDestWidth);
+    }
+
+    pTable->dwDestWidth = dwDestWidth;
+    pTable->dwWidthInPixels = dwWidthInPixels;
+    pTable->cStripes = cStripes;
+    pTable->dwSumStride = dwSumStride;
+
+    return S_OK;
+}
+
+
+//-------------------------------------------------------------------
+// FreeScaleTable
+//-------------------------------------------------------------------
+
+void FreeScaleTable(ScaleTable *pTable)
+{
+    free(pTable->pBoxX);
+    _aligned_free(pTable->pSums);
+
+    ZeroMemory(pTable, sizeof(*pTable));
+}
+
+
+//-------------------------------------------------------------------
+// TransformImage_Parallel
+//
+// Splits the frame into row stripes and converts them on the worker
+// pool. Works with any IMAGE_TRANSFORM_FN; returns after all stripes
+// are done.
+//-------------------------------------------------------------------
+
+struct TransformJob
+{
+    IMAGE_TRANSFORM_FN  fn;
+    BYTE*               pDest;
+    LONG                lDestStride;
+    const BYTE*         pSrc;
+    LONG                lSrcStride;
+    DWORD               dwWidthInPixels;
+    DWORD               dwHeightInPixels;
+};
+
+static void TransformStripe(void *ctx, uint32_t start, uint32_t end)
+{
+    TransformJob *job = (TransformJob*)ctx;
+
+    job->fn(
+        job->pDest,
+        job->lDestStride,
+        job->pSrc,
+        job->lSrcStride,
+        job->dwWidthInPixels,
+        job->dwHeightInPixels,
+        start,
+        end
+        );
+}
+
+void TransformImage_Parallel(
+    WorkerPool*         pPool,
+    IMAGE_TRANSFORM_FN  fn,
+    DWORD               dwRowAlign,
+    BYTE*               pDest,
+    LONG                lDestStride,
+    const BYTE*         pSrc,
+    LONG                lSrcStride,
+    DWORD               dwWidthInPixels,
+    DWORD               dwHeightInPixels
+    )
+{
+    TransformJob job = { fn, pDest, lDestStride, pSrc, lSrcStride, dwWidthInPixels, dwHeightInPixels };
+
+    if (pPool == NULL)
+    {
+        TransformStripe(&job, 0, dwHeightInPixels);
+        return;
+    }
+
+    pPool->Run(TransformStripe, &job, dwHeightInPixels, dwRowAlign);
+}
+
+
+//-------------------------------------------------------------------
+// ScaleImage_Parallel
+//
+// Splits the destination into the stripes of the table and
+// converts/downscales them on the worker pool. Each stripe sums into
+// its own row of the table.
+//-------------------------------------------------------------------
+
+struct ScaleJob
+{
+    IMAGE_SCALE_FN      fn;
+    const ScaleTable*   pTable;
+    BYTE*               pDest;
+    LONG                lDestStride;
+    DWORD               dwDestWidth;
+    DWORD               dwDestHeight;
+    const BYTE*         pSrc;
+    LONG                lSrcStride;
+    DWORD               dwWidthInPixels;
+    DWORD               dwHeightInPixels;
+};
+
+static void ScaleStripe(void *ctx, uint32_t start, uint32_t end)
+{
+    ScaleJob *job = (ScaleJob*)ctx;
+    const ScaleTable *pTable = job->pTable;
+
+    for (uint32_t i = start; i < end; i++)
+    {
+        job->fn(
+            job->pDest,
+            job->lDestStride,
+            job->dwDestWidth,
+            job->dwDestHeight,
+            job->pSrc,
+            job->lSrcStride,
+            job->dwWidthInPixels,
+            job->dwHeightInPixels,
+            (DWORD)((UINT64)i * job->dwDestHeight / pTable->cStripes),
+            (DWORD)((UINT64)(i + 1) * job->dwDestHeight / pTable->cStripes),
+            pTable->pBoxX,
+            pTable->pSums + (size_t)i * pTable->dwSumStride
+            );
+    }
+}
+
+void ScaleImage_Parallel(
+    WorkerPool*         pPool,
+    IMAGE_SCALE_FN      fn,
+    const ScaleTable*   pTable,
+    BYTE*               pDest,
+    LONG                lDestStride,
+    DWORD               dwDestWidth,
+    DWORD               dwDestHeight,
+    const BYTE*         pSrc,
+    LONG                lSrcStride,
+    DWORD               dwWidthInPixels,
+    DWORD               dwHeightInPixels
+    )
+{
+    if (pTable->pBoxX == NULL || pTable->dwDestWidth != dwDestWidth ||
+        pTable->dwWidthInPixels != dwWidthInPixels)
+    {
+        return;
+    }
+
+    ScaleJob job = { fn, pTable, pDest, lDestStride, dwDestWidth, dwDestHeight,
+                     pSrc, lSrcStride, dwWidthInPixels, dwHeightInPixels };
+
+    if (pPool == NULL)
+    {
+        ScaleStripe(&job, 0, pTable->cStripes);
+        return;
+    }
+
+    pPool->Run(ScaleStripe, &job, pTable->cStripes, 1);
+}
+
+
 //-------------------------------------------------------------------
 // LetterBoxDstRect
 //
@@ -14,7 +14,28 @@
 
 #pragma once
 
+// YCbCr -> RGB color matrix and nominal range of the source.
+
+enum YUV_MATRIX
+{
+    YUV_MATRIX_BT601,
+    YUV_MATRIX_BT709,
+    YUV_MATRIX_COUNT
+};
+
+enum YUV_RANGE
+{
+    YUV_RANGE_LIMITED,      // 16-235
+    YUV_RANGE_FULL,         // 0-255
+    YUV_RANGE_COUNT
+};
+
+
 // Function pointer for the function that transforms the image.
+//
+// pDest and pSrc always point to the first scan line of the full frame.
+// Only the rows [dwStartRow, dwEndRow) are converted, so that a frame can
+// be split into stripes and converted on several threads.
 
 typedef void (*IMAGE_TRANSFORM_FN)(
     BYTE*       pDest,
@@ -22,7 +43,102 @@ typedef void (*IMAGE_TRANSFORM_FN)(
     const BYTE* pSrc,
     LONG        lSrcStride,
     DWORD       dwWidthInPixels,
-    DWORD       dwHeightInPixels
+    DWORD       dwHeightInPixels,
+    DWORD       dwStartRow,
+    DWORD       dwEndRow
+    );
+
+
+// Function pointer for the function that converts the image to RGB32 and
+// downscales it in the same pass. Each destination pixel is the average of
+// the source pixels it covers, so only the destination-size image is ever
+// converted. Only the destination rows [dwStartRow, dwEndRow) are written.
+//
+// pBoxX holds the box boundaries of a ScaleTable for these widths, and
+// pSum a row of dwDestWidth * 3 sums that no other call uses meanwhile.
+
+typedef void (*IMAGE_SCALE_FN)(
+    BYTE*       pDest,
+    LONG        lDestStride,
+    DWORD       dwDestWidth,
+    DWORD       dwDestHeight,
+    const BYTE* pSrc,
+    LONG        lSrcStride,
+    DWORD       dwWidthInPixels,
+    DWORD       dwHeightInPixels,
+    DWORD       dwStartRow,
+    DWORD       dwEndRow,
+    const DWORD* pBoxX,
+    int*        pSum
+    );
+
+
+// Box boundaries along x of a scaled conversion, and one row of sums per
+// stripe. Made when the source or destination width changes, so that
+// converting a frame allocates nothing.
+
+struct ScaleTable
+{
+    DWORD       dwDestWidth;
+    DWORD       dwWidthInPixels;
+    DWORD       cStripes;
+    DWORD       dwSumStride;    // ints from one row of sums to the next.
+    DWORD       *pBoxX;         // dwDestWidth + 1 boundaries.
+    int         *pSums;         // cStripes rows.
+};
+
+// Keeps the table if it already fits. The table must be zeroed before
+// the first call.
+
+HRESULT InitScaleTable(ScaleTable *pTable, DWORD dwDestWidth, DWORD dwWidthInPixels, DWORD cStripes);
+void    FreeScaleTable(ScaleTable *pTable);
+
+
+// Static table of output formats and conversion functions.
+// YUV formats have one specialization per color matrix and range.
+
+struct ConversionFunction
+{
+    GUID               subtype;
+    IMAGE_TRANSFORM_FN xform[YUV_MATRIX_COUNT][YUV_RANGE_COUNT];
+    IMAGE_SCALE_FN     scale[YUV_MATRIX_COUNT][YUV_RANGE_COUNT];
+    DWORD              rowAlign;    // Rows per stripe must be a multiple of this.
+};
+
+extern ConversionFunction   g_FormatConversions[];
+extern const DWORD          g_cFormats;
+
+
+// Converts a whole frame, splitting it into row stripes on the worker pool.
+// dwRowAlign is the row granularity of the format (2 for 4:2:0).
+
+void TransformImage_Parallel(
+    WorkerPool*         pPool,
+    IMAGE_TRANSFORM_FN  fn,
+    DWORD               dwRowAlign,
+    BYTE*               pDest,
+    LONG                lDestStride,
+    const BYTE*         pSrc,
+    LONG                lSrcStride,
+    DWORD               dwWidthInPixels,
+    DWORD               dwHeightInPixels
+    );
+
+// Converts and downscales in pTable->cStripes stripes, each with its own
+// row of sums. The table must be made for dwDestWidth and dwWidthInPixels.
+
+void ScaleImage_Parallel(
+    WorkerPool*         pPool,
+    IMAGE_SCALE_FN      fn,
+    const ScaleTable*   pTable,
+    BYTE*               pDest,
+    LONG                lDestStride,
+    DWORD               dwDestWidth,
+    DWORD               dwDestHeight,
+    const BYTE*         pSrc,
+    LONG                lSrcStride,
+    DWORD               dwWidthInPixels,
+    DWORD               dwHeightInPixels
     );
 
 
@@ -48,14 +164,22 @@ private:
     MFRatio                 m_PixelAR;
     MFVideoInterlaceMode    m_interlace;
     RECT                    m_rcDest;       // Destination rectangle
+    UINT                    m_surfaceWidth; // Size of the swap-chain surface. Smaller
+    UINT                    m_surfaceHeight;// than the frame when it is downscaled.
 
     // Drawing
     IMAGE_TRANSFORM_FN      m_convertFn;    // Function to convert the video to RGB32
+    DWORD                   m_convertRowAlign;
+    IMAGE_SCALE_FN          m_scaleFn;      // Function to convert and downscale to RGB32
+    ScaleTable              m_scaleTable;   // For m_surfaceWidth, when it is not m_width
+    YUV_MATRIX              m_yuvMatrix;
+    YUV_RANGE               m_yuvRange;
+    WorkerPool              *m_pWorkerPool; // Threads for striped conversion
 
 private:
     
     HRESULT TestCooperativeLevel();
-    HRESULT SetConversionFunction(REFGUID subtype);
+    HRESULT SetConversionFunction(REFGUID subtype, YUV_MATRIX matrix, YUV_RANGE range);
     HRESULT CreateSwapChains();
     void    UpdateDestinationRect();
     
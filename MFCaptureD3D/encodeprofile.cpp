@@ -0,0 +1,194 @@
+//////////////////////////////////////////////////////////////////////////
+//
+// encodeprofile.cpp: H.264 encoder settings.
+//
+//////////////////////////////////////////////////////////////////////////
+
+#include "MFCaptureD3D.h"
+
+
+const EncodeProfile g_EncodeProfiles[ENCODE_PROFILE_COUNT] =
+{
+    // Frame threads and B-frames each hold frames back; the lookahead of
+    // the slow preset holds back many more.
+    { "archive",    "slow",     NULL,           1, FF_THREAD_FRAME, FALSE, 0, 2000 },
+
+    // zerolatency turns off the lookahead. Sliced threads encode every
+    // frame on all threads, intra refresh spreads the key frame over the
+    // GOP, and a VBV of one frame keeps each frame near the mean size.
+    // A frame later than a few frame times is of no use to a viewer.
+    { "lowlatency", "veryfast", "zerolatency",  0, FF_THREAD_SLICE, TRUE,  1, 150 }
+};
+
+
+const char * const g_X264Presets[] =
+{
+    "ultrafast", "superfast", "veryfast", "faster", "fast",
+    "medium", "slow", "slower", "veryslow"
+};
+
+extern const int g_cX264Presets = ARRAYSIZE(g_X264Presets);
+
+
+// The speed options of each of g_X264Presets that leave the stream
+// headers alone, as x264 sets them.
+static const struct
+{
+    const char  *me;
+    int         subme;
+    int         trellis;
+}
+g_X264Speeds[] =
+{
+    { "dia", 0, 0 }, { "dia", 1, 0 }, { "hex", 2, 0 }, { "hex", 4, 1 }, { "hex", 6, 1 },
+    { "hex", 7, 1 }, { "umh", 8, 2 }, { "umh", 9, 2 }, { "umh", 10, 2 }
+};
+
+C_ASSERT(ARRAYSIZE(g_X264Speeds) == ARRAYSIZE(g_X264Presets));
+
+
+//-------------------------------------------------------------------
+// GetX264Subme
+//
+// The subme of iPreset with the floor of iStreamPreset applied.
+//-------------------------------------------------------------------
+
+static int GetX264Subme(int iPreset, int iStreamPreset)
+{
+    int subme = g_X264Speeds[iPreset].subme;
+
+    if (g_X264Speeds[iStreamPreset].subme >= 6 && subme < 6)
+    {
+        subme = 6;
+    }
+    return subme;
+}
+
+
+const SimulcastRung g_SimulcastLadder[] =
+{
+    { 1080, 4500000 },
+    {  720, 2500000 },
+    {  360,  800000 }
+};
+
+extern const int g_cSimulcastRungs = ARRAYSIZE(g_SimulcastLadder);
+
+
+//-------------------------------------------------------------------
+// FindX264Preset
+//-------------------------------------------------------------------
+
+int FindX264Preset(const char *pszPreset)
+{
+    for (int i = 0; i < g_cX264Presets; i++)
+    {
+        if (strcmp(g_X264Presets[i], pszPreset) == 0)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+
+//-------------------------------------------------------------------
+// ApplyX264Speed
+//-------------------------------------------------------------------
+
+void ApplyX264Speed(
+    AVCodecContext  *pContext,
+    int             iPreset,
+    int             iStreamPreset
+    )
+{
+    if (iPreset < 0 || iPreset >= g_cX264Presets ||
+        iStreamPreset < 0 || iStreamPreset >= g_cX264Presets)
+    {
+        return;
+    }
+
+    char szParams[64];
+    snprintf(szParams, sizeof(szParams), "me=%s:subme=%d:trellis=%d",
+        g_X264Speeds[iPreset].me, GetX264Subme(iPreset, iStreamPreset),
+        g_X264Speeds[iPreset].trellis);
+
+    av_opt_set(pContext->priv_data, "x264-params", szParams, 0);
+}
+
+
+//-------------------------------------------------------------------
+// StepX264Speed
+//-------------------------------------------------------------------
+
+int StepX264Speed(int iPreset, int iStreamPreset, int iStep)
+{
+    if (iPreset < 0 || iPreset >= g_cX264Presets ||
+        iStreamPreset < 0 || iStreamPreset >= g_cX264Presets)
+    {
+        return -1;
+    }
+
+    for (int i = iPreset + iStep; i >= 0 && i < g_cX264Presets; i += iStep)
+    {
+        if (strcmp(g_X264Speeds[i].me, g_X264Speeds[iPreset].me) != 0 ||
+            GetX264Subme(i, iStreamPreset) != GetX264Subme(iPreset, iStreamPreset) ||
+            g_X264Speeds[i].trellis != g_X264Speeds[iPreset].trellis)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+
+//-------------------------------------------------------------------
+// ApplyEncodeProfile
+//-------------------------------------------------------------------
+
+void ApplyEncodeProfile(
+    AVCodecContext  *pContext,
+    ENCODE_PROFILE  profile,
+    int             fps,
+    int64_t         bitRate
+    )
+{
+    const EncodeProfile &p = g_EncodeProfiles[profile];
+
+    pContext->profile = FF_PROFILE_H264_HIGH;
+
+    pContext->gop_size = fps;
+    pContext->max_b_frames = p.maxBFrames;
+    pContext->thread_type = p.threadType;
+
+    av_opt_set(pContext->priv_data, "preset", p.preset, 0);
+    if (p.tune)
+    {
+        av_opt_set(pContext->priv_data, "tune", p.tune, 0);
+    }
+    if (p.bIntraRefresh)
+    {
+        av_opt_set_int(pContext->priv_data, "intra-refresh", 1, 0);
+    }
+
+    // A frame of type I is encoded as an IDR frame, where a recording
+    // can start, also with intra refresh.
+    av_opt_set_int(pContext->priv_data, "forced-idr", 1, 0);
+
+    pContext->bit_rate = bitRate;
+    pContext->bit_rate_tolerance = (int)bitRate;
+    pContext->rc_max_rate = bitRate;
+
+    if (p.vbvFrames > 0 && fps > 0)
+    {
+        pContext->rc_buffer_size = (int)(bitRate * p.vbvFrames / fps);
+    }
+    else
+    {
+        pContext->rc_min_rate = bitRate;
+    }
+
+    pContext->qmin = 12;
+    pContext->qmax = 34;
+    pContext->max_qdiff = 8;
+}
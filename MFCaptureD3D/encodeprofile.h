@@ -0,0 +1,82 @@
+//////////////////////////////////////////////////////////////////////////
+//
+// encodeprofile.h: H.264 encoder settings.
+//
+//////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+enum ENCODE_PROFILE
+{
+    ENCODE_PROFILE_ARCHIVE,         // Best quality for the bit rate, several frames of delay.
+    ENCODE_PROFILE_LOW_LATENCY,     // A packet for every frame, for live monitoring.
+    ENCODE_PROFILE_COUNT
+};
+
+struct EncodeProfile
+{
+    const char  *name;              // As selected with /profile:<name>.
+    const char  *preset;            // x264 preset.
+    const char  *tune;              // x264 tune, or NULL.
+    int         maxBFrames;
+    int         threadType;         // FF_THREAD_FRAME or FF_THREAD_SLICE.
+    BOOL        bIntraRefresh;      // Periodic intra refresh instead of IDR frames.
+    int         vbvFrames;          // VBV buffer, in frames at the bit rate. 0: none.
+    int         latencyBudget;      // ms from capture after which a frame is dropped.
+};
+
+extern const EncodeProfile g_EncodeProfiles[ENCODE_PROFILE_COUNT];
+
+// x264 presets, fastest first.
+extern const char * const   g_X264Presets[];
+extern const int            g_cX264Presets;
+
+struct SimulcastRung
+{
+    int         height;             // The width keeps the aspect ratio of the source.
+    int64_t     bitRate;
+};
+
+// Renditions of /simulcast, largest first. Each is scaled from the one
+// before it.
+extern const SimulcastRung  g_SimulcastLadder[];
+extern const int            g_cSimulcastRungs;
+
+// Index of a preset in g_X264Presets, or -1.
+
+int FindX264Preset(const char *pszPreset);
+
+// Sets the subme, me and trellis options of the x264 preset iPreset on a
+// codec context set up for the stream preset iStreamPreset, which is
+// slower. None of them is written into the SPS or PPS, so the encoder
+// gives the same stream headers as one with the stream preset: profile,
+// entropy coder, reference frames, B-frames and weighted prediction stay
+// those of iStreamPreset. subme does not go below 6 when the stream
+// preset uses it, since below 6 x264 drops psy-rd and with it the chroma
+// QP offset of the PPS.
+
+void ApplyX264Speed(
+    AVCodecContext  *pContext,
+    int             iPreset,
+    int             iStreamPreset
+    );
+
+// The next preset from iPreset in the direction of iStep (-1 faster, 1
+// slower) whose options, as ApplyX264Speed() sets them for iStreamPreset,
+// differ from those of iPreset, or -1. With the subme floor some presets
+// set the same options as their neighbour.
+
+int StepX264Speed(int iPreset, int iStreamPreset, int iStep);
+
+// Sets the rate control, GOP, threading and x264 options of a profile on
+// a codec context that has not been opened. The caller sets the size,
+// pixel format and time base. One key frame (or intra refresh period) is
+// placed every fps frames, and an input frame of type AV_PICTURE_TYPE_I
+// is encoded as an IDR frame.
+
+void ApplyEncodeProfile(
+    AVCodecContext  *pContext,
+    ENCODE_PROFILE  profile,
+    int             fps,
+    int64_t         bitRate
+    );
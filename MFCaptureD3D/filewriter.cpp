@@ -0,0 +1,484 @@
+
+#include <stdint.h>
+#include <string.h>
+
+#include <windows.h>
+#include <malloc.h>
+
+#include <pthread.h>
+
+#include "filewriter.h"
+
+
+struct FileBuffer
+{
+	uint8_t * data;
+	uint32_t used;
+	uint64_t offset;		// In the file.
+};
+
+
+class FileWriterImpl : public FileWriter
+{
+
+public:
+	FileWriterImpl();
+	~FileWriterImpl();
+
+	void Create(uint32_t bufferSize, uint32_t bufferCount);
+	void Destory();
+
+	int Open(const char * path, bool direct, uint64_t preallocSize);
+	int Write(const void * data, uint32_t size);
+	int WriteV(const FileWriterSegment * segments, uint32_t count);
+	int Close();
+	void GetStats(FileWriterStats * stats);
+
+private:
+	void Init();
+	void Uninit();
+
+	void Submit();
+
+	static void * ThreadProc(void * arg);
+	void Flush();
+	bool WriteBuffer(FileBuffer * buffer);
+	bool Reserve(uint64_t end);
+
+	int64_t Now();
+
+private:
+	HANDLE file = INVALID_HANDLE_VALUE;
+	bool direct = false;
+	uint64_t preallocSize = 0;
+	uint64_t allocated = 0;		// Reserved on disk.
+	uint64_t offset = 0;		// Of the next buffer.
+	uint64_t length = 0;		// Of the data.
+
+	FileBuffer * buffers = NULL;
+	uint32_t bufferSize = 0;
+	uint32_t bufferCount = 0;
+
+	// Buffers by state. The flush thread owns the one it writes.
+	FileBuffer * current = NULL;
+	FileBuffer ** freeList = NULL;
+	uint32_t freeCount = 0;
+	FileBuffer ** fullList = NULL;	// Ring, in file order.
+	uint32_t fullHead = 0;
+	uint32_t fullCount = 0;
+
+	bool threadStarted = false;
+	bool closing = false;
+	bool failed = false;
+	pthread_t thread;
+
+	FileWriterStats stats;
+	int64_t latencySum = 0;
+	LARGE_INTEGER frequency;
+
+	pthread_mutex_t mutex;
+	pthread_cond_t fullcond;
+	pthread_cond_t freecond;
+};
+
+
+FileWriter * FileWriter::Create(uint32_t bufferSize, uint32_t bufferCount) {
+
+	FileWriterImpl * writer = new FileWriterImpl();
+	if (writer)
+	{
+		writer->Create(bufferSize, bufferCount);
+	}
+
+	return writer;
+
+}
+
+
+FileWriterImpl::FileWriterImpl()
+{
+	Init();
+}
+
+
+FileWriterImpl::~FileWriterImpl()
+{
+	Uninit();
+}
+
+
+void FileWriterImpl::Init()
+{
+	memset(&stats, 0, sizeof(stats));
+	QueryPerformanceFrequency(&frequency);
+
+	pthread_mutex_init(&mutex, NULL);
+	pthread_cond_init(&fullcond, NULL);
+	pthread_cond_init(&freecond, NULL);
+}
+
+
+void FileWriterImpl::Uninit()
+{
+	Close();
+
+	for (uint32_t i = 0; buffers && i < bufferCount; i++)
+	{
+		_aligned_free(buffers[i].data);
+	}
+	delete[] buffers;
+	delete[] freeList;
+	delete[] fullList;
+
+	pthread_cond_destroy(&freecond);
+	pthread_cond_destroy(&fullcond);
+	pthread_mutex_destroy(&mutex);
+}
+
+
+void FileWriterImpl::Create(uint32_t _bufferSize, uint32_t _bufferCount)
+{
+	bufferSize = (_bufferSize + FILE_WRITER_ALIGN - 1) / FILE_WRITER_ALIGN * FILE_WRITER_ALIGN;
+	bufferCount = _bufferCount < 2 ? 2 : _bufferCount;
+
+	buffers = new FileBuffer[bufferCount];
+	freeList = new FileBuffer *[bufferCount];
+	fullList = new FileBuffer *[bufferCount];
+
+	for (uint32_t i = 0; i < bufferCount; i++)
+	{
+		buffers[i].data = (uint8_t *)_aligned_malloc(bufferSize, FILE_WRITER_ALIGN);
+		buffers[i].used = 0;
+		buffers[i].offset = 0;
+
+		if (buffers[i].data)
+		{
+			freeList[freeCount++] = &buffers[i];
+		}
+	}
+}
+
+
+void FileWriterImpl::Destory()
+{
+	delete this;
+}
+
+
+int FileWriterImpl::Open(const char * path, bool _direct, uint64_t _preallocSize)
+{
+	if (file != INVALID_HANDLE_VALUE || freeCount < 2)
+	{
+		return -1;
+	}
+
+	DWORD flags = FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN;
+	if (_direct)
+	{
+		flags |= FILE_FLAG_NO_BUFFERING | FILE_FLAG_WRITE_THROUGH;
+	}
+
+	file = CreateFileA(path, GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS, flags, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+	{
+		return -1;
+	}
+
+	direct = _direct;
+	preallocSize = _preallocSize;
+	allocated = 0;
+	offset = 0;
+	length = 0;
+
+	closing = false;
+	failed = false;
+	memset(&stats, 0, sizeof(stats));
+	latencySum = 0;
+
+	if (pthread_create(&thread, NULL, ThreadProc, this) != 0)
+	{
+		CloseHandle(file);
+		file = INVALID_HANDLE_VALUE;
+		return -1;
+	}
+	threadStarted = true;
+
+	return 0;
+}
+
+
+int FileWriterImpl::Write(const void * data, uint32_t size)
+{
+	if (file == INVALID_HANDLE_VALUE || failed)
+	{
+		return -1;
+	}
+
+	const uint8_t * p = (const uint8_t *)data;
+
+	while (size > 0)
+	{
+		if (current == NULL)
+		{
+			pthread_mutex_lock(&mutex);
+
+			if (freeCount == 0)
+			{
+				stats.stalls++;
+			}
+			while (freeCount == 0 && !failed)
+			{
+				pthread_cond_wait(&freecond, &mutex);
+			}
+			if (freeCount > 0)
+			{
+				current = freeList[--freeCount];
+				current->used = 0;
+			}
+
+			pthread_mutex_unlock(&mutex);
+
+			if (current == NULL)
+			{
+				return -1;
+			}
+		}
+
+		uint32_t n = bufferSize - current->used;
+		if (n > size)
+		{
+			n = size;
+		}
+
+		memcpy(current->data + current->used, p, n);
+		current->used += n;
+		length += n;
+		p += n;
+		size -= n;
+
+		if (current->used == bufferSize)
+		{
+			Submit();
+		}
+	}
+
+	return 0;
+}
+
+
+int FileWriterImpl::WriteV(const FileWriterSegment * segments, uint32_t count)
+{
+	for (uint32_t i = 0; i < count; i++)
+	{
+		if (Write(segments[i].data, segments[i].size) < 0)
+		{
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+
+// Queues the current buffer for the flush thread.
+void FileWriterImpl::Submit()
+{
+	current->offset = offset;
+	offset += current->used;
+
+	pthread_mutex_lock(&mutex);
+
+	fullList[(fullHead + fullCount) % bufferCount] = current;
+	fullCount++;
+	if (fullCount > stats.maxDepth)
+	{
+		stats.maxDepth = fullCount;
+	}
+
+	pthread_cond_signal(&fullcond);
+	pthread_mutex_unlock(&mutex);
+
+	current = NULL;
+}
+
+
+int FileWriterImpl::Close()
+{
+	if (file == INVALID_HANDLE_VALUE)
+	{
+		return 0;
+	}
+
+	if (current && current->used > 0)
+	{
+		// A direct write covers whole sectors; the padding is cut off below.
+		if (direct)
+		{
+			uint32_t padded = (current->used + FILE_WRITER_ALIGN - 1) / FILE_WRITER_ALIGN * FILE_WRITER_ALIGN;
+			memset(current->data + current->used, 0, padded - current->used);
+			current->used = padded;
+		}
+		Submit();
+	}
+	else if (current)
+	{
+		pthread_mutex_lock(&mutex);
+		freeList[freeCount++] = current;
+		pthread_mutex_unlock(&mutex);
+		current = NULL;
+	}
+
+	pthread_mutex_lock(&mutex);
+	closing = true;
+	pthread_cond_signal(&fullcond);
+	pthread_mutex_unlock(&mutex);
+
+	if (threadStarted)
+	{
+		pthread_join(thread, NULL);
+		threadStarted = false;
+	}
+
+	// Drop the padding and whatever was reserved past the data.
+	FILE_END_OF_FILE_INFO eof;
+	eof.EndOfFile.QuadPart = (LONGLONG)length;
+
+	if (!SetFileInformationByHandle(file, FileEndOfFileInfo, &eof, sizeof(eof)))
+	{
+		failed = true;
+	}
+
+	CloseHandle(file);
+	file = INVALID_HANDLE_VALUE;
+
+	return failed ? -1 : 0;
+}
+
+
+void FileWriterImpl::GetStats(FileWriterStats * _stats)
+{
+	pthread_mutex_lock(&mutex);
+
+	*_stats = stats;
+	_stats->meanLatency = stats.writes > 0 ? latencySum / stats.writes : 0;
+
+	pthread_mutex_unlock(&mutex);
+}
+
+
+void * FileWriterImpl::ThreadProc(void * arg)
+{
+	((FileWriterImpl *)arg)->Flush();
+	return NULL;
+}
+
+
+// Writes full buffers in order until Close().
+void FileWriterImpl::Flush()
+{
+	pthread_mutex_lock(&mutex);
+
+	for (;;)
+	{
+		while (fullCount == 0 && !closing)
+		{
+			pthread_cond_wait(&fullcond, &mutex);
+		}
+		if (fullCount == 0)
+		{
+			break;
+		}
+
+		FileBuffer * buffer = fullList[fullHead];
+		fullHead = (fullHead + 1) % bufferCount;
+		fullCount--;
+
+		bool ok = !failed;
+
+		pthread_mutex_unlock(&mutex);
+
+		int64_t start = Now();
+		if (ok)
+		{
+			ok = WriteBuffer(buffer);
+		}
+		int64_t latency = Now() - start;
+
+		pthread_mutex_lock(&mutex);
+
+		if (ok)
+		{
+			stats.written += buffer->used;
+			stats.writes++;
+			latencySum += latency;
+			if (latency > stats.maxLatency)
+			{
+				stats.maxLatency = latency;
+			}
+		}
+		else
+		{
+			failed = true;
+		}
+
+		freeList[freeCount++] = buffer;
+		pthread_cond_signal(&freecond);
+	}
+
+	pthread_mutex_unlock(&mutex);
+}
+
+
+// Writes a buffer at its offset, as pwrite() does.
+bool FileWriterImpl::WriteBuffer(FileBuffer * buffer)
+{
+	if (!Reserve(buffer->offset + buffer->used))
+	{
+		return false;
+	}
+
+	OVERLAPPED ov;
+	memset(&ov, 0, sizeof(ov));
+	ov.Offset = (DWORD)buffer->offset;
+	ov.OffsetHigh = (DWORD)(buffer->offset >> 32);
+
+	DWORD written = 0;
+	return WriteFile(file, buffer->data, buffer->used, &written, &ov) && written == buffer->used;
+}
+
+
+// Reserves disk space up to end, a preallocation step at a time. The
+// length of the file does not change.
+bool FileWriterImpl::Reserve(uint64_t end)
+{
+	if (preallocSize == 0 || end <= allocated)
+	{
+		return true;
+	}
+
+	uint64_t size = (end + preallocSize - 1) / preallocSize * preallocSize;
+
+	FILE_ALLOCATION_INFO info;
+	info.AllocationSize.QuadPart = (LONGLONG)size;
+
+	// Not fatal: the file system allocates as the file grows.
+	if (SetFileInformationByHandle(file, FileAllocationInfo, &info, sizeof(info)))
+	{
+		allocated = size;
+	}
+	else
+	{
+		preallocSize = 0;
+	}
+
+	return true;
+}
+
+
+int64_t FileWriterImpl::Now()
+{
+	LARGE_INTEGER t;
+	QueryPerformanceCounter(&t);
+	return t.QuadPart / frequency.QuadPart * 1000000 +
+		t.QuadPart % frequency.QuadPart * 1000000 / frequency.QuadPart;
+}
@@ -0,0 +1,62 @@
+
+#pragma once
+
+// Sector alignment of direct writes.
+const uint32_t FILE_WRITER_ALIGN = 4096;
+
+// One piece of a gathered write.
+struct FileWriterSegment
+{
+	const void * data;
+	uint32_t size;
+};
+
+struct FileWriterStats
+{
+	uint64_t written;		// Bytes handed to the file system.
+	uint32_t writes;
+	int64_t meanLatency;	// us per write.
+	int64_t maxLatency;
+	uint32_t maxDepth;		// Full buffers waiting to be written.
+	uint32_t stalls;		// Write() waited for a free buffer.
+};
+
+// Writes a file from a background thread. Write() copies into one of a
+// few large buffers; a full buffer is written at its offset in a single
+// call while the next one fills, so a slow disk only stalls the caller
+// once every buffer is waiting.
+//
+// In direct mode the file is opened without the system cache. Buffers are
+// aligned to, and written in multiples of, FILE_WRITER_ALIGN; the file is
+// cut back to its length when it is closed.
+//
+// The file is grown in steps of the preallocation size ahead of the
+// writes, so that it is laid out in few extents.
+//
+// Write() and Close() are called from one thread at a time.
+
+class FileWriter
+{
+
+public:
+
+	// bufferSize is rounded up to FILE_WRITER_ALIGN; bufferCount is at
+	// least 2.
+	static FileWriter * Create(uint32_t bufferSize, uint32_t bufferCount);
+	virtual void Destory() = 0;
+
+	virtual int Open(const char * path, bool direct, uint64_t preallocSize) = 0;
+
+	// Returns 0, or -1 if the file is not open or a write failed.
+	virtual int Write(const void * data, uint32_t size) = 0;
+
+	// Writes the segments one after the other, as writev() does, e.g. the
+	// rows of an image without their padding. Returns 0, or -1.
+	virtual int WriteV(const FileWriterSegment * segments, uint32_t count) = 0;
+
+	// Writes the rest and closes the file. Returns -1 if anything was lost.
+	virtual int Close() = 0;
+
+	virtual void GetStats(FileWriterStats * stats) = 0;
+
+};
@@ -0,0 +1,257 @@
+
+#include <stdint.h>
+#include <string.h>
+
+#include <deque>
+
+#include <pthread.h>
+
+#include "mediaqueue.h"
+
+
+class MediaQueueImpl : public MediaQueue
+{
+
+public:
+	MediaQueueImpl();
+	~MediaQueueImpl();
+
+	void Create(uint32_t capacity, QUEUE_DROP_POLICY policy, QUEUE_FREE_FN freefn);
+	void Destory();
+
+	bool Push(void * item);
+	void * Pop();
+	void * TryPop();
+	void Close();
+	void Flush();
+
+	void GetStats(QueueStats * stats, bool reset);
+
+private:
+	void Init();
+	void Uninit();
+
+	void Drop(void * item);
+
+private:
+	std::deque<void *> items;
+
+	uint32_t capacity = 0;
+	QUEUE_DROP_POLICY policy = QUEUE_DROP_NEWEST;
+	QUEUE_FREE_FN freefn = NULL;
+	bool closed = false;
+
+	QueueStats stats;
+
+	pthread_mutex_t mutex;
+	pthread_cond_t notempty;
+	pthread_cond_t notfull;
+};
+
+
+MediaQueue * MediaQueue::Create(uint32_t capacity, QUEUE_DROP_POLICY policy, QUEUE_FREE_FN freefn) {
+
+	MediaQueueImpl * queue = new MediaQueueImpl();
+	if (queue)
+	{
+		queue->Create(capacity, policy, freefn);
+	}
+
+	return queue;
+
+}
+
+
+MediaQueueImpl::MediaQueueImpl()
+{
+	Init();
+}
+
+
+MediaQueueImpl::~MediaQueueImpl()
+{
+	Uninit();
+}
+
+
+void MediaQueueImpl::Init()
+{
+	memset(&stats, 0, sizeof(stats));
+
+	pthread_mutex_init(&mutex, NULL);
+	pthread_cond_init(&notempty, NULL);
+	pthread_cond_init(&notfull, NULL);
+}
+
+
+void MediaQueueImpl::Uninit()
+{
+	pthread_cond_destroy(&notfull);
+	pthread_cond_destroy(&notempty);
+	pthread_mutex_destroy(&mutex);
+}
+
+
+void MediaQueueImpl::Create(uint32_t _capacity, QUEUE_DROP_POLICY _policy, QUEUE_FREE_FN _freefn)
+{
+	capacity = _capacity > 0 ? _capacity : 1;
+	policy = _policy;
+	freefn = _freefn;
+}
+
+
+void MediaQueueImpl::Destory()
+{
+	Close();
+	Flush();
+
+	delete this;
+}
+
+
+void MediaQueueImpl::Drop(void * item)
+{
+	stats.dropped++;
+	if (freefn && item)
+	{
+		freefn(item);
+	}
+}
+
+
+bool MediaQueueImpl::Push(void * item)
+{
+	bool ok = true;
+
+	pthread_mutex_lock(&mutex);
+
+	if (policy == QUEUE_BLOCK)
+	{
+		while (!closed && items.size() >= capacity)
+		{
+			pthread_cond_wait(&notfull, &mutex);
+		}
+	}
+
+	if (closed)
+	{
+		Drop(item);
+		pthread_mutex_unlock(&mutex);
+		return false;
+	}
+
+	if (items.size() >= capacity)
+	{
+		if (policy == QUEUE_DROP_NEWEST)
+		{
+			Drop(item);
+			pthread_mutex_unlock(&mutex);
+			return false;
+		}
+
+		Drop(items.front());
+		items.pop_front();
+		ok = false;
+	}
+
+	items.push_back(item);
+	stats.pushed++;
+	if (items.size() > stats.maxDepth)
+	{
+		stats.maxDepth = (uint32_t)items.size();
+	}
+
+	pthread_cond_signal(&notempty);
+	pthread_mutex_unlock(&mutex);
+
+	return ok;
+}
+
+
+void * MediaQueueImpl::Pop()
+{
+	void * item = NULL;
+
+	pthread_mutex_lock(&mutex);
+
+	while (!closed && items.empty())
+	{
+		pthread_cond_wait(&notempty, &mutex);
+	}
+
+	if (!items.empty())
+	{
+		item = items.front();
+		items.pop_front();
+		stats.popped++;
+		pthread_cond_signal(&notfull);
+	}
+
+	pthread_mutex_unlock(&mutex);
+
+	return item;
+}
+
+
+void * MediaQueueImpl::TryPop()
+{
+	void * item = NULL;
+
+	pthread_mutex_lock(&mutex);
+
+	if (!items.empty())
+	{
+		item = items.front();
+		items.pop_front();
+		stats.popped++;
+		pthread_cond_signal(&notfull);
+	}
+
+	pthread_mutex_unlock(&mutex);
+
+	return item;
+}
+
+
+void MediaQueueImpl::Close()
+{
+	pthread_mutex_lock(&mutex);
+	closed = true;
+	pthread_cond_broadcast(&notempty);
+	pthread_cond_broadcast(&notfull);
+	pthread_mutex_unlock(&mutex);
+}
+
+
+void MediaQueueImpl::Flush()
+{
+	pthread_mutex_lock(&mutex);
+	while (!items.empty())
+	{
+		if (freefn && items.front())
+		{
+			freefn(items.front());
+		}
+		items.pop_front();
+	}
+	pthread_cond_broadcast(&notfull);
+	pthread_mutex_unlock(&mutex);
+}
+
+
+void MediaQueueImpl::GetStats(QueueStats * _stats, bool reset)
+{
+	pthread_mutex_lock(&mutex);
+
+	stats.depth = (uint32_t)items.size();
+	if (_stats)
+	{
+		*_stats = stats;
+	}
+	if (reset)
+	{
+		stats.maxDepth = stats.depth;
+	}
+
+	pthread_mutex_unlock(&mutex);
+}
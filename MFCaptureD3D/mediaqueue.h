@@ -0,0 +1,52 @@
+
+#pragma once
+
+// Frees an item that the queue drops, or still holds when it is flushed
+// or destroyed.
+typedef void (*QUEUE_FREE_FN)(void * item);
+
+// What Push() does when the queue is full.
+enum QUEUE_DROP_POLICY
+{
+	QUEUE_DROP_NEWEST,	// The pushed item is dropped.
+	QUEUE_DROP_OLDEST,	// The oldest queued item is dropped.
+	QUEUE_BLOCK			// Push() waits for space.
+};
+
+struct QueueStats
+{
+	uint64_t pushed;
+	uint64_t popped;
+	uint64_t dropped;
+	uint32_t depth;
+	uint32_t maxDepth;	// Since the last GetStats(reset = true).
+};
+
+class MediaQueue
+{
+
+public:
+
+	static MediaQueue * Create(uint32_t capacity, QUEUE_DROP_POLICY policy, QUEUE_FREE_FN freefn);
+	virtual void Destory() = 0;
+
+	// Takes ownership of item. Returns false if an item was dropped to
+	// make room, or item itself was dropped (freed).
+	virtual bool Push(void * item) = 0;
+
+	// Waits for an item. Returns NULL once the queue is closed and empty.
+	virtual void * Pop() = 0;
+
+	// Returns NULL at once if the queue is empty.
+	virtual void * TryPop() = 0;
+
+	// Wakes up all waiters. Pop() returns the remaining items, then NULL;
+	// Push() drops everything.
+	virtual void Close() = 0;
+
+	// Frees all queued items.
+	virtual void Flush() = 0;
+
+	virtual void GetStats(QueueStats * stats, bool reset) = 0;
+
+};
@@ -0,0 +1,617 @@
+
+#include "MFCaptureD3D.h"
+
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+
+// The file is written in runs of this size.
+const int MP4_IO_BUFFER_SIZE = 1 << 20;
+
+// Packets held until every stream has its decoder configuration. When
+// this many are waiting, the header is written without the missing ones.
+const size_t MP4_MAX_PENDING = 512;
+
+
+struct Mp4Stream
+{
+	AVStream * stream;
+	AVRational timeBase;	// Of the packets passed to Write().
+	AVBSFContext * bsf;		// ADTS to raw AAC, or NULL.
+	bool configured;		// The stream has its decoder configuration.
+	bool started;
+	int64_t lastDts;		// In timeBase, as passed to Write().
+};
+
+
+class Mp4WriterImpl : public Mp4Writer
+{
+
+public:
+	Mp4WriterImpl();
+	~Mp4WriterImpl();
+
+	void Create();
+	void Destory();
+
+	int AddStream(const AVCodecContext * context);
+	int Open(const char * path, bool fragmented);
+	int Write(int stream, const AVPacket * packet);
+	void Close();
+
+private:
+	void Init();
+	void Uninit();
+
+	int Filter(AVPacket * pkt);
+	int Queue(AVPacket * pkt);
+	int WriteHeader();
+	int WritePacket(AVPacket * pkt);
+
+	static int ExtractParameterSets(const AVPacket * pkt, AVCodecParameters * par);
+
+	static int WriteIO(void * opaque, uint8_t * buf, int size);
+	static int64_t SeekIO(void * opaque, int64_t offset, int whence);
+
+private:
+	AVFormatContext * format = NULL;
+	FILE * file = NULL;
+	std::string path;
+	bool fragmented = false;
+	bool headerWritten = false;
+	bool failed = false;
+
+	// Earliest decode time of the packets held for the header, in
+	// AV_TIME_BASE_Q; subtracted from every stream.
+	int64_t origin = AV_NOPTS_VALUE;
+
+	std::vector<Mp4Stream> streams;
+	std::vector<AVPacket *> pending;
+
+	pthread_mutex_t mutex;
+};
+
+
+Mp4Writer * Mp4Writer::Create() {
+
+	Mp4WriterImpl * writer = new Mp4WriterImpl();
+	if (writer)
+	{
+		writer->Create();
+	}
+
+	return writer;
+
+}
+
+
+Mp4WriterImpl::Mp4WriterImpl()
+{
+	Init();
+}
+
+
+Mp4WriterImpl::~Mp4WriterImpl()
+{
+	Uninit();
+}
+
+
+void Mp4WriterImpl::Init()
+{
+	pthread_mutex_init(&mutex, NULL);
+}
+
+
+void Mp4WriterImpl::Uninit()
+{
+	Close();
+
+	for (size_t i = 0; i < streams.size(); i++)
+	{
+		av_bsf_free(&streams[i].bsf);
+	}
+	streams.clear();
+
+	avformat_free_context(format);
+	format = NULL;
+
+	pthread_mutex_destroy(&mutex);
+}
+
+
+void Mp4WriterImpl::Create()
+{
+	int ret = avformat_alloc_output_context2(&format, NULL, "mp4", NULL);
+	if (ret < 0)
+	{
+		LOG_ERR("cannot create the mp4 muxer: %d\n", ret);
+		format = NULL;
+	}
+}
+
+
+void Mp4WriterImpl::Destory()
+{
+	delete this;
+}
+
+
+int Mp4WriterImpl::AddStream(const AVCodecContext * context)
+{
+	if (format == NULL || file != NULL || context == NULL)
+	{
+		return -1;
+	}
+
+	AVStream * st = avformat_new_stream(format, NULL);
+	if (st == NULL || avcodec_parameters_from_context(st->codecpar, context) < 0)
+	{
+		return -1;
+	}
+
+	st->time_base = context->time_base;
+	if (context->codec_type == AVMEDIA_TYPE_VIDEO)
+	{
+		// Nominal; the pts give the timing of each frame.
+		st->avg_frame_rate = context->framerate;
+	}
+
+	Mp4Stream s;
+	memset(&s, 0, sizeof(s));
+	s.stream = st;
+	s.timeBase = context->time_base;
+	s.configured = context->extradata_size > 0;
+	s.lastDts = AV_NOPTS_VALUE;
+
+	// An AAC encoder without a global header writes ADTS.
+	if (!s.configured && context->codec_id == AV_CODEC_ID_AAC)
+	{
+		const AVBitStreamFilter * filter = av_bsf_get_by_name("aac_adtstoasc");
+
+		if (filter == NULL || av_bsf_alloc(filter, &s.bsf) < 0 ||
+			avcodec_parameters_copy(s.bsf->par_in, st->codecpar) < 0)
+		{
+			av_bsf_free(&s.bsf);
+			return -1;
+		}
+
+		s.bsf->time_base_in = context->time_base;
+
+		if (av_bsf_init(s.bsf) < 0)
+		{
+			av_bsf_free(&s.bsf);
+			return -1;
+		}
+	}
+
+	streams.push_back(s);
+
+	return (int)streams.size() - 1;
+}
+
+
+int Mp4WriterImpl::Open(const char * _path, bool _fragmented)
+{
+	if (format == NULL || file != NULL || streams.empty())
+	{
+		return -1;
+	}
+
+	file = fopen(_path, "wb");
+	if (file == NULL)
+	{
+		LOG_ERR("cannot create %s\n", _path);
+		return -1;
+	}
+
+	// avio buffers the writes already.
+	setvbuf(file, NULL, _IONBF, 0);
+
+	uint8_t * buffer = (uint8_t *)av_malloc(MP4_IO_BUFFER_SIZE);
+
+	format->pb = buffer ? avio_alloc_context(buffer, MP4_IO_BUFFER_SIZE, 1, this, NULL, WriteIO, SeekIO) : NULL;
+	if (format->pb == NULL)
+	{
+		av_free(buffer);
+		fclose(file);
+		file = NULL;
+		return -1;
+	}
+
+	path = _path;
+	fragmented = _fragmented;
+	headerWritten = false;
+	failed = false;
+	origin = AV_NOPTS_VALUE;
+
+	return 0;
+}
+
+
+int Mp4WriterImpl::Write(int stream, const AVPacket * packet)
+{
+	int ret = -1;
+
+	pthread_mutex_lock(&mutex);
+
+	if (file && !failed && stream >= 0 && stream < (int)streams.size() && packet)
+	{
+		AVPacket * pkt = av_packet_clone((AVPacket *)packet);
+		if (pkt)
+		{
+			pkt->stream_index = stream;
+			ret = Filter(pkt);
+		}
+	}
+
+	pthread_mutex_unlock(&mutex);
+
+	return ret;
+}
+
+
+// Takes pkt. Gets the decoder configuration of the stream from its
+// first packets.
+int Mp4WriterImpl::Filter(AVPacket * pkt)
+{
+	Mp4Stream & s = streams[pkt->stream_index];
+
+	if (s.bsf)
+	{
+		int index = pkt->stream_index;
+
+		int ret = av_bsf_send_packet(s.bsf, pkt);
+		av_packet_free(&pkt);
+
+		if (ret < 0)
+		{
+			return -1;
+		}
+
+		for (;;)
+		{
+			AVPacket * out = av_packet_alloc();
+
+			if (out == NULL || av_bsf_receive_packet(s.bsf, out) < 0)
+			{
+				av_packet_free(&out);
+				break;
+			}
+
+			if (!s.configured && s.bsf->par_out->extradata_size > 0)
+			{
+				avcodec_parameters_copy(s.stream->codecpar, s.bsf->par_out);
+				s.configured = true;
+			}
+
+			out->stream_index = index;
+			ret = Queue(out);
+		}
+
+		return ret;
+	}
+
+	// Video starts at a key frame, which also carries the SPS and PPS of
+	// an encoder without a global header.
+	if (s.stream->codecpar->codec_type == AVMEDIA_TYPE_VIDEO && !s.started &&
+		!(pkt->flags & AV_PKT_FLAG_KEY))
+	{
+		av_packet_free(&pkt);
+		return 0;
+	}
+
+	if (!s.configured)
+	{
+		if (s.stream->codecpar->codec_id != AV_CODEC_ID_H264 ||
+			ExtractParameterSets(pkt, s.stream->codecpar) < 0)
+		{
+			av_packet_free(&pkt);
+			return 0;
+		}
+		s.configured = true;
+	}
+
+	return Queue(pkt);
+}
+
+
+// Takes pkt. Holds the packet until the header is written, which fixes
+// the origin of the file.
+int Mp4WriterImpl::Queue(AVPacket * pkt)
+{
+	Mp4Stream & s = streams[pkt->stream_index];
+
+	if (pkt->dts == AV_NOPTS_VALUE)
+	{
+		pkt->dts = pkt->pts;
+	}
+
+	// Decode times must increase. The encoders see to it, also across a
+	// reopened encoder; a packet that breaks the rule is not written.
+	if (pkt->dts == AV_NOPTS_VALUE || (s.lastDts != AV_NOPTS_VALUE && pkt->dts <= s.lastDts))
+	{
+		LOG_ERR("%s: stream %d: dts %lld after %lld, packet dropped\n", path.c_str(),
+			pkt->stream_index, (long long)pkt->dts, (long long)s.lastDts);
+		av_packet_free(&pkt);
+		return -1;
+	}
+	s.lastDts = pkt->dts;
+	s.started = true;
+
+	if (headerWritten)
+	{
+		return WritePacket(pkt);
+	}
+
+	pending.push_back(pkt);
+
+	bool ready = true;
+	for (size_t i = 0; i < streams.size(); i++)
+	{
+		ready = ready && streams[i].configured;
+	}
+
+	if (!ready && pending.size() < MP4_MAX_PENDING)
+	{
+		return 0;
+	}
+
+	// The streams share one clock. The file starts at the first packet
+	// of any of them; one that starts later keeps its delay.
+	for (size_t i = 0; i < pending.size(); i++)
+	{
+		// Rounded down both ways, so that no held packet falls before it.
+		int64_t dts = av_rescale_q_rnd(pending[i]->dts, streams[pending[i]->stream_index].timeBase,
+			AV_TIME_BASE_Q, AV_ROUND_DOWN);
+
+		if (origin == AV_NOPTS_VALUE || dts < origin)
+		{
+			origin = dts;
+		}
+	}
+
+	int ret = WriteHeader();
+
+	for (size_t i = 0; i < pending.size(); i++)
+	{
+		if (ret < 0)
+		{
+			av_packet_free(&pending[i]);
+		}
+		else if (WritePacket(pending[i]) < 0)
+		{
+			ret = -1;
+		}
+	}
+	pending.clear();
+
+	return ret;
+}
+
+
+int Mp4WriterImpl::WriteHeader()
+{
+	for (size_t i = 0; i < streams.size(); i++)
+	{
+		if (!streams[i].configured)
+		{
+			LOG_ERR("%s: stream %u has no decoder configuration\n", path.c_str(), (unsigned)i);
+		}
+	}
+
+	AVDictionary * options = NULL;
+
+	if (fragmented)
+	{
+		av_dict_set(&options, "movflags", "frag_keyframe+empty_moov+default_base_moof", 0);
+	}
+
+	int ret = avformat_write_header(format, &options);
+	av_dict_free(&options);
+
+	if (ret < 0)
+	{
+		char strerr[100];
+		av_strerror(ret, strerr, 100);
+		LOG_ERR("%s: avformat_write_header failed with %s\n", path.c_str(), strerr);
+
+		failed = true;
+		return -1;
+	}
+
+	headerWritten = true;
+	return 0;
+}
+
+
+// Takes pkt. A packet from before the origin, which came after the
+// header, is left out.
+int Mp4WriterImpl::WritePacket(AVPacket * pkt)
+{
+	AVStream * st = format->streams[pkt->stream_index];
+	AVRational timeBase = streams[pkt->stream_index].timeBase;
+	int64_t offset = av_rescale_q_rnd(origin, AV_TIME_BASE_Q, timeBase, AV_ROUND_DOWN);
+
+	if (pkt->dts < offset)
+	{
+		av_packet_free(&pkt);
+		return 0;
+	}
+
+	pkt->dts -= offset;
+	if (pkt->pts != AV_NOPTS_VALUE)
+	{
+		pkt->pts -= offset;
+	}
+
+	av_packet_rescale_ts(pkt, timeBase, st->time_base);
+
+	bool key = st->codecpar->codec_type == AVMEDIA_TYPE_VIDEO && (pkt->flags & AV_PKT_FLAG_KEY);
+
+	int ret = av_interleaved_write_frame(format, pkt);
+	av_packet_free(&pkt);
+
+	if (ret < 0)
+	{
+		char strerr[100];
+		av_strerror(ret, strerr, 100);
+		LOG_ERR("%s: av_interleaved_write_frame failed with %s\n", path.c_str(), strerr);
+		return -1;
+	}
+
+	// A key frame starts a fragment: let readers see the previous one.
+	if (fragmented && key)
+	{
+		avio_flush(format->pb);
+	}
+
+	return 0;
+}
+
+
+void Mp4WriterImpl::Close()
+{
+	pthread_mutex_lock(&mutex);
+
+	if (file)
+	{
+		if (headerWritten)
+		{
+			int ret = av_write_trailer(format);
+			if (ret < 0)
+			{
+				LOG_ERR("%s: av_write_trailer failed with %d\n", path.c_str(), ret);
+			}
+		}
+		else
+		{
+			LOG_ERR("%s: no key frame was recorded\n", path.c_str());
+		}
+
+		for (size_t i = 0; i < pending.size(); i++)
+		{
+			av_packet_free(&pending[i]);
+		}
+		pending.clear();
+
+		avio_flush(format->pb);
+		av_freep(&format->pb->buffer);
+		av_freep(&format->pb);
+
+		fclose(file);
+		file = NULL;
+
+		headerWritten = false;
+	}
+
+	pthread_mutex_unlock(&mutex);
+}
+
+
+// Copies the SPS and PPS NAL units of an Annex B packet into the
+// extradata, with their start codes. The muxer turns them into an avcC.
+int Mp4WriterImpl::ExtractParameterSets(const AVPacket * pkt, AVCodecParameters * par)
+{
+	std::vector<uint8_t> sets;
+	bool sps = false;
+	bool pps = false;
+
+	const uint8_t * end = pkt->data + pkt->size;
+	const uint8_t * p = pkt->data;
+
+	// Start of the first NAL unit.
+	while (p + 3 <= end && !(p[0] == 0 && p[1] == 0 && p[2] == 1))
+	{
+		p++;
+	}
+
+	while (p + 3 < end)
+	{
+		const uint8_t * nal = p + 3;
+		const uint8_t * next = nal;
+
+		while (next + 3 <= end && !(next[0] == 0 && next[1] == 0 && next[2] == 1))
+		{
+			next++;
+		}
+		if (next + 3 > end)
+		{
+			next = end;
+		}
+
+		// Zeros before the next start code are not part of the unit.
+		const uint8_t * last = next;
+		while (last > nal && last[-1] == 0)
+		{
+			last--;
+		}
+
+		int type = nal[0] & 0x1F;
+		if (type == 7 || type == 8)
+		{
+			static const uint8_t startCode[4] = { 0, 0, 0, 1 };
+
+			sets.insert(sets.end(), startCode, startCode + 4);
+			sets.insert(sets.end(), nal, last);
+
+			sps = sps || type == 7;
+			pps = pps || type == 8;
+		}
+
+		p = next;
+	}
+
+	if (!sps || !pps)
+	{
+		return -1;
+	}
+
+	uint8_t * extradata = (uint8_t *)av_mallocz(sets.size() + AV_INPUT_BUFFER_PADDING_SIZE);
+	if (extradata == NULL)
+	{
+		return -1;
+	}
+
+	memcpy(extradata, &sets[0], sets.size());
+
+	av_freep(&par->extradata);
+	par->extradata = extradata;
+	par->extradata_size = (int)sets.size();
+
+	return 0;
+}
+
+
+int Mp4WriterImpl::WriteIO(void * opaque, uint8_t * buf, int size)
+{
+	FILE * file = ((Mp4WriterImpl *)opaque)->file;
+
+	if (fwrite(buf, 1, size, file) != (size_t)size)
+	{
+		return AVERROR(EIO);
+	}
+	return size;
+}
+
+
+int64_t Mp4WriterImpl::SeekIO(void * opaque, int64_t offset, int whence)
+{
+	FILE * file = ((Mp4WriterImpl *)opaque)->file;
+
+	if (whence == AVSEEK_SIZE)
+	{
+		int64_t pos = _ftelli64(file);
+		_fseeki64(file, 0, SEEK_END);
+		int64_t size = _ftelli64(file);
+		_fseeki64(file, pos, SEEK_SET);
+		return size;
+	}
+
+	if (_fseeki64(file, offset, whence & ~AVSEEK_FORCE) != 0)
+	{
+		return AVERROR(EIO);
+	}
+	return _ftelli64(file);
+}
@@ -0,0 +1,43 @@
+
+#pragma once
+
+// Muxes encoded streams into an MP4 file with libavformat. Packets may
+// come from several threads, e.g. the write stages of the video and
+// audio pipelines; they are interleaved by decode time.
+//
+// The header is written once every stream has its decoder configuration.
+// Encoders opened without a global header are handled: the H.264 SPS and
+// PPS are taken from the first key frame, and ADTS headers are turned
+// into an AudioSpecificConfig. Video starts at a key frame.
+//
+// The timestamps of all streams are on one clock, each in the time base
+// of its encoder. The file starts at time 0 with the earliest packet held
+// for the header, and every stream is moved by the same amount, so that
+// they stay in sync. The decode times of each stream must increase; a
+// packet that does not follow on is dropped.
+//
+// In fragmented mode the file starts with an empty moov and gets a
+// fragment at every video key frame, so that it can be read while it is
+// being written, and nothing is rewritten when it is closed.
+class Mp4Writer
+{
+
+public:
+
+	static Mp4Writer * Create();
+	virtual void Destory() = 0;
+
+	// Adds a stream with the parameters of an open encoder, before
+	// Open(). Packets of the stream are in the time base of the encoder.
+	// Returns the stream index, or -1.
+	virtual int AddStream(const AVCodecContext * context) = 0;
+
+	virtual int Open(const char * path, bool fragmented) = 0;
+
+	// Writes a copy of packet. Returns 0, or -1 if it could not be written.
+	virtual int Write(int stream, const AVPacket * packet) = 0;
+
+	// Writes the trailer and closes the file.
+	virtual void Close() = 0;
+
+};
@@ -0,0 +1,310 @@
+
+#include "MFCaptureD3D.h"
+
+#include <string>
+#include <vector>
+
+
+static void FreePacket(void * item)
+{
+	AVPacket * pkt = (AVPacket *)item;
+	av_packet_free(&pkt);
+}
+
+
+struct PacketSink
+{
+	std::string name;
+	PACKET_SINK_FN fn;
+	void * ctx;
+	QUEUE_DROP_POLICY policy;
+	MediaQueue * queue;
+	pthread_t thread;
+
+	bool waitKey;		// Skips packets until the next key frame.
+	uint64_t skipped;	// Packets not queued while waiting.
+
+	int refs;			// Deliver() calls using the sink, under mutex.
+};
+
+
+class PacketDistributorImpl : public PacketDistributor
+{
+
+public:
+	PacketDistributorImpl();
+	~PacketDistributorImpl();
+
+	void Create(const char * name);
+	void Destory();
+
+	int AddSink(const char * name, PACKET_SINK_FN fn, void * ctx,
+		uint32_t capacity, QUEUE_DROP_POLICY policy);
+	void RemoveSink(int sink);
+	void Deliver(const AVPacket * packet);
+
+private:
+	void DeliverToSink(PacketSink * sink, const AVPacket * packet, bool key);
+
+	void Init();
+	void Uninit();
+
+	static void * ThreadProc(void * arg);
+
+private:
+	std::string name;
+
+	// Slots are reused; a removed sink leaves NULL.
+	std::vector<PacketSink *> sinks;
+
+	// The sinks a Deliver() call pushes to, outside the mutex. Each holds
+	// a reference until it has the packet; RemoveSink() waits for it.
+	std::vector<PacketSink *> delivering;
+
+	pthread_mutex_t mutex;
+	pthread_cond_t released;	// A reference to a sink was dropped.
+};
+
+
+PacketDistributor * PacketDistributor::Create(const char * name) {
+
+	PacketDistributorImpl * distributor = new PacketDistributorImpl();
+	if (distributor)
+	{
+		distributor->Create(name);
+	}
+
+	return distributor;
+
+}
+
+
+PacketDistributorImpl::PacketDistributorImpl()
+{
+	Init();
+}
+
+
+PacketDistributorImpl::~PacketDistributorImpl()
+{
+	Uninit();
+}
+
+
+void PacketDistributorImpl::Init()
+{
+	pthread_mutex_init(&mutex, NULL);
+	pthread_cond_init(&released, NULL);
+}
+
+
+void PacketDistributorImpl::Uninit()
+{
+	for (size_t i = 0; i < sinks.size(); i++)
+	{
+		RemoveSink((int)i);
+	}
+
+	pthread_cond_destroy(&released);
+	pthread_mutex_destroy(&mutex);
+}
+
+
+void PacketDistributorImpl::Create(const char * _name)
+{
+	name = _name ? _name : "";
+}
+
+
+void PacketDistributorImpl::Destory()
+{
+	delete this;
+}
+
+
+int PacketDistributorImpl::AddSink(const char * _name, PACKET_SINK_FN fn, void * ctx,
+	uint32_t capacity, QUEUE_DROP_POLICY policy)
+{
+	if (fn == NULL)
+	{
+		return -1;
+	}
+
+	PacketSink * sink = new PacketSink();
+	sink->name = _name ? _name : "";
+	sink->fn = fn;
+	sink->ctx = ctx;
+	sink->policy = policy;
+	sink->queue = MediaQueue::Create(capacity, policy, FreePacket);
+	sink->waitKey = true;
+	sink->skipped = 0;
+	sink->refs = 0;
+
+	if (sink->queue == NULL || pthread_create(&sink->thread, NULL, ThreadProc, sink) != 0)
+	{
+		if (sink->queue)
+		{
+			sink->queue->Destory();
+		}
+		delete sink;
+		return -1;
+	}
+
+	pthread_mutex_lock(&mutex);
+
+	int id = -1;
+	for (size_t i = 0; i < sinks.size() && id < 0; i++)
+	{
+		if (sinks[i] == NULL)
+		{
+			id = (int)i;
+		}
+	}
+	if (id < 0)
+	{
+		id = (int)sinks.size();
+		sinks.push_back(NULL);
+	}
+	sinks[id] = sink;
+
+	pthread_mutex_unlock(&mutex);
+
+	return id;
+}
+
+
+void PacketDistributorImpl::RemoveSink(int id)
+{
+	pthread_mutex_lock(&mutex);
+
+	PacketSink * sink = NULL;
+	if (id >= 0 && id < (int)sinks.size())
+	{
+		sink = sinks[id];
+		sinks[id] = NULL;
+	}
+
+	pthread_mutex_unlock(&mutex);
+
+	if (sink == NULL)
+	{
+		return;
+	}
+
+	// Also wakes a Deliver() that waits for room in the queue.
+	sink->queue->Close();
+	pthread_join(sink->thread, NULL);
+
+	pthread_mutex_lock(&mutex);
+	while (sink->refs > 0)
+	{
+		pthread_cond_wait(&released, &mutex);
+	}
+	pthread_mutex_unlock(&mutex);
+
+	QueueStats qs;
+	sink->queue->GetStats(&qs, false);
+
+	LOG_INFO("%s: sink %s: %llu packets, %llu dropped, %llu skipped, queue max %u\n",
+		name.c_str(), sink->name.c_str(), qs.popped, qs.dropped, sink->skipped, qs.maxDepth);
+
+	sink->queue->Destory();
+	delete sink;
+}
+
+
+void PacketDistributorImpl::Deliver(const AVPacket * packet)
+{
+	if (packet == NULL)
+	{
+		return;
+	}
+
+	bool key = (packet->flags & AV_PKT_FLAG_KEY) != 0;
+
+	// Push outside the mutex: a blocking sink that waits for room must
+	// not hold up AddSink() and RemoveSink().
+	pthread_mutex_lock(&mutex);
+
+	delivering.clear();
+	for (size_t i = 0; i < sinks.size(); i++)
+	{
+		if (sinks[i])
+		{
+			sinks[i]->refs++;
+			delivering.push_back(sinks[i]);
+		}
+	}
+
+	pthread_mutex_unlock(&mutex);
+
+	// Each reference goes as soon as the sink has the packet, so that
+	// removing one sink does not wait for a slower one.
+	for (size_t i = 0; i < delivering.size(); i++)
+	{
+		DeliverToSink(delivering[i], packet, key);
+
+		pthread_mutex_lock(&mutex);
+		delivering[i]->refs--;
+		pthread_cond_broadcast(&released);
+		pthread_mutex_unlock(&mutex);
+	}
+}
+
+
+void PacketDistributorImpl::DeliverToSink(PacketSink * sink, const AVPacket * packet, bool key)
+{
+	if (sink->waitKey && !key)
+	{
+		sink->skipped++;
+		return;
+	}
+	sink->waitKey = false;
+
+	AVPacket * pkt = av_packet_clone((AVPacket *)packet);
+	if (pkt == NULL)
+	{
+		sink->waitKey = true;
+		return;
+	}
+
+	if (sink->queue->Push(pkt))
+	{
+		return;
+	}
+
+	// The queued packets after a dropped oldest one cannot be decoded
+	// either. A key frame does not depend on them: it stays, and starts
+	// the next GOP.
+	if (sink->policy == QUEUE_DROP_OLDEST)
+	{
+		sink->queue->Flush();
+
+		pkt = key ? av_packet_clone((AVPacket *)packet) : NULL;
+		if (pkt && sink->queue->Push(pkt))
+		{
+			return;
+		}
+	}
+	sink->waitKey = true;
+}
+
+
+void * PacketDistributorImpl::ThreadProc(void * arg)
+{
+	PacketSink * sink = (PacketSink *)arg;
+
+	for (;;)
+	{
+		AVPacket * pkt = (AVPacket *)sink->queue->Pop();
+		if (pkt == NULL)
+		{
+			break;
+		}
+
+		sink->fn(sink->ctx, pkt);
+		av_packet_free(&pkt);
+	}
+
+	return NULL;
+}
@@ -0,0 +1,41 @@
+
+#pragma once
+
+// Handles one packet on the thread of a sink. The packet belongs to the
+// distributor.
+typedef void (*PACKET_SINK_FN)(void * ctx, const AVPacket * packet);
+
+// Delivers the packets of one encoded stream to any number of sinks, e.g.
+// a file and a muxer. Every sink has its own thread and a bounded queue
+// with its own drop policy, and gets a reference to each packet, never a
+// copy of the data. A sink that drops the newest packets, or the oldest,
+// never holds up the encoder or the other sinks; a blocking sink holds up
+// Deliver() when its queue is full.
+//
+// A packet depends on the ones before it back to the last key frame. A
+// sink that drops a packet therefore skips the rest of the GOP and
+// resumes at the next key frame; a sink that drops the oldest packet
+// loses everything it has queued. A sink starts at a key frame.
+//
+// Sinks may be added and removed while packets are delivered.
+class PacketDistributor
+{
+
+public:
+
+	static PacketDistributor * Create(const char * name);
+	virtual void Destory() = 0;
+
+	// Returns the sink id, or -1.
+	virtual int AddSink(const char * name, PACKET_SINK_FN fn, void * ctx,
+		uint32_t capacity, QUEUE_DROP_POLICY policy) = 0;
+
+	// Passes the queued packets to the sink, stops its thread and logs
+	// its statistics.
+	virtual void RemoveSink(int sink) = 0;
+
+	// Queues a reference to packet for every sink. Called from one
+	// thread at a time.
+	virtual void Deliver(const AVPacket * packet) = 0;
+
+};
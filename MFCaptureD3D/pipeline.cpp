@@ -0,0 +1,546 @@
+
+#include "MFCaptureD3D.h"
+
+#include <string>
+#include <vector>
+
+
+static void * CloneFrameItem(void * item)
+{
+	return av_frame_clone((const AVFrame *)item);
+}
+
+static void FreeFrameItem(void * item)
+{
+	AVFrame * frame = (AVFrame *)item;
+	av_frame_free(&frame);
+}
+
+static void * ClonePacketItem(void * item)
+{
+	return av_packet_clone((AVPacket *)item);
+}
+
+static void FreePacketItem(void * item)
+{
+	AVPacket * pkt = (AVPacket *)item;
+	av_packet_free(&pkt);
+}
+
+const PipeItemOps g_AVFrameItemOps = { CloneFrameItem, FreeFrameItem };
+const PipeItemOps g_AVPacketItemOps = { ClonePacketItem, FreePacketItem };
+
+
+class PipelineImpl;
+
+struct PipeEdge
+{
+	int from;
+	int to;
+
+	// Since the last LogStats(). Guarded by the stats mutex.
+	uint64_t items;
+	uint64_t dropped;
+	int64_t latencySum;
+	int64_t latencyMax;
+};
+
+// Queue entry: the item plus what is needed to account for it.
+struct PipeEnvelope
+{
+	void * item;
+	int64_t queued;
+	int edge;
+	PipelineImpl * pipeline;
+};
+
+class PipeNodeOutput : public PipelineOutput
+{
+
+public:
+	void Emit(void * item);
+	void Discard();
+
+	PipelineImpl * pipeline = NULL;
+	int node = -1;
+};
+
+struct PipeNode
+{
+	std::string name;
+	NODE_PROCESS_FN fn = NULL;
+	void * ctx = NULL;
+	const PipeItemOps * ops = NULL;
+
+	MediaQueue * input = NULL;		// NULL for sources.
+	std::vector<int> edges;			// Outgoing edges.
+
+	pthread_t thread;
+	bool running = false;
+
+	PipeNodeOutput output;
+
+	// Since the last LogStats(). Guarded by the stats mutex.
+	uint64_t processed = 0;
+	uint64_t discarded = 0;
+	int64_t busy = 0;
+};
+
+
+class PipelineImpl : public Pipeline
+{
+
+public:
+	PipelineImpl();
+	~PipelineImpl();
+
+	void Create(const char * name);
+	void Destory();
+
+	int AddSource(const char * name, const PipeItemOps * ops);
+	int AddNode(const char * name, NODE_PROCESS_FN fn, void * ctx,
+		uint32_t capacity, QUEUE_DROP_POLICY policy, const PipeItemOps * ops);
+	int Connect(int from, int to);
+
+	int Start();
+	void Stop();
+
+	void Push(int source, void * item);
+
+	uint32_t GetQueueDepth(int node);
+
+	void LogStats();
+
+	friend class PipeNodeOutput;
+
+private:
+	void Init();
+	void Uninit();
+
+	void Emit(int node, void * item);
+	void FreeItem(int node, void * item);
+
+	static void FreeEnvelope(void * item);
+	static void * ThreadProc(void * arg);
+	void NodeLoop(PipeNode * node);
+
+	struct ThreadArg
+	{
+		PipelineImpl * pipeline;
+		PipeNode * node;
+	};
+
+private:
+	std::string name;
+	std::vector<PipeNode *> nodes;
+	std::vector<PipeEdge> edges;
+	std::vector<ThreadArg> threadArgs;
+
+	bool running = false;
+	int64_t statsStart = 0;
+
+	pthread_mutex_t statsmutex;
+};
+
+
+Pipeline * Pipeline::Create(const char * name) {
+
+	PipelineImpl * pipeline = new PipelineImpl();
+	if (pipeline)
+	{
+		pipeline->Create(name);
+	}
+
+	return pipeline;
+
+}
+
+
+PipelineImpl::PipelineImpl()
+{
+	Init();
+}
+
+
+PipelineImpl::~PipelineImpl()
+{
+	Uninit();
+}
+
+
+void PipelineImpl::Init()
+{
+	pthread_mutex_init(&statsmutex, NULL);
+}
+
+
+void PipelineImpl::Uninit()
+{
+	pthread_mutex_destroy(&statsmutex);
+}
+
+
+void PipelineImpl::Create(const char * _name)
+{
+	name = _name ? _name : "pipeline";
+}
+
+
+void PipelineImpl::Destory()
+{
+	Stop();
+
+	for (size_t i = 0; i < nodes.size(); i++)
+	{
+		if (nodes[i]->input)
+		{
+			nodes[i]->input->Destory();
+		}
+		delete nodes[i];
+	}
+	nodes.clear();
+
+	delete this;
+}
+
+
+int PipelineImpl::AddSource(const char * _name, const PipeItemOps * ops)
+{
+	if (running)
+	{
+		return -1;
+	}
+
+	PipeNode * node = new PipeNode();
+	node->name = _name;
+	node->ops = ops;
+	node->output.pipeline = this;
+	node->output.node = (int)nodes.size();
+
+	nodes.push_back(node);
+	return node->output.node;
+}
+
+
+int PipelineImpl::AddNode(const char * _name, NODE_PROCESS_FN fn, void * ctx,
+	uint32_t capacity, QUEUE_DROP_POLICY policy, const PipeItemOps * ops)
+{
+	if (running || fn == NULL)
+	{
+		return -1;
+	}
+
+	MediaQueue * input = MediaQueue::Create(capacity, policy, FreeEnvelope);
+	if (input == NULL)
+	{
+		return -1;
+	}
+
+	PipeNode * node = new PipeNode();
+	node->name = _name;
+	node->fn = fn;
+	node->ctx = ctx;
+	node->ops = ops;
+	node->input = input;
+	node->output.pipeline = this;
+	node->output.node = (int)nodes.size();
+
+	nodes.push_back(node);
+	return node->output.node;
+}
+
+
+int PipelineImpl::Connect(int from, int to)
+{
+	if (running ||
+		from < 0 || from >= (int)nodes.size() ||
+		to < 0 || to >= (int)nodes.size() ||
+		nodes[to]->input == NULL || nodes[from]->ops == NULL)
+	{
+		return -1;
+	}
+
+	PipeEdge edge = { from, to, 0, 0, 0, 0 };
+	edges.push_back(edge);
+	nodes[from]->edges.push_back((int)edges.size() - 1);
+
+	return (int)edges.size() - 1;
+}
+
+
+int PipelineImpl::Start()
+{
+	if (running)
+	{
+		return 0;
+	}
+
+	// Thread arguments must not move once the threads run.
+	threadArgs.resize(nodes.size());
+
+	running = true;
+	statsStart = av_gettime_relative();
+
+	for (size_t i = 0; i < nodes.size(); i++)
+	{
+		PipeNode * node = nodes[i];
+		if (node->input == NULL)
+		{
+			continue;
+		}
+
+		threadArgs[i].pipeline = this;
+		threadArgs[i].node = node;
+
+		if (pthread_create(&node->thread, NULL, ThreadProc, &threadArgs[i]) != 0)
+		{
+			LOG_ERR("%s: cannot start node %s\n", name.c_str(), node->name.c_str());
+			Stop();
+			return -1;
+		}
+		node->running = true;
+	}
+
+	return 0;
+}
+
+
+void PipelineImpl::Stop()
+{
+	if (!running)
+	{
+		return;
+	}
+	running = false;
+
+	for (size_t i = 0; i < nodes.size(); i++)
+	{
+		PipeNode * node = nodes[i];
+
+		if (node->input)
+		{
+			node->input->Close();
+		}
+		if (node->running)
+		{
+			pthread_join(node->thread, NULL);
+			node->running = false;
+		}
+	}
+
+	LogStats();
+}
+
+
+void PipelineImpl::Push(int source, void * item)
+{
+	if (source < 0 || source >= (int)nodes.size() || item == NULL)
+	{
+		return;
+	}
+
+	if (!running)
+	{
+		FreeItem(source, item);
+		return;
+	}
+
+	Emit(source, item);
+}
+
+
+uint32_t PipelineImpl::GetQueueDepth(int node)
+{
+	if (node < 0 || node >= (int)nodes.size() || nodes[node]->input == NULL)
+	{
+		return 0;
+	}
+
+	QueueStats qs;
+	nodes[node]->input->GetStats(&qs, false);
+
+	return qs.depth;
+}
+
+
+void PipelineImpl::FreeItem(int node, void * item)
+{
+	const PipeItemOps * ops = nodes[node]->ops;
+	if (ops && ops->free && item)
+	{
+		ops->free(item);
+	}
+}
+
+
+void PipeNodeOutput::Emit(void * item)
+{
+	pipeline->Emit(node, item);
+}
+
+
+void PipeNodeOutput::Discard()
+{
+	pthread_mutex_lock(&pipeline->statsmutex);
+	pipeline->nodes[node]->discarded++;
+	pthread_mutex_unlock(&pipeline->statsmutex);
+}
+
+
+void PipelineImpl::Emit(int from, void * item)
+{
+	PipeNode * node = nodes[from];
+
+	if (item == NULL)
+	{
+		return;
+	}
+
+	if (node->edges.empty())
+	{
+		FreeItem(from, item);
+		return;
+	}
+
+	int64_t now = av_gettime_relative();
+
+	for (size_t i = 0; i < node->edges.size(); i++)
+	{
+		int e = node->edges[i];
+		bool last = (i == node->edges.size() - 1);
+
+		// The last edge takes the item itself, the others a reference.
+		void * it = last ? item : node->ops->clone(item);
+		if (it == NULL)
+		{
+			continue;
+		}
+
+		PipeEnvelope * env = new PipeEnvelope();
+		env->item = it;
+		env->queued = now;
+		env->edge = e;
+		env->pipeline = this;
+
+		pthread_mutex_lock(&statsmutex);
+		edges[e].items++;
+		pthread_mutex_unlock(&statsmutex);
+
+		nodes[edges[e].to]->input->Push(env);
+	}
+}
+
+
+// Queue free callback: the item was dropped, or left over at shutdown.
+void PipelineImpl::FreeEnvelope(void * item)
+{
+	PipeEnvelope * env = (PipeEnvelope *)item;
+	PipelineImpl * pipeline = env->pipeline;
+	PipeEdge & edge = pipeline->edges[env->edge];
+
+	pthread_mutex_lock(&pipeline->statsmutex);
+	edge.dropped++;
+	pthread_mutex_unlock(&pipeline->statsmutex);
+
+	pipeline->FreeItem(edge.from, env->item);
+	delete env;
+}
+
+
+void * PipelineImpl::ThreadProc(void * arg)
+{
+	ThreadArg * ta = (ThreadArg *)arg;
+	ta->pipeline->NodeLoop(ta->node);
+	return NULL;
+}
+
+
+void PipelineImpl::NodeLoop(PipeNode * node)
+{
+	PipeEnvelope * env = NULL;
+
+	while ((env = (PipeEnvelope *)node->input->Pop()) != NULL)
+	{
+		int64_t start = av_gettime_relative();
+		int64_t latency = start - env->queued;
+		void * item = env->item;
+
+		pthread_mutex_lock(&statsmutex);
+		PipeEdge & edge = edges[env->edge];
+		edge.latencySum += latency;
+		if (latency > edge.latencyMax)
+		{
+			edge.latencyMax = latency;
+		}
+		pthread_mutex_unlock(&statsmutex);
+
+		delete env;
+
+		node->fn(node->ctx, item, &node->output);
+
+		int64_t busy = av_gettime_relative() - start;
+
+		pthread_mutex_lock(&statsmutex);
+		node->processed++;
+		node->busy += busy;
+		pthread_mutex_unlock(&statsmutex);
+	}
+
+	// End of stream.
+	node->fn(node->ctx, NULL, &node->output);
+}
+
+
+void PipelineImpl::LogStats()
+{
+	int64_t now = av_gettime_relative();
+	double elapsed = (double)(now - statsStart);
+	statsStart = now;
+
+	if (elapsed <= 0)
+	{
+		return;
+	}
+
+	pthread_mutex_lock(&statsmutex);
+
+	for (size_t i = 0; i < nodes.size(); i++)
+	{
+		PipeNode * node = nodes[i];
+		if (node->input == NULL)
+		{
+			continue;
+		}
+
+		LOG_INFO("%s: node %s: %llu items, %llu discarded, %.1f%% busy, %.2f ms/item\n",
+			name.c_str(), node->name.c_str(), node->processed, node->discarded,
+			100.0 * node->busy / elapsed,
+			node->processed ? node->busy / 1000.0 / node->processed : 0.0);
+
+		node->processed = 0;
+		node->discarded = 0;
+		node->busy = 0;
+	}
+
+	for (size_t i = 0; i < edges.size(); i++)
+	{
+		PipeEdge & edge = edges[i];
+		QueueStats qs = { 0 };
+		nodes[edge.to]->input->GetStats(&qs, true);
+
+		uint64_t delivered = edge.items - edge.dropped;
+
+		LOG_INFO("%s: %s -> %s: %llu items, %llu dropped, depth %u (max %u), latency %.2f ms (max %.2f ms)\n",
+			name.c_str(), nodes[edge.from]->name.c_str(), nodes[edge.to]->name.c_str(),
+			edge.items, edge.dropped, qs.depth, qs.maxDepth,
+			delivered ? edge.latencySum / 1000.0 / delivered : 0.0,
+			edge.latencyMax / 1000.0);
+
+		edge.items = 0;
+		edge.dropped = 0;
+		edge.latencySum = 0;
+		edge.latencyMax = 0;
+	}
+
+	pthread_mutex_unlock(&statsmutex);
+}
@@ -0,0 +1,78 @@
+
+#pragma once
+
+// Item operations of a node's output. clone returns a new reference to
+// item for fan-out (NULL on failure); free releases one.
+struct PipeItemOps
+{
+	void * (*clone)(void * item);
+	void   (*free)(void * item);
+};
+
+// Items that are AVFrame or AVPacket pointers. Fan-out adds a reference
+// to the buffers; the data is never copied.
+extern const PipeItemOps g_AVFrameItemOps;
+extern const PipeItemOps g_AVPacketItemOps;
+
+// Passed to a node's process function to send items downstream.
+class PipelineOutput
+{
+
+public:
+
+	// Takes ownership of item and pushes it to every connected node.
+	virtual void Emit(void * item) = 0;
+
+	// Counts an input item that the node dropped rather than processed,
+	// e.g. one that was already too late. Logged by LogStats().
+	virtual void Discard() = 0;
+
+};
+
+// Processes one input item, which the function owns. Called once more
+// with item == NULL after the input has been closed and drained, so
+// that the node can flush.
+typedef void (*NODE_PROCESS_FN)(void * ctx, void * item, PipelineOutput * out);
+
+// A graph of stages. Every node but a source runs on its own thread and
+// reads a bounded input queue, so a chain of stages runs as fast as its
+// slowest stage rather than the sum of all of them. Items are passed by
+// pointer; fan-out clones a reference, never the data.
+class Pipeline
+{
+
+public:
+
+	static Pipeline * Create(const char * name);
+	virtual void Destory() = 0;
+
+	// A source node has no thread: Push() emits items on the caller's thread.
+	virtual int AddSource(const char * name, const PipeItemOps * ops) = 0;
+
+	// A processing node with an input queue of capacity items. ops
+	// describes the items it emits; it may be NULL for a sink.
+	virtual int AddNode(const char * name, NODE_PROCESS_FN fn, void * ctx,
+		uint32_t capacity, QUEUE_DROP_POLICY policy, const PipeItemOps * ops) = 0;
+
+	// Connects the output of node from to the input of node to. Every
+	// edge keeps its own item, drop and latency statistics.
+	virtual int Connect(int from, int to) = 0;
+
+	virtual int Start() = 0;
+
+	// Closes the inputs one node at a time, in the order the nodes were
+	// added, letting each drain and flush before the next. Add nodes
+	// upstream first.
+	virtual void Stop() = 0;
+
+	// Emits item from a source node. The item is freed if the pipeline
+	// is not running.
+	virtual void Push(int source, void * item) = 0;
+
+	// Items waiting in the input queue of node. 0 for a source.
+	virtual uint32_t GetQueueDepth(int node) = 0;
+
+	// Logs per-node load and per-edge depth and latency since the last call.
+	virtual void LogStats() = 0;
+
+};
@@ -12,10 +12,128 @@
 //////////////////////////////////////////////////////////////////////////
 
 #include "MFCaptureD3D.h"
-#include "BufferLock.h"
 #include <shlwapi.h>
+#include <math.h>
 #include "VideoAttribute.h"
 
+// Number of frames between conversion timing reports.
+const UINT CONVERT_STATS_FRAMES = 300;
+
+// Number of frames between capture timing reports.
+const UINT CAPTURE_STATS_FRAMES = 300;
+
+// Frames the encoder may fall behind before frames are dropped.
+const UINT ENCODE_QUEUE_FRAMES = 8;
+
+// Frames waiting to be drawn. Only the newest one matters.
+const UINT PREVIEW_QUEUE_FRAMES = 2;
+
+// Wrapped capture samples held at once, by the preview and recording
+// stages, beyond which recording takes a copy. Media Foundation has only
+// a few capture buffers; held much longer, the source runs out.
+const LONG MAX_WRAPPED_SAMPLES = 4;
+
+// Queue sizes between the later stages, which block rather than drop.
+const UINT STAGE_QUEUE_FRAMES = 4;
+const UINT STAGE_QUEUE_PACKETS = 32;
+
+// Packets of a replaced encoder drained ahead of the h264-encode stage,
+// and packets of the new encoder held back meanwhile. A drain that
+// holds back more than this is waited for.
+const UINT DRAIN_QUEUE_PACKETS = STAGE_QUEUE_PACKETS;
+const UINT HELD_QUEUE_PACKETS = 64;
+
+// Bit rate of the H.264 recording.
+const int64_t H264_BIT_RATE = 4000000;
+
+// Packets between encoder latency reports.
+const UINT LATENCY_STATS_FRAMES = 300;
+
+// Frames waiting for the encoder at which the speed control steps at
+// once: the h264-encode queue is full and the convert queue, which
+// drops when full, is half full.
+const UINT ENCODE_QUEUE_LIMIT = STAGE_QUEUE_FRAMES + ENCODE_QUEUE_FRAMES / 2;
+
+// Threads that scale the encoder input in bands.
+const DWORD MAX_SCALE_THREADS = 4;
+
+// Slice threads of the FFV1 archive.
+const DWORD MAX_ARCHIVE_THREADS = 8;
+
+// Filter of the encoder input. The preview draws with its own kernels,
+// so the recording can afford the sharper filter.
+const int ENCODE_SCALE_FLAGS = SWS_BICUBIC;
+
+// Record files. Raw video is written past the system cache, which it
+// would only flush out, in room reserved a few seconds at a time.
+const RecordFileConfig YUV_FILE_CONFIG = { 8 << 20, 3, TRUE, 256 << 20 };
+const RecordFileConfig H264_FILE_CONFIG = { 1 << 20, 2, FALSE, 16 << 20 };
+const RecordFileConfig RAW_SIDECAR_FILE_CONFIG = { 64 << 10, 2, FALSE, 0 };
+
+// Packets a record sink may fall behind by, about 8 s at 30 fps, before
+// it drops what it holds and resumes at the next key frame.
+const UINT SINK_QUEUE_PACKETS = 256;
+
+// Age, from capture, after which a frame is no longer written to the
+// YUV file. The encoded outputs take the budget of their profile.
+const INT64 YUV_LATENCY_BUDGET = 4000000;   // us
+
+// Time base of the Media Foundation sample times.
+const AVRational MF_TIME_BASE = { 1, 10000000 };
+
+static const char * EncoderInputName(ENCODER_INPUT input)
+{
+    switch (input)
+    {
+    case ENCODER_INPUT_DIRECT:  return "direct";
+    case ENCODER_INPUT_YUY2:    return "yuy2-to-i420";
+    default:                    return "sws_scale";
+    }
+}
+
+// Nominal frame duration in units of 1/uUnits s, or 0 if the rate is
+// not known.
+static INT64 FrameDuration(const MFRatio &rate, INT64 uUnits)
+{
+    return rate.Numerator > 0 ? av_rescale(uUnits, rate.Denominator, rate.Numerator) : 0;
+}
+
+// Time since the capture callback received the frame, in us.
+static INT64 FrameAge(const AVFrame *pFrame)
+{
+    return pFrame->reordered_opaque ? av_gettime_relative() - pFrame->reordered_opaque : 0;
+}
+
+// TRUE if an Annex B packet holds slices and no other picture refers to
+// any of them (nal_ref_idc 0), so that it can be left out of the stream.
+static BOOL IsNonReferencePacket(const AVPacket *pPacket)
+{
+    BOOL bSlice = FALSE;
+
+    for (int i = 0; i + 3 < pPacket->size; i++)
+    {
+        if (pPacket->data[i] != 0 || pPacket->data[i + 1] != 0 || pPacket->data[i + 2] != 1)
+        {
+            continue;
+        }
+
+        BYTE nal = pPacket->data[i + 3];
+        int type = nal & 0x1F;
+
+        if (type == 1 || type == 5)
+        {
+            if ((nal & 0x60) != 0)
+            {
+                return FALSE;
+            }
+            bSlice = TRUE;
+        }
+        i += 3;
+    }
+
+    return bSlice;
+}
+
 //-------------------------------------------------------------------
 //  CreateInstance
 //
@@ -71,14 +189,95 @@ CPreview::CPreview(HWND hVideo, HWND hEvent) :
     m_cchSymbolicLink(0),
     m_codec(NULL),
     m_codecContext(NULL),
-	m_swsContext(NULL),
-    m_srcFrame(NULL),
+    m_scaler(NULL),
+    m_scalePool(NULL),
+    m_encoderInput(ENCODER_INPUT_SWSCALE),
+    m_encodeProfile(ENCODE_PROFILE_ARCHIVE),
+    m_llLatencySum(0),
+    m_llLatencyMax(0),
+    m_uLatencyFrames(0),
+    m_uNextInput(0),
+    m_llLastEncodeTimestamp(AV_NOPTS_VALUE),
+    m_llLastEncodePts(0),
+    m_llLastEncodeDts(AV_NOPTS_VALUE),
+    m_bEncoderReopened(FALSE),
+    m_drainContext(NULL),
+    m_drainQueue(NULL),
+    m_heldQueue(NULL),
+    m_uHeldPackets(0),
+    m_lDrainDone(0),
+    m_lForceKeyFrame(0),
+    m_speedControl(NULL),
+    m_iPreset(-1),
+    m_iProfilePreset(-1),
+    m_bSimulcast(FALSE),
+    m_simulcast(NULL),
+    m_simulcastPool(NULL),
+    m_llConvertTime(0),
+    m_uConvertFrames(0),
+    m_pipeline(NULL),
+    m_captureSource(-1),
+    m_recordSource(-1),
+    m_rawSource(-1),
+    m_convertNode(-1),
+    m_encodeNode(-1),
+    m_framePool(NULL),
+    m_lWrappedSamples(0),
+    m_encPool(NULL),
+    m_packetSinks(NULL),
+    m_h264Sink(-1),
+    m_mp4Sink(-1),
+    m_llLastArrival(0),
+    m_llLastTimestamp(0),
+    m_uCaptureFrames(0),
+    m_llIntervalSum(0),
+    m_llIntervalSqSum(0),
+    m_llIntervalMax(0),
+    m_uSourceGaps(0),
     m_dstFrame(NULL),
 	m_videoPool(NULL),
     h264file(NULL),
-    yuvfile(NULL)
+    yuvfile(NULL),
+    yuvindex(NULL),
+    m_uYUVFrames(0),
+    m_ullYUVBytes(0),
+    m_bRawNative(FALSE),
+    m_bRecordIndex(FALSE),
+    m_bArchive(FALSE),
+    m_archive(NULL),
+    m_iArchiveThreads(1),
+    rawfile(NULL),
+    rawsidecar(NULL),
+    rawindex(NULL),
+    m_uRawFrames(0),
+    m_ullRawBytes(0),
+    m_mp4Writer(NULL),
+    m_iMP4Stream(-1)
 {
     InitializeCriticalSection(&m_critsec);
+    InitializeCriticalSection(&m_drawsec);
+    InitializeCriticalSection(&m_filesec);
+    InitializeCriticalSection(&m_simulcastsec);
+
+    ZeroMemory(m_simulcastFiles, sizeof(m_simulcastFiles));
+
+    SYSTEM_INFO si;
+    GetSystemInfo(&si);
+
+    m_scalePool = WorkerPool::Create(min(si.dwNumberOfProcessors, MAX_SCALE_THREADS));
+    m_scaler = SliceScaler::Create(m_scalePool);
+
+    m_speedControl = SpeedControl::Create();
+    // The rungs are encoded on a pool of their own: an encode holds its
+    // pool for the whole x264 call, and the encoder input is scaled on
+    // m_scalePool meanwhile.
+    m_simulcastPool = WorkerPool::Create(min(si.dwNumberOfProcessors, (DWORD)MAX_SIMULCAST_RUNGS));
+    m_simulcast = Simulcast::Create(m_simulcastPool);
+
+    m_archive = ArchiveWriter::Create();
+    m_iArchiveThreads = (int)min(si.dwNumberOfProcessors, MAX_ARCHIVE_THREADS);
+
+    m_packetSinks = PacketDistributor::Create("h264");
 }
 
 //-------------------------------------------------------------------
@@ -89,8 +288,53 @@ CPreview::~CPreview()
 {
     CloseDevice();
 
+    if (m_scaler)
+    {
+        m_scaler->Destory();
+        m_scaler = NULL;
+    }
+
+    if (m_scalePool)
+    {
+        m_scalePool->Destory();
+        m_scalePool = NULL;
+    }
+
+    if (m_speedControl)
+    {
+        m_speedControl->Destory();
+        m_speedControl = NULL;
+    }
+
+    if (m_simulcast)
+    {
+        m_simulcast->Destory();
+        m_simulcast = NULL;
+    }
+
+    if (m_simulcastPool)
+    {
+        m_simulcastPool->Destory();
+        m_simulcastPool = NULL;
+    }
+
+    if (m_archive)
+    {
+        m_archive->Destory();
+        m_archive = NULL;
+    }
+
+    if (m_packetSinks)
+    {
+        m_packetSinks->Destory();
+        m_packetSinks = NULL;
+    }
+
     m_draw.DestroyDevice();
 
+    DeleteCriticalSection(&m_simulcastsec);
+    DeleteCriticalSection(&m_filesec);
+    DeleteCriticalSection(&m_drawsec);
     DeleteCriticalSection(&m_critsec);
 }
 
@@ -127,6 +371,8 @@ HRESULT CPreview::CloseDevice()
     m_pwszSymbolicLink = NULL;
     m_cchSymbolicLink = 0;
 
+    // Drains and flushes every stage before the codec goes away.
+    StopPipeline();
     UninitCodec();
 
     LeaveCriticalSection(&m_critsec);
@@ -134,179 +380,1447 @@ HRESULT CPreview::CloseDevice()
 }
 
 
-/////////////// IUnknown methods ///////////////
-
+/////////////// IUnknown methods ///////////////
+
+//-------------------------------------------------------------------
+//  AddRef
+//-------------------------------------------------------------------
+
+ULONG CPreview::AddRef()
+{
+    return InterlockedIncrement(&m_nRefCount);
+}
+
+
+//-------------------------------------------------------------------
+//  Release
+//-------------------------------------------------------------------
+
+ULONG CPreview::Release()
+{
+    ULONG uCount = InterlockedDecrement(&m_nRefCount);
+    if (uCount == 0)
+    {
+        delete this;
+    }
+    // For thread safety, return a temporary variable.
+    return uCount;
+}
+
+
+
+//-------------------------------------------------------------------
+//  QueryInterface
+//-------------------------------------------------------------------
+
+HRESULT CPreview::QueryInterface(REFIID riid, void** ppv)
+{
+    static const QITAB qit[] =
+    {
+        QITABENT(CPreview, IMFSourceReaderCallback),
+        { 0 },
+    };
+    return QISearch(this, qit, riid, ppv);
+}
+
+
+/////////////// IMFSourceReaderCallback methods ///////////////
+
+//-------------------------------------------------------------------
+// OnReadSample
+//
+// Called when the IMFMediaSource::ReadSample method completes.
+//-------------------------------------------------------------------
+
+HRESULT CPreview::OnReadSample(
+    HRESULT hrStatus,
+    DWORD /* dwStreamIndex */,
+    DWORD /* dwStreamFlags */,
+    LONGLONG llTimestamp,
+    IMFSample *pSample      // Can be NULL
+    )
+{
+    HRESULT hr = S_OK;
+    AVFrame *pFrame = NULL;
+
+    EnterCriticalSection(&m_critsec);
+
+    if (FAILED(hrStatus))
+    {
+        hr = hrStatus;
+    }
+
+    if (SUCCEEDED(hr) && pSample)
+    {
+        UpdateCaptureStats(llTimestamp);
+
+        // Wrap the video frame buffer in an AVFrame. The buffer stays
+        // locked, and the sample referenced, until the last reference
+        // to the frame is released.
+
+        hr = CreateFrameFromSample(
+            pSample,
+            (AVPixelFormat)m_videoAttribute.m_iPixFmt,
+            m_videoAttribute.m_uWidth,
+            m_videoAttribute.m_uHeight,
+            m_videoAttribute.m_uStride,
+            &m_lWrappedSamples,
+            &pFrame
+            );
+
+        // The arrival time travels with the frame and its copies, for
+        // the latency budget, and the sample time for the encoder pts.
+        if (SUCCEEDED(hr))
+        {
+            pFrame->reordered_opaque = m_llLastArrival;
+            pFrame->pts = llTimestamp;
+        }
+
+        if (SUCCEEDED(hr) && m_pipeline)
+        {
+            // Native frames need no conversion: the raw-write stage
+            // writes them from the locked buffer, or from a copy once
+            // too many capture buffers are held, as for recording.
+            if (m_bRawNative && m_bYUVRecordStatus == TRUE)
+            {
+                AVFrame *pRaw = NULL;
+
+                if (m_lWrappedSamples <= MAX_WRAPPED_SAMPLES)
+                {
+                    pRaw = av_frame_clone(pFrame);
+                }
+                else if (FAILED(CopyFrameToPool(m_framePool, pFrame, &pRaw)))
+                {
+                    pRaw = NULL;
+                }
+
+                if (pRaw)
+                {
+                    m_pipeline->Push(m_rawSource, pRaw);
+                }
+            }
+
+            // The encoder takes the capture format as is: record the
+            // wrapped frame itself, while few enough capture buffers are
+            // held. The queues of the recording stages together hold
+            // far more frames than the source has buffers; once the
+            // stages fall behind, frames are copied until they catch up.
+            //
+            // A frame that is converted anyway is recorded as a copy.
+            // Copying, rather than holding a reference, gives the capture
+            // buffer back to the source as soon as the frame is drawn,
+            // however far behind the conversion is.
+            if ((m_bYUVRecordStatus == TRUE && !m_bRawNative) || m_bH264RecordStatus == TRUE ||
+                m_bMP4RecordStatus == TRUE)
+            {
+                AVFrame *pRecord = NULL;
+
+                if (m_encoderInput == ENCODER_INPUT_DIRECT &&
+                    m_lWrappedSamples <= MAX_WRAPPED_SAMPLES)
+                {
+                    pRecord = av_frame_clone(pFrame);
+                }
+                else if (FAILED(CopyFrameToPool(m_framePool, pFrame, &pRecord)))
+                {
+                    pRecord = NULL;
+                }
+
+                if (pRecord)
+                {
+                    m_pipeline->Push(m_recordSource, pRecord);
+                }
+            }
+
+            // The preview stage takes the frame itself.
+            m_pipeline->Push(m_captureSource, pFrame);
+            pFrame = NULL;
+        }
+    }
+
+    // Request the next frame before drawing, so the source never waits
+    // for the preview.
+    if (SUCCEEDED(hr))
+    {
+        hr = m_pReader->ReadSample(
+            (DWORD)MF_SOURCE_READER_FIRST_VIDEO_STREAM,
+            0,
+            NULL,   // actual
+            NULL,   // flags
+            NULL,   // timestamp
+            NULL    // sample
+            );
+    }
+
+    // Without a pipeline, draw the frame here.
+    if (SUCCEEDED(hr) && pFrame)
+    {
+        EnterCriticalSection(&m_drawsec);
+        hr = m_draw.DrawFrame(pFrame->data[0], pFrame->linesize[0]);
+        LeaveCriticalSection(&m_drawsec);
+    }
+
+    if (FAILED(hr))
+    {
+        NotifyError(hr);
+    }
+
+    // Unlocks the capture buffer and releases the sample.
+    av_frame_free(&pFrame);
+
+    LeaveCriticalSection(&m_critsec);
+    return hr;
+}
+
+
+//-------------------------------------------------------------------
+// UpdateCaptureStats
+//
+// Tracks the interval between capture callbacks and gaps in the
+// sample times, and logs them with the pipeline statistics.
+//-------------------------------------------------------------------
+
+void CPreview::UpdateCaptureStats(LONGLONG llTimestamp)
+{
+    INT64 llNow = av_gettime_relative();
+
+    if (m_llLastArrival != 0)
+    {
+        INT64 llInterval = llNow - m_llLastArrival;
+
+        m_llIntervalSum += llInterval;
+        m_llIntervalSqSum += llInterval * llInterval;
+        if (llInterval > m_llIntervalMax)
+        {
+            m_llIntervalMax = llInterval;
+        }
+        m_uCaptureFrames++;
+
+        // A step of more than 1.5 frames in the sample times means the
+        // source dropped frames.
+        LONGLONG llFrame = FrameDuration(m_videoAttribute.m_frameRate, 10000000);
+
+        if (llFrame > 0)
+        {
+            LONGLONG llDelta = llTimestamp - m_llLastTimestamp;
+
+            if (llDelta > llFrame * 3 / 2)
+            {
+                m_uSourceGaps += (UINT)((llDelta + llFrame / 2) / llFrame - 1);
+            }
+        }
+    }
+
+    m_llLastArrival = llNow;
+    m_llLastTimestamp = llTimestamp;
+
+    if (m_uCaptureFrames == CAPTURE_STATS_FRAMES)
+    {
+        double mean = (double)m_llIntervalSum / m_uCaptureFrames;
+        double var = (double)m_llIntervalSqSum / m_uCaptureFrames - mean * mean;
+
+        LOG_INFO("capture: interval %.2f ms, jitter %.2f ms, max %.2f ms, source drops %u\n",
+            mean / 1000.0, sqrt(var > 0 ? var : 0) / 1000.0, m_llIntervalMax / 1000.0, m_uSourceGaps);
+
+        if (m_pipeline)
+        {
+            m_pipeline->LogStats();
+        }
+
+        m_uCaptureFrames = 0;
+        m_llIntervalSum = 0;
+        m_llIntervalSqSum = 0;
+        m_llIntervalMax = 0;
+    }
+}
+
+
+//-------------------------------------------------------------------
+// StartPipeline
+//
+// Creates the frame pools and starts the capture graph. Each stage
+// runs on its own thread, so capture, drawing, conversion, encoding
+// and writing overlap instead of running one after the other.
+//-------------------------------------------------------------------
+
+HRESULT CPreview::StartPipeline()
+{
+    int size = av_image_get_buffer_size((AVPixelFormat)m_videoAttribute.m_iPixFmt,
+        m_videoAttribute.m_uWidth, m_videoAttribute.m_uHeight, 32);
+
+    if (size <= 0)
+    {
+        return E_FAIL;
+    }
+
+    m_framePool = av_buffer_pool_init(size, NULL);
+
+    if (m_dstFrame && m_encoderInput != ENCODER_INPUT_DIRECT)
+    {
+        size = av_image_get_buffer_size((AVPixelFormat)m_dstFrame->format,
+            m_dstFrame->width, m_dstFrame->height, 32);
+
+        m_encPool = size > 0 ? av_buffer_pool_init(size, NULL) : NULL;
+    }
+
+    m_pipeline = Pipeline::Create("video");
+
+    if (m_framePool == NULL || m_pipeline == NULL ||
+        (m_dstFrame && m_encoderInput != ENCODER_INPUT_DIRECT && m_encPool == NULL))
+    {
+        StopPipeline();
+        return E_OUTOFMEMORY;
+    }
+
+    // Stages are stopped in the order they are added: upstream first.
+    m_captureSource = m_pipeline->AddSource("capture", &g_AVFrameItemOps);
+    int preview = m_pipeline->AddNode("preview", DrawNode, this,
+        PREVIEW_QUEUE_FRAMES, QUEUE_DROP_OLDEST, NULL);
+
+    m_recordSource = m_pipeline->AddSource("record", &g_AVFrameItemOps);
+    m_convertNode = m_pipeline->AddNode("convert", ConvertNode, this,
+        ENCODE_QUEUE_FRAMES, QUEUE_DROP_OLDEST, &g_AVFrameItemOps);
+    int yuvWrite = m_pipeline->AddNode("yuv-write", YUVWriteNode, this,
+        STAGE_QUEUE_FRAMES, QUEUE_BLOCK, NULL);
+    m_encodeNode = m_pipeline->AddNode("h264-encode", EncodeNode, this,
+        STAGE_QUEUE_FRAMES, QUEUE_BLOCK, &g_AVPacketItemOps);
+    int deliver = m_pipeline->AddNode("h264-deliver", DeliverNode, this,
+        STAGE_QUEUE_PACKETS, QUEUE_BLOCK, NULL);
+    int simulcast = m_pipeline->AddNode("simulcast", SimulcastNode, this,
+        ENCODE_QUEUE_FRAMES, QUEUE_DROP_OLDEST, NULL);
+
+    m_rawSource = m_pipeline->AddSource("raw", &g_AVFrameItemOps);
+    int rawWrite = m_pipeline->AddNode("raw-write", RawWriteNode, this,
+        ENCODE_QUEUE_FRAMES, QUEUE_DROP_OLDEST, NULL);
+
+    if (m_pipeline->Connect(m_captureSource, preview) < 0 ||
+        m_pipeline->Connect(m_recordSource, m_convertNode) < 0 ||
+        m_pipeline->Connect(m_convertNode, yuvWrite) < 0 ||
+        m_pipeline->Connect(m_convertNode, m_encodeNode) < 0 ||
+        m_pipeline->Connect(m_encodeNode, deliver) < 0 ||
+        m_pipeline->Connect(m_recordSource, simulcast) < 0 ||
+        m_pipeline->Connect(m_rawSource, rawWrite) < 0 ||
+        m_pipeline->Start() < 0)
+    {
+        StopPipeline();
+        return E_FAIL;
+    }
+
+    m_llLastArrival = 0;
+    m_llLastTimestamp = 0;
+    m_uCaptureFrames = 0;
+    m_llIntervalSum = 0;
+    m_llIntervalSqSum = 0;
+    m_llIntervalMax = 0;
+    m_uSourceGaps = 0;
+
+    return S_OK;
+}
+
+
+//-------------------------------------------------------------------
+// StopPipeline
+//
+// Lets every stage finish its queued items and flush, then frees the
+// graph and the frame pools.
+//-------------------------------------------------------------------
+
+void CPreview::StopPipeline()
+{
+    if (m_pipeline)
+    {
+        m_pipeline->Destory();
+        m_pipeline = NULL;
+    }
+
+    m_captureSource = -1;
+    m_recordSource = -1;
+    m_rawSource = -1;
+    m_convertNode = -1;
+    m_encodeNode = -1;
+
+    // Buffers still referenced are freed when their frames are.
+    av_buffer_pool_uninit(&m_framePool);
+    av_buffer_pool_uninit(&m_encPool);
+}
+
+
+/////////////// Pipeline stages ///////////////
+
+void CPreview::DrawNode(void *ctx, void *item, PipelineOutput * /* out */)
+{
+    AVFrame *pFrame = (AVFrame*)item;
+
+    if (pFrame)
+    {
+        ((CPreview*)ctx)->DrawFrame(pFrame);
+
+        // Unlocks the capture buffer and releases the sample.
+        av_frame_free(&pFrame);
+    }
+}
+
+
+void CPreview::RawWriteNode(void *ctx, void *item, PipelineOutput * /* out */)
+{
+    AVFrame *pFrame = (AVFrame*)item;
+
+    if (pFrame)
+    {
+        ((CPreview*)ctx)->WriteRawFrame(pFrame);
+        av_frame_free(&pFrame);
+    }
+}
+
+
+void CPreview::ConvertNode(void *ctx, void *item, PipelineOutput *out)
+{
+    AVFrame *pFrame = (AVFrame*)item;
+
+    if (pFrame)
+    {
+        ((CPreview*)ctx)->ConvertFrame(pFrame, out);
+        av_frame_free(&pFrame);
+    }
+}
+
+
+void CPreview::YUVWriteNode(void *ctx, void *item, PipelineOutput *out)
+{
+    AVFrame *pFrame = (AVFrame*)item;
+
+    if (pFrame)
+    {
+        ((CPreview*)ctx)->WriteYUVFrame(pFrame, out);
+        av_frame_free(&pFrame);
+    }
+}
+
+
+void CPreview::EncodeNode(void *ctx, void *item, PipelineOutput *out)
+{
+    AVFrame *pFrame = (AVFrame*)item;
+
+    // NULL at the end of the stream flushes the encoder.
+    ((CPreview*)ctx)->EncodeFrame(pFrame, out);
+    av_frame_free(&pFrame);
+}
+
+
+void CPreview::DeliverNode(void *ctx, void *item, PipelineOutput * /* out */)
+{
+    AVPacket *pPacket = (AVPacket*)item;
+
+    if (pPacket)
+    {
+        ((CPreview*)ctx)->m_packetSinks->Deliver(pPacket);
+        av_packet_free(&pPacket);
+    }
+}
+
+
+void CPreview::SimulcastNode(void *ctx, void *item, PipelineOutput *out)
+{
+    AVFrame *pFrame = (AVFrame*)item;
+
+    if (pFrame)
+    {
+        ((CPreview*)ctx)->EncodeSimulcast(pFrame, out);
+        av_frame_free(&pFrame);
+    }
+}
+
+
+void CPreview::SimulcastPacket(void *ctx, int rung, const AVPacket *pPacket)
+{
+    // Each rung has its own file, written from one thread at a time.
+    FileWriter *pFile = ((CPreview*)ctx)->m_simulcastFiles[rung];
+
+    if (pFile)
+    {
+        pFile->Write(pPacket->data, pPacket->size);
+    }
+}
+
+
+void CPreview::H264FileSink(void *ctx, const AVPacket *pPacket)
+{
+    ((CPreview*)ctx)->WriteH264Packet(pPacket);
+}
+
+
+void CPreview::MP4Sink(void *ctx, const AVPacket *pPacket)
+{
+    ((CPreview*)ctx)->WriteMP4Packet(pPacket);
+}
+
+
+//-------------------------------------------------------------------
+// DrawFrame
+//
+// Draws a captured frame. Runs on the preview stage.
+//-------------------------------------------------------------------
+
+void CPreview::DrawFrame(AVFrame *pFrame)
+{
+    EnterCriticalSection(&m_drawsec);
+
+    HRESULT hr = m_draw.DrawFrame(pFrame->data[0], pFrame->linesize[0]);
+
+    LeaveCriticalSection(&m_drawsec);
+
+    if (FAILED(hr))
+    {
+        NotifyError(hr);
+    }
+}
+
+
+//-------------------------------------------------------------------
+// ConvertFrame
+//
+// Converts a captured frame to the encoder format and emits it. Runs
+// on the convert stage.
+//-------------------------------------------------------------------
+
+void CPreview::ConvertFrame(AVFrame *pFrame, PipelineOutput *out)
+{
+    if (m_dstFrame == NULL)
+    {
+        return;
+    }
+
+    // Not worth converting if every output would drop it.
+    INT64 llBudget = 0;
+
+    if (m_bYUVRecordStatus == TRUE && !m_bRawNative)
+    {
+        llBudget = YUV_LATENCY_BUDGET;
+    }
+    if ((m_bH264RecordStatus == TRUE || m_bMP4RecordStatus == TRUE) && EncodeBudget() > llBudget)
+    {
+        llBudget = EncodeBudget();
+    }
+
+    if (llBudget > 0 && FrameAge(pFrame) > llBudget)
+    {
+        out->Discard();
+        return;
+    }
+
+    // The encoder takes the capture format: pass the wrapped capture
+    // frame on, by reference.
+    if (m_encoderInput == ENCODER_INPUT_DIRECT)
+    {
+        out->Emit(av_frame_clone(pFrame));
+        return;
+    }
+
+    AVFrame *pEncFrame = NULL;
+
+    if (FAILED(AllocFrameFromPool(m_encPool, (AVPixelFormat)m_dstFrame->format,
+        m_dstFrame->width, m_dstFrame->height, &pEncFrame)))
+    {
+        return;
+    }
+
+    INT64 llStart = av_gettime_relative();
+
+    switch (m_encoderInput)
+    {
+    case ENCODER_INPUT_YUY2:
+        ConvertYUY2ToI420(
+            pEncFrame->data[0], pEncFrame->linesize[0],
+            pEncFrame->data[1], pEncFrame->linesize[1],
+            pEncFrame->data[2], pEncFrame->linesize[2],
+            pFrame->data[0], pFrame->linesize[0],
+            pEncFrame->width, pEncFrame->height,
+            0, pEncFrame->height
+            );
+        break;
+
+    default:
+        if (m_scaler->Scale(pFrame->data, pFrame->linesize, pEncFrame->data, pEncFrame->linesize) < 0)
+        {
+            av_frame_free(&pEncFrame);
+            return;
+        }
+        break;
+    }
+
+    m_llConvertTime += av_gettime_relative() - llStart;
+    if (++m_uConvertFrames == CONVERT_STATS_FRAMES)
+    {
+        LOG_INFO("encoder input (%s): %lld us/frame\n",
+            EncoderInputName(m_encoderInput), m_llConvertTime / m_uConvertFrames);
+        m_llConvertTime = 0;
+        m_uConvertFrames = 0;
+    }
+
+    av_frame_copy_props(pEncFrame, pFrame);
+
+    out->Emit(pEncFrame);
+}
+
+
+//-------------------------------------------------------------------
+// WriteYUVFrame
+//
+// Appends an encoder input frame to the Y4M file, and its offset and
+// sample time to the index, unless it is older than YUV_LATENCY_BUDGET.
+// The stream header goes before the first frame. With /archive the
+// frame is compressed into the archive instead. Runs on the yuv-write
+// stage.
+//-------------------------------------------------------------------
+
+void CPreview::WriteYUVFrame(AVFrame *pFrame, PipelineOutput *out)
+{
+    EnterCriticalSection(&m_filesec);
+
+    if (m_bYUVRecordStatus == TRUE && (yuvfile || m_bArchive) && FrameAge(pFrame) > YUV_LATENCY_BUDGET)
+    {
+        out->Discard();
+    }
+    else if (m_bYUVRecordStatus == TRUE && m_bArchive)
+    {
+        WriteArchiveFrame(pFrame);
+    }
+    else if (m_bYUVRecordStatus == TRUE && yuvfile)
+    {
+        if (m_uYUVFrames == 0)
+        {
+            int cbHeader = WriteY4MHeader(yuvfile, pFrame->width, pFrame->height,
+                m_videoAttribute.m_frameRate, (AVPixelFormat)pFrame->format);
+
+            m_ullYUVBytes = cbHeader > 0 ? cbHeader : 0;
+        }
+
+        if (yuvindex)
+        {
+            WriteRecordIndex(yuvindex, m_ullYUVBytes + Y4M_FRAME_HEADER_SIZE, pFrame->pts);
+        }
+
+        int len = WriteY4MFrame(yuvfile, pFrame);
+        LOG_INFO("write %d byte data\n", len);
+
+        m_ullYUVBytes += len;
+        m_uYUVFrames++;
+    }
+
+    LeaveCriticalSection(&m_filesec);
+}
+
+
+//-------------------------------------------------------------------
+// WriteArchiveFrame
+//
+// Compresses a frame into the archive, which is opened for the format
+// of the first one. Called with m_filesec held.
+//-------------------------------------------------------------------
+
+void CPreview::WriteArchiveFrame(AVFrame *pFrame)
+{
+    if (m_uYUVFrames == 0 &&
+        m_archive->Open("video.mkv", pFrame->width, pFrame->height, (AVPixelFormat)pFrame->format,
+            av_make_q(m_videoAttribute.m_frameRate.Numerator, m_videoAttribute.m_frameRate.Denominator),
+            MF_TIME_BASE, m_iArchiveThreads) < 0)
+    {
+        LOG_ERR("cannot open video.mkv, YUV recording stopped\n");
+        m_bYUVRecordStatus = FALSE;
+        return;
+    }
+
+    if (m_archive->Write(pFrame) < 0)
+    {
+        LOG_ERR("video.mkv: write failed, YUV recording stopped\n");
+        CloseArchive();
+        m_bYUVRecordStatus = FALSE;
+        return;
+    }
+
+    if (++m_uYUVFrames % CONVERT_STATS_FRAMES == 0)
+    {
+        LogArchiveStats(TRUE);
+    }
+}
+
+
+//-------------------------------------------------------------------
+// LogArchiveStats
+//
+// Reports how far the archive compresses, and how fast: MB/s of raw
+// frames in the time spent encoding, and per encoder thread, which is
+// what a core sustains when the slices keep all of them busy.
+//-------------------------------------------------------------------
+
+void CPreview::LogArchiveStats(BOOL bReset)
+{
+    ArchiveStats stats;
+    m_archive->GetStats(&stats, bReset ? true : false);
+
+    if (stats.frames == 0 || stats.codedBytes == 0 || stats.encodeTime <= 0)
+    {
+        return;
+    }
+
+    double mbps = (double)stats.rawBytes / stats.encodeTime;
+
+    LOG_INFO("video.mkv: %u frames, ratio %.2f:1, %.1f ms/frame, %.1f MB/s, %.1f MB/s per thread (%d)\n",
+        stats.frames, (double)stats.rawBytes / stats.codedBytes,
+        stats.encodeTime / 1000.0 / stats.frames, mbps, mbps / max(stats.threads, 1), stats.threads);
+}
+
+
+//-------------------------------------------------------------------
+// CloseArchive
+//
+// Finishes video.mkv, if it was opened. Called with m_filesec held.
+//-------------------------------------------------------------------
+
+void CPreview::CloseArchive()
+{
+    if (m_archive == NULL || !m_bArchive || m_uYUVFrames == 0)
+    {
+        return;
+    }
+
+    LogArchiveStats(FALSE);
+
+    if (m_archive->Close() < 0)
+    {
+        LOG_ERR("video.mkv is incomplete\n");
+    }
+
+    m_uYUVFrames = 0;
+}
+
+
+//-------------------------------------------------------------------
+// WriteRawFrame
+//
+// Appends a captured frame, in the capture format and without stride
+// padding, to the raw file, and its offset and sample time to the
+// sidecar. Runs on the raw-write stage, so that a slow disk holds up
+// that stage rather than the capture callback; when it falls behind,
+// its queue drops the oldest frame.
+//-------------------------------------------------------------------
+
+void CPreview::WriteRawFrame(const AVFrame *pFrame)
+{
+    EnterCriticalSection(&m_filesec);
+
+    if (m_bYUVRecordStatus == TRUE && rawfile && rawsidecar)
+    {
+        if (m_uRawFrames == 0)
+        {
+            WriteRawHeader(pFrame);
+        }
+
+        char szLine[64];
+        int cch = snprintf(szLine, sizeof(szLine), "%u %llu %lld\n", m_uRawFrames, m_ullRawBytes, pFrame->pts);
+        rawsidecar->Write(szLine, (uint32_t)cch);
+
+        if (rawindex)
+        {
+            WriteRecordIndex(rawindex, m_ullRawBytes, pFrame->pts);
+        }
+
+        m_ullRawBytes += WriteFramePlanes(rawfile, pFrame);
+        m_uRawFrames++;
+    }
+
+    LeaveCriticalSection(&m_filesec);
+}
+
+
+//-------------------------------------------------------------------
+// WriteRawHeader
+//
+// Describes the frames of the raw file at the top of the sidecar: the
+// format, the size and rate, and the rows of each plane as written and
+// as captured. A negative capture stride is a bottom-up image, written
+// top row first.
+//-------------------------------------------------------------------
+
+void CPreview::WriteRawHeader(const AVFrame *pFrame)
+{
+    AVPixelFormat fmt = (AVPixelFormat)pFrame->format;
+    DWORD dwFourCC = m_videoAttribute.m_dwFmtName;
+    char szText[512];
+    int cch = 0;
+    int cbFrame = 0;
+
+    cch += snprintf(szText + cch, sizeof(szText) - cch,
+        "format %c%c%c%c %s\nsize %dx%d\nframe_rate %u/%u\ntime_base 1/10000000\n",
+        (char)(dwFourCC & 0xFF), (char)((dwFourCC >> 8) & 0xFF), (char)((dwFourCC >> 16) & 0xFF),
+        (char)((dwFourCC >> 24) & 0xFF), av_get_pix_fmt_name(fmt), pFrame->width, pFrame->height,
+        m_videoAttribute.m_frameRate.Numerator, m_videoAttribute.m_frameRate.Denominator);
+
+    for (int i = 0; i < av_pix_fmt_count_planes(fmt); i++)
+    {
+        int bytes = 0;
+        int rows = 0;
+        GetFramePlaneSize(pFrame, i, &bytes, &rows);
+
+        cch += snprintf(szText + cch, sizeof(szText) - cch,
+            "plane %d %d bytes x %d rows, capture stride %d\n", i, bytes, rows, pFrame->linesize[i]);
+        cbFrame += bytes * rows;
+    }
+
+    cch += snprintf(szText + cch, sizeof(szText) - cch,
+        "frame_bytes %d\n# frame offset timestamp\n", cbFrame);
+
+    rawsidecar->Write(szText, (uint32_t)min(cch, (int)sizeof(szText) - 1));
+}
+
+
+//-------------------------------------------------------------------
+// EncodeFrame
+//
+// Encodes a frame and emits the packets. pFrame is NULL at the end of
+// the stream, which drains the frames the encoder still holds. Runs
+// on the h264-encode stage.
+//
+// A frame past the latency budget is not encoded; a packet past it is
+// dropped if it is not a reference. The pts follow the capture times,
+// so that the frames dropped here or in a queue leave a gap rather
+// than speed up the video.
+//-------------------------------------------------------------------
+
+void CPreview::EncodeFrame(AVFrame *pFrame, PipelineOutput *out)
+{
+    if (m_codecContext == NULL || m_dstFrame == NULL ||
+        (m_bH264RecordStatus != TRUE && m_bMP4RecordStatus != TRUE))
+    {
+        return;
+    }
+
+    // Passes on what the replaced encoder has drained so far; the end
+    // of the stream waits for the rest.
+    if (m_drainContext)
+    {
+        FinishDrain(pFrame == NULL, out);
+    }
+
+    if (pFrame && FrameAge(pFrame) > EncodeBudget())
+    {
+        out->Discard();
+        return;
+    }
+
+    if (pFrame)
+    {
+        // The pts are the capture times, the clock the audio of an MP4
+        // recording is stamped on as well. A step back counts as one
+        // frame at the nominal rate, until the capture times pass it.
+        if (m_llLastEncodeTimestamp == AV_NOPTS_VALUE || pFrame->pts > m_llLastEncodePts)
+        {
+            m_llLastEncodePts = pFrame->pts;
+        }
+        else
+        {
+            m_llLastEncodePts += max(FrameDuration(m_videoAttribute.m_frameRate, 10000000), 1);
+        }
+        m_llLastEncodeTimestamp = pFrame->pts;
+
+        pFrame->pts = m_llLastEncodePts;
+
+        // A recording that has just added its sink starts at this frame.
+        pFrame->pict_type = InterlockedExchange(&m_lForceKeyFrame, 0) ?
+            AV_PICTURE_TYPE_I : AV_PICTURE_TYPE_NONE;
+
+        m_encodeInputs[m_uNextInput].pts = pFrame->pts;
+        m_encodeInputs[m_uNextInput].llArrival = pFrame->reordered_opaque;
+        m_uNextInput = (m_uNextInput + 1) % ENCODE_LATENCY_SLOTS;
+    }
+
+    INT64 llStart = av_gettime_relative();
+
+    for (;;)
+    {
+        AVPacket *pPacket = av_packet_alloc();
+        int got_packet = 0;
+
+        if (pPacket == NULL)
+        {
+            break;
+        }
+
+        int ret = avcodec_encode_video2(m_codecContext, pPacket, pFrame, &got_packet);
+        if (ret != 0)
+        {
+            LOG_ERR("avcodec_encode_video2 error with %d !\n", ret);
+        }
+
+        if (ret != 0 || !got_packet)
+        {
+            av_packet_free(&pPacket);
+            break;
+        }
+
+        LOG_DEBUG("pkt.pts=%lld pkt.dts=%lld pkt.size=%d !\n", pPacket->pts, pPacket->dts, pPacket->size);
+
+        if (pFrame && IsLatePacket(pPacket))
+        {
+            out->Discard();
+            av_packet_free(&pPacket);
+            break;
+        }
+
+        if (pFrame)
+        {
+            UpdateEncodeLatency(pPacket);
+        }
+
+        // The packets of the encoder it replaced go first. A drain
+        // that falls too far behind is waited for.
+        if (m_drainContext && m_uHeldPackets == HELD_QUEUE_PACKETS)
+        {
+            FinishDrain(TRUE, out);
+        }
+
+        if (m_drainContext)
+        {
+            m_heldQueue->Push(pPacket);
+            m_uHeldPackets++;
+        }
+        else
+        {
+            EmitPacket(pPacket, out);
+        }
+
+        // A frame gives at most one packet; a flush gives all of them.
+        if (pFrame)
+        {
+            break;
+        }
+    }
+
+    // The frames encoded while the replaced encoder drains are not
+    // judged: the drain takes part of the CPU.
+    if (pFrame && m_speedControl && m_pipeline && m_drainContext == NULL)
+    {
+        UINT depth = m_pipeline->GetQueueDepth(m_convertNode) + m_pipeline->GetQueueDepth(m_encodeNode);
+
+        SPEED_STEP step = m_speedControl->Update(av_gettime_relative() - llStart, depth);
+        if (step != SPEED_KEEP)
+        {
+            AdjustEncoderSpeed(step, out);
+        }
+    }
+}
+
+
+//-------------------------------------------------------------------
+// EmitPacket
+//
+// Emits a packet of the encoder, or of the one it replaced, in dts
+// order. Runs on the h264-encode stage.
+//-------------------------------------------------------------------
+
+void CPreview::EmitPacket(AVPacket *pPacket, PipelineOutput *out)
+{
+    // A reopened encoder starts its dts at its first pts less its
+    // B-frame delay, which can reach back to the last dts of the
+    // encoder it replaced. Its first packets follow on from there
+    // instead; their pts are later than any before them.
+    if (m_bEncoderReopened && m_llLastEncodeDts != AV_NOPTS_VALUE)
+    {
+        if (pPacket->dts > m_llLastEncodeDts)
+        {
+            m_bEncoderReopened = FALSE;
+        }
+        else if (pPacket->pts > m_llLastEncodeDts)
+        {
+            pPacket->dts = m_llLastEncodeDts + 1;
+        }
+    }
+    m_llLastEncodeDts = pPacket->dts;
+
+    out->Emit(pPacket);
+}
+
+
+//-------------------------------------------------------------------
+// EncodeBudget
+//
+// Age, in us, after which a frame is not worth encoding.
+//-------------------------------------------------------------------
+
+INT64 CPreview::EncodeBudget()
+{
+    return (INT64)g_EncodeProfiles[m_encodeProfile].latencyBudget * 1000;
+}
+
+
+//-------------------------------------------------------------------
+// IsLatePacket
+//
+// TRUE if the frame of a packet is past the latency budget and the
+// packet can be left out without breaking the stream. Runs on the
+// h264-encode stage.
+//-------------------------------------------------------------------
+
+BOOL CPreview::IsLatePacket(const AVPacket *pPacket)
+{
+    INT64 llInput = FindInputTime(pPacket->pts);
+
+    if (llInput == 0 ||
+        av_gettime_relative() - llInput <= EncodeBudget())
+    {
+        return FALSE;
+    }
+
+    return IsNonReferencePacket(pPacket);
+}
+
+
+//-------------------------------------------------------------------
+// FindInputTime
+//
+// Arrival time, in us, of the frame with the given pts, or 0 if it is
+// no longer known. Runs on the h264-encode stage.
+//-------------------------------------------------------------------
+
+INT64 CPreview::FindInputTime(INT64 pts)
+{
+    // Newest first: a packet is usually for one of the last frames.
+    for (UINT i = 1; i <= ENCODE_LATENCY_SLOTS; i++)
+    {
+        const EncodeInput &input = m_encodeInputs[(m_uNextInput + ENCODE_LATENCY_SLOTS - i) % ENCODE_LATENCY_SLOTS];
+
+        if (input.llArrival != 0 && input.pts == pts)
+        {
+            return input.llArrival;
+        }
+    }
+    return 0;
+}
+
+
+//-------------------------------------------------------------------
+// AdjustEncoderSpeed
+//
+// Moves to the next x264 preset, faster or slower, that changes the
+// speed options, never slower than the preset of the profile. Runs on
+// the h264-encode stage.
+//-------------------------------------------------------------------
+
+void CPreview::AdjustEncoderSpeed(SPEED_STEP step, PipelineOutput *out)
+{
+    SpeedWindow window;
+    m_speedControl->GetWindow(&window);
+
+    int iPreset = StepX264Speed(m_iPreset, m_iProfilePreset, step == SPEED_FASTER ? -1 : 1);
+
+    if (iPreset < 0 || iPreset > m_iProfilePreset)
+    {
+        if (step == SPEED_FASTER)
+        {
+            LOG_INFO("h264-encode: behind at preset %s, encode %.2f ms/frame, interval %.2f ms, queue %u\n",
+                m_iPreset >= 0 ? g_X264Presets[m_iPreset] : "?",
+                window.meanEncode / 1000.0, window.interval / 1000.0, window.maxDepth);
+        }
+        return;
+    }
+
+    if (SUCCEEDED(ReopenEncoder(iPreset, out)))
+    {
+        LOG_INFO("h264-encode: preset %s -> %s, encode %.2f ms/frame, interval %.2f ms, queue %u\n",
+            g_X264Presets[m_iPreset], g_X264Presets[iPreset],
+            window.meanEncode / 1000.0, window.interval / 1000.0, window.maxDepth);
+
+        m_iPreset = iPreset;
+    }
+
+    // The first frames of a new encoder are slower; judge it afresh.
+    m_speedControl->Reset(window.interval, ENCODE_QUEUE_LIMIT);
+}
+
+
+//-------------------------------------------------------------------
+// ReopenEncoder
+//
+// libx264 cannot change its preset once open, and x264_encoder_reconfig
+// is not reachable through libavcodec: opens an encoder with the speed
+// options of the new preset and replaces the old one, which drains on
+// m_drainThread while the new one takes the next frames. The drain of
+// the archive profile is its whole lookahead, far more than a frame
+// time. The stream headers do not change, since the new encoder keeps
+// the preset of the profile for everything else; the sinks and the MP4
+// track go on with the headers they have. The new stream starts with a
+// key frame. The old encoder is kept if the new one cannot be opened.
+// Runs on the h264-encode stage.
+//-------------------------------------------------------------------
+
+HRESULT CPreview::ReopenEncoder(int iPreset, PipelineOutput *out)
+{
+    AVCodecContext *pContext = avcodec_alloc_context3(m_codec);
+    if (pContext == NULL)
+    {
+        return E_OUTOFMEMORY;
+    }
+
+    pContext->pix_fmt = m_codecContext->pix_fmt;
+    pContext->width = m_codecContext->width;
+    pContext->height = m_codecContext->height;
+    pContext->framerate = m_codecContext->framerate;
+    pContext->time_base = m_codecContext->time_base;
+
+    ApplyEncodeProfile(pContext, m_encodeProfile, (int)m_videoAttribute.m_uFps, H264_BIT_RATE);
+    ApplyX264Speed(pContext, iPreset, m_iProfilePreset);
+
+    int ret = avcodec_open2(pContext, m_codec, NULL);
+    if (ret < 0)
+    {
+        LOG_ERR("cannot open the encoder with preset %s: %d\n", g_X264Presets[iPreset], ret);
+        avcodec_free_context(&pContext);
+        return E_FAIL;
+    }
+
+    m_drainQueue = MediaQueue::Create(DRAIN_QUEUE_PACKETS, QUEUE_BLOCK, g_AVPacketItemOps.free);
+    m_heldQueue = MediaQueue::Create(HELD_QUEUE_PACKETS, QUEUE_DROP_NEWEST, g_AVPacketItemOps.free);
+    m_uHeldPackets = 0;
+    m_lDrainDone = 0;
+    m_drainContext = m_codecContext;
+
+    if (m_drainQueue == NULL || m_heldQueue == NULL ||
+        pthread_create(&m_drainThread, NULL, DrainProc, this) != 0)
+    {
+        m_drainContext = NULL;
+        StopDrain();
+
+        // Its packets come before those of the new encoder, whose dts
+        // continue from the last of them.
+        EncodeFrame(NULL, out);
+        m_bEncoderReopened = TRUE;
+
+        avcodec_close(m_codecContext);
+        av_free(m_codecContext);
+    }
+
+    // AddMP4Stream() reads the context on the UI thread.
+    EnterCriticalSection(&m_filesec);
+    m_codecContext = pContext;
+    LeaveCriticalSection(&m_filesec);
+
+    return S_OK;
+}
+
+
+//-------------------------------------------------------------------
+// DrainProc
+//
+// The drain thread: takes the packets the replaced encoder still holds
+// into m_drainQueue, and closes it at the end.
+//-------------------------------------------------------------------
+
+void *CPreview::DrainProc(void *arg)
+{
+    CPreview *pPreview = (CPreview*)arg;
+
+    for (;;)
+    {
+        AVPacket *pPacket = av_packet_alloc();
+        int got_packet = 0;
+
+        if (pPacket == NULL)
+        {
+            break;
+        }
+
+        int ret = avcodec_encode_video2(pPreview->m_drainContext, pPacket, NULL, &got_packet);
+        if (ret != 0)
+        {
+            LOG_ERR("avcodec_encode_video2 error with %d !\n", ret);
+        }
+
+        if (ret != 0 || !got_packet)
+        {
+            av_packet_free(&pPacket);
+            break;
+        }
+
+        pPreview->m_drainQueue->Push(pPacket);
+    }
+
+    InterlockedExchange(&pPreview->m_lDrainDone, 1);
+    pPreview->m_drainQueue->Close();
+
+    return NULL;
+}
+
+
+//-------------------------------------------------------------------
+// FinishDrain
+//
+// Emits the packets drained so far. Once the drain is done, or with
+// bWait after waiting for it, emits the held packets of the new
+// encoder after them and frees the old one. Runs on the h264-encode
+// stage.
+//-------------------------------------------------------------------
+
+void CPreview::FinishDrain(BOOL bWait, PipelineOutput *out)
+{
+    AVPacket *pPacket;
+
+    if (bWait)
+    {
+        // NULL once the drain thread has closed the queue.
+        while ((pPacket = (AVPacket*)m_drainQueue->Pop()) != NULL)
+        {
+            EmitPacket(pPacket, out);
+        }
+    }
+    else
+    {
+        // Read before the queue: every drained packet is in it by then.
+        BOOL bDone = InterlockedCompareExchange(&m_lDrainDone, 0, 0) != 0;
+
+        while ((pPacket = (AVPacket*)m_drainQueue->TryPop()) != NULL)
+        {
+            EmitPacket(pPacket, out);
+        }
+
+        if (!bDone)
+        {
+            return;
+        }
+    }
+
+    // The new encoder's dts continue from the last drained packet.
+    m_bEncoderReopened = TRUE;
+
+    while ((pPacket = (AVPacket*)m_heldQueue->TryPop()) != NULL)
+    {
+        EmitPacket(pPacket, out);
+    }
+
+    StopDrain();
+
+    // Judge the new encoder afresh, without the drain beside it.
+    if (m_speedControl && m_videoAttribute.m_frameRate.Numerator > 0)
+    {
+        m_speedControl->Reset(FrameDuration(m_videoAttribute.m_frameRate, 1000000), ENCODE_QUEUE_LIMIT);
+    }
+}
+
+
 //-------------------------------------------------------------------
-//  AddRef
+// StopDrain
+//
+// Ends the drain thread, if any, and frees the replaced encoder and
+// the packets not yet emitted.
 //-------------------------------------------------------------------
 
-ULONG CPreview::AddRef()
+void CPreview::StopDrain()
 {
-    return InterlockedIncrement(&m_nRefCount);
+    if (m_drainContext)
+    {
+        // A drain thread that waits for room gives up its packets.
+        m_drainQueue->Close();
+        pthread_join(m_drainThread, NULL);
+
+        avcodec_close(m_drainContext);
+        av_free(m_drainContext);
+        m_drainContext = NULL;
+    }
+
+    if (m_drainQueue)
+    {
+        m_drainQueue->Destory();
+        m_drainQueue = NULL;
+    }
+
+    if (m_heldQueue)
+    {
+        m_heldQueue->Destory();
+        m_heldQueue = NULL;
+    }
+
+    m_uHeldPackets = 0;
 }
 
 
 //-------------------------------------------------------------------
-//  Release
+// UpdateEncodeLatency
+//
+// Measures the time from the capture of a frame to its packet. Logs
+// every packet at debug level, and a summary every LATENCY_STATS_FRAMES
+// packets. Runs on the h264-encode stage.
 //-------------------------------------------------------------------
 
-ULONG CPreview::Release()
+void CPreview::UpdateEncodeLatency(const AVPacket *pPacket)
 {
-    ULONG uCount = InterlockedDecrement(&m_nRefCount);
-    if (uCount == 0)
+    INT64 llInput = FindInputTime(pPacket->pts);
+
+    if (llInput == 0)
     {
-        delete this;
+        return;
     }
-    // For thread safety, return a temporary variable.
-    return uCount;
-}
 
+    INT64 llLatency = av_gettime_relative() - llInput;
+
+    LOG_DEBUG("latency pts=%lld %.2f ms\n", pPacket->pts, llLatency / 1000.0);
+
+    m_llLatencySum += llLatency;
+    if (llLatency > m_llLatencyMax)
+    {
+        m_llLatencyMax = llLatency;
+    }
+
+    if (++m_uLatencyFrames == LATENCY_STATS_FRAMES)
+    {
+        LOG_INFO("h264-encode (%s, %s): capture to packet %.2f ms, max %.2f ms\n",
+            g_EncodeProfiles[m_encodeProfile].name, m_iPreset >= 0 ? g_X264Presets[m_iPreset] : "?",
+            m_llLatencySum / 1000.0 / m_uLatencyFrames, m_llLatencyMax / 1000.0);
+
+        m_llLatencySum = 0;
+        m_llLatencyMax = 0;
+        m_uLatencyFrames = 0;
+    }
+}
 
 
 //-------------------------------------------------------------------
-//  QueryInterface
+// WriteH264Packet
+//
+// Appends a packet to the H.264 file. The sink starts at a key frame.
+// Runs on the thread of the H.264 file sink.
 //-------------------------------------------------------------------
 
-HRESULT CPreview::QueryInterface(REFIID riid, void** ppv)
+void CPreview::WriteH264Packet(const AVPacket *pPacket)
 {
-    static const QITAB qit[] =
-    {
-        QITABENT(CPreview, IMFSourceReaderCallback),
-        { 0 },
-    };
-    return QISearch(this, qit, riid, ppv);
+    h264file->Write(pPacket->data, pPacket->size);
 }
 
 
-/////////////// IMFSourceReaderCallback methods ///////////////
-
 //-------------------------------------------------------------------
-// OnReadSample
+// WriteMP4Packet
 //
-// Called when the IMFMediaSource::ReadSample method completes.
+// Passes a packet to the MP4 writer. Runs on the thread of the MP4
+// sink.
 //-------------------------------------------------------------------
 
-HRESULT CPreview::OnReadSample(
-    HRESULT hrStatus,
-    DWORD /* dwStreamIndex */,
-    DWORD /* dwStreamFlags */,
-    LONGLONG /* llTimestamp */,
-    IMFSample *pSample      // Can be NULL
-    )
+void CPreview::WriteMP4Packet(const AVPacket *pPacket)
 {
-    HRESULT hr = S_OK;
-    IMFMediaBuffer *pBuffer = NULL;
+    m_mp4Writer->Write(m_iMP4Stream, pPacket);
+}
 
-    static int count = 0;
 
-    int ret = 0;
+//-------------------------------------------------------------------
+// EncodeSimulcast
+//
+// Encodes a captured frame as every rendition of the ladder while H.264
+// is recorded, unless it is past the latency budget of the profile.
+// Runs on the simulcast stage.
+//-------------------------------------------------------------------
 
-    EnterCriticalSection(&m_critsec);
+void CPreview::EncodeSimulcast(AVFrame *pFrame, PipelineOutput *out)
+{
+    EnterCriticalSection(&m_simulcastsec);
 
-    if (FAILED(hrStatus))
+    if (m_simulcastFiles[0] && FrameAge(pFrame) > EncodeBudget())
     {
-        hr = hrStatus;
+        out->Discard();
     }
-
-    if (SUCCEEDED(hr))
+    else if (m_simulcastFiles[0])
     {
-        if (pSample)
-        {
-            // Get the video frame buffer from the sample.
+        m_simulcast->Encode(pFrame);
 
-            hr = pSample->GetBufferByIndex(0, &pBuffer);
+        SimulcastStats stats;
+        m_simulcast->GetStats(&stats, false);
 
-            // Draw the frame.
+        if (stats.frames == CONVERT_STATS_FRAMES)
+        {
+            m_simulcast->GetStats(&stats, true);
+            LOG_INFO("simulcast: %d renditions, scale %.2f ms/frame, encode %.2f ms/frame\n",
+                m_simulcast->GetRungCount(), stats.scaleTime / 1000.0 / stats.frames,
+                stats.encodeTime / 1000.0 / stats.frames);
+        }
+    }
 
-            if (SUCCEEDED(hr))
-            {
-                BYTE * pbScanline0;
-                LONG lStride;
+    LeaveCriticalSection(&m_simulcastsec);
+}
 
-                VideoBufferLock buffer(pBuffer);    // Helper object to lock the video buffer.
 
-                // Lock the video buffer. This method returns a pointer to the first scan
-                // line in the image, and the stride in bytes.
-                hr = buffer.LockBuffer(m_videoAttribute.m_uStride, m_videoAttribute.m_uHeight, &pbScanline0, &lStride);
+//-------------------------------------------------------------------
+// OpenSimulcastFiles
+//
+// Opens video_<height>p.h264 for every rendition.
+//-------------------------------------------------------------------
 
-                if (SUCCEEDED(hr)) {
-                    hr = m_draw.DrawFrame(pbScanline0, lStride);
+void CPreview::OpenSimulcastFiles()
+{
+    EnterCriticalSection(&m_simulcastsec);
 
-                    av_image_fill_pointers(m_srcFrame->data, (AVPixelFormat)m_srcFrame->format, m_srcFrame->height, pbScanline0, m_srcFrame->linesize);
+    int cRungs = m_simulcast ? min(m_simulcast->GetRungCount(), MAX_SIMULCAST_RUNGS) : 0;
 
-                    ret = sws_scale(m_swsContext, m_srcFrame->data, m_srcFrame->linesize, 0, m_srcFrame->height, m_dstFrame->data, m_dstFrame->linesize);
+    for (int i = 0; i < cRungs; i++)
+    {
+        int width = 0;
+        int height = 0;
+        char szPath[MAX_PATH];
 
+        m_simulcast->GetRungSize(i, &width, &height);
+        StringCchPrintfA(szPath, ARRAYSIZE(szPath), "video_%dp.h264", height);
 
-                    if (m_bYUVRecordStatus == TRUE)
-                    {
-                        int len = av_image_get_buffer_size((AVPixelFormat)m_dstFrame->format, m_dstFrame->width, m_dstFrame->height, 32);
-                        yuvfile->write((char *)m_dstFrame->data[0], len);
-                        count++;
-                        LOG_INFO("write %d byte data\n",len);
-                    }
+        m_simulcastFiles[i] = OpenRecordFile(szPath, H264_FILE_CONFIG);
+    }
 
-					if (m_bH264RecordStatus == TRUE)
-					{
-						static BOOL first = TRUE;
-						AVPacket pkt;
-						av_init_packet(&pkt);
-						pkt.data = NULL;    // packet data will be allocated by the encoder
-						pkt.size = 0;
-						int got_frame;
-						ret = avcodec_encode_video2(m_codecContext, &pkt, m_dstFrame, &got_frame);
-						if (ret != 0)
-						{
-							LOG_ERR("avcodec_encode_video2 error with %d !\n", ret);
-						}
-
-						if (got_frame)
-						{
-							if (first == TRUE)
-							{
-								if ((pkt.flags & AV_PKT_FLAG_KEY)) {
-									first = FALSE;
-									LOG_INFO("get first key frame\n");
-									h264file->write((char *)pkt.data, pkt.size);
-								}
-							}
-							else {
-								h264file->write((char *)pkt.data, pkt.size);
-							}
-
-							LOG_DEBUG("pkt.pts=%lld pkt.dts=%lld pkt.size=%d !\n", pkt.pts, pkt.dts, pkt.size);
-							av_packet_unref(&pkt);
-						}
-
-						m_dstFrame->pts++;
-					}
-                }
+    LeaveCriticalSection(&m_simulcastsec);
+}
 
-            }
-        }
 
+//-------------------------------------------------------------------
+// CloseSimulcastFiles
+//
+// Drains the encoders of the ladder into the files and closes them.
+//-------------------------------------------------------------------
+
+void CPreview::CloseSimulcastFiles()
+{
+    if (m_simulcast == NULL)
+    {
+        return;
     }
 
-    // Request the next frame.
-    if (SUCCEEDED(hr))
+    EnterCriticalSection(&m_simulcastsec);
+
+    if (m_simulcastFiles[0])
     {
-        hr = m_pReader->ReadSample(
-            (DWORD)MF_SOURCE_READER_FIRST_VIDEO_STREAM,
-            0,
-            NULL,   // actual
-            NULL,   // flags
-            NULL,   // timestamp
-            NULL    // sample
-            );
+        m_simulcast->Flush();
     }
 
-    if (FAILED(hr))
+    for (int i = 0; i < MAX_SIMULCAST_RUNGS; i++)
     {
-        NotifyError(hr);
+        int width = 0;
+        int height = 0;
+        char szName[MAX_PATH];
+
+        m_simulcast->GetRungSize(i, &width, &height);
+        StringCchPrintfA(szName, ARRAYSIZE(szName), "video_%dp.h264", height);
+
+        CloseRecordFile(&m_simulcastFiles[i], szName);
     }
-    SafeRelease(&pBuffer);
 
-    LeaveCriticalSection(&m_critsec);
-    return hr;
+    LeaveCriticalSection(&m_simulcastsec);
+}
+
+
+//-------------------------------------------------------------------
+// RemovePacketSinks
+//
+// Removes the sinks of the H.264 and MP4 recordings, after they have
+// written what they hold.
+//-------------------------------------------------------------------
+
+void CPreview::RemovePacketSinks()
+{
+    m_packetSinks->RemoveSink(m_h264Sink);
+    m_h264Sink = -1;
+
+    m_packetSinks->RemoveSink(m_mp4Sink);
+    m_mp4Sink = -1;
 }
 
 
@@ -539,6 +2053,11 @@ HRESULT CPreview::SetDevice(IMFActivate *pActivate)
     //Init Codec
     InitCodec();
 
+    if (SUCCEEDED(hr) && FAILED(StartPipeline()))
+    {
+        LOG_ERR("cannot start the video pipeline, drawing on the capture thread\n");
+    }
+
     if (SUCCEEDED(hr))
     {
         // Ask for the first sample.
@@ -611,9 +2130,11 @@ HRESULT CPreview::SetVideoAttribute(IMFMediaType *pType) {
     m_videoAttribute.m_bInterlace = MFGetAttributeUINT32(pType, MF_MT_INTERLACE_MODE, MFVideoInterlace_Progressive);
 
     hr = MFGetAttributeRatio(pType, MF_MT_FRAME_RATE, (UINT32*)&PAR.Numerator, (UINT32*)&PAR.Denominator);
-    if (SUCCEEDED(hr))
+    if (SUCCEEDED(hr) && PAR.Numerator > 0 && PAR.Denominator > 0)
     {
-        m_videoAttribute.m_uFps = PAR.Numerator / PAR.Denominator;
+        // 30000/1001 is 29.97, not 29.
+        m_videoAttribute.m_frameRate = PAR;
+        m_videoAttribute.m_uFps = (PAR.Numerator + PAR.Denominator / 2) / PAR.Denominator;
     }
 
 
@@ -633,6 +2154,23 @@ HRESULT CPreview::SetVideoAttribute(IMFMediaType *pType) {
 }
 
 
+static BOOL IsPixelFormatSupported(AVCodec *codec, AVPixelFormat pix_fmt)
+{
+    const enum AVPixelFormat *p = codec->pix_fmts;
+
+    if (p == NULL)
+    {
+        return FALSE;
+    }
+
+    while (*p != AV_PIX_FMT_NONE) {
+        if (*p == pix_fmt)
+            return TRUE;
+        p++;
+    }
+    return FALSE;
+}
+
 HRESULT CPreview::InitCodec() {
 
     HRESULT hr = S_OK;
@@ -645,28 +2183,63 @@ HRESULT CPreview::InitCodec() {
 
     m_codecContext = avcodec_alloc_context3(m_codec);
 
-    m_codecContext->pix_fmt = AV_PIX_FMT_YUV420P;
-    m_codecContext->profile = FF_PROFILE_H264_HIGH;
+    // Negotiate the encoder input format from the capture format.
+    // NV12 and I420 go straight to libx264; YUY2 is converted to I420
+    // in a single pass; anything else goes through sws_scale.
+    AVPixelFormat captureFmt = (AVPixelFormat)m_videoAttribute.m_iPixFmt;
+
+    if ((captureFmt == AV_PIX_FMT_NV12 || captureFmt == AV_PIX_FMT_YUV420P) &&
+        IsPixelFormatSupported(m_codec, captureFmt))
+    {
+        m_encoderInput = ENCODER_INPUT_DIRECT;
+        m_codecContext->pix_fmt = captureFmt;
+    }
+    else if (captureFmt == AV_PIX_FMT_YUYV422)
+    {
+        m_encoderInput = ENCODER_INPUT_YUY2;
+        m_codecContext->pix_fmt = AV_PIX_FMT_YUV420P;
+    }
+    else
+    {
+        m_encoderInput = ENCODER_INPUT_SWSCALE;
+        m_codecContext->pix_fmt = AV_PIX_FMT_YUV420P;
+    }
+
+    LOG_INFO("encoder input %s -> %s (%s)\n", av_get_pix_fmt_name(captureFmt),
+        av_get_pix_fmt_name(m_codecContext->pix_fmt), EncoderInputName(m_encoderInput));
 
     m_codecContext->width = (int)m_videoAttribute.m_uWidth;
     m_codecContext->height = (int)m_videoAttribute.m_uHeight;
-    m_codecContext->framerate.num = (int)m_videoAttribute.m_uFps;
-    m_codecContext->framerate.den = (int)1;
-    m_codecContext->time_base.num = (int)1;
-    m_codecContext->time_base.den = (int)m_videoAttribute.m_uFps;
-    m_codecContext->gop_size = (int)m_videoAttribute.m_uFps;
+    m_codecContext->framerate.num = (int)m_videoAttribute.m_frameRate.Numerator;
+    m_codecContext->framerate.den = (int)m_videoAttribute.m_frameRate.Denominator;
+    m_codecContext->time_base = MF_TIME_BASE;
+
+    ApplyEncodeProfile(m_codecContext, m_encodeProfile, (int)m_videoAttribute.m_uFps, H264_BIT_RATE);
+
+    if (m_bSimulcast && m_simulcast)
+    {
+        EnterCriticalSection(&m_simulcastsec);
+
+        if (m_simulcast->Configure(m_codecContext->width, m_codecContext->height, captureFmt,
+                g_SimulcastLadder, min(g_cSimulcastRungs, MAX_SIMULCAST_RUNGS),
+                m_encodeProfile, m_codecContext->framerate, MF_TIME_BASE, SimulcastPacket, this) <= 0)
+        {
+            LOG_ERR("no simulcast renditions for %ux%u\n",
+                m_videoAttribute.m_uWidth, m_videoAttribute.m_uHeight);
+        }
+
+        LeaveCriticalSection(&m_simulcastsec);
+    }
 
-    m_codecContext->max_b_frames = 1;
+    LOG_INFO("encoding profile %s\n", g_EncodeProfiles[m_encodeProfile].name);
 
-    av_opt_set(m_codecContext->priv_data, "preset", "slow", 0);
-    m_codecContext->bit_rate = 4000000;
-    m_codecContext->bit_rate_tolerance = 4000000;
-    m_codecContext->rc_max_rate = 4000000;
-    m_codecContext->rc_min_rate = 4000000;
+    m_iProfilePreset = FindX264Preset(g_EncodeProfiles[m_encodeProfile].preset);
+    m_iPreset = m_iProfilePreset;
 
-    m_codecContext->qmin = 12;
-    m_codecContext->qmax = 34;
-    m_codecContext->max_qdiff = 8;
+    if (m_speedControl && m_videoAttribute.m_frameRate.Numerator > 0)
+    {
+        m_speedControl->Reset(FrameDuration(m_videoAttribute.m_frameRate, 1000000), ENCODE_QUEUE_LIMIT);
+    }
 
     int ret = avcodec_open2(m_codecContext, m_codec, NULL);
     if (ret < 0) {
@@ -679,45 +2252,118 @@ HRESULT CPreview::InitCodec() {
         m_dstFrame->width = m_codecContext->width;
         m_dstFrame->height = m_codecContext->height;
     }
-    ret = av_image_alloc(m_dstFrame->data, m_dstFrame->linesize, m_dstFrame->width, m_dstFrame->height,
-        (AVPixelFormat)m_dstFrame->format, 32);
+    m_llLastEncodeTimestamp = AV_NOPTS_VALUE;
+    m_llLastEncodePts = 0;
+    m_llLastEncodeDts = AV_NOPTS_VALUE;
+    m_bEncoderReopened = FALSE;
 
-    m_srcFrame = av_frame_alloc();
-    if (m_srcFrame) {
-        m_srcFrame->format = (AVPixelFormat)m_videoAttribute.m_iPixFmt;
-        m_srcFrame->width = m_codecContext->width;
-        m_srcFrame->height = m_codecContext->height;
+    // m_dstFrame only describes the encoder input; the convert stage
+    // takes its frames from m_encPool.
+
+    if (m_encoderInput == ENCODER_INPUT_SWSCALE)
+    {
+        if (m_scaler == NULL || m_dstFrame == NULL ||
+            m_scaler->Configure(m_codecContext->width, m_codecContext->height, captureFmt,
+                m_dstFrame->width, m_dstFrame->height, (AVPixelFormat)m_dstFrame->format,
+                ENCODE_SCALE_FLAGS, 0) < 0)
+        {
+            LOG_ERR("cannot convert %s to the encoder input\n", av_get_pix_fmt_name(captureFmt));
+            hr = E_FAIL;
+        }
+        else
+        {
+            LOG_INFO("encoder input scaled in %u bands\n", m_scaler->GetSliceCount());
+        }
     }
-    av_image_fill_linesizes(m_srcFrame->linesize, (AVPixelFormat)m_srcFrame->format, m_srcFrame->width);
 
-    m_swsContext = sws_getContext(m_srcFrame->width, m_srcFrame->height, (AVPixelFormat)m_srcFrame->format,
-        m_dstFrame->width, m_dstFrame->height, (AVPixelFormat)m_dstFrame->format,
-        SWS_BILINEAR, NULL, NULL, NULL);
+    m_llConvertTime = 0;
+    m_uConvertFrames = 0;
+
+    ZeroMemory(m_encodeInputs, sizeof(m_encodeInputs));
+    m_uNextInput = 0;
+    m_llLatencySum = 0;
+    m_llLatencyMax = 0;
+    m_uLatencyFrames = 0;
 
     return hr;
 }
 
 
-void CPreview::UninitCodec() {
+//-------------------------------------------------------------------
+// SetEncodeProfile
+//
+// Selects the H.264 encoder settings. Takes effect when the next
+// device is opened.
+//-------------------------------------------------------------------
+
+void CPreview::SetEncodeProfile(ENCODE_PROFILE profile)
+{
+    if (profile < ENCODE_PROFILE_COUNT)
+    {
+        m_encodeProfile = profile;
+    }
+}
+
+
+//-------------------------------------------------------------------
+// SetSimulcast
+//
+// Records the renditions of g_SimulcastLadder along with the H.264
+// file. Takes effect when the next device is opened.
+//-------------------------------------------------------------------
+
+void CPreview::SetSimulcast(BOOL bSimulcast)
+{
+    m_bSimulcast = bSimulcast;
+}
+
+
+//-------------------------------------------------------------------
+// SetRawNative
+//
+// Makes the YUV recording write the captured frames unconverted, to
+// video.raw with the sidecar video.raw.txt. Set before recording.
+//-------------------------------------------------------------------
+
+void CPreview::SetRawNative(BOOL bRawNative)
+{
+    m_bRawNative = bRawNative;
+}
+
+
+//-------------------------------------------------------------------
+// SetRecordIndex
+//
+// Writes a binary frame index (see RecordIndexHeader) next to the YUV
+// recording: video.y4m.idx, or video.raw.idx. Set before recording.
+//-------------------------------------------------------------------
+
+void CPreview::SetRecordIndex(BOOL bIndex)
+{
+    m_bRecordIndex = bIndex;
+}
+
+
+//-------------------------------------------------------------------
+// SetArchive
+//
+// Makes the YUV recording lossless FFV1 in video.mkv rather than Y4M.
+// Matroska indexes the frames itself, so /index does not apply. Set
+// before recording.
+//-------------------------------------------------------------------
+
+void CPreview::SetArchive(BOOL bArchive)
+{
+    m_bArchive = bArchive;
+}
 
-	if (m_swsContext)
-	{
-		sws_freeContext(m_swsContext);
-		m_swsContext = NULL;
-	}
 
-	if (m_srcFrame)
-	{
-		av_frame_free(&m_srcFrame);
-		m_srcFrame = NULL;
-	}
+void CPreview::UninitCodec() {
+
+    StopDrain();
 
     if (m_dstFrame)
     {
-        if (m_dstFrame->data[0])
-        {
-            av_freep(&m_dstFrame->data[0]);
-        }
         av_frame_free(&m_dstFrame);
 		m_dstFrame = NULL;
     }
@@ -729,21 +2375,23 @@ void CPreview::UninitCodec() {
         m_codecContext = NULL;
     }
 
-    if (h264file)
-    {
-        h264file->flush();
-        h264file->close();
-        delete h264file;
-        h264file = NULL;
-    }
+    RemovePacketSinks();
 
-    if (yuvfile)
-    {
-        yuvfile->flush();
-        yuvfile->close();
-        delete yuvfile;
-        yuvfile = NULL;
-    }
+    // The stream was added with the parameters of this encoder.
+    m_bMP4RecordStatus = FALSE;
+    m_mp4Writer = NULL;
+    m_iMP4Stream = -1;
+
+    m_bH264RecordStatus = FALSE;
+    CloseRecordFile(&h264file, "video.h264");
+    CloseArchive();
+    CloseRecordFile(&yuvfile, "video.y4m");
+    CloseRecordFile(&yuvindex, "video.y4m.idx");
+    CloseRecordFile(&rawfile, "video.raw");
+    CloseRecordFile(&rawsidecar, "video.raw.txt");
+    CloseRecordFile(&rawindex, "video.raw.idx");
+
+    CloseSimulcastFiles();
 }
 
 
@@ -762,9 +2410,12 @@ HRESULT CPreview::ResizeVideo(WORD /*width*/, WORD /*height*/)
     HRESULT hr = S_OK;
 
     EnterCriticalSection(&m_critsec);
+    EnterCriticalSection(&m_drawsec);
 
     hr = m_draw.ResetDevice();
 
+    LeaveCriticalSection(&m_drawsec);
+
     if (FAILED(hr))
     {
         MessageBox(NULL, L"ResetDevice failed!", NULL, MB_OK);
@@ -828,26 +2479,71 @@ HRESULT CPreview::CheckDeviceLost(DEV_BROADCAST_HDR *pHdr, BOOL *pbDeviceLost)
 HRESULT CPreview::StartYUVRecord() {
     LOG_INFO("YUV Record Starting...\n");
 
-    yuvfile = new std::ofstream("video.yuv", std::ios::binary);
+    EnterCriticalSection(&m_filesec);
+
+    if (m_bRawNative)
+    {
+        rawfile = OpenRecordFile("video.raw", YUV_FILE_CONFIG);
+        rawsidecar = OpenRecordFile("video.raw.txt", RAW_SIDECAR_FILE_CONFIG);
+        if (m_bRecordIndex)
+        {
+            rawindex = OpenRecordIndex("video.raw.idx", MF_TIME_BASE);
+        }
+        m_uRawFrames = 0;
+        m_ullRawBytes = 0;
+
+        if (rawfile == NULL || rawsidecar == NULL || (m_bRecordIndex && rawindex == NULL))
+        {
+            CloseRecordFile(&rawfile, "video.raw");
+            CloseRecordFile(&rawsidecar, "video.raw.txt");
+            CloseRecordFile(&rawindex, "video.raw.idx");
+        }
+        m_bYUVRecordStatus = rawfile ? TRUE : FALSE;
+    }
+    else if (m_bArchive)
+    {
+        m_uYUVFrames = 0;
+        m_bYUVRecordStatus = m_archive ? TRUE : FALSE;
+    }
+    else
+    {
+        yuvfile = OpenRecordFile("video.y4m", YUV_FILE_CONFIG);
+        if (m_bRecordIndex)
+        {
+            yuvindex = OpenRecordIndex("video.y4m.idx", MF_TIME_BASE);
+        }
+        m_uYUVFrames = 0;
+        m_ullYUVBytes = 0;
+
+        if (yuvfile == NULL || (m_bRecordIndex && yuvindex == NULL))
+        {
+            CloseRecordFile(&yuvfile, "video.y4m");
+            CloseRecordFile(&yuvindex, "video.y4m.idx");
+        }
+        m_bYUVRecordStatus = yuvfile ? TRUE : FALSE;
+    }
 
-    m_bYUVRecordStatus = TRUE;
+    LeaveCriticalSection(&m_filesec);
 
-	return S_OK;
+	return m_bYUVRecordStatus ? S_OK : E_FAIL;
 }
 
 HRESULT CPreview::StopYUVRecord() {
 
     LOG_INFO("YUV Record Stopping...\n");
 
+    EnterCriticalSection(&m_filesec);
+
     m_bYUVRecordStatus = FALSE;
 
-    if (yuvfile)
-    {
-        yuvfile->flush();
-        yuvfile->close();
-        delete yuvfile;
-        yuvfile = NULL;
-    }
+    CloseArchive();
+    CloseRecordFile(&yuvfile, "video.y4m");
+    CloseRecordFile(&yuvindex, "video.y4m.idx");
+    CloseRecordFile(&rawfile, "video.raw");
+    CloseRecordFile(&rawsidecar, "video.raw.txt");
+    CloseRecordFile(&rawindex, "video.raw.idx");
+
+    LeaveCriticalSection(&m_filesec);
 
 	return S_OK;
 }
@@ -856,10 +2552,28 @@ HRESULT CPreview::StartH264Record() {
 
     LOG_INFO("H264 Record Starting...\n");
 
-    h264file = new std::ofstream("video.h264", std::ios::binary);
+    h264file = OpenRecordFile("video.h264", H264_FILE_CONFIG);
+    if (h264file == NULL)
+    {
+        return E_FAIL;
+    }
+
+    m_h264Sink = m_packetSinks->AddSink("h264-file", H264FileSink, this,
+        SINK_QUEUE_PACKETS, QUEUE_DROP_OLDEST);
+    if (m_h264Sink < 0)
+    {
+        CloseRecordFile(&h264file, "video.h264");
+        return E_FAIL;
+    }
 
+    InterlockedExchange(&m_lForceKeyFrame, 1);
     m_bH264RecordStatus = TRUE;
 
+    if (m_bSimulcast)
+    {
+        OpenSimulcastFiles();
+    }
+
 	return S_OK;
 }
 
@@ -869,21 +2583,54 @@ HRESULT CPreview::StopH264Record() {
 
     m_bH264RecordStatus = FALSE;
 
-    if (h264file)
+    m_packetSinks->RemoveSink(m_h264Sink);
+    m_h264Sink = -1;
+
+    CloseRecordFile(&h264file, "video.h264");
+
+    CloseSimulcastFiles();
+
+	return S_OK;
+}
+
+HRESULT CPreview::AddMP4Stream(Mp4Writer *pWriter, int *piStream) {
+
+    HRESULT hr = E_FAIL;
+
+    EnterCriticalSection(&m_filesec);
+
+    *piStream = m_codecContext ? pWriter->AddStream(m_codecContext) : -1;
+    if (*piStream >= 0)
     {
-        h264file->flush();
-        h264file->close();
-        delete h264file;
-        h264file = NULL;
+        hr = S_OK;
     }
 
-	return S_OK;
+    LeaveCriticalSection(&m_filesec);
+
+    return hr;
 }
 
-HRESULT CPreview::StartMP4Record() {
+HRESULT CPreview::StartMP4Record(Mp4Writer *pWriter, int iStream) {
 
 	LOG_INFO("MP4 Record Starting...\n");
 
+    m_mp4Writer = pWriter;
+    m_iMP4Stream = iStream;
+
+    m_mp4Sink = m_packetSinks->AddSink("mp4", MP4Sink, this,
+        SINK_QUEUE_PACKETS, QUEUE_DROP_OLDEST);
+    if (m_mp4Sink < 0)
+    {
+        m_mp4Writer = NULL;
+        m_iMP4Stream = -1;
+        return E_FAIL;
+    }
+
+    // The video of the file starts at a key frame: do not leave up to a
+    // GOP of audio before it.
+    InterlockedExchange(&m_lForceKeyFrame, 1);
+    m_bMP4RecordStatus = TRUE;
+
 	return S_OK;
 }
 
@@ -891,5 +2638,13 @@ HRESULT CPreview::StopMP4Record() {
 
 	LOG_INFO("MP4 Record Stopping...\n");
 
+    m_bMP4RecordStatus = FALSE;
+
+    m_packetSinks->RemoveSink(m_mp4Sink);
+    m_mp4Sink = -1;
+
+    m_mp4Writer = NULL;
+    m_iMP4Stream = -1;
+
 	return S_OK;
 }
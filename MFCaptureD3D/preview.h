@@ -15,6 +15,27 @@
 
 const UINT WM_APP_PREVIEW_ERROR = WM_APP + 1;    // wparam = HRESULT
 
+// How capture frames reach the encoder.
+enum ENCODER_INPUT
+{
+    ENCODER_INPUT_DIRECT,       // Capture format is the encoder format. No conversion.
+    ENCODER_INPUT_YUY2,         // YUY2 -> I420 with ConvertYUY2ToI420.
+    ENCODER_INPUT_SWSCALE       // Anything else, through sws_scale.
+};
+
+// Frames the encoder may hold at once. The arrival times of the last
+// this many frames are kept, with their pts.
+const UINT ENCODE_LATENCY_SLOTS = 128;
+
+struct EncodeInput
+{
+    INT64   pts;
+    INT64   llArrival;                  // us
+};
+
+// Renditions of /simulcast at most.
+const int MAX_SIMULCAST_RUNGS = 4;
+
 class CPreview : public IMFSourceReaderCallback
 {
 public:
@@ -51,11 +72,17 @@ public:
     HRESULT       SetDevice(IMFActivate *pActivate);
     HRESULT       InitCodec();
     void          UninitCodec();
+    void          SetEncodeProfile(ENCODE_PROFILE profile);
+    void          SetSimulcast(BOOL bSimulcast);
+    void          SetRawNative(BOOL bRawNative);
+    void          SetRecordIndex(BOOL bIndex);
+    void          SetArchive(BOOL bArchive);
 	HRESULT       StartYUVRecord();
 	HRESULT       StopYUVRecord();
 	HRESULT       StartH264Record();
 	HRESULT       StopH264Record();
-	HRESULT       StartMP4Record();
+	HRESULT       AddMP4Stream(Mp4Writer *pWriter, int *piStream);
+	HRESULT       StartMP4Record(Mp4Writer *pWriter, int iStream);
 	HRESULT       StopMP4Record();
     HRESULT       SetVideoAttribute(IMFMediaType *pType);
     VideoAttribute * GetVideoAttribute();
@@ -75,6 +102,50 @@ protected:
     void    NotifyError(HRESULT hr) { PostMessage(m_hwndEvent, WM_APP_PREVIEW_ERROR, (WPARAM)hr, 0L); }
     HRESULT TryMediaType(IMFMediaType *pType);
 
+    HRESULT StartPipeline();
+    void    StopPipeline();
+    void    UpdateCaptureStats(LONGLONG llTimestamp);
+
+    // Pipeline stages. ctx is the CPreview.
+    static void DrawNode(void *ctx, void *item, PipelineOutput *out);
+    static void RawWriteNode(void *ctx, void *item, PipelineOutput *out);
+    static void ConvertNode(void *ctx, void *item, PipelineOutput *out);
+    static void YUVWriteNode(void *ctx, void *item, PipelineOutput *out);
+    static void EncodeNode(void *ctx, void *item, PipelineOutput *out);
+    static void DeliverNode(void *ctx, void *item, PipelineOutput *out);
+    static void SimulcastNode(void *ctx, void *item, PipelineOutput *out);
+    static void SimulcastPacket(void *ctx, int rung, const AVPacket *pPacket);
+
+    // Packet sinks. ctx is the CPreview.
+    static void H264FileSink(void *ctx, const AVPacket *pPacket);
+    static void MP4Sink(void *ctx, const AVPacket *pPacket);
+
+    void    DrawFrame(AVFrame *pFrame);
+    void    ConvertFrame(AVFrame *pFrame, PipelineOutput *out);
+    void    WriteYUVFrame(AVFrame *pFrame, PipelineOutput *out);
+    void    EncodeFrame(AVFrame *pFrame, PipelineOutput *out);
+    void    EmitPacket(AVPacket *pPacket, PipelineOutput *out);
+    INT64   EncodeBudget();
+    BOOL    IsLatePacket(const AVPacket *pPacket);
+    INT64   FindInputTime(INT64 pts);
+    void    UpdateEncodeLatency(const AVPacket *pPacket);
+    void    AdjustEncoderSpeed(SPEED_STEP step, PipelineOutput *out);
+    HRESULT ReopenEncoder(int iPreset, PipelineOutput *out);
+    static void *DrainProc(void *arg);
+    void    FinishDrain(BOOL bWait, PipelineOutput *out);
+    void    StopDrain();
+    void    WriteH264Packet(const AVPacket *pPacket);
+    void    WriteMP4Packet(const AVPacket *pPacket);
+    void    RemovePacketSinks();
+    void    EncodeSimulcast(AVFrame *pFrame, PipelineOutput *out);
+    void    OpenSimulcastFiles();
+    void    CloseSimulcastFiles();
+    void    WriteRawFrame(const AVFrame *pFrame);
+    void    WriteRawHeader(const AVFrame *pFrame);
+    void    WriteArchiveFrame(AVFrame *pFrame);
+    void    LogArchiveStats(BOOL bReset);
+    void    CloseArchive();
+
     long                    m_nRefCount;        // Reference count.
     CRITICAL_SECTION        m_critsec;
 
@@ -92,13 +163,145 @@ protected:
 
 	AVCodec					*m_codec;
 	AVCodecContext          *m_codecContext;
-    AVFrame                 *m_srcFrame;
     AVFrame                 *m_dstFrame;
 
-    struct SwsContext       *m_swsContext;
+    // Kept across devices: Configure() reuses the contexts when the
+    // format does not change.
+    SliceScaler             *m_scaler;
+    WorkerPool              *m_scalePool;
+    ENCODER_INPUT           m_encoderInput;
+    ENCODE_PROFILE          m_encodeProfile;    // Applied when the device is opened.
+
+    // Capture to packet latency of the encoder, reported every
+    // LATENCY_STATS_FRAMES packets. Only the h264-encode stage uses these.
+    EncodeInput             m_encodeInputs[ENCODE_LATENCY_SLOTS];
+    UINT                    m_uNextInput;
+    INT64                   m_llLatencySum;
+    INT64                   m_llLatencyMax;
+    UINT                    m_uLatencyFrames;
+
+    // The encoder runs in MF_TIME_BASE, with the pts of each frame taken
+    // from its sample time, the capture clock: the capture time of the
+    // last frame encoded, or AV_NOPTS_VALUE, and its pts.
+    LONGLONG                m_llLastEncodeTimestamp;
+    INT64                   m_llLastEncodePts;
+
+    // The dts of the last packet emitted, or AV_NOPTS_VALUE, and whether
+    // the encoder was replaced since a packet went past it.
+    INT64                   m_llLastEncodeDts;
+    BOOL                    m_bEncoderReopened;
+
+    // The encoder ReopenEncoder() replaced, while m_drainThread drains it
+    // into m_drainQueue, or NULL. The packets of the new encoder wait in
+    // m_heldQueue until the drained ones have gone. m_lDrainDone is set
+    // by the drain thread at the end. Used by the h264-encode stage.
+    AVCodecContext          *m_drainContext;
+    MediaQueue              *m_drainQueue;
+    MediaQueue              *m_heldQueue;
+    UINT                    m_uHeldPackets;
+    pthread_t               m_drainThread;
+    volatile LONG           m_lDrainDone;
+
+    // Set when a packet sink is added, so that the next frame is encoded
+    // as an IDR frame rather than the sink waiting out the GOP.
+    volatile LONG           m_lForceKeyFrame;
+
+    // Steps the speed options of the x264 preset between ultrafast and
+    // that of the profile when the encoder falls behind or catches up,
+    // so that frames are not dropped before the encoder. The stream keeps
+    // the headers of the profile preset. Used by the h264-encode stage.
+    SpeedControl            *m_speedControl;
+    int                     m_iPreset;          // In g_X264Presets.
+    int                     m_iProfilePreset;
+
+    // /simulcast: while H.264 is recorded, the capture is also encoded
+    // as the renditions of g_SimulcastLadder, on m_simulcastPool, into
+    // one file each.
+    BOOL                    m_bSimulcast;
+    Simulcast               *m_simulcast;
+    WorkerPool              *m_simulcastPool;
+    FileWriter              *m_simulcastFiles[MAX_SIMULCAST_RUNGS];
+    CRITICAL_SECTION        m_simulcastsec;     // Guards m_simulcastFiles.
+
+    // Conversion timing, reported every CONVERT_STATS_FRAMES frames.
+    INT64                   m_llConvertTime;
+    UINT                    m_uConvertFrames;
+
+    // Capture graph:
+    //
+    //   capture -> preview
+    //   record  -> convert -> yuv-write
+    //                      -> h264-encode -> h264-deliver
+    //           -> simulcast
+    //   raw     -> raw-write
+    //
+    // The capture source emits the wrapped sample. The record source
+    // emits it too when the encoder takes the capture format, so that
+    // nothing is copied, as long as no more than MAX_WRAPPED_SAMPLES are
+    // held; otherwise it emits a copy in m_framePool, so that conversion
+    // never holds on to capture buffers. m_lWrappedSamples counts the
+    // wrapped samples still held by any stage. Converted frames come
+    // from m_encPool. With /rawnative the raw source emits the captured
+    // frames for the raw file, held or copied the same way.
+    //
+    // A frame older than the latency budget of its outputs is dropped at
+    // the first stage that finds it late, before the work of that stage:
+    // before conversion if it is late for every output, before encoding
+    // or writing, and after encoding only if no other frame refers to it.
+    // Each stage counts what it drops in the pipeline statistics.
+    //
+    // h264-deliver hands the packets to m_packetSinks, where each
+    // recording that takes them adds a sink while it runs. A sink is
+    // added once its file is open and removed before it is closed.
+    Pipeline                *m_pipeline;
+    int                     m_captureSource;
+    int                     m_recordSource;
+    int                     m_rawSource;
+    int                     m_convertNode;
+    int                     m_encodeNode;
+    AVBufferPool            *m_framePool;
+    volatile LONG           m_lWrappedSamples;
+    AVBufferPool            *m_encPool;
+    PacketDistributor       *m_packetSinks;
+    int                     m_h264Sink;
+    int                     m_mp4Sink;
+    CRITICAL_SECTION        m_drawsec;          // Guards m_draw.
+    CRITICAL_SECTION        m_filesec;          // Guards the record files.
+
+    // Capture timing, reported every CAPTURE_STATS_FRAMES frames.
+    INT64                   m_llLastArrival;    // us
+    LONGLONG                m_llLastTimestamp;  // 100 ns
+    UINT                    m_uCaptureFrames;
+    INT64                   m_llIntervalSum;
+    INT64                   m_llIntervalSqSum;
+    INT64                   m_llIntervalMax;
+    UINT                    m_uSourceGaps;      // Frames missing from the sample times.
+
+    FileWriter              *h264file;
+    // The YUV recording: Y4M of the encoder input, or with /rawnative
+    // the captured frames as they are, written on the raw-write stage,
+    // with their format and times in rawsidecar.
+    // /index adds a binary frame index to either. With /archive the
+    // encoder input goes to m_archive instead, as FFV1 in video.mkv,
+    // opened at the first frame.
+    FileWriter              *yuvfile;
+    FileWriter              *yuvindex;
+    UINT                    m_uYUVFrames;
+    UINT64                  m_ullYUVBytes;
+    BOOL                    m_bRawNative;
+    BOOL                    m_bRecordIndex;
+    FileWriter              *rawfile;
+    FileWriter              *rawsidecar;
+    FileWriter              *rawindex;
+    UINT                    m_uRawFrames;
+    UINT64                  m_ullRawBytes;
+    BOOL                    m_bArchive;
+    ArchiveWriter           *m_archive;
+    int                     m_iArchiveThreads;
 
-    std::ofstream           *h264file;
-    std::ofstream           *yuvfile;
+    // Owned by the application, which adds the audio stream as well.
+    Mp4Writer               *m_mp4Writer;
+    int                     m_iMP4Stream;
 
 	BOOL					m_bYUVRecordStatus = FALSE;
 	BOOL					m_bH264RecordStatus = FALSE;
@@ -0,0 +1,183 @@
+//////////////////////////////////////////////////////////////////////////
+//
+// recordfile.cpp: Files of the raw and elementary stream recordings.
+//
+//////////////////////////////////////////////////////////////////////////
+
+#include "MFCaptureD3D.h"
+
+
+// Buffer of the index files, which grow by 16 bytes a frame.
+const RecordFileConfig INDEX_FILE_CONFIG = { 64 << 10, 2, FALSE, 0 };
+
+// Chroma bytes split out of an NV12 row at a time.
+const int Y4M_CHROMA_CHUNK = 2048;
+
+
+//-------------------------------------------------------------------
+// OpenRecordFile
+//-------------------------------------------------------------------
+
+FileWriter *OpenRecordFile(const char *pszPath, const RecordFileConfig &config)
+{
+    FileWriter *pFile = FileWriter::Create(config.cbBuffer, config.cBuffers);
+
+    if (pFile && pFile->Open(pszPath, config.bDirect == TRUE, config.cbPrealloc) < 0)
+    {
+        LOG_ERR("cannot create %s\n", pszPath);
+        pFile->Destory();
+        pFile = NULL;
+    }
+
+    return pFile;
+}
+
+
+//-------------------------------------------------------------------
+// CloseRecordFile
+//-------------------------------------------------------------------
+
+void CloseRecordFile(FileWriter **ppFile, const char *pszName)
+{
+    if (*ppFile == NULL)
+    {
+        return;
+    }
+
+    if ((*ppFile)->Close() < 0)
+    {
+        LOG_ERR("%s: data was lost, the disk is full or failed\n", pszName);
+    }
+
+    FileWriterStats stats;
+    (*ppFile)->GetStats(&stats);
+
+    LOG_INFO("%s: %llu bytes in %u writes, write %.2f ms, max %.2f ms, queue max %u, stalls %u\n",
+        pszName, stats.written, stats.writes,
+        stats.meanLatency / 1000.0, stats.maxLatency / 1000.0, stats.maxDepth, stats.stalls);
+
+    (*ppFile)->Destory();
+    *ppFile = NULL;
+}
+
+
+//-------------------------------------------------------------------
+// OpenRecordIndex
+//-------------------------------------------------------------------
+
+FileWriter *OpenRecordIndex(const char *pszPath, AVRational timeBase)
+{
+    FileWriter *pIndex = OpenRecordFile(pszPath, INDEX_FILE_CONFIG);
+
+    if (pIndex)
+    {
+        RecordIndexHeader header;
+        memcpy(header.magic, RECORD_INDEX_MAGIC, sizeof(header.magic));
+        header.cbEntry = sizeof(RecordIndexEntry);
+        header.timeBaseNum = timeBase.num;
+        header.timeBaseDen = timeBase.den;
+
+        pIndex->Write(&header, sizeof(header));
+    }
+
+    return pIndex;
+}
+
+
+//-------------------------------------------------------------------
+// WriteRecordIndex
+//-------------------------------------------------------------------
+
+void WriteRecordIndex(FileWriter *pIndex, UINT64 offset, INT64 timestamp)
+{
+    RecordIndexEntry entry;
+    entry.offset = offset;
+    entry.timestamp = timestamp;
+
+    pIndex->Write(&entry, sizeof(entry));
+}
+
+
+//-------------------------------------------------------------------
+// WriteY4MHeader
+//-------------------------------------------------------------------
+
+int WriteY4MHeader(FileWriter *pFile, int width, int height, const MFRatio &frameRate, AVPixelFormat fmt)
+{
+    if (fmt != AV_PIX_FMT_YUV420P && fmt != AV_PIX_FMT_NV12)
+    {
+        LOG_ERR("y4m: cannot write %s\n", av_get_pix_fmt_name(fmt));
+        return -1;
+    }
+
+    // Camera NV12 and I420, and the x264 input converted to it, have
+    // their chroma sited as in MPEG-2: left, between the rows.
+    char szHeader[128];
+    int cch = snprintf(szHeader, sizeof(szHeader),
+        "YUV4MPEG2 W%d H%d F%u:%u Ip A1:1 C420mpeg2 XYSCSS=420MPEG2\n",
+        width, height, frameRate.Numerator, frameRate.Denominator);
+
+    pFile->Write(szHeader, (uint32_t)cch);
+    return cch;
+}
+
+
+//-------------------------------------------------------------------
+// WriteChromaPlane
+//
+// Writes one chroma plane of an NV12 frame: every other byte of its
+// interleaved rows, starting at iOffset.
+//-------------------------------------------------------------------
+
+static void WriteChromaPlane(FileWriter *pFile, const AVFrame *frame, int iOffset)
+{
+    BYTE buffer[Y4M_CHROMA_CHUNK];
+    int width = (frame->width + 1) / 2;
+    int rows = (frame->height + 1) / 2;
+
+    for (int y = 0; y < rows; y++)
+    {
+        const BYTE *pRow = frame->data[1] + y * frame->linesize[1] + iOffset;
+
+        for (int x = 0; x < width; x += Y4M_CHROMA_CHUNK)
+        {
+            int n = min(width - x, Y4M_CHROMA_CHUNK);
+
+            for (int i = 0; i < n; i++)
+            {
+                buffer[i] = pRow[(x + i) * 2];
+            }
+            pFile->Write(buffer, (uint32_t)n);
+        }
+    }
+}
+
+
+//-------------------------------------------------------------------
+// WriteY4MFrame
+//-------------------------------------------------------------------
+
+int WriteY4MFrame(FileWriter *pFile, const AVFrame *frame)
+{
+    pFile->Write("FRAME\n", Y4M_FRAME_HEADER_SIZE);
+
+    if (frame->format != AV_PIX_FMT_NV12)
+    {
+        return Y4M_FRAME_HEADER_SIZE + WriteFramePlanes(pFile, frame);
+    }
+
+    int bytes = 0;
+    int rows = 0;
+    GetFramePlaneSize(frame, 0, &bytes, &rows);
+
+    for (int y = 0; y < rows; y++)
+    {
+        pFile->Write(frame->data[0] + y * frame->linesize[0], (uint32_t)bytes);
+    }
+
+    WriteChromaPlane(pFile, frame, 0);
+    WriteChromaPlane(pFile, frame, 1);
+
+    int cbChroma = ((frame->width + 1) / 2) * ((frame->height + 1) / 2);
+    return Y4M_FRAME_HEADER_SIZE + bytes * rows + 2 * cbChroma;
+}
@@ -0,0 +1,64 @@
+//////////////////////////////////////////////////////////////////////////
+//
+// recordfile.h: Files of the raw and elementary stream recordings.
+//
+//////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+struct RecordFileConfig
+{
+    UINT32      cbBuffer;           // Size of each write buffer.
+    UINT32      cBuffers;
+    BOOL        bDirect;            // Bypass the system cache.
+    UINT64      cbPrealloc;         // Disk space reserved at a time. 0: none.
+};
+
+// Opens pszPath for writing from a FileWriter thread. Returns NULL if the
+// file cannot be created.
+
+FileWriter *OpenRecordFile(const char *pszPath, const RecordFileConfig &config);
+
+// Writes what is buffered, logs the write statistics of the file and
+// destroys the writer. Sets *ppFile to NULL.
+
+void CloseRecordFile(FileWriter **ppFile, const char *pszName);
+
+// Frame index of a raw recording: a RecordIndexHeader, then one
+// RecordIndexEntry per frame, so that frame i is found at a fixed place
+// without reading the recording. All fields are little-endian.
+
+const char RECORD_INDEX_MAGIC[4] = { 'R', 'I', 'D', 'X' };
+
+struct RecordIndexHeader
+{
+    char        magic[4];           // RECORD_INDEX_MAGIC
+    UINT32      cbEntry;            // sizeof(RecordIndexEntry)
+    INT32       timeBaseNum;        // Of the timestamps.
+    INT32       timeBaseDen;
+};
+
+struct RecordIndexEntry
+{
+    UINT64      offset;             // Of the image data in the recording.
+    INT64       timestamp;
+};
+
+// Opens an index and writes its header. Returns NULL on failure.
+
+FileWriter *OpenRecordIndex(const char *pszPath, AVRational timeBase);
+
+void WriteRecordIndex(FileWriter *pIndex, UINT64 offset, INT64 timestamp);
+
+// Bytes of the FRAME line before the image data of each Y4M frame.
+const UINT32 Y4M_FRAME_HEADER_SIZE = 6;
+
+// Writes the YUV4MPEG2 stream header for frames of the given size, rate
+// and format: AV_PIX_FMT_YUV420P, or AV_PIX_FMT_NV12, which is written
+// as planar 4:2:0. Returns the bytes written, or -1 for another format.
+
+int WriteY4MHeader(FileWriter *pFile, int width, int height, const MFRatio &frameRate, AVPixelFormat fmt);
+
+// Writes a FRAME line and the image. Returns the bytes written.
+
+int WriteY4MFrame(FileWriter *pFile, const AVFrame *frame);
@@ -0,0 +1,223 @@
+//////////////////////////////////////////////////////////////////////////
+//
+// sampleframe.cpp: AVFrame views of Media Foundation samples.
+//
+//////////////////////////////////////////////////////////////////////////
+
+#include "MFCaptureD3D.h"
+#include "BufferLock.h"
+
+
+// Owned by the AVBuffer of a wrapped frame.
+struct SampleFrameRef
+{
+    IMFSample       *pSample;
+    VideoBufferLock *pLock;
+    volatile LONG   *plLive;    // Wrapped samples still held, or NULL.
+};
+
+
+//-------------------------------------------------------------------
+// ReleaseSampleFrame
+//
+// AVBuffer free callback. Unlocks the buffer and releases the sample.
+//-------------------------------------------------------------------
+
+static void ReleaseSampleFrame(void *opaque, uint8_t * /* data */)
+{
+    SampleFrameRef *ref = (SampleFrameRef*)opaque;
+
+    delete ref->pLock;      // Unlocks and releases the media buffer.
+    SafeRelease(&ref->pSample);
+
+    if (ref->plLive)
+    {
+        InterlockedDecrement(ref->plLive);
+    }
+    delete ref;
+}
+
+
+//-------------------------------------------------------------------
+// CreateFrameFromSample
+//-------------------------------------------------------------------
+
+HRESULT CreateFrameFromSample(
+    IMFSample       *pSample,
+    AVPixelFormat   format,
+    UINT32          width,
+    UINT32          height,
+    LONG            lDefaultStride,
+    volatile LONG   *plLive,
+    AVFrame         **ppFrame
+    )
+{
+    if (pSample == NULL || ppFrame == NULL)
+    {
+        return E_POINTER;
+    }
+
+    HRESULT hr = S_OK;
+    IMFMediaBuffer *pBuffer = NULL;
+    SampleFrameRef *ref = NULL;
+    AVFrame *frame = NULL;
+    BYTE *pbScanline0 = NULL;
+    BYTE *pbStart = NULL;
+    DWORD cbLength = 0;
+    LONG lStride = 0;
+    int size = 0;
+
+    hr = pSample->GetBufferByIndex(0, &pBuffer);
+
+    if (FAILED(hr)) { goto done; }
+
+    ref = new (std::nothrow) SampleFrameRef;
+    if (ref == NULL)
+    {
+        hr = E_OUTOFMEMORY;
+        goto done;
+    }
+
+    ref->pSample = pSample;
+    ref->pSample->AddRef();
+    ref->plLive = NULL;
+    ref->pLock = new (std::nothrow) VideoBufferLock(pBuffer);
+    if (ref->pLock == NULL)
+    {
+        hr = E_OUTOFMEMORY;
+        goto done;
+    }
+
+    // Lock the video buffer. This returns a pointer to the first scan
+    // line in the image, the stride in bytes, and the locked memory.
+    hr = ref->pLock->LockBuffer(lDefaultStride, height, &pbScanline0, &lStride,
+        &pbStart, &cbLength);
+
+    if (FAILED(hr)) { goto done; }
+
+    frame = av_frame_alloc();
+    if (frame == NULL)
+    {
+        hr = E_OUTOFMEMORY;
+        goto done;
+    }
+
+    frame->format = format;
+    frame->width = width;
+    frame->height = height;
+
+    size = FillFramePlanes(frame, pbScanline0, lStride);
+
+    // The AVBuffer covers the locked memory, not the span from scan line
+    // 0: for a bottom-up image, scan line 0 is the highest row in memory.
+    if (lStride > 0 && size > (int)cbLength)
+    {
+        // Planes after the first one, which Lock2D does not account for.
+        cbLength = size;
+    }
+
+    frame->buf[0] = av_buffer_create(pbStart, cbLength,
+        ReleaseSampleFrame, ref, AV_BUFFER_FLAG_READONLY);
+    if (frame->buf[0] == NULL)
+    {
+        hr = E_OUTOFMEMORY;
+        goto done;
+    }
+
+    // The frame owns the lock and the sample reference now.
+    if (plLive)
+    {
+        ref->plLive = plLive;
+        InterlockedIncrement(plLive);
+    }
+    ref = NULL;
+
+    *ppFrame = frame;
+    frame = NULL;
+
+done:
+    if (ref)
+    {
+        ReleaseSampleFrame(ref, NULL);
+    }
+    av_frame_free(&frame);
+    SafeRelease(&pBuffer);
+    return hr;
+}
+
+
+//-------------------------------------------------------------------
+// AllocFrameFromPool
+//-------------------------------------------------------------------
+
+HRESULT AllocFrameFromPool(
+    AVBufferPool    *pPool,
+    AVPixelFormat   format,
+    int             width,
+    int             height,
+    AVFrame         **ppFrame
+    )
+{
+    if (pPool == NULL || ppFrame == NULL)
+    {
+        return E_POINTER;
+    }
+
+    AVFrame *frame = av_frame_alloc();
+    if (frame == NULL)
+    {
+        return E_OUTOFMEMORY;
+    }
+
+    frame->format = format;
+    frame->width = width;
+    frame->height = height;
+
+    frame->buf[0] = av_buffer_pool_get(pPool);
+    if (frame->buf[0] == NULL)
+    {
+        av_frame_free(&frame);
+        return E_OUTOFMEMORY;
+    }
+
+    av_image_fill_arrays(frame->data, frame->linesize, frame->buf[0]->data,
+        format, width, height, 32);
+
+    *ppFrame = frame;
+    return S_OK;
+}
+
+
+//-------------------------------------------------------------------
+// CopyFrameToPool
+//-------------------------------------------------------------------
+
+HRESULT CopyFrameToPool(
+    AVBufferPool    *pPool,
+    const AVFrame   *pSrc,
+    AVFrame         **ppFrame
+    )
+{
+    if (pSrc == NULL)
+    {
+        return E_POINTER;
+    }
+
+    AVFrame *frame = NULL;
+
+    HRESULT hr = AllocFrameFromPool(pPool, (AVPixelFormat)pSrc->format,
+        pSrc->width, pSrc->height, &frame);
+    if (FAILED(hr))
+    {
+        return hr;
+    }
+
+    if (av_frame_copy(frame, pSrc) < 0 || av_frame_copy_props(frame, pSrc) < 0)
+    {
+        av_frame_free(&frame);
+        return E_FAIL;
+    }
+
+    *ppFrame = frame;
+    return S_OK;
+}
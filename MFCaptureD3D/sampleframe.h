@@ -0,0 +1,47 @@
+//////////////////////////////////////////////////////////////////////////
+//
+// sampleframe.h: AVFrame views of Media Foundation samples.
+//
+//////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+// Wraps the first buffer of a video sample in an AVFrame without copying.
+//
+// The buffer is locked and the sample is AddRef'd for as long as any
+// reference to the frame (or a clone of it) exists; releasing the last
+// reference unlocks the buffer and releases the sample. The frame is
+// read-only.
+//
+// plLive, if not NULL, counts the samples wrapped with it that are still
+// held: it goes up here and down when the last reference is released.
+
+HRESULT CreateFrameFromSample(
+    IMFSample       *pSample,
+    AVPixelFormat   format,
+    UINT32          width,
+    UINT32          height,
+    LONG            lDefaultStride,
+    volatile LONG   *plLive,
+    AVFrame         **ppFrame
+    );
+
+// Allocates a video frame from pPool, which must hold buffers of at
+// least av_image_get_buffer_size(format, width, height, 32) bytes.
+
+HRESULT AllocFrameFromPool(
+    AVBufferPool    *pPool,
+    AVPixelFormat   format,
+    int             width,
+    int             height,
+    AVFrame         **ppFrame
+    );
+
+// Copies a frame into a buffer from pPool (see AllocFrameFromPool). Used
+// to release capture buffers early when a frame is queued.
+
+HRESULT CopyFrameToPool(
+    AVBufferPool    *pPool,
+    const AVFrame   *pSrc,
+    AVFrame         **ppFrame
+    );
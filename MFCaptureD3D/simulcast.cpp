@@ -0,0 +1,433 @@
+
+#include "MFCaptureD3D.h"
+
+#include <vector>
+
+
+// Filter of the pyramid.
+const int SIMULCAST_SCALE_FLAGS = SWS_BICUBIC;
+
+
+struct SimulcastLevel
+{
+	int width;
+	int height;
+	int64_t bitRate;
+	SliceScaler * scaler;	// From the level above, or the source.
+	AVFrame * frame;
+	AVCodecContext * context;
+};
+
+
+class SimulcastImpl : public Simulcast
+{
+
+public:
+	SimulcastImpl();
+	~SimulcastImpl();
+
+	void Create(WorkerPool * pool);
+	void Destory();
+
+	int Configure(int srcW, int srcH, AVPixelFormat srcFmt,
+		const SimulcastRung * rungs, int count, ENCODE_PROFILE profile,
+		AVRational frameRate, AVRational timeBase,
+		SIMULCAST_PACKET_FN fn, void * ctx);
+
+	int GetRungCount() {
+		return (int)levels.size();
+	}
+
+	void GetRungSize(int rung, int * width, int * height);
+	int Encode(const AVFrame * frame);
+	void Flush();
+	void GetStats(SimulcastStats * stats, bool reset);
+
+private:
+	void Init();
+	void Uninit();
+
+	AVCodecContext * OpenEncoder(const SimulcastLevel & level);
+
+	void RunEncodeJob();
+	static void EncodeJob(void * ctx, uint32_t start, uint32_t end);
+	void EncodeLevel(int index);
+
+private:
+	WorkerPool * pool = NULL;
+
+	std::vector<SimulcastLevel> levels;
+	ENCODE_PROFILE profile = ENCODE_PROFILE_ARCHIVE;
+	AVRational frameRate = { 0, 1 };
+	AVRational timeBase = { 0, 1 };
+	int fps = 0;								// Rounded, for the GOP.
+	int64_t frameDuration = 0;					// In timeBase.
+	int64_t second = 0;
+
+	int64_t lastPts = AV_NOPTS_VALUE;			// Encoded.
+	int64_t lastSourcePts = AV_NOPTS_VALUE;
+	bool flushing = false;		// EncodeJob drains the encoders.
+
+	SIMULCAST_PACKET_FN fn = NULL;
+	void * ctx = NULL;
+
+	SimulcastStats stats;
+};
+
+
+Simulcast * Simulcast::Create(WorkerPool * pool) {
+
+	SimulcastImpl * simulcast = new SimulcastImpl();
+	if (simulcast)
+	{
+		simulcast->Create(pool);
+	}
+
+	return simulcast;
+
+}
+
+
+SimulcastImpl::SimulcastImpl()
+{
+	Init();
+}
+
+
+SimulcastImpl::~SimulcastImpl()
+{
+	Uninit();
+}
+
+
+void SimulcastImpl::Init()
+{
+	memset(&stats, 0, sizeof(stats));
+}
+
+
+void SimulcastImpl::Uninit()
+{
+	for (size_t i = 0; i < levels.size(); i++)
+	{
+		levels[i].scaler->Destory();
+		av_frame_free(&levels[i].frame);
+		avcodec_free_context(&levels[i].context);
+	}
+	levels.clear();
+}
+
+
+void SimulcastImpl::Create(WorkerPool * _pool)
+{
+	pool = _pool;
+}
+
+
+void SimulcastImpl::Destory()
+{
+	delete this;
+}
+
+
+int SimulcastImpl::Configure(int srcW, int srcH, AVPixelFormat srcFmt,
+	const SimulcastRung * rungs, int count, ENCODE_PROFILE _profile,
+	AVRational _frameRate, AVRational _timeBase,
+	SIMULCAST_PACKET_FN _fn, void * _ctx)
+{
+	Uninit();
+
+	profile = _profile;
+	frameRate = _frameRate;
+	timeBase = _timeBase;
+	fn = _fn;
+	ctx = _ctx;
+	lastPts = AV_NOPTS_VALUE;
+	lastSourcePts = AV_NOPTS_VALUE;
+	memset(&stats, 0, sizeof(stats));
+
+	if (srcW <= 0 || srcH <= 0 || frameRate.num <= 0 || frameRate.den <= 0 ||
+		timeBase.num <= 0 || timeBase.den <= 0)
+	{
+		return -1;
+	}
+
+	fps = FFMAX((frameRate.num + frameRate.den / 2) / frameRate.den, 1);
+	frameDuration = FFMAX(av_rescale_q(1, av_inv_q(frameRate), timeBase), 1);
+	second = FFMAX(av_rescale_q(1, av_make_q(1, 1), timeBase), 1);
+
+	int w = srcW;
+	int h = srcH;
+	AVPixelFormat fmt = srcFmt;
+
+	for (int i = 0; i < count; i++)
+	{
+		if (rungs[i].height > srcH || rungs[i].height > h)
+		{
+			continue;
+		}
+
+		SimulcastLevel level;
+		level.height = rungs[i].height & ~1;
+		level.width = (int)((int64_t)srcW * level.height / srcH) & ~1;
+		level.bitRate = rungs[i].bitRate;
+		level.scaler = SliceScaler::Create(pool);
+		level.frame = av_frame_alloc();
+		level.context = NULL;
+
+		if (level.frame)
+		{
+			level.frame->format = AV_PIX_FMT_YUV420P;
+			level.frame->width = level.width;
+			level.frame->height = level.height;
+		}
+
+		if (level.scaler == NULL || level.frame == NULL ||
+			level.scaler->Configure(w, h, fmt, level.width, level.height, AV_PIX_FMT_YUV420P,
+				SIMULCAST_SCALE_FLAGS, 0) < 0 ||
+			av_frame_get_buffer(level.frame, 32) < 0 ||
+			(level.context = OpenEncoder(level)) == NULL)
+		{
+			if (level.scaler)
+			{
+				level.scaler->Destory();
+			}
+			av_frame_free(&level.frame);
+
+			LOG_ERR("simulcast: cannot set up %dx%d\n", level.width, level.height);
+			Uninit();
+			return -1;
+		}
+
+		LOG_INFO("simulcast: %dx%d from %dx%d, %lld kb/s\n",
+			level.width, level.height, w, h, level.bitRate / 1000);
+
+		levels.push_back(level);
+
+		w = level.width;
+		h = level.height;
+		fmt = AV_PIX_FMT_YUV420P;
+	}
+
+	return (int)levels.size();
+}
+
+
+AVCodecContext * SimulcastImpl::OpenEncoder(const SimulcastLevel & level)
+{
+	AVCodec * codec = avcodec_find_encoder(AV_CODEC_ID_H264);
+	AVCodecContext * context = codec ? avcodec_alloc_context3(codec) : NULL;
+	if (context == NULL)
+	{
+		return NULL;
+	}
+
+	context->width = level.width;
+	context->height = level.height;
+	context->pix_fmt = AV_PIX_FMT_YUV420P;
+	context->framerate = frameRate;
+	context->time_base = timeBase;
+
+	ApplyEncodeProfile(context, profile, fps, level.bitRate);
+
+	// IDR frames only where Encode() asks for them, on every rung alike:
+	// no intra refresh, no scene cuts and no GOP limit of x264's own,
+	// which would otherwise place one every fps frames as well.
+	context->thread_count = 1;
+	av_opt_set_int(context->priv_data, "intra-refresh", 0, 0);
+	av_opt_set_int(context->priv_data, "forced-idr", 1, 0);
+	av_opt_set(context->priv_data, "x264-params", "scenecut=0:keyint=infinite", 0);
+
+	if (avcodec_open2(context, codec, NULL) < 0)
+	{
+		avcodec_free_context(&context);
+		return NULL;
+	}
+
+	return context;
+}
+
+
+void SimulcastImpl::GetRungSize(int rung, int * width, int * height)
+{
+	if (rung < 0 || rung >= (int)levels.size())
+	{
+		*width = 0;
+		*height = 0;
+		return;
+	}
+
+	*width = levels[rung].width;
+	*height = levels[rung].height;
+}
+
+
+int SimulcastImpl::Encode(const AVFrame * frame)
+{
+	if (levels.empty() || frame == NULL)
+	{
+		return -1;
+	}
+
+	int64_t start = av_gettime_relative();
+
+	const uint8_t * const * src = frame->data;
+	const int * srcStride = frame->linesize;
+
+	for (size_t i = 0; i < levels.size(); i++)
+	{
+		AVFrame * dst = levels[i].frame;
+
+		if (levels[i].scaler->Scale(src, srcStride, dst->data, dst->linesize) < 0)
+		{
+			return -1;
+		}
+
+		src = dst->data;
+		srcStride = dst->linesize;
+	}
+
+	int64_t scaled = av_gettime_relative();
+
+	int64_t step = frameDuration;
+	if (lastSourcePts != AV_NOPTS_VALUE && frame->pts != AV_NOPTS_VALUE &&
+		frame->pts > lastSourcePts && frame->pts - lastSourcePts <= second)
+	{
+		step = frame->pts - lastSourcePts;
+	}
+	if (frame->pts != AV_NOPTS_VALUE)
+	{
+		lastSourcePts = frame->pts;
+	}
+
+	int64_t pts = lastPts == AV_NOPTS_VALUE ? 0 : lastPts + step;
+
+	// The same frames are IDR frames on every rung.
+	bool idr = lastPts == AV_NOPTS_VALUE || pts / second != lastPts / second;
+	lastPts = pts;
+
+	for (size_t i = 0; i < levels.size(); i++)
+	{
+		levels[i].frame->pts = pts;
+		levels[i].frame->pict_type = idr ? AV_PICTURE_TYPE_I : AV_PICTURE_TYPE_NONE;
+	}
+
+	RunEncodeJob();
+
+	int64_t end = av_gettime_relative();
+
+	stats.frames++;
+	stats.scaleTime += scaled - start;
+	stats.encodeTime += end - scaled;
+
+	return 0;
+}
+
+
+void SimulcastImpl::Flush()
+{
+	if (levels.empty())
+	{
+		return;
+	}
+
+	flushing = true;
+	RunEncodeJob();
+	flushing = false;
+
+	for (size_t i = 0; i < levels.size(); i++)
+	{
+		avcodec_free_context(&levels[i].context);
+		levels[i].context = OpenEncoder(levels[i]);
+
+		if (levels[i].context == NULL)
+		{
+			LOG_ERR("simulcast: cannot reopen %dx%d\n", levels[i].width, levels[i].height);
+			Uninit();
+			return;
+		}
+	}
+
+	lastPts = AV_NOPTS_VALUE;
+	lastSourcePts = AV_NOPTS_VALUE;
+}
+
+
+void SimulcastImpl::RunEncodeJob()
+{
+	if (pool)
+	{
+		pool->Run(EncodeJob, this, (uint32_t)levels.size(), 1);
+	}
+	else
+	{
+		EncodeJob(this, 0, (uint32_t)levels.size());
+	}
+}
+
+
+void SimulcastImpl::EncodeJob(void * ctx, uint32_t start, uint32_t end)
+{
+	SimulcastImpl * simulcast = (SimulcastImpl *)ctx;
+
+	for (uint32_t i = start; i < end; i++)
+	{
+		simulcast->EncodeLevel((int)i);
+	}
+}
+
+
+// Encodes the frame of a level, or drains its encoder.
+void SimulcastImpl::EncodeLevel(int index)
+{
+	bool flush = flushing;
+
+	SimulcastLevel & level = levels[index];
+
+	AVPacket * pkt = av_packet_alloc();
+	if (pkt == NULL)
+	{
+		return;
+	}
+
+	for (;;)
+	{
+		int got_packet = 0;
+
+		int ret = avcodec_encode_video2(level.context, pkt, flush ? NULL : level.frame, &got_packet);
+		if (ret < 0)
+		{
+			LOG_ERR("simulcast: %dx%d: avcodec_encode_video2 error with %d\n", level.width, level.height, ret);
+		}
+
+		if (ret < 0 || !got_packet)
+		{
+			break;
+		}
+
+		if (fn)
+		{
+			fn(ctx, index, pkt);
+		}
+		av_packet_unref(pkt);
+
+		// A frame gives at most one packet; a flush gives all of them.
+		if (!flush)
+		{
+			break;
+		}
+	}
+
+	av_packet_free(&pkt);
+}
+
+
+void SimulcastImpl::GetStats(SimulcastStats * _stats, bool reset)
+{
+	*_stats = stats;
+
+	if (reset)
+	{
+		memset(&stats, 0, sizeof(stats));
+	}
+}
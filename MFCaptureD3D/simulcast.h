@@ -0,0 +1,64 @@
+
+#pragma once
+
+// Receives a packet of one rung. Called on a pool thread, never for the
+// same rung from two threads at once. The packet belongs to the caller.
+typedef void (*SIMULCAST_PACKET_FN)(void * ctx, int rung, const AVPacket * packet);
+
+struct SimulcastStats
+{
+	uint32_t frames;
+	int64_t scaleTime;		// us, all rungs.
+	int64_t encodeTime;		// us, all rungs in parallel.
+};
+
+// Encodes one source as several renditions (rungs) of decreasing size.
+//
+// The rungs form a pyramid: the first is scaled from the source, every
+// other one from the rung above it, which is smaller and already in the
+// encoder format. The rungs are then encoded in parallel on a WorkerPool,
+// one x264 instance each, with a single thread each so that the pool
+// decides how many cores the ladder takes. The scalers of the rungs use
+// the pool as well. Run() holds the pool for the whole encode, so it is
+// best not shared with work that cannot wait that long. Without a pool
+// everything runs on the calling thread.
+//
+// Every rung gets an IDR frame on the same source frames, the first of
+// every second, and no others, so that a receiver can switch between the
+// renditions at any key frame.
+//
+// The encoders run in the time base of the source pts, and the streams
+// start at 0. A gap in the source pts, e.g. a dropped frame or a lower
+// rate from the camera, is kept; a step back or of more than a second is
+// taken as one frame at the nominal rate.
+class Simulcast
+{
+
+public:
+
+	static Simulcast * Create(WorkerPool * pool);
+	virtual void Destory() = 0;
+
+	// Sets up the rungs for frames of the source format and opens their
+	// encoders. frameRate is the nominal rate; the source pts are in
+	// timeBase. Rungs taller than the source are left out. Returns the
+	// number of rungs, or -1.
+	virtual int Configure(int srcW, int srcH, AVPixelFormat srcFmt,
+		const SimulcastRung * rungs, int count, ENCODE_PROFILE profile,
+		AVRational frameRate, AVRational timeBase,
+		SIMULCAST_PACKET_FN fn, void * ctx) = 0;
+
+	virtual int GetRungCount() = 0;
+	virtual void GetRungSize(int rung, int * width, int * height) = 0;
+
+	// Scales and encodes a source frame. A frame without a pts follows
+	// the last one. Returns 0, or -1.
+	virtual int Encode(const AVFrame * frame) = 0;
+
+	// Drains the encoders and opens new ones: the next frame starts new
+	// streams, with an IDR frame on every rung.
+	virtual void Flush() = 0;
+
+	virtual void GetStats(SimulcastStats * stats, bool reset) = 0;
+
+};
@@ -0,0 +1,369 @@
+
+#include "MFCaptureD3D.h"
+
+#include <vector>
+
+
+// Source rows, per unit of scale factor, that a filter tap can reach on
+// either side of a destination row. Covers every sws filter up to Lanczos.
+const int SCALER_FILTER_REACH = 4;
+
+// A band scales a window that reaches past its rows into the
+// neighbouring bands, so that the filter sees the same rows as it would
+// for the whole frame. The rows of the window outside the band are
+// scaled into scratch and discarded.
+struct ScalerBand
+{
+	SwsContext * context;
+	int dstY;			// Rows of the frame the band writes.
+	int dstH;
+	int srcY;			// Window of the context.
+	int srcH;
+	int windowY;
+	int windowH;
+	int margin;			// Destination rows of the window above dstY.
+	uint8_t * scratch[4];	// Window output, NULL if the window is the band.
+	int scratchStride[4];
+	int result;			// Of the last sws_scale() call.
+};
+
+
+class SliceScalerImpl : public SliceScaler
+{
+
+public:
+	SliceScalerImpl();
+	~SliceScalerImpl();
+
+	void Create(WorkerPool * pool);
+	void Destory();
+
+	int Configure(int srcW, int srcH, AVPixelFormat srcFmt,
+		int dstW, int dstH, AVPixelFormat dstFmt, int flags, uint32_t slices);
+
+	uint32_t GetSliceCount() {
+		return (uint32_t)bands.size();
+	}
+
+	int Scale(const uint8_t * const src[], const int srcStride[],
+		uint8_t * const dst[], const int dstStride[]);
+
+private:
+	static void ScaleJob(void * ctx, uint32_t start, uint32_t end);
+	int ScaleBand(uint32_t index);
+
+	static void OffsetPlanes(const AVPixFmtDescriptor * desc, int y,
+		uint8_t * const planes[], const int strides[], uint8_t * out[]);
+
+	void FreeBand(ScalerBand & band);
+
+private:
+	WorkerPool * pool = NULL;
+	std::vector<ScalerBand> bands;
+
+	const AVPixFmtDescriptor * srcDesc = NULL;
+	const AVPixFmtDescriptor * dstDesc = NULL;
+	AVPixelFormat dstFormat = AV_PIX_FMT_NONE;
+	int dstWidth = 0;
+
+	// Frame being scaled.
+	const uint8_t * const * src = NULL;
+	const int * srcStride = NULL;
+	uint8_t * const * dst = NULL;
+	const int * dstStride = NULL;
+};
+
+
+SliceScaler * SliceScaler::Create(WorkerPool * pool) {
+
+	SliceScalerImpl * scaler = new SliceScalerImpl();
+	if (scaler)
+	{
+		scaler->Create(pool);
+	}
+
+	return scaler;
+
+}
+
+
+SliceScalerImpl::SliceScalerImpl()
+{
+}
+
+
+SliceScalerImpl::~SliceScalerImpl()
+{
+	for (size_t i = 0; i < bands.size(); i++)
+	{
+		FreeBand(bands[i]);
+	}
+	bands.clear();
+}
+
+
+void SliceScalerImpl::FreeBand(ScalerBand & band)
+{
+	sws_freeContext(band.context);
+	band.context = NULL;
+
+	av_freep(&band.scratch[0]);
+}
+
+
+void SliceScalerImpl::Create(WorkerPool * _pool)
+{
+	pool = _pool;
+}
+
+
+void SliceScalerImpl::Destory()
+{
+	delete this;
+}
+
+
+static int Gcd(int a, int b)
+{
+	while (b != 0)
+	{
+		int t = a % b;
+		a = b;
+		b = t;
+	}
+	return a;
+}
+
+
+int SliceScalerImpl::Configure(int srcW, int srcH, AVPixelFormat srcFmt,
+	int dstW, int dstH, AVPixelFormat dstFmt, int flags, uint32_t slices)
+{
+	srcDesc = av_pix_fmt_desc_get(srcFmt);
+	dstDesc = av_pix_fmt_desc_get(dstFmt);
+
+	if (srcDesc == NULL || dstDesc == NULL || srcW <= 0 || srcH <= 0 || dstW <= 0 || dstH <= 0)
+	{
+		return -1;
+	}
+
+	if (slices == 0)
+	{
+		slices = pool ? pool->GetThreadCount() : 1;
+	}
+
+	// The smallest band that keeps the exact scale factor, with a whole
+	// number of chroma rows on both sides.
+	int g = Gcd(srcH, dstH);
+	int unitSrc = srcH / g;
+	int unitDst = dstH / g;
+	int alignSrc = 1 << srcDesc->log2_chroma_h;
+	int alignDst = 1 << dstDesc->log2_chroma_h;
+
+	int k = 1;
+	while ((unitSrc * k) % alignSrc != 0 || (unitDst * k) % alignDst != 0)
+	{
+		k++;
+	}
+	unitSrc *= k;
+	unitDst *= k;
+
+	uint32_t units = (uint32_t)(dstH / unitDst);
+	uint32_t count = slices < units ? slices : units;
+	if (count == 0)
+	{
+		count = 1;
+	}
+
+	// Units of overlap with the neighbouring bands. None without
+	// vertical filtering, i.e. when no plane changes height.
+	int reach = SCALER_FILTER_REACH * ((srcH + dstH - 1) / dstH);
+	int overlap = (reach + unitSrc - 1) / unitSrc;
+
+	if (srcH == dstH && srcDesc->log2_chroma_h == dstDesc->log2_chroma_h)
+	{
+		overlap = 0;
+	}
+
+	for (size_t i = count; i < bands.size(); i++)
+	{
+		FreeBand(bands[i]);
+	}
+	bands.resize(count, ScalerBand());
+
+	dstFormat = dstFmt;
+	dstWidth = dstW;
+
+	uint32_t i = 0;
+
+	for (i = 0; i < count; i++)
+	{
+		ScalerBand & band = bands[i];
+
+		if (count == 1)
+		{
+			band.dstY = 0;
+			band.dstH = dstH;
+			band.srcY = 0;
+			band.srcH = srcH;
+			band.windowY = 0;
+			band.windowH = dstH;
+			band.margin = 0;
+		}
+		else
+		{
+			int first = (int)(i * units / count);
+			int last = (int)((i + 1) * units / count);
+
+			// The last band also takes the rows that do not fill a unit.
+			bool bottom = (i == count - 1);
+
+			int windowFirst = first > overlap ? first - overlap : 0;
+			int windowLast = last + overlap < (int)units ? last + overlap : (int)units;
+
+			band.dstY = first * unitDst;
+			band.dstH = bottom ? dstH - band.dstY : (last - first) * unitDst;
+			band.srcY = windowFirst * unitSrc;
+			band.srcH = bottom ? srcH - band.srcY : (windowLast - windowFirst) * unitSrc;
+			band.windowY = windowFirst * unitDst;
+			band.windowH = bottom ? dstH - band.windowY : (windowLast - windowFirst) * unitDst;
+			band.margin = band.dstY - band.windowY;
+		}
+
+		av_freep(&band.scratch[0]);
+
+		if (band.windowH != band.dstH &&
+			av_image_alloc(band.scratch, band.scratchStride, dstW, band.windowH, dstFmt, 32) < 0)
+		{
+			break;
+		}
+
+		band.context = sws_getCachedContext(band.context,
+			srcW, band.srcH, srcFmt, dstW, band.windowH, dstFmt,
+			flags, NULL, NULL, NULL);
+
+		if (band.context == NULL)
+		{
+			break;
+		}
+	}
+
+	if (i < count)
+	{
+		LOG_ERR("cannot set up scaler band %u of %u (%dx%d -> %dx%d)\n",
+			i, count, srcW, srcH, dstW, dstH);
+
+		for (size_t j = 0; j < bands.size(); j++)
+		{
+			FreeBand(bands[j]);
+		}
+		bands.clear();
+		return -1;
+	}
+
+	return 0;
+}
+
+
+// Points out[] at row y of every plane.
+void SliceScalerImpl::OffsetPlanes(const AVPixFmtDescriptor * desc, int y,
+	uint8_t * const planes[], const int strides[], uint8_t * out[])
+{
+	for (int p = 0; p < 4; p++)
+	{
+		out[p] = planes[p];
+
+		if (planes[p] == NULL || ((desc->flags & AV_PIX_FMT_FLAG_PAL) && p == 1))
+		{
+			continue;
+		}
+
+		int rows = (p == 1 || p == 2) ? (y >> desc->log2_chroma_h) : y;
+		out[p] = planes[p] + (ptrdiff_t)rows * strides[p];
+	}
+}
+
+
+int SliceScalerImpl::ScaleBand(uint32_t index)
+{
+	ScalerBand & band = bands[index];
+
+	uint8_t * srcPlanes[4];
+	uint8_t * dstPlanes[4];
+
+	OffsetPlanes(srcDesc, band.srcY, (uint8_t * const *)src, srcStride, srcPlanes);
+	OffsetPlanes(dstDesc, band.dstY, dst, dstStride, dstPlanes);
+
+	if (band.scratch[0] == NULL)
+	{
+		return sws_scale(band.context, srcPlanes, srcStride, 0, band.srcH, dstPlanes, dstStride);
+	}
+
+	int ret = sws_scale(band.context, srcPlanes, srcStride, 0, band.srcH,
+		band.scratch, band.scratchStride);
+
+	if (ret > 0)
+	{
+		uint8_t * rows[4];
+		int linesize[4];
+
+		OffsetPlanes(dstDesc, band.margin, band.scratch, band.scratchStride, rows);
+
+		for (int p = 0; p < 4; p++)
+		{
+			linesize[p] = dstStride[p];
+		}
+
+		av_image_copy(dstPlanes, linesize, (const uint8_t **)rows, band.scratchStride,
+			dstFormat, dstWidth, band.dstH);
+	}
+
+	return ret;
+}
+
+
+void SliceScalerImpl::ScaleJob(void * ctx, uint32_t start, uint32_t end)
+{
+	SliceScalerImpl * scaler = (SliceScalerImpl *)ctx;
+
+	for (uint32_t i = start; i < end; i++)
+	{
+		scaler->bands[i].result = scaler->ScaleBand(i);
+	}
+}
+
+
+int SliceScalerImpl::Scale(const uint8_t * const _src[], const int _srcStride[],
+	uint8_t * const _dst[], const int _dstStride[])
+{
+	if (bands.empty())
+	{
+		return -1;
+	}
+
+	src = _src;
+	srcStride = _srcStride;
+	dst = _dst;
+	dstStride = _dstStride;
+
+	if (pool && bands.size() > 1)
+	{
+		pool->Run(ScaleJob, this, (uint32_t)bands.size(), 1);
+	}
+	else
+	{
+		ScaleJob(this, 0, (uint32_t)bands.size());
+	}
+
+	src = NULL;
+	dst = NULL;
+
+	for (size_t i = 0; i < bands.size(); i++)
+	{
+		if (bands[i].result <= 0)
+		{
+			return -1;
+		}
+	}
+
+	return 0;
+}
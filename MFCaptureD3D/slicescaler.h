@@ -0,0 +1,40 @@
+
+#pragma once
+
+// Scales and converts frames with sws_scale, split into horizontal bands
+// that run in parallel on a WorkerPool. Every band has its own SwsContext
+// that maps a band of source rows onto the destination rows it covers.
+// Bands keep the exact scale factor and scale a few rows past their
+// edges, so the output is that of a single context. When the vertical
+// step is not exact in the 16.16 fixed point of swscale (e.g. 768 ->
+// 480), the rounding restarts at every band and samples may differ by
+// one level.
+//
+// The flags select the filter of each output, e.g. SWS_FAST_BILINEAR
+// for a preview and SWS_BICUBIC for a recording.
+class SliceScaler
+{
+
+public:
+
+	// pool may be NULL, or shared with other users: bands then run on
+	// the calling thread, or wait for the pool.
+	static SliceScaler * Create(WorkerPool * pool);
+	virtual void Destory() = 0;
+
+	// Sets up the conversion, with up to slices bands (0: one per pool
+	// thread). The contexts are kept with sws_getCachedContext, so
+	// calling this again with the same parameters, e.g. after the device
+	// is reopened, reuses them.
+	virtual int Configure(int srcW, int srcH, AVPixelFormat srcFmt,
+		int dstW, int dstH, AVPixelFormat dstFmt, int flags, uint32_t slices) = 0;
+
+	// Bands in use. Fewer than requested when the heights cannot be
+	// split at the exact scale factor.
+	virtual uint32_t GetSliceCount() = 0;
+
+	// Scales a whole frame.
+	virtual int Scale(const uint8_t * const src[], const int srcStride[],
+		uint8_t * const dst[], const int dstStride[]) = 0;
+
+};
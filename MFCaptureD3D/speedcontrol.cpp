@@ -0,0 +1,170 @@
+
+#include <stdint.h>
+#include <string.h>
+
+#include "speedcontrol.h"
+
+
+// Frames in a window, about one second of video.
+const uint32_t SPEED_WINDOW_FRAMES = 30;
+
+// Share of the frame interval the encoder may be busy for, in percent.
+const int64_t SPEED_BUSY_HIGH = 90;
+const int64_t SPEED_BUSY_LOW = 50;
+
+// Consecutive windows before a step.
+const uint32_t SPEED_OVERRUN_WINDOWS = 2;
+const uint32_t SPEED_HEADROOM_WINDOWS = 10;
+
+
+class SpeedControlImpl : public SpeedControl
+{
+
+public:
+	SpeedControlImpl();
+	~SpeedControlImpl();
+
+	void Create();
+	void Destory();
+
+	void Reset(int64_t interval, uint32_t queueLimit);
+	SPEED_STEP Update(int64_t encodeTime, uint32_t depth);
+	void GetWindow(SpeedWindow * window);
+
+private:
+	SPEED_STEP EndWindow();
+
+private:
+	int64_t interval = 0;
+	uint32_t queueLimit = 0;
+
+	// Current window.
+	uint32_t frames = 0;
+	int64_t encodeSum = 0;
+	uint32_t maxDepth = 0;
+
+	// Windows in a row.
+	uint32_t overrun = 0;
+	uint32_t headroom = 0;
+
+	SpeedWindow last;
+};
+
+
+SpeedControl * SpeedControl::Create() {
+
+	SpeedControlImpl * control = new SpeedControlImpl();
+	if (control)
+	{
+		control->Create();
+	}
+
+	return control;
+
+}
+
+
+SpeedControlImpl::SpeedControlImpl()
+{
+	memset(&last, 0, sizeof(last));
+}
+
+
+SpeedControlImpl::~SpeedControlImpl()
+{
+}
+
+
+void SpeedControlImpl::Create()
+{
+}
+
+
+void SpeedControlImpl::Destory()
+{
+	delete this;
+}
+
+
+void SpeedControlImpl::Reset(int64_t _interval, uint32_t _queueLimit)
+{
+	interval = _interval;
+	queueLimit = _queueLimit;
+
+	frames = 0;
+	encodeSum = 0;
+	maxDepth = 0;
+
+	overrun = 0;
+	headroom = 0;
+}
+
+
+SPEED_STEP SpeedControlImpl::Update(int64_t encodeTime, uint32_t depth)
+{
+	encodeSum += encodeTime;
+	if (depth > maxDepth)
+	{
+		maxDepth = depth;
+	}
+
+	if (++frames < SPEED_WINDOW_FRAMES)
+	{
+		return SPEED_KEEP;
+	}
+
+	return EndWindow();
+}
+
+
+SPEED_STEP SpeedControlImpl::EndWindow()
+{
+	last.meanEncode = encodeSum / frames;
+	last.interval = interval;
+	last.maxDepth = maxDepth;
+
+	frames = 0;
+	encodeSum = 0;
+	maxDepth = 0;
+
+	if (interval <= 0)
+	{
+		return SPEED_KEEP;
+	}
+
+	bool full = queueLimit > 0 && last.maxDepth >= queueLimit;
+
+	if (full || last.meanEncode * 100 > interval * SPEED_BUSY_HIGH)
+	{
+		headroom = 0;
+
+		if (full || ++overrun >= SPEED_OVERRUN_WINDOWS)
+		{
+			overrun = 0;
+			return SPEED_FASTER;
+		}
+	}
+	else if (last.maxDepth <= 1 && last.meanEncode * 100 < interval * SPEED_BUSY_LOW)
+	{
+		overrun = 0;
+
+		if (++headroom >= SPEED_HEADROOM_WINDOWS)
+		{
+			headroom = 0;
+			return SPEED_SLOWER;
+		}
+	}
+	else
+	{
+		overrun = 0;
+		headroom = 0;
+	}
+
+	return SPEED_KEEP;
+}
+
+
+void SpeedControlImpl::GetWindow(SpeedWindow * window)
+{
+	*window = last;
+}
@@ -0,0 +1,46 @@
+
+#pragma once
+
+enum SPEED_STEP
+{
+	SPEED_KEEP,
+	SPEED_FASTER,		// The encoder cannot keep up: use a faster preset.
+	SPEED_SLOWER		// There is headroom: go back towards the profile.
+};
+
+// What a window of frames looked like, for logging.
+struct SpeedWindow
+{
+	int64_t meanEncode;		// us per frame
+	int64_t interval;		// us between frames
+	uint32_t maxDepth;		// Frames waiting for the encoder.
+};
+
+// Decides when the encoder should change speed, from the time it takes
+// for each frame and the frames waiting for it. Frames are judged in
+// windows: the encoder is overrun when it is busy for most of the frame
+// interval or the queue has built up, and has headroom when it is idle
+// for half of it with an empty queue. Overrun has to last for a few
+// windows (a full queue only one) before a faster step is asked for,
+// headroom for many more before a slower one, so that the preset does
+// not swing with the content.
+class SpeedControl
+{
+
+public:
+
+	static SpeedControl * Create();
+	virtual void Destory() = 0;
+
+	// Starts over, e.g. after a step was taken. interval is the frame
+	// interval; queueLimit the depth at which frames are about to be
+	// dropped upstream.
+	virtual void Reset(int64_t interval, uint32_t queueLimit) = 0;
+
+	// Adds a frame that took encodeTime us, with depth frames waiting.
+	virtual SPEED_STEP Update(int64_t encodeTime, uint32_t depth) = 0;
+
+	// The last complete window.
+	virtual void GetWindow(SpeedWindow * window) = 0;
+
+};
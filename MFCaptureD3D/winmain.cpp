@@ -49,7 +49,7 @@ void    OnStartYUVRecord();
 void    OnStopYUVRecord();
 void    OnStartH264Record();
 void    OnStopH264Record();
-void    OnStartMP4Record();
+BOOL    OnStartMP4Record();
 void    OnStopMP4Record();
 void    OnStartPCMRecord();
 void    OnStopPCMRecord();
@@ -74,6 +74,19 @@ BOOL g_MP4RecordStatus = FALSE;
 BOOL g_PCMRecordStatus = FALSE;
 BOOL g_AACRecordStatus = FALSE;
 
+ENCODE_PROFILE g_EncodeProfile = ENCODE_PROFILE_ARCHIVE;
+
+Mp4Writer   *g_pMP4Writer = NULL;
+BOOL        g_bFragmentedMP4 = FALSE;
+BOOL        g_bSimulcast = FALSE;
+BOOL        g_bRawNative = FALSE;
+BOOL        g_bRecordIndex = FALSE;
+BOOL        g_bArchive = FALSE;
+BOOL        g_bDither = FALSE;
+int         g_iDownmixChannels = 0;
+RESAMPLE_PROFILE g_ResampleProfile = RESAMPLE_PROFILE_DEFAULT;
+BOOL        g_bDriftCompensation = FALSE;
+
 
 //-------------------------------------------------------------------
 // WinMain
@@ -81,12 +94,152 @@ BOOL g_AACRecordStatus = FALSE;
 // Application entry-point. 
 //-------------------------------------------------------------------
 
-INT WINAPI wWinMain(HINSTANCE,HINSTANCE,LPWSTR,INT)
+INT WINAPI wWinMain(HINSTANCE,HINSTANCE,LPWSTR lpCmdLine,INT)
 {
     HWND hwnd = 0;
 
     (void)HeapSetInformation(NULL, HeapEnableTerminationOnCorruption, NULL, 0);
 
+    // /profile:<name>: H.264 encoding profile, e.g. /profile:lowlatency.
+    if (lpCmdLine)
+    {
+        for (int i = 0; i < ENCODE_PROFILE_COUNT; i++)
+        {
+            WCHAR szOption[64];
+            StringCchPrintfW(szOption, ARRAYSIZE(szOption), L"/profile:%S", g_EncodeProfiles[i].name);
+
+            if (wcsstr(lpCmdLine, szOption))
+            {
+                g_EncodeProfile = (ENCODE_PROFILE)i;
+            }
+        }
+    }
+
+    // /fragmented: record fragmented MP4, which stays readable if the
+    // application stops before the recording.
+    if (lpCmdLine && wcsstr(lpCmdLine, L"/fragmented"))
+    {
+        g_bFragmentedMP4 = TRUE;
+    }
+
+    // /simulcast: record the renditions of the simulcast ladder along
+    // with the H.264 file.
+    if (lpCmdLine && wcsstr(lpCmdLine, L"/simulcast"))
+    {
+        g_bSimulcast = TRUE;
+    }
+
+    // /rawnative: record the YUV file in the capture format, without
+    // converting it, with a sidecar that describes the frames.
+    if (lpCmdLine && wcsstr(lpCmdLine, L"/rawnative"))
+    {
+        g_bRawNative = TRUE;
+    }
+
+    // /index: write a binary frame index next to the YUV recording.
+    if (lpCmdLine && wcsstr(lpCmdLine, L"/index"))
+    {
+        g_bRecordIndex = TRUE;
+    }
+
+    // /archive: record the YUV file losslessly compressed, as FFV1 in
+    // video.mkv.
+    if (lpCmdLine && wcsstr(lpCmdLine, L"/archive"))
+    {
+        g_bArchive = TRUE;
+    }
+
+    // /dither: add TPDF dither when audio is converted to 16 bits.
+    if (lpCmdLine && wcsstr(lpCmdLine, L"/dither"))
+    {
+        g_bDither = TRUE;
+    }
+
+    // /downmix:stereo, /downmix:mono: encode that many channels when the
+    // capture has more.
+    if (lpCmdLine && wcsstr(lpCmdLine, L"/downmix:stereo"))
+    {
+        g_iDownmixChannels = 2;
+    }
+    if (lpCmdLine && wcsstr(lpCmdLine, L"/downmix:mono"))
+    {
+        g_iDownmixChannels = 1;
+    }
+
+    // /resample:<name>: swresample profile, e.g. /resample:hq.
+    if (lpCmdLine)
+    {
+        for (int i = 0; i < RESAMPLE_PROFILE_COUNT; i++)
+        {
+            WCHAR szOption[64];
+            StringCchPrintfW(szOption, ARRAYSIZE(szOption), L"/resample:%S", g_ResampleProfiles[i].name);
+
+            if (wcsstr(lpCmdLine, szOption))
+            {
+                g_ResampleProfile = (RESAMPLE_PROFILE)i;
+            }
+        }
+    }
+
+    // /drift: keep the recorded audio to the system clock.
+    if (lpCmdLine && wcsstr(lpCmdLine, L"/drift"))
+    {
+        g_bDriftCompensation = TRUE;
+    }
+
+    // /benchmark: time the frame converters and exit.
+    // /verify: check the frame converters and exit; returns 1 on failure.
+    // /latency: measure the latency of every encoding profile and exit.
+    // /ladder: measure the cost of the simulcast ladder and exit.
+    // /audiobench: time the audio sample converters and exit.
+    // No window, no Direct3D device and no capture device are created.
+    if (lpCmdLine && wcsstr(lpCmdLine, L"/benchmark"))
+    {
+        if (InitializeApplication())
+        {
+            RunConverterBenchmark("benchmark.txt");
+        }
+        CleanUp();
+        return 0;
+    }
+    if (lpCmdLine && wcsstr(lpCmdLine, L"/verify"))
+    {
+        HRESULT hr = E_FAIL;
+        if (InitializeApplication())
+        {
+            hr = RunConverterVerify("verify.txt", "verify_baseline.txt");
+        }
+        CleanUp();
+        return (hr == S_OK) ? 0 : 1;
+    }
+    if (lpCmdLine && wcsstr(lpCmdLine, L"/latency"))
+    {
+        if (InitializeApplication())
+        {
+            RunEncoderLatency("latency.txt");
+        }
+        CleanUp();
+        return 0;
+    }
+    if (lpCmdLine && wcsstr(lpCmdLine, L"/ladder"))
+    {
+        if (InitializeApplication())
+        {
+            RunSimulcastBenchmark("simulcast.txt");
+        }
+        CleanUp();
+        return 0;
+    }
+    if (lpCmdLine && wcsstr(lpCmdLine, L"/audiobench"))
+    {
+        if (InitializeApplication())
+        {
+            RunAudioBenchmark("audio.txt");
+        }
+        CleanUp();
+        return 0;
+    }
+
     if (InitializeApplication() && InitializeWindow(&hwnd))
     {
         MessageLoop(hwnd);
@@ -146,6 +299,7 @@ BOOL InitializeApplication()
 	}
 
 	avcodec_register_all();
+	av_register_all();
 
     return (SUCCEEDED(hr));
 }
@@ -163,6 +317,12 @@ void CleanUp()
         UnregisterDeviceNotification(g_hdevnotify);
     }
 
+    // Finish the MP4 file while its encoders are still open.
+    if (g_pMP4Writer)
+    {
+        OnStopMP4Record();
+    }
+
     if (g_pPreview)
     {
         g_pPreview->CloseDevice();
@@ -283,6 +443,12 @@ BOOL OnCreate(HWND hwnd, LPCREATESTRUCT)
         return FALSE;
     }
 
+    g_pPreview->SetEncodeProfile(g_EncodeProfile);
+    g_pPreview->SetSimulcast(g_bSimulcast);
+    g_pPreview->SetRawNative(g_bRawNative);
+    g_pPreview->SetRecordIndex(g_bRecordIndex);
+    g_pPreview->SetArchive(g_bArchive);
+
     // Create the object that manages video preview. 
     hr = CAudio::CreateInstance(&g_pAudio);
     if (FAILED(hr))
@@ -291,6 +457,11 @@ BOOL OnCreate(HWND hwnd, LPCREATESTRUCT)
         return FALSE;
     }
 
+    g_pAudio->SetDither(g_bDither);
+    g_pAudio->SetDownmix(g_iDownmixChannels);
+    g_pAudio->SetResampleProfile(g_ResampleProfile);
+    g_pAudio->SetDriftCompensation(g_bDriftCompensation);
+
     // Select the first available device (if any).
     OnChooseDevice(hwnd, FALSE);
 
@@ -378,16 +549,15 @@ void OnCommand(HWND hwnd, int id, HWND /*hwndCtl*/, UINT /*codeNotify*/)
 			}
 			break;
 		case ID_REC_MP4:
-			if (g_MP4RecordStatus = TRUE)
+			if (g_MP4RecordStatus == TRUE)
 			{
 				OnStopMP4Record();
 				HMENU hMenu = GetMenu(hwnd);
 				ModifyMenuA(hMenu, ID_REC_MP4, MF_BYCOMMAND, ID_REC_MP4, "Start MP4 Record");
 				g_MP4RecordStatus = FALSE;
 			}
-			else
+			else if (OnStartMP4Record())
 			{
-				OnStartMP4Record();
 				HMENU hMenu = GetMenu(hwnd);
 				ModifyMenuA(hMenu, ID_REC_MP4, MF_BYCOMMAND, ID_REC_MP4, "Stop MP4 Record");
 				g_MP4RecordStatus = TRUE;
@@ -490,12 +660,58 @@ void OnStopH264Record() {
 	g_pPreview->StopH264Record();
 }
 
-void OnStartMP4Record() {
-	g_pPreview->StartMP4Record();
+BOOL OnStartMP4Record() {
+	int iVideo = -1;
+	int iAudio = -1;
+
+	g_pMP4Writer = Mp4Writer::Create();
+	if (g_pMP4Writer == NULL)
+	{
+		return FALSE;
+	}
+
+	// Either stream may be missing, e.g. without an audio device.
+	g_pPreview->AddMP4Stream(g_pMP4Writer, &iVideo);
+	if (g_pAudio)
+	{
+		g_pAudio->AddMP4Stream(g_pMP4Writer, &iAudio);
+	}
+
+	if ((iVideo < 0 && iAudio < 0) ||
+		g_pMP4Writer->Open("video.mp4", g_bFragmentedMP4 == TRUE) < 0)
+	{
+		LOG_ERR("cannot record video.mp4\n");
+		g_pMP4Writer->Destory();
+		g_pMP4Writer = NULL;
+		return FALSE;
+	}
+
+	if (iVideo >= 0)
+	{
+		g_pPreview->StartMP4Record(g_pMP4Writer, iVideo);
+	}
+	if (iAudio >= 0)
+	{
+		g_pAudio->StartMP4Record(g_pMP4Writer, iAudio);
+	}
+
+	return TRUE;
 }
 
 void OnStopMP4Record() {
 	g_pPreview->StopMP4Record();
+	if (g_pAudio)
+	{
+		g_pAudio->StopMP4Record();
+	}
+
+	// Nothing writes to it any more.
+	if (g_pMP4Writer)
+	{
+		g_pMP4Writer->Close();
+		g_pMP4Writer->Destory();
+		g_pMP4Writer = NULL;
+	}
 }
 
 void OnStartPCMRecord() {
@@ -0,0 +1,258 @@
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <pthread.h>
+
+#include "workerpool.h"
+
+
+class WorkerPoolImpl : public WorkerPool
+{
+
+public:
+	WorkerPoolImpl();
+	~WorkerPoolImpl();
+
+	void Create(uint32_t threads);
+	void Destory();
+
+	uint32_t GetThreadCount() {
+		return threadCount + 1;
+	}
+
+	void Run(WORKER_JOB_FN fn, void * ctx, uint32_t count, uint32_t align);
+
+private:
+	void Init();
+	void Uninit();
+
+	static void * ThreadProc(void * arg);
+	void Worker();
+	void RunStripe(uint32_t index);
+
+private:
+	bool created = false;
+	bool quit = false;
+
+	pthread_t * threads = NULL;
+	uint32_t threadCount = 0;	// Worker threads, not counting the caller.
+
+	// Current job
+	WORKER_JOB_FN fn = NULL;
+	void * ctx = NULL;
+	uint32_t count = 0;
+	uint32_t stripeSize = 0;
+	uint32_t stripeCount = 0;
+	uint32_t nextStripe = 0;
+	uint32_t pending = 0;
+
+	pthread_mutex_t runmutex;	// Serializes Run() callers.
+	pthread_mutex_t mutex;
+	pthread_cond_t workcond;
+	pthread_cond_t donecond;
+};
+
+
+WorkerPool * WorkerPool::Create(uint32_t threads) {
+
+	WorkerPoolImpl * pool = new WorkerPoolImpl();
+	if (pool)
+	{
+		pool->Create(threads);
+	}
+
+	return pool;
+
+}
+
+
+WorkerPoolImpl::WorkerPoolImpl()
+{
+	Init();
+}
+
+
+WorkerPoolImpl::~WorkerPoolImpl()
+{
+	Uninit();
+}
+
+
+void WorkerPoolImpl::Init()
+{
+	pthread_mutex_init(&runmutex, NULL);
+	pthread_mutex_init(&mutex, NULL);
+	pthread_cond_init(&workcond, NULL);
+	pthread_cond_init(&donecond, NULL);
+}
+
+
+void WorkerPoolImpl::Uninit()
+{
+	pthread_cond_destroy(&donecond);
+	pthread_cond_destroy(&workcond);
+	pthread_mutex_destroy(&mutex);
+	pthread_mutex_destroy(&runmutex);
+}
+
+
+void WorkerPoolImpl::Create(uint32_t _threads)
+{
+	pthread_mutex_lock(&runmutex);
+	if (!created)
+	{
+		// The caller of Run() works as well, so start one thread less.
+		uint32_t n = _threads > 1 ? _threads - 1 : 0;
+		if (n > 0)
+		{
+			threads = (pthread_t *)malloc(n * sizeof(pthread_t));
+			if (threads == NULL)
+			{
+				n = 0;
+			}
+		}
+		for (uint32_t i = 0; i < n; i++)
+		{
+			if (pthread_create(&threads[i], NULL, ThreadProc, this) != 0)
+			{
+				break;
+			}
+			threadCount++;
+		}
+		created = true;
+	}
+	pthread_mutex_unlock(&runmutex);
+}
+
+
+void WorkerPoolImpl::Destory()
+{
+	pthread_mutex_lock(&runmutex);
+	if (created)
+	{
+		pthread_mutex_lock(&mutex);
+		quit = true;
+		pthread_cond_broadcast(&workcond);
+		pthread_mutex_unlock(&mutex);
+
+		for (uint32_t i = 0; i < threadCount; i++)
+		{
+			pthread_join(threads[i], NULL);
+		}
+		free(threads);
+		threads = NULL;
+		threadCount = 0;
+		created = false;
+	}
+	pthread_mutex_unlock(&runmutex);
+
+	delete this;
+}
+
+
+void * WorkerPoolImpl::ThreadProc(void * arg)
+{
+	((WorkerPoolImpl *)arg)->Worker();
+	return NULL;
+}
+
+
+void WorkerPoolImpl::Worker()
+{
+	pthread_mutex_lock(&mutex);
+	while (true)
+	{
+		while (!quit && nextStripe >= stripeCount)
+		{
+			pthread_cond_wait(&workcond, &mutex);
+		}
+		if (quit)
+		{
+			break;
+		}
+
+		uint32_t index = nextStripe++;
+		pthread_mutex_unlock(&mutex);
+
+		RunStripe(index);
+
+		pthread_mutex_lock(&mutex);
+		if (--pending == 0)
+		{
+			pthread_cond_signal(&donecond);
+		}
+	}
+	pthread_mutex_unlock(&mutex);
+}
+
+
+void WorkerPoolImpl::RunStripe(uint32_t index)
+{
+	uint32_t start = index * stripeSize;
+	uint32_t end = start + stripeSize;
+	if (end > count)
+	{
+		end = count;
+	}
+	fn(ctx, start, end);
+}
+
+
+void WorkerPoolImpl::Run(WORKER_JOB_FN _fn, void * _ctx, uint32_t _count, uint32_t _align)
+{
+	if (_fn == NULL || _count == 0)
+	{
+		return;
+	}
+	if (_align == 0)
+	{
+		_align = 1;
+	}
+
+	pthread_mutex_lock(&runmutex);
+
+	uint32_t stripes = threadCount + 1;
+	uint32_t size = (_count + stripes - 1) / stripes;
+	size = (size + _align - 1) / _align * _align;
+
+	if (threadCount == 0 || size >= _count)
+	{
+		pthread_mutex_unlock(&runmutex);
+		_fn(_ctx, 0, _count);
+		return;
+	}
+
+	pthread_mutex_lock(&mutex);
+	fn = _fn;
+	ctx = _ctx;
+	count = _count;
+	stripeSize = size;
+	stripeCount = (_count + size - 1) / size;
+	nextStripe = 0;
+	pending = stripeCount;
+	pthread_cond_broadcast(&workcond);
+
+	// Work on the job from this thread too, then wait at the barrier.
+	while (nextStripe < stripeCount)
+	{
+		uint32_t index = nextStripe++;
+		pthread_mutex_unlock(&mutex);
+
+		RunStripe(index);
+
+		pthread_mutex_lock(&mutex);
+		pending--;
+	}
+	while (pending > 0)
+	{
+		pthread_cond_wait(&donecond, &mutex);
+	}
+	fn = NULL;
+	ctx = NULL;
+	stripeCount = 0;
+	nextStripe = 0;
+	pthread_mutex_unlock(&mutex);
+
+	pthread_mutex_unlock(&runmutex);
+}
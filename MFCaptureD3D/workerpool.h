@@ -0,0 +1,22 @@
+
+#pragma once
+
+// Job callback. Processes the items [start, end) of a job.
+typedef void (*WORKER_JOB_FN)(void * ctx, uint32_t start, uint32_t end);
+
+class WorkerPool
+{
+
+public:
+
+	static WorkerPool * Create(uint32_t threads);
+	virtual void Destory() = 0;
+
+	virtual uint32_t GetThreadCount() = 0;
+
+	// Splits count items into stripes (multiples of align, except the last one)
+	// and runs them on the pool. The calling thread takes part in the work and
+	// Run() returns only after every stripe has completed.
+	virtual void Run(WORKER_JOB_FN fn, void * ctx, uint32_t count, uint32_t align) = 0;
+
+};
@@ -0,0 +1,207 @@
+//////////////////////////////////////////////////////////////////////////
+//
+// yuvconvert.cpp: YUV to YUV conversion for the encoder input.
+//
+//////////////////////////////////////////////////////////////////////////
+
+#include "MFCaptureD3D.h"
+
+
+//-------------------------------------------------------------------
+// ConvertYUY2ToI420
+//
+// YUY2 to I420. Luma is copied; Cb/Cr of two rows are averaged. An
+// odd width ends in half a pair: its luma, and the chroma of the pair,
+// which is the last chroma sample of the row.
+//-------------------------------------------------------------------
+
+void ConvertYUY2ToI420(
+    BYTE*       pDstY,
+    LONG        lDstStrideY,
+    BYTE*       pDstU,
+    LONG        lDstStrideU,
+    BYTE*       pDstV,
+    LONG        lDstStrideV,
+    const BYTE* pSrc,
+    LONG        lSrcStride,
+    DWORD       dwWidthInPixels,
+    DWORD       dwHeightInPixels,
+    DWORD       dwStartRow,
+    DWORD       dwEndRow
+    )
+{
+    pSrc  += (LONG)dwStartRow * lSrcStride;
+    pDstY += (LONG)dwStartRow * lDstStrideY;
+    pDstU += (LONG)(dwStartRow / 2) * lDstStrideU;
+    pDstV += (LONG)(dwStartRow / 2) * lDstStrideV;
+
+    for (DWORD y = dwStartRow; y < dwEndRow; y += 2)
+    {
+        const BYTE *pSrc1 = pSrc;
+        const BYTE *pSrc2 = (y + 1 < dwHeightInPixels) ? pSrc + lSrcStride : pSrc;
+
+        BYTE *pY1 = pDstY;
+        BYTE *pY2 = pDstY + lDstStrideY;
+
+        for (DWORD x = 0; x < dwWidthInPixels / 2; x++)
+        {
+            // Byte order is Y0 U0 Y1 V0
+
+            pY1[2 * x]     = pSrc1[4 * x];
+            pY1[2 * x + 1] = pSrc1[4 * x + 2];
+
+            if (y + 1 < dwHeightInPixels)
+            {
+                pY2[2 * x]     = pSrc2[4 * x];
+                pY2[2 * x + 1] = pSrc2[4 * x + 2];
+            }
+
+            pDstU[x] = (BYTE)((pSrc1[4 * x + 1] + pSrc2[4 * x + 1] + 1) >> 1);
+            pDstV[x] = (BYTE)((pSrc1[4 * x + 3] + pSrc2[4 * x + 3] + 1) >> 1);
+        }
+
+        if (dwWidthInPixels & 1)
+        {
+            DWORD x = dwWidthInPixels / 2;
+
+            pY1[2 * x] = pSrc1[4 * x];
+
+            if (y + 1 < dwHeightInPixels)
+            {
+                pY2[2 * x] = pSrc2[4 * x];
+            }
+
+            pDstU[x] = (BYTE)((pSrc1[4 * x + 1] + pSrc2[4 * x + 1] + 1) >> 1);
+            pDstV[x] = (BYTE)((pSrc1[4 * x + 3] + pSrc2[4 * x + 3] + 1) >> 1);
+        }
+
+        pSrc  += 2 * lSrcStride;
+        pDstY += 2 * lDstStrideY;
+        pDstU += lDstStrideU;
+        pDstV += lDstStrideV;
+    }
+}
+
+
+//-------------------------------------------------------------------
+// FillFramePlanes
+//
+// Sets the plane pointers and line sizes of frame for a buffer whose
+// first plane has stride lStride. Chroma strides follow the format.
+//-------------------------------------------------------------------
+
+int FillFramePlanes(AVFrame *frame, BYTE *pbScanline0, LONG lStride)
+{
+    AVPixelFormat fmt = (AVPixelFormat)frame->format;
+    LONG lAbsStride = abs(lStride);
+
+    if (av_pix_fmt_count_planes(fmt) == 1)
+    {
+        // Packed formats use the stride as is. It can have any padding,
+        // and is negative for bottom-up images.
+        frame->data[0] = pbScanline0;
+        frame->linesize[0] = lStride;
+        return lAbsStride * frame->height;
+    }
+
+    // Width in pixels that gives a first-plane line size of lStride.
+    int minLinesize = av_image_get_linesize(fmt, frame->width, 0);
+    int paddedWidth = (minLinesize > 0) ? (int)((INT64)lAbsStride * frame->width / minLinesize) : frame->width;
+
+    av_image_fill_linesizes(frame->linesize, fmt, paddedWidth);
+
+    return av_image_fill_pointers(frame->data, fmt, frame->height, pbScanline0, frame->linesize);
+}
+
+
+//-------------------------------------------------------------------
+// GetFramePlaneSize
+//-------------------------------------------------------------------
+
+void GetFramePlaneSize(const AVFrame *frame, int plane, int *pBytes, int *pRows)
+{
+    AVPixelFormat fmt = (AVPixelFormat)frame->format;
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(fmt);
+
+    *pBytes = av_image_get_linesize(fmt, frame->width, plane);
+    *pRows = frame->height;
+
+    if (desc && (plane == 1 || plane == 2))
+    {
+        *pRows = -((-frame->height) >> desc->log2_chroma_h);
+    }
+}
+
+
+//-------------------------------------------------------------------
+// WriteFramePlanes
+//
+// Writes the image rows of each plane, without stride padding, in
+// gathered writes of up to FRAME_WRITE_SEGMENTS pieces. A plane without
+// padding is a single piece.
+//-------------------------------------------------------------------
+
+const UINT32 FRAME_WRITE_SEGMENTS = 64;
+
+int WriteFramePlanes(FileWriter *file, const AVFrame *frame)
+{
+    AVPixelFormat fmt = (AVPixelFormat)frame->format;
+
+    if (file == NULL || av_pix_fmt_desc_get(fmt) == NULL)
+    {
+        return 0;
+    }
+
+    FileWriterSegment segments[FRAME_WRITE_SEGMENTS];
+    UINT32 cSegments = 0;
+    int total = 0;
+    int planes = av_pix_fmt_count_planes(fmt);
+
+    for (int i = 0; i < planes; i++)
+    {
+        int bytes = 0;
+        int rows = 0;
+        GetFramePlaneSize(frame, i, &bytes, &rows);
+
+        const uint8_t *line = frame->data[i];
+
+        if (frame->linesize[i] == bytes)
+        {
+            segments[cSegments].data = line;
+            segments[cSegments].size = (uint32_t)(bytes * rows);
+            cSegments++;
+        }
+        else
+        {
+            for (int y = 0; y < rows; y++)
+            {
+                if (cSegments == FRAME_WRITE_SEGMENTS)
+                {
+                    file->WriteV(segments, cSegments);
+                    cSegments = 0;
+                }
+
+                segments[cSegments].data = line;
+                segments[cSegments].size = (uint32_t)bytes;
+                cSegments++;
+
+                line += frame->linesize[i];
+            }
+        }
+
+        if (cSegments == FRAME_WRITE_SEGMENTS)
+        {
+            file->WriteV(segments, cSegments);
+            cSegments = 0;
+        }
+
+        total += bytes * rows;
+    }
+
+    if (cSegments > 0)
+    {
+        file->WriteV(segments, cSegments);
+    }
+
+    return total;
+}
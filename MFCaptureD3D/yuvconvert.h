@@ -0,0 +1,42 @@
+//////////////////////////////////////////////////////////////////////////
+//
+// yuvconvert.h: YUV to YUV conversion for the encoder input.
+//
+//////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+// YUY2 (4:2:2 packed) to I420 (4:2:0 planar) in a single pass.
+// The chroma of each pair of rows is averaged. Only the rows
+// [dwStartRow, dwEndRow) are converted; dwStartRow must be even. Any
+// width: an odd one ends in the first half of a YUY2 pair.
+
+void ConvertYUY2ToI420(
+    BYTE*       pDstY,
+    LONG        lDstStrideY,
+    BYTE*       pDstU,
+    LONG        lDstStrideU,
+    BYTE*       pDstV,
+    LONG        lDstStrideV,
+    const BYTE* pSrc,
+    LONG        lSrcStride,
+    DWORD       dwWidthInPixels,
+    DWORD       dwHeightInPixels,
+    DWORD       dwStartRow,
+    DWORD       dwEndRow
+    );
+
+// Points the planes of frame at a locked capture buffer with the given
+// stride. No pixel data is copied. A negative stride (bottom-up RGB) is
+// kept as a negative line size. Returns the size of the image data.
+
+int FillFramePlanes(AVFrame *frame, BYTE *pbScanline0, LONG lStride);
+
+// Visible bytes in a row of a plane of frame, and its rows.
+
+void GetFramePlaneSize(const AVFrame *frame, int plane, int *pBytes, int *pRows);
+
+// Writes the visible bytes of every plane of frame, skipping stride
+// padding. Returns the number of bytes written.
+
+int WriteFramePlanes(FileWriter *file, const AVFrame *frame);